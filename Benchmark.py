@@ -0,0 +1,466 @@
+import serial
+import os
+import sys
+import io
+import json
+import math
+import time
+import random
+import argparse
+import tempfile
+import queue
+import multiprocessing
+import threading
+import subprocess
+import contextlib
+from collections import deque
+from time import sleep, perf_counter
+
+import Host
+
+'''
+End-to-end flashing benchmark of the bootloader protocol, one JSON line per case.
+
+   python Benchmark.py --sim [options]          a fresh Host Simulation/bootloader_sim per case
+   python Benchmark.py --port /dev/ttyUSB0      a board waiting in the bootloader
+
+Every case of --bauds x --sizes x --latency-ms x --bit-error-rates is run --repeat times:
+open, baud change, frame negotiation, --pings round trips of CBL_GET_VER_CMD, blocking erase of the
+sectors under the image, windowed write of a random image, CRC of the range on the target.
+Added latency and bit errors are applied on the host side of the port, in both directions, so the
+same line model works for the simulator and a real board.
+With --baseline, the results are compared with an earlier run (its output file): a metric worse
+than the baseline median by more than --tolerance percent, or a case that failed where the baseline
+passed, is a regression and the exit code is 1.
+'''
+BENCH_START_BAUD             = 115200
+BENCH_OPEN_TIMEOUT           = 5
+BENCH_PING_COUNT             = 50
+''' Attempts of the single frame commands (erase, CRC) before the case fails, a bit error costs one '''
+BENCH_COMMAND_ATTEMPTS       = 3
+''' Silence on the link before such a command, replies to retransmitted frames may still be coming '''
+BENCH_SETTLE_TIME            = 0.05
+BENCH_TOLERANCE              = 10
+''' A case still running after this many seconds is stopped, a lost frame sync can keep the write going forever '''
+BENCH_CASE_TIMEOUT           = 300
+BENCH_RESULT_POLL            = 1
+BENCH_SIM_BINARY             = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'Host Simulation', 'bootloader_sim')
+''' Time the reader of an impaired link waits on the port before it looks for a stop '''
+LINK_POLL_TIME               = 0.005
+
+''' Queue of the running session to the parent: ('phase', name) as it goes, then ('result', result) '''
+Session_Results = None
+''' (result section, value, 1 when higher is better) compared with the baseline '''
+BENCH_METRICS                = [('write', 'kbps', 1), ('write', 'host_cpu_us_per_kb', 0), ('rtt_ms', 'p50', 0),
+                                ('erase', 'seconds', 0), ('crc', 'target_us', 0)]
+
+class Impaired_Link:
+    ''' Stands in for the serial port object of Host.py with a longer, noisier line in front of the port.
+        Every byte is held Latency seconds in each direction and every bit is flipped with the bit
+        error rate. The line keeps carrying bytes back to back, the latency does not slow it down. '''
+    def __init__(self, Port, Latency, Bit_Error_Rate, Seed):
+        self.Port = Port
+        self.Latency = Latency
+        self.Bit_Error_Rate = min(Bit_Error_Rate, 0.5)
+        self.timeout = Port.timeout
+        self.Random = { 'tx' : random.Random(Seed), 'rx' : random.Random(Seed + 1) }
+        self.Next_Error = { Direction : self.Error_Gap(Direction) for Direction in self.Random }
+        self.Flipped_Bits = { 'tx' : 0, 'rx' : 0 }
+        self.Tx_Line = deque()
+        self.Rx_Line = deque()
+        self.Rx_Data = bytearray()
+        self.Tx_Busy = False
+        self.Line_Changed = threading.Condition()
+        self.Running = True
+        self.Thread_Cpu = [0.0, 0.0]
+        Port.timeout = LINK_POLL_TIME
+        self.Threads = [threading.Thread(target = self.Transmitter, daemon = True), threading.Thread(target = self.Receiver, daemon = True)]
+        for Thread in self.Threads:
+            Thread.start()
+
+    def Error_Gap(self, Direction):
+        ''' Bits up to the next error, geometric with the bit error rate '''
+        if(self.Bit_Error_Rate <= 0):
+            return math.inf
+        return 1 + int(math.log(1.0 - self.Random[Direction].random()) / math.log(1.0 - self.Bit_Error_Rate))
+
+    def Corrupt(self, Data, Direction):
+        Data = bytearray(Data)
+        Bits = len(Data) * 8
+        while(self.Next_Error[Direction] <= Bits):
+            Bit = self.Next_Error[Direction] - 1
+            Data[Bit // 8] ^= (1 << (Bit % 8))
+            self.Flipped_Bits[Direction] += 1
+            self.Next_Error[Direction] += self.Error_Gap(Direction)
+        self.Next_Error[Direction] -= Bits
+        return bytes(Data)
+
+    def Transmitter(self):
+        while(True):
+            with self.Line_Changed:
+                self.Tx_Busy = False
+                self.Line_Changed.notify_all()
+                while(self.Running and ((not self.Tx_Line) or (self.Tx_Line[0][0] > perf_counter()))):
+                    self.Line_Changed.wait((self.Tx_Line[0][0] - perf_counter()) if self.Tx_Line else None)
+                if(not self.Running):
+                    return
+                Data = b''
+                while(self.Tx_Line and (self.Tx_Line[0][0] <= perf_counter())):
+                    Data += self.Tx_Line.popleft()[1]
+                self.Tx_Busy = True
+            self.Port.write(Data)
+            self.Thread_Cpu[0] = time.thread_time()
+
+    def Receiver(self):
+        while(self.Running):
+            try:
+                Data = self.Port.read(max(1, self.Port.in_waiting))
+            except (OSError, serial.SerialException):
+                return
+            if(Data):
+                with self.Line_Changed:
+                    self.Rx_Line.append((perf_counter() + self.Latency, self.Corrupt(Data, 'rx')))
+                    self.Line_Changed.notify_all()
+            self.Thread_Cpu[1] = time.thread_time()
+
+    def Take_Arrived(self):
+        while(self.Rx_Line and (self.Rx_Line[0][0] <= perf_counter())):
+            self.Rx_Data += self.Rx_Line.popleft()[1]
+
+    def write(self, Data):
+        with self.Line_Changed:
+            self.Tx_Line.append((perf_counter() + self.Latency, self.Corrupt(Data, 'tx')))
+            self.Line_Changed.notify_all()
+        return len(Data)
+
+    def read(self, Size = 1):
+        Deadline = None if (self.timeout is None) else (perf_counter() + self.timeout)
+        with self.Line_Changed:
+            while(True):
+                self.Take_Arrived()
+                if(len(self.Rx_Data) >= Size):
+                    break
+                Waits = [Time - perf_counter() for Time in ([self.Rx_Line[0][0]] if self.Rx_Line else []) + ([Deadline] if Deadline else [])]
+                if(Deadline and (perf_counter() >= Deadline)):
+                    break
+                self.Line_Changed.wait(max(0.0, min(Waits)) if Waits else None)
+            Data = bytes(self.Rx_Data[:Size])
+            del self.Rx_Data[:Size]
+        return Data
+
+    def flush(self):
+        ''' Everything written is on the wire, the bytes still on the line included '''
+        with self.Line_Changed:
+            while(self.Tx_Line or self.Tx_Busy):
+                self.Line_Changed.wait()
+        self.Port.flush()
+
+    def reset_input_buffer(self):
+        ''' Drops what arrived, bytes still on the line come in later as they would on a real one '''
+        with self.Line_Changed:
+            self.Take_Arrived()
+            self.Rx_Data.clear()
+
+    @property
+    def baudrate(self):
+        return self.Port.baudrate
+
+    @baudrate.setter
+    def baudrate(self, Baud):
+        self.Port.baudrate = Baud
+
+    @property
+    def is_open(self):
+        return self.Port.is_open
+
+    def close(self):
+        with self.Line_Changed:
+            self.Running = False
+            self.Line_Changed.notify_all()
+        for Thread in self.Threads:
+            Thread.join()
+        self.Port.close()
+
+    def Cpu_Seconds(self):
+        return sum(self.Thread_Cpu)
+
+def Start_Simulator(Work_Dir, Time_Scale):
+    ''' Bootloader simulator on an erased flash, returns the process and its host link '''
+    Link = os.path.join(Work_Dir, 'tty')
+    Environment = dict(os.environ, BL_SIM_FLASH = os.path.join(Work_Dir, 'flash.bin'), BL_SIM_BACKUP = os.path.join(Work_Dir, 'backup.bin'),
+                       BL_SIM_PTY_LINK = Link, BL_SIM_TIME_SCALE = str(Time_Scale), BL_SIM_FLASH_TRACE = '0')
+    Simulator = subprocess.Popen([BENCH_SIM_BINARY], env = Environment, stdout = subprocess.DEVNULL, stderr = subprocess.DEVNULL)
+    Deadline = perf_counter() + BENCH_OPEN_TIMEOUT
+    while((not os.path.exists(Link)) and (perf_counter() < Deadline) and (Simulator.poll() is None)):
+        sleep(0.02)
+    return Simulator, Link
+
+def Ping():
+    ''' One CBL_GET_VER_CMD round trip in seconds, None without a reply '''
+    Host.Serial_Port_Obj.reset_input_buffer()
+    Start_Time = perf_counter()
+    Host.Send_Command_Frame(Host.CBL_GET_VER_CMD)
+    if(Host.Read_Reply() is None):
+        return None
+    return perf_counter() - Start_Time
+
+def Enter_Phase(Result, Phase):
+    ''' The parent keeps the phase, it is all that is left of a session it has to stop '''
+    Result['phase'] = Phase
+    Session_Results.put(('phase', Phase))
+
+def Settle_Link():
+    ''' Reads until the link stays quiet, a round trip of the impaired line included '''
+    Port_Timeout = Host.Serial_Port_Obj.timeout
+    Host.Serial_Port_Obj.timeout = BENCH_SETTLE_TIME + 2 * getattr(Host.Serial_Port_Obj, 'Latency', 0.0)
+    while(Host.Serial_Port_Obj.read(4096)):
+        pass
+    Host.Serial_Port_Obj.timeout = Port_Timeout
+
+def Attempt_Command(Request, Accepted):
+    ''' Request() until Accepted(reply), returns the last reply, the seconds of the last attempt and the attempts '''
+    for Attempt in range(1, BENCH_COMMAND_ATTEMPTS + 1):
+        Settle_Link()
+        Start_Time = perf_counter()
+        Reply = Request()
+        Seconds = perf_counter() - Start_Time
+        if(Accepted(Reply)):
+            break
+    return Reply, Seconds, Attempt
+
+def Profile_Summary(Profile, Command):
+    ''' Frames, p50 bound and maximum of every phase of one command, in us. The bound is the
+        upper edge of the p50 bucket, or the maximum when that is lower or the bucket has no edge. '''
+    if((Profile is None) or (Command not in Profile['commands'])):
+        return None
+    Summary = {}
+    for Name, Phase in Profile['commands'][Command].items():
+        Edge = Host.Profile_Percentile_us(Phase['buckets'], 0.5, Profile['core_clock'])
+        P50 = Phase['max_us'] if (Edge is None) else min(Edge, Phase['max_us'])
+        Summary[Name] = { 'frames' : Phase['count'], 'p50_us' : round(P50, 1), 'max_us' : round(Phase['max_us'], 1) }
+    return Summary
+
+def Run_Case(Case, Options, Result):
+    ''' Phases of one case, Result is filled as they pass, an exception or a 0 ends the case '''
+    Enter_Phase(Result, 'open')
+    Deadline = perf_counter() + BENCH_OPEN_TIMEOUT
+    while(Ping() is None):
+        if(perf_counter() >= Deadline):
+            return
+    Enter_Phase(Result, 'baud')
+    if((Case['baud'] != Host.Serial_Port_Obj.baudrate) and (Host.Change_Baud_Rate(Case['baud']) != 1)):
+        return
+    Enter_Phase(Result, 'negotiate')
+    Window_Size, Payload_Length, Decompress_Budget = Host.Frame_Settings(Case['window'], Case['payload'])
+    Result.update({ 'window' : Window_Size, 'payload' : Payload_Length })
+    Profile_Supported = (Host.Query_Profile(True) is not None)
+
+    Enter_Phase(Result, 'rtt')
+    Round_Trips = [Ping() for Count in range(Options.pings)]
+    Result['rtt_ms'] = dict(Host.Latency_Summary([Seconds for Seconds in Round_Trips if Seconds is not None]) or {}, lost = Round_Trips.count(None))
+
+    Enter_Phase(Result, 'erase')
+    Image = random.Random(Case['seed']).randbytes(Case['bytes'])
+    First_Sector, Last_Sector, Sector_Starts = Host.Flash_Sector_Span(Options.address, len(Image))
+    Erased, Seconds, Attempts = Attempt_Command(lambda: Host.Erase_Flash_Sectors(First_Sector, Last_Sector - First_Sector + 1), bool)
+    if(not Erased):
+        print("\n   Error !! Sectors", First_Sector, "to", Last_Sector, "not erased after", Attempts, "attempts")
+        return
+    Result['erase'] = { 'seconds' : round(Seconds, 3), 'sectors' : Last_Sector - First_Sector + 1, 'attempts' : Attempts }
+
+    Enter_Phase(Result, 'write')
+    Start_Time = perf_counter()
+    Start_Cpu = time.process_time() - Link_Cpu_Seconds()
+    if(Host.Memory_Write_Segments([(Options.address, memoryview(Image))], Window_Size, Payload_Length) != 1):
+        return
+    Seconds = perf_counter() - Start_Time
+    Cpu_Seconds = time.process_time() - Link_Cpu_Seconds() - Start_Cpu
+    Result['write'] = { 'seconds' : round(Seconds, 3), 'kbps' : round(len(Image) / max(Seconds, 1e-6) / 1024, 2),
+                        'frames' : Host.Window_Stats['frames'], 'retransmissions' : Host.Window_Stats['retransmissions'],
+                        'frame_latency_ms' : Host.Latency_Summary(Host.Window_Stats['latencies']),
+                        'host_cpu_s' : round(Cpu_Seconds, 3), 'host_cpu_us_per_kb' : round(Cpu_Seconds * 1e6 / (len(Image) / 1024), 1) }
+    if(Profile_Supported):
+        Result['target_write_profile'] = Profile_Summary(Host.Query_Profile(False), Host.CBL_MEM_WRITE_WINDOW_CMD)
+
+    Enter_Phase(Result, 'crc')
+    Start_Time = perf_counter()
+    Image_CRC = Host.CRC32_Flash_Words(Image)
+    Host_Seconds = perf_counter() - Start_Time
+    ''' A reply hit by a bit error mismatches once, a wrong flash content every time '''
+    Target_CRC, Round_Trip, Attempts = Attempt_Command(lambda: Host.Query_Memory_CRC(Options.address, len(Image)),
+                                                      lambda Reply: (Reply is not None) and (Reply['crc'] == Image_CRC))
+    if(Target_CRC is None):
+        print("\n   Error !! No CRC of the written range after", Attempts, "attempts")
+        return
+    Target_Seconds = Target_CRC['cycles'] / float(max(Target_CRC['core_clock'], 1))
+    Result['crc'] = { 'verified' : (Target_CRC['crc'] == Image_CRC), 'attempts' : Attempts, 'round_trip_ms' : round(Round_Trip * 1e3, 2),
+                      'target_us' : round(Target_Seconds * 1e6, 1), 'target_mbps' : round(len(Image) / max(Target_Seconds, 1e-9) / 1e6, 1),
+                      'host_us' : round(Host_Seconds * 1e6, 1) }
+    if(not Result['crc']['verified']):
+        print("\n   Error !! The CRC of the written range does not match the image")
+        return
+    Result['ok'] = True
+    del Result['phase']
+
+def Link_Cpu_Seconds():
+    ''' CPU of the line emulation, kept out of the host figures '''
+    return Host.Serial_Port_Obj.Cpu_Seconds() if isinstance(Host.Serial_Port_Obj, Impaired_Link) else 0.0
+
+def Bench_Session(Port_Name, Case, Options, Results):
+    ''' One case in its own process, the console output of Host.py is kept back '''
+    global Session_Results
+    Session_Results = Results
+    Result = { 'case' : Case, 'run' : 0, 'ok' : False }
+    Console = io.StringIO()
+    Host.Serial_Port_Obj = None
+    Start_Cpu = time.process_time()
+    with contextlib.redirect_stdout(Console):
+        try:
+            Port = serial.Serial(Port_Name, BENCH_START_BAUD, timeout = 2)
+            if((Case['latency_ms'] > 0) or (Case['bit_error_rate'] > 0)):
+                Host.Serial_Port_Obj = Impaired_Link(Port, Case['latency_ms'] / 1e3, Case['bit_error_rate'], Case['seed'])
+            else:
+                Host.Serial_Port_Obj = Port
+            Run_Case(Case, Options, Result)
+            if((not Options.sim) and (Host.Serial_Port_Obj.baudrate != BENCH_START_BAUD)):
+                ''' The board stays in the bootloader for the next case, at the rate it started with '''
+                Host.Change_Baud_Rate(BENCH_START_BAUD)
+        except (OSError, serial.SerialException) as Error:
+            print("\n   Error !!", Error)
+        finally:
+            Result['host_cpu_s'] = round(time.process_time() - Start_Cpu - Link_Cpu_Seconds(), 3)
+            if(isinstance(Host.Serial_Port_Obj, Impaired_Link)):
+                Result['flipped_bits'] = Host.Serial_Port_Obj.Flipped_Bits
+            if(Host.Serial_Port_Obj is not None):
+                Host.Serial_Port_Obj.close()
+    if(not Result['ok']):
+        Lines = [Line.strip() for Line in Console.getvalue().splitlines() if Line.strip()]
+        Result['error'] = Lines[-1] if Lines else 'no reply from the bootloader'
+    Results.put(('result', Result))
+
+def Bench_Case(Case, Options):
+    ''' One case on a fresh simulator or the board, stopped after --case-timeout seconds '''
+    Result = { 'case' : Case, 'run' : 0, 'ok' : False, 'phase' : 'open' }
+    Simulator = None
+    Start_Time = perf_counter()
+    with tempfile.TemporaryDirectory() as Work_Dir:
+        Port_Name = Options.port
+        if(Options.sim):
+            Simulator, Port_Name = Start_Simulator(Work_Dir, Options.sim_time_scale)
+        Results = multiprocessing.Queue()
+        Session = multiprocessing.Process(target = Bench_Session, args = (Port_Name, Case, Options, Results))
+        Session.start()
+        Deadline = Start_Time + Options.case_timeout
+        while(True):
+            try:
+                Kind, Value = Results.get(timeout = BENCH_RESULT_POLL)
+            except queue.Empty:
+                if((not Session.is_alive()) and Results.empty()):
+                    Result['error'] = 'session ended without a result'
+                    break
+                if(perf_counter() >= Deadline):
+                    Result['error'] = 'stopped after ' + str(Options.case_timeout) + ' s'
+                    Session.terminate()
+                    break
+                continue
+            if(Kind == 'result'):
+                Result = Value
+                break
+            Result['phase'] = Value
+        Session.join()
+        if(Simulator is not None):
+            Simulator.kill()
+            Simulator.wait()
+    Result['seconds'] = round(perf_counter() - Start_Time, 3)
+    return Result
+
+def Case_Key(Case):
+    return json.dumps(Case, sort_keys = True)
+
+def Load_Baseline(File_Name):
+    ''' Results of an earlier run per case, the summary line is skipped '''
+    Baseline = {}
+    with open(File_Name, 'r') as Baseline_File:
+        for Line in Baseline_File:
+            Line = Line.strip()
+            if(Line.startswith('{')):
+                Result = json.loads(Line)
+                if('case' in Result):
+                    Baseline.setdefault(Case_Key(Result['case']), []).append(Result)
+    return Baseline
+
+def Find_Regressions(Result, Baseline_Results, Tolerance):
+    ''' Metrics worse than the median of the baseline runs by more than Tolerance percent '''
+    Passed = [Baseline for Baseline in Baseline_Results if Baseline['ok']]
+    if(not Passed):
+        return []
+    if(not Result['ok']):
+        return [{ 'metric' : 'ok', 'baseline' : True, 'value' : False }]
+    Regressions = []
+    for Section, Name, Higher_Is_Better in BENCH_METRICS:
+        Values = sorted(Baseline[Section][Name] for Baseline in Passed if (Baseline.get(Section) or {}).get(Name) is not None)
+        Value = (Result.get(Section) or {}).get(Name)
+        if((not Values) or (Value is None)):
+            continue
+        Median = Values[len(Values) // 2]
+        Limit = Median * ((1 - Tolerance / 100.0) if Higher_Is_Better else (1 + Tolerance / 100.0))
+        if((Value < Limit) if Higher_Is_Better else (Value > Limit)):
+            Regressions.append({ 'metric' : Section + '.' + Name, 'baseline' : Median, 'value' : Value })
+    return Regressions
+
+def Bench_Main(Arguments):
+    Parser = argparse.ArgumentParser(prog = 'Benchmark.py', description = 'End-to-end flashing benchmark, one JSON line per case and a summary line.')
+    Target = Parser.add_mutually_exclusive_group(required = True)
+    Target.add_argument('--sim', action = 'store_true', help = 'run every case on a fresh ' + BENCH_SIM_BINARY)
+    Target.add_argument('--port', help = 'serial port of a board waiting in the bootloader at ' + str(BENCH_START_BAUD) + ' baud')
+    Parser.add_argument('--bauds', type = int, nargs = '+', default = [BENCH_START_BAUD], help = 'link rates to measure')
+    Parser.add_argument('--sizes', type = int, nargs = '+', default = [16, 64], help = 'image sizes in KB')
+    Parser.add_argument('--latency-ms', type = float, nargs = '+', default = [0], help = 'latency added in each direction')
+    Parser.add_argument('--bit-error-rates', type = float, nargs = '+', default = [0], help = 'probability of a flipped bit, in each direction')
+    Parser.add_argument('--window', type = int, default = Host.FLEET_WINDOW_SIZE, help = 'frames in flight (1-8)')
+    Parser.add_argument('--payload', type = int, default = Host.WINDOW_PAYLOAD_LENGTH, help = 'payload per frame, 1024-4096 for large frames')
+    Parser.add_argument('--address', type = lambda Text: int(Text, 0), default = Host.SLOT_BASE_ADDRESSES[0], help = 'where the image is written (default 0x08020000)')
+    Parser.add_argument('--pings', type = int, default = BENCH_PING_COUNT, help = 'round trips measured per case')
+    Parser.add_argument('--repeat', type = int, default = 1, help = 'runs of every case')
+    Parser.add_argument('--case-timeout', type = float, default = BENCH_CASE_TIMEOUT, help = 'seconds a case may take before it is stopped')
+    Parser.add_argument('--seed', type = int, default = 1, help = 'seed of the images and of the bit errors')
+    Parser.add_argument('--sim-time-scale', type = float, default = 1.0, help = 'BL_SIM_TIME_SCALE of the simulator, 1 for datasheet flash times')
+    Parser.add_argument('--baseline', help = 'output of an earlier run to compare with')
+    Parser.add_argument('--tolerance', type = float, default = BENCH_TOLERANCE, help = 'percent a metric may be worse than the baseline')
+    Options = Parser.parse_args(Arguments)
+    if(Options.sim and not os.path.exists(BENCH_SIM_BINARY)):
+        Parser.error(BENCH_SIM_BINARY + ' not found, run make in Host Simulation first')
+    Slot_End = Host.SLOT_BASE_ADDRESSES[0] + Host.SLOT_SIZE if (Options.address < Host.SLOT_BASE_ADDRESSES[1]) else Host.SLOT_BASE_ADDRESSES[1] + Host.SLOT_SIZE
+    if(Options.address + max(Options.sizes) * 1024 > Slot_End):
+        Parser.error('the largest image does not fit in the slot at ' + hex(Options.address))
+    Baseline = Load_Baseline(Options.baseline) if Options.baseline else {}
+
+    Start_Time = perf_counter()
+    Results = []
+    Regression_Count = 0
+    for Baud in Options.bauds:
+        for Size in Options.sizes:
+            for Latency in Options.latency_ms:
+                for Bit_Error_Rate in Options.bit_error_rates:
+                    Case = { 'baud' : Baud, 'bytes' : Size * 1024, 'latency_ms' : Latency, 'bit_error_rate' : Bit_Error_Rate,
+                             'window' : max(1, min(8, Options.window)), 'payload' : max(1, min(Host.LARGE_PAYLOAD_LENGTH, Options.payload)),
+                             'seed' : Options.seed, 'target' : 'sim' if Options.sim else 'board' }
+                    for Run in range(Options.repeat):
+                        Result = Bench_Case(Case, Options)
+                        Result['run'] = Run
+                        if(Options.baseline):
+                            Result['regressions'] = Find_Regressions(Result, Baseline.get(Case_Key(Case), []), Options.tolerance)
+                            Regression_Count += len(Result['regressions'])
+                        Results.append(Result)
+                        print(json.dumps(Result), flush = True)
+
+    Failed = [Result for Result in Results if not Result['ok']]
+    print(json.dumps({ 'cases' : len(Results), 'ok' : len(Results) - len(Failed), 'failed' : len(Failed), 'regressions' : Regression_Count,
+                       'seconds' : round(perf_counter() - Start_Time, 3) }), flush = True)
+    ''' Without a baseline, only a failure on a clean line counts against the run '''
+    if(Options.baseline):
+        return 1 if Regression_Count else 0
+    return 1 if any(Result['case']['bit_error_rate'] == 0 for Result in Failed) else 0
+
+if __name__ == '__main__':
+    sys.exit(Bench_Main(sys.argv[1:]))
@@ -0,0 +1,57 @@
+/*
+ * Host simulation stand-in for an application that links the update agent
+ * (Update Agent/Update_Agent.c).
+ *
+ * It runs as if the bootloader had just started it from the slot named by
+ * BL_SIM_APP_SLOT (A or B, default A): the vector table is placed there and the
+ * host link is the USART3 pseudo-terminal, like for the bootloader. Every pass
+ * of the main loop stands for 1 ms of application work followed by one step of
+ * the agent. The handoff ends the process with a system reset, the bootloader
+ * simulation started next takes the image over from the flash and backup files.
+ * BL_SIM_APP_CONFIRM=1 confirms the slot right away, like an image on trial
+ * that passed its self test.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "main.h"
+#include "dma.h"
+#include "usart.h"
+#include "Update_Agent.h"
+
+#define SIM_APP_WORK_MS              1U
+
+int main(void)
+{
+	const char *Slot_Name = getenv("BL_SIM_APP_SLOT");
+	RCC_ClkInitTypeDef RCC_ClkInitStruct = {0};
+
+	HAL_Init();
+	RCC_ClkInitStruct.APB1CLKDivider = RCC_HCLK_DIV4;
+	HAL_RCC_ClockConfig(&RCC_ClkInitStruct, FLASH_LATENCY_5);
+	MX_DMA_Init();
+	MX_USART3_UART_Init();
+
+	//the bootloader sets VTOR to the slot before the jump
+	SCB->VTOR = ((NULL != Slot_Name) && (('B' == Slot_Name[0]) || ('b' == Slot_Name[0]))) ? BL_SLOT_B_BASE_ADDRESS : BL_SLOT_A_BASE_ADDRESS;
+	fprintf(stderr, "[sim] application running from 0x%08X\n", (unsigned int)SCB->VTOR);
+	if(HAL_OK != Update_Agent_Init(&huart3))
+	{
+		Error_Handler();
+	}
+	if(Sim_Get_Env_Double("BL_SIM_APP_CONFIRM", 0.0) != 0.0)
+	{
+		Update_Agent_Confirm();
+	}
+
+	while(1)
+	{
+		HAL_Delay(SIM_APP_WORK_MS);
+		Update_Agent_Process();
+	}
+}
+
+void Error_Handler(void)
+{
+	fprintf(stderr, "[sim] application error\n");
+	exit(EXIT_FAILURE);
+}
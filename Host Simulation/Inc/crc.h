@@ -0,0 +1,11 @@
+#ifndef __CRC_H__
+#define __CRC_H__
+
+/* Host simulation stand-in for the CubeMX generated crc.h */
+#include "main.h"
+
+extern CRC_HandleTypeDef hcrc;
+
+void MX_CRC_Init(void);
+
+#endif /* __CRC_H__ */
@@ -0,0 +1,9 @@
+#ifndef __DMA_H__
+#define __DMA_H__
+
+/* Host simulation stand-in for the CubeMX generated dma.h */
+#include "main.h"
+
+void MX_DMA_Init(void);
+
+#endif /* __DMA_H__ */
@@ -0,0 +1,9 @@
+#ifndef __GPIO_H__
+#define __GPIO_H__
+
+/* Host simulation stand-in for the CubeMX generated gpio.h */
+#include "main.h"
+
+void MX_GPIO_Init(void);
+
+#endif /* __GPIO_H__ */
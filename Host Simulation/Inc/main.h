@@ -0,0 +1,9 @@
+#ifndef __MAIN_H
+#define __MAIN_H
+
+/* Host simulation stand-in for the CubeMX generated main.h */
+#include "stm32f4xx_hal.h"
+
+void Error_Handler(void);
+
+#endif /* __MAIN_H */
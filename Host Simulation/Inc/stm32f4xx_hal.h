@@ -0,0 +1,586 @@
+#ifndef STM32F4XX_HAL_H
+#define STM32F4XX_HAL_H
+
+/*
+ * Host simulation of the subset of the STM32F4 HAL/CMSIS used by the bootloader.
+ * Names, values and prototypes follow the real STM32CubeF4 headers so that
+ * Bootloader.c and main.c compile without modification on Linux.
+ */
+
+//Includes
+#include <stdint.h>
+#include <stddef.h>
+
+//---------------------------------------
+//-*-*-*-*-*-*-*-*-*-*-*-
+//Core Definitions
+//-*-*-*-*-*-*-*-*-*-*-*
+#define __IO volatile
+#define HAL_MAX_DELAY                0xFFFFFFFFU
+
+typedef enum{
+	HAL_OK       = 0x00U,
+	HAL_ERROR    = 0x01U,
+	HAL_BUSY     = 0x02U,
+	HAL_TIMEOUT  = 0x03U
+}HAL_StatusTypeDef;
+
+typedef enum{
+	HAL_UNLOCKED = 0x00U,
+	HAL_LOCKED   = 0x01U
+}HAL_LockTypeDef;
+
+typedef enum{
+	RESET = 0U,
+	SET = !RESET
+}FlagStatus, ITStatus;
+
+typedef enum{
+	DISABLE = 0U,
+	ENABLE = !DISABLE
+}FunctionalState;
+
+extern uint32_t SystemCoreClock;
+
+//---------------------------------------
+//-*-*-*-*-*-*-*-*-*-*-*-
+//Memory Map (STM32F407VG)
+//-*-*-*-*-*-*-*-*-*-*-*
+#define FLASH_BASE                   0x08000000UL
+#define CCMDATARAM_BASE              0x10000000UL
+#define SRAM1_BASE                   0x20000000UL
+#define SRAM2_BASE                   0x2001C000UL
+#define FLASH_END                    0x080FFFFFUL
+#define FLASH_OTP_BASE               0x1FFF7800UL
+#define UID_BASE                     0x1FFF7A10UL
+#define RTC_BASE                     0x40002800UL
+#define BKPSRAM_BASE                 0x40024000UL
+
+/* Size of the regions backed by the simulator */
+#define SIM_FLASH_SIZE               (1024U * 1024U)
+#define SIM_SRAM_SIZE                (128U * 1024U)
+#define SIM_CCMRAM_SIZE              (64U * 1024U)
+/* System memory, OTP area and unique device ID */
+#define SIM_SYSTEM_MEMORY_BASE       0x1FFF0000UL
+#define SIM_SYSTEM_MEMORY_SIZE       (32U * 1024U)
+/* Page of the backup domain holding the RTC registers, kept in a file across runs */
+#define SIM_BACKUP_BASE              0x40002000UL
+#define SIM_BACKUP_SIZE              (4U * 1024U)
+/* Backup SRAM, kept in the same file behind the RTC page */
+#define SIM_BKPSRAM_SIZE             (4U * 1024U)
+
+//---------------------------------------
+//-*-*-*-*-*-*-*-*-*-*-*-
+//Peripheral Registers
+//-*-*-*-*-*-*-*-*-*-*-*
+typedef struct{
+	__IO uint32_t IDCODE;
+	__IO uint32_t CR;
+	__IO uint32_t APB1FZ;
+	__IO uint32_t APB2FZ;
+}DBGMCU_TypeDef;
+
+typedef struct{
+	__IO uint32_t DR;
+	__IO uint8_t  IDR;
+	uint8_t       RESERVED0;
+	uint16_t      RESERVED1;
+	__IO uint32_t CR;
+}CRC_TypeDef;
+
+typedef struct{
+	__IO uint32_t SR;
+	__IO uint32_t DR;
+	__IO uint32_t BRR;
+	__IO uint32_t CR1;
+	__IO uint32_t CR2;
+	__IO uint32_t CR3;
+	__IO uint32_t GTPR;
+	/* simulator back end */
+	int           Sim_Fd;
+	uint8_t       Sim_Console;
+	uint64_t      Sim_Rx_Line_Time;
+	uint64_t      Sim_Tx_Line_Time;
+	void          *Sim_Rx_DMA;
+	void          *Sim_Tx_DMA;
+}USART_TypeDef;
+
+typedef struct{
+	__IO uint32_t CR;
+	__IO uint32_t NDTR;
+	__IO uint32_t PAR;
+	__IO uint32_t M0AR;
+	__IO uint32_t M1AR;
+	__IO uint32_t FCR;
+}DMA_Stream_TypeDef;
+
+typedef struct{
+	__IO uint32_t MODER;
+	__IO uint32_t OTYPER;
+	__IO uint32_t OSPEEDR;
+	__IO uint32_t PUPDR;
+	__IO uint32_t IDR;
+	__IO uint32_t ODR;
+	__IO uint32_t BSRR;
+	__IO uint32_t LCKR;
+	__IO uint32_t AFR[2];
+}GPIO_TypeDef;
+
+typedef struct{
+	__IO uint32_t TR;
+	__IO uint32_t DR;
+	__IO uint32_t CR;
+	__IO uint32_t ISR;
+	__IO uint32_t PRER;
+	__IO uint32_t WUTR;
+	__IO uint32_t CALIBR;
+	__IO uint32_t ALRMAR;
+	__IO uint32_t ALRMBR;
+	__IO uint32_t WPR;
+	__IO uint32_t SSR;
+	__IO uint32_t SHIFTR;
+	__IO uint32_t TSTR;
+	__IO uint32_t TSDR;
+	__IO uint32_t TSSSR;
+	__IO uint32_t CALR;
+	__IO uint32_t TAFCR;
+	__IO uint32_t ALRMASSR;
+	__IO uint32_t ALRMBSSR;
+	uint32_t      RESERVED7;
+	__IO uint32_t BKP0R;
+	__IO uint32_t BKP1R;
+	__IO uint32_t BKP2R;
+	__IO uint32_t BKP3R;
+	__IO uint32_t BKP4R;
+	__IO uint32_t BKP5R;
+	__IO uint32_t BKP6R;
+	__IO uint32_t BKP7R;
+	__IO uint32_t BKP8R;
+	__IO uint32_t BKP9R;
+	__IO uint32_t BKP10R;
+	__IO uint32_t BKP11R;
+	__IO uint32_t BKP12R;
+	__IO uint32_t BKP13R;
+	__IO uint32_t BKP14R;
+	__IO uint32_t BKP15R;
+	__IO uint32_t BKP16R;
+	__IO uint32_t BKP17R;
+	__IO uint32_t BKP18R;
+	__IO uint32_t BKP19R;
+}RTC_TypeDef;
+
+typedef struct{
+	__IO uint32_t CTRL;
+	__IO uint32_t LOAD;
+	__IO uint32_t VAL;
+	__IO uint32_t CALIB;
+}SysTick_Type;
+
+typedef struct{
+	__IO uint32_t ISER[8];
+	uint32_t      RESERVED0[24];
+	__IO uint32_t ICER[8];
+	uint32_t      RESERVED1[24];
+	__IO uint32_t ISPR[8];
+	uint32_t      RESERVED2[24];
+	__IO uint32_t ICPR[8];
+}NVIC_Type;
+
+typedef struct{
+	__IO uint32_t CPUID;
+	__IO uint32_t ICSR;
+	__IO uint32_t VTOR;
+	__IO uint32_t AIRCR;
+	__IO uint32_t SCR;
+	__IO uint32_t CCR;
+}SCB_Type;
+
+typedef struct{
+	__IO uint32_t CTRL;
+	__IO uint32_t CYCCNT;
+	__IO uint32_t CPICNT;
+	__IO uint32_t EXCCNT;
+	__IO uint32_t SLEEPCNT;
+	__IO uint32_t LSUCNT;
+	__IO uint32_t FOLDCNT;
+	__IO uint32_t PCSR;
+}DWT_Type;
+
+typedef struct{
+	__IO uint32_t DHCSR;
+	__IO uint32_t DCRSR;
+	__IO uint32_t DCRDR;
+	__IO uint32_t DEMCR;
+}CoreDebug_Type;
+
+extern DBGMCU_TypeDef     Sim_DBGMCU;
+extern CRC_TypeDef        Sim_CRC;
+extern USART_TypeDef      Sim_USART2;
+extern USART_TypeDef      Sim_USART3;
+extern DMA_Stream_TypeDef Sim_DMA1_Stream1;
+extern DMA_Stream_TypeDef Sim_DMA1_Stream6;
+extern DMA_Stream_TypeDef Sim_DMA2_Stream0;
+extern CoreDebug_Type     Sim_CoreDebug;
+extern GPIO_TypeDef       Sim_GPIOA;
+extern SysTick_Type       Sim_SysTick;
+extern NVIC_Type          Sim_NVIC;
+extern SCB_Type           Sim_SCB;
+
+/* Every access to DWT first brings CYCCNT up to date with the elapsed time */
+DWT_Type *Sim_DWT_Update(void);
+
+#define DBGMCU                       (&Sim_DBGMCU)
+#define CRC                          (&Sim_CRC)
+#define USART2                       (&Sim_USART2)
+#define USART3                       (&Sim_USART3)
+#define DMA1_Stream1                 (&Sim_DMA1_Stream1)
+#define DMA1_Stream6                 (&Sim_DMA1_Stream6)
+#define DMA2_Stream0                 (&Sim_DMA2_Stream0)
+#define DWT                          (Sim_DWT_Update())
+#define CoreDebug                    (&Sim_CoreDebug)
+#define GPIOA                        (&Sim_GPIOA)
+#define SysTick                      (&Sim_SysTick)
+#define NVIC                         (&Sim_NVIC)
+#define SCB                          (&Sim_SCB)
+/* Mapped at its real address from the backup domain file */
+#define RTC                          ((RTC_TypeDef *)RTC_BASE)
+
+#define DWT_CTRL_CYCCNTENA_Msk       (1UL << 0)
+#define CoreDebug_DEMCR_TRCENA_Msk   (1UL << 24)
+
+//---------------------------------------
+//-*-*-*-*-*-*-*-*-*-*-*-
+//Cortex-M4 Intrinsics
+//-*-*-*-*-*-*-*-*-*-*-*
+void __set_MSP(uint32_t topOfMainStack);
+void __disable_irq(void);
+void __enable_irq(void);
+uint32_t __get_PRIMASK(void);
+void __set_PRIMASK(uint32_t priMask);
+void __DSB(void);
+void __ISB(void);
+/* Ends the process like a reset ends the program, the flash and backup files stay */
+void NVIC_SystemReset(void) __attribute__((noreturn));
+
+/* Interrupt lines of the peripherals the bootloader uses, enabled lines are set in NVIC->ISER */
+typedef enum{
+	FLASH_IRQn        = 4,
+	DMA1_Stream1_IRQn = 12,
+	DMA1_Stream6_IRQn = 17,
+	USART2_IRQn       = 38,
+	USART3_IRQn       = 39
+}IRQn_Type;
+
+void HAL_NVIC_SetPriority(IRQn_Type IRQn, uint32_t PreemptPriority, uint32_t SubPriority);
+void HAL_NVIC_EnableIRQ(IRQn_Type IRQn);
+void HAL_NVIC_DisableIRQ(IRQn_Type IRQn);
+uint32_t NVIC_GetEnableIRQ(IRQn_Type IRQn);
+
+//---------------------------------------
+//-*-*-*-*-*-*-*-*-*-*-*-
+//HAL Core / RCC / PWR
+//-*-*-*-*-*-*-*-*-*-*-*
+typedef struct{
+	uint32_t PLLState;
+	uint32_t PLLSource;
+	uint32_t PLLM;
+	uint32_t PLLN;
+	uint32_t PLLP;
+	uint32_t PLLQ;
+}RCC_PLLInitTypeDef;
+
+typedef struct{
+	uint32_t OscillatorType;
+	uint32_t HSEState;
+	uint32_t LSEState;
+	uint32_t HSIState;
+	uint32_t HSICalibrationValue;
+	uint32_t LSIState;
+	RCC_PLLInitTypeDef PLL;
+}RCC_OscInitTypeDef;
+
+typedef struct{
+	uint32_t ClockType;
+	uint32_t SYSCLKSource;
+	uint32_t AHBCLKDivider;
+	uint32_t APB1CLKDivider;
+	uint32_t APB2CLKDivider;
+}RCC_ClkInitTypeDef;
+
+#define RCC_OSCILLATORTYPE_HSE       0x00000001U
+#define RCC_HSE_ON                   0x00010000U
+#define RCC_PLL_ON                   0x00000002U
+#define RCC_PLLSOURCE_HSE            0x00400000U
+#define RCC_PLLP_DIV2                0x00000002U
+#define RCC_CLOCKTYPE_SYSCLK         0x00000001U
+#define RCC_CLOCKTYPE_HCLK           0x00000002U
+#define RCC_CLOCKTYPE_PCLK1          0x00000004U
+#define RCC_CLOCKTYPE_PCLK2          0x00000008U
+#define RCC_SYSCLKSOURCE_PLLCLK      0x00000002U
+#define RCC_SYSCLK_DIV1              0x00000000U
+#define RCC_HCLK_DIV2                0x00001000U
+#define RCC_HCLK_DIV4                0x00001400U
+#define FLASH_LATENCY_5              0x00000005U
+#define PWR_REGULATOR_VOLTAGE_SCALE1 0x0000C000U
+
+#define __HAL_RCC_PWR_CLK_ENABLE()                 do{}while(0)
+#define __HAL_RCC_BKPSRAM_CLK_ENABLE()             do{}while(0)
+#define __HAL_RCC_DMA1_CLK_ENABLE()                do{}while(0)
+#define __HAL_RCC_DMA2_CLK_ENABLE()                do{}while(0)
+#define __HAL_RCC_GPIOA_CLK_ENABLE()               do{}while(0)
+#define __HAL_PWR_VOLTAGESCALING_CONFIG(__SCALE__) do{(void)(__SCALE__);}while(0)
+
+HAL_StatusTypeDef HAL_Init(void);
+HAL_StatusTypeDef HAL_DeInit(void);
+uint32_t HAL_GetTick(void);
+void HAL_Delay(uint32_t Delay);
+HAL_StatusTypeDef HAL_RCC_OscConfig(RCC_OscInitTypeDef *RCC_OscInitStruct);
+HAL_StatusTypeDef HAL_RCC_ClockConfig(RCC_ClkInitTypeDef *RCC_ClkInitStruct, uint32_t FLatency);
+HAL_StatusTypeDef HAL_RCC_DeInit(void);
+uint32_t HAL_RCC_GetPCLK1Freq(void);
+void HAL_PWR_EnableBkUpAccess(void);
+void HAL_PWR_DisableBkUpAccess(void);
+HAL_StatusTypeDef HAL_PWREx_EnableBkUpReg(void);
+
+//---------------------------------------
+//-*-*-*-*-*-*-*-*-*-*-*-
+//GPIO
+//-*-*-*-*-*-*-*-*-*-*-*
+typedef enum{
+	GPIO_PIN_RESET = 0U,
+	GPIO_PIN_SET
+}GPIO_PinState;
+
+#define GPIO_PIN_0                   ((uint16_t)0x0001)
+
+GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin);
+
+//---------------------------------------
+//-*-*-*-*-*-*-*-*-*-*-*-
+//CRC
+//-*-*-*-*-*-*-*-*-*-*-*
+typedef struct{
+	CRC_TypeDef *Instance;
+	HAL_LockTypeDef Lock;
+	__IO uint32_t State;
+}CRC_HandleTypeDef;
+
+#define __HAL_CRC_DR_RESET(__HANDLE__) ((__HANDLE__)->Instance->DR = 0xFFFFFFFFU)
+
+HAL_StatusTypeDef HAL_CRC_Init(CRC_HandleTypeDef *crc_handle);
+HAL_StatusTypeDef HAL_CRC_DeInit(CRC_HandleTypeDef *crc_handle);
+uint32_t HAL_CRC_Accumulate(CRC_HandleTypeDef *crc_handle, uint32_t pBuffer[], uint32_t BufferLength);
+uint32_t HAL_CRC_Calculate(CRC_HandleTypeDef *crc_handle, uint32_t pBuffer[], uint32_t BufferLength);
+
+//---------------------------------------
+//-*-*-*-*-*-*-*-*-*-*-*-
+//DMA
+//-*-*-*-*-*-*-*-*-*-*-*
+typedef struct{
+	uint32_t Channel;
+	uint32_t Direction;
+	uint32_t PeriphInc;
+	uint32_t MemInc;
+	uint32_t PeriphDataAlignment;
+	uint32_t MemDataAlignment;
+	uint32_t Mode;
+	uint32_t Priority;
+	uint32_t FIFOMode;
+	uint32_t FIFOThreshold;
+	uint32_t MemBurst;
+	uint32_t PeriphBurst;
+}DMA_InitTypeDef;
+
+typedef struct __DMA_HandleTypeDef{
+	DMA_Stream_TypeDef *Instance;
+	DMA_InitTypeDef Init;
+	HAL_LockTypeDef Lock;
+	__IO uint32_t State;
+	void *Parent;
+	__IO uint32_t ErrorCode;
+}DMA_HandleTypeDef;
+
+typedef enum{
+	HAL_DMA_FULL_TRANSFER        = 0x00U,
+	HAL_DMA_HALF_TRANSFER        = 0x01U
+}HAL_DMA_LevelCompleteTypeDef;
+
+#define DMA_CHANNEL_0                0x00000000U
+#define DMA_CHANNEL_4                0x08000000U
+#define DMA_PERIPH_TO_MEMORY         0x00000000U
+#define DMA_MEMORY_TO_PERIPH         0x00000040U
+#define DMA_MEMORY_TO_MEMORY         0x00000080U
+#define DMA_PINC_ENABLE              0x00000200U
+#define DMA_PINC_DISABLE             0x00000000U
+#define DMA_MINC_ENABLE              0x00000400U
+#define DMA_MINC_DISABLE             0x00000000U
+#define DMA_PDATAALIGN_BYTE          0x00000000U
+#define DMA_PDATAALIGN_HALFWORD      0x00000800U
+#define DMA_PDATAALIGN_WORD          0x00001000U
+#define DMA_MDATAALIGN_BYTE          0x00000000U
+#define DMA_MDATAALIGN_HALFWORD      0x00002000U
+#define DMA_MDATAALIGN_WORD          0x00004000U
+#define DMA_NORMAL                   0x00000000U
+#define DMA_CIRCULAR                 0x00000100U
+#define DMA_PRIORITY_LOW             0x00000000U
+#define DMA_PRIORITY_HIGH            0x00020000U
+#define DMA_FIFOMODE_DISABLE         0x00000000U
+#define DMA_FIFOMODE_ENABLE          0x00000004U
+#define DMA_FIFO_THRESHOLD_FULL      0x00000003U
+#define DMA_MBURST_SINGLE            0x00000000U
+#define DMA_PBURST_SINGLE            0x00000000U
+
+#define __HAL_DMA_GET_COUNTER(__HANDLE__) ((__HANDLE__)->Instance->NDTR)
+
+HAL_StatusTypeDef HAL_DMA_Init(DMA_HandleTypeDef *hdma);
+HAL_StatusTypeDef HAL_DMA_DeInit(DMA_HandleTypeDef *hdma);
+HAL_StatusTypeDef HAL_DMA_Start(DMA_HandleTypeDef *hdma, uint32_t SrcAddress, uint32_t DstAddress, uint32_t DataLength);
+HAL_StatusTypeDef HAL_DMA_PollForTransfer(DMA_HandleTypeDef *hdma, HAL_DMA_LevelCompleteTypeDef CompleteLevel, uint32_t Timeout);
+
+//---------------------------------------
+//-*-*-*-*-*-*-*-*-*-*-*-
+//UART
+//-*-*-*-*-*-*-*-*-*-*-*
+typedef struct{
+	uint32_t BaudRate;
+	uint32_t WordLength;
+	uint32_t StopBits;
+	uint32_t Parity;
+	uint32_t Mode;
+	uint32_t HwFlowCtl;
+	uint32_t OverSampling;
+}UART_InitTypeDef;
+
+typedef struct{
+	USART_TypeDef *Instance;
+	UART_InitTypeDef Init;
+	DMA_HandleTypeDef *hdmatx;
+	DMA_HandleTypeDef *hdmarx;
+	HAL_LockTypeDef Lock;
+	__IO uint32_t gState;
+	__IO uint32_t RxState;
+	__IO uint32_t ReceptionType;
+	__IO uint32_t ErrorCode;
+}UART_HandleTypeDef;
+
+#define UART_WORDLENGTH_8B           0x00000000U
+#define UART_STOPBITS_1              0x00000000U
+#define UART_PARITY_NONE             0x00000000U
+#define UART_MODE_TX_RX              0x0000000CU
+#define UART_HWCONTROL_NONE          0x00000000U
+#define UART_OVERSAMPLING_16         0x00000000U
+#define UART_FLAG_RXNE               0x00000020U
+
+/* SR flags, RXNE is set while a received byte waits on the line */
+uint32_t Sim_UART_Get_Flag(UART_HandleTypeDef *huart, uint32_t Flag);
+#define __HAL_UART_GET_FLAG(__HANDLE__, __FLAG__)  (Sim_UART_Get_Flag((__HANDLE__), (__FLAG__)))
+
+HAL_StatusTypeDef HAL_UART_Init(UART_HandleTypeDef *huart);
+HAL_StatusTypeDef HAL_UART_DeInit(UART_HandleTypeDef *huart);
+HAL_StatusTypeDef HAL_UART_Transmit(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size, uint32_t Timeout);
+HAL_StatusTypeDef HAL_UART_Receive(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size, uint32_t Timeout);
+HAL_StatusTypeDef HAL_UART_Transmit_DMA(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size);
+HAL_StatusTypeDef HAL_UART_DMAStop(UART_HandleTypeDef *huart);
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart);
+HAL_StatusTypeDef HAL_UARTEx_ReceiveToIdle_DMA(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size);
+void HAL_UARTEx_RxEventCallback(UART_HandleTypeDef *huart, uint16_t Size);
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart);
+
+//---------------------------------------
+//-*-*-*-*-*-*-*-*-*-*-*-
+//FLASH
+//-*-*-*-*-*-*-*-*-*-*-*
+typedef struct{
+	uint32_t TypeErase;
+	uint32_t Banks;
+	uint32_t Sector;
+	uint32_t NbSectors;
+	uint32_t VoltageRange;
+}FLASH_EraseInitTypeDef;
+
+typedef struct{
+	uint32_t OptionType;
+	uint32_t WRPState;
+	uint32_t WRPSector;
+	uint32_t Banks;
+	uint32_t RDPLevel;
+	uint32_t BORLevel;
+	uint8_t  USERConfig;
+}FLASH_OBProgramInitTypeDef;
+
+#define FLASH_TYPEERASE_SECTORS      0x00000000U
+#define FLASH_TYPEERASE_MASSERASE    0x00000001U
+
+#define FLASH_VOLTAGE_RANGE_1        0x00000000U  /* 1.8V - 2.1V, x8  */
+#define FLASH_VOLTAGE_RANGE_2        0x00000001U  /* 2.1V - 2.7V, x16 */
+#define FLASH_VOLTAGE_RANGE_3        0x00000002U  /* 2.7V - 3.6V, x32 */
+#define FLASH_VOLTAGE_RANGE_4        0x00000003U  /* 2.7V - 3.6V + VPP, x64 */
+
+#define FLASH_BANK_1                 1U
+
+#define FLASH_TYPEPROGRAM_BYTE       0x00000000U
+#define FLASH_TYPEPROGRAM_HALFWORD   0x00000001U
+#define FLASH_TYPEPROGRAM_WORD       0x00000002U
+#define FLASH_TYPEPROGRAM_DOUBLEWORD 0x00000003U
+
+#define FLASH_SECTOR_0               0U
+#define FLASH_SECTOR_1               1U
+#define FLASH_SECTOR_2               2U
+#define FLASH_SECTOR_3               3U
+#define FLASH_SECTOR_4               4U
+#define FLASH_SECTOR_5               5U
+#define FLASH_SECTOR_6               6U
+#define FLASH_SECTOR_7               7U
+#define FLASH_SECTOR_8               8U
+#define FLASH_SECTOR_9               9U
+#define FLASH_SECTOR_10              10U
+#define FLASH_SECTOR_11              11U
+
+#define OPTIONBYTE_WRP               0x00000001U
+#define OPTIONBYTE_RDP               0x00000002U
+#define OPTIONBYTE_USER              0x00000004U
+#define OPTIONBYTE_BOR               0x00000008U
+
+#define OB_RDP_LEVEL_0               ((uint8_t)0xAA)
+#define OB_RDP_LEVEL_1               ((uint8_t)0x55)
+#define OB_RDP_LEVEL_2               ((uint8_t)0xCC)
+
+#define HAL_FLASH_ERROR_NONE         0x00000000U
+#define HAL_FLASH_ERROR_PGS          0x00000002U
+#define HAL_FLASH_ERROR_PGP          0x00000004U
+#define HAL_FLASH_ERROR_PGA          0x00000008U
+#define HAL_FLASH_ERROR_WRP          0x00000010U
+
+HAL_StatusTypeDef HAL_FLASH_Unlock(void);
+HAL_StatusTypeDef HAL_FLASH_Lock(void);
+HAL_StatusTypeDef HAL_FLASH_OB_Unlock(void);
+HAL_StatusTypeDef HAL_FLASH_OB_Lock(void);
+HAL_StatusTypeDef HAL_FLASH_OB_Launch(void);
+HAL_StatusTypeDef HAL_FLASH_Program(uint32_t TypeProgram, uint32_t Address, uint64_t Data);
+uint32_t HAL_FLASH_GetError(void);
+HAL_StatusTypeDef HAL_FLASHEx_Erase(FLASH_EraseInitTypeDef *pEraseInit, uint32_t *SectorError);
+HAL_StatusTypeDef HAL_FLASHEx_Erase_IT(FLASH_EraseInitTypeDef *pEraseInit);
+void HAL_FLASH_IRQHandler(void);
+void HAL_FLASH_EndOfOperationCallback(uint32_t ReturnValue);
+void HAL_FLASH_OperationErrorCallback(uint32_t ReturnValue);
+HAL_StatusTypeDef HAL_FLASHEx_OBProgram(FLASH_OBProgramInitTypeDef *pOBInit);
+void HAL_FLASHEx_OBGetConfig(FLASH_OBProgramInitTypeDef *pOBInit);
+
+//---------------------------------------
+//-*-*-*-*-*-*-*-*-*-*-*-
+//Simulator Internals
+//-*-*-*-*-*-*-*-*-*-*-*
+uint64_t Sim_Time_Now_ns(void);
+void Sim_Sleep_Until_ns(uint64_t Deadline_ns);
+double Sim_Get_Env_Double(const char *Name, double Default_Value);
+void Sim_Memory_Init(void);
+void Sim_Backup_Init(void);
+void Sim_Flash_Init(void);
+void Sim_CRC_Write_DR(uint32_t Data);
+/* Interrupt handlers of the peripheral threads run inside, __disable_irq keeps them out */
+void Sim_IRQ_Enter(void);
+void Sim_IRQ_Exit(void);
+/* A line left disabled in the NVIC never raises its handler */
+int Sim_IRQ_Enabled(IRQn_Type IRQn);
+
+#endif /*STM32F4XX_HAL_H*/
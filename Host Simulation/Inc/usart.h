@@ -0,0 +1,13 @@
+#ifndef __USART_H__
+#define __USART_H__
+
+/* Host simulation stand-in for the CubeMX generated usart.h */
+#include "main.h"
+
+extern UART_HandleTypeDef huart2;
+extern UART_HandleTypeDef huart3;
+
+void MX_USART2_UART_Init(void);
+void MX_USART3_UART_Init(void);
+
+#endif /* __USART_H__ */
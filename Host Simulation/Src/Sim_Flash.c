@@ -0,0 +1,471 @@
+/*
+ * Host simulation of the STM32F407 embedded flash.
+ *
+ * The 1 MB main array is a file mapped twice: read-only at FLASH_BASE, so the
+ * bootloader reads it exactly like on the target, and writable at an arbitrary
+ * address for the program/erase engine. The engine enforces the real sector
+ * geometry (4 x 16 KB, 1 x 64 KB, 7 x 128 KB), the control register lock, the
+ * 1 -> 0 only programming rule and the typical program/erase times of the
+ * STM32F407 datasheet, scaled by BL_SIM_TIME_SCALE.
+ *
+ * Program operations between an unlock and the next lock are reported as one
+ * line (bytes, operations, program time), which is one frame for the
+ * memory write commands. BL_SIM_FLASH_TRACE=0 silences the report.
+ *
+ * HAL_FLASHEx_Erase_IT erases the sectors from a thread and raises the end of
+ * operation callbacks like HAL_FLASH_IRQHandler. With FLASH_IRQn disabled the
+ * interrupt stays pending until HAL_FLASH_IRQHandler is called, the next sector
+ * only starts from there like on the target. Program and erase calls made
+ * meanwhile wait for it like for the BSY flag. The core does not stall on flash
+ * reads here, on the target it stalls until the sector under erase is done.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "main.h"
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+#define SIM_FLASH_SECTOR_COUNT       12U
+#define SIM_FLASH_ERASED_BYTE        0xFFU
+
+/* Typical program time per operation and erase times per parallelism (x8, x16, x32, x64) */
+#define SIM_FLASH_PROGRAM_TIME_NS    16000ULL
+/* A sleep costs more than a word program, busy time below this is slept off in batches */
+#define SIM_FLASH_BUSY_BATCH_NS      1000000ULL
+static const uint32_t Sim_Erase_16K_ms[4]  = { 400U,   300U,   250U,  250U  };
+static const uint32_t Sim_Erase_64K_ms[4]  = { 1200U,  700U,   550U,  550U  };
+static const uint32_t Sim_Erase_128K_ms[4] = { 2000U,  1300U,  1000U, 1000U };
+static const uint32_t Sim_Mass_Erase_ms[4] = { 16000U, 11000U, 8000U, 8000U };
+
+static const uint32_t Sim_Sector_Size[SIM_FLASH_SECTOR_COUNT] = {
+	16U * 1024U, 16U * 1024U, 16U * 1024U, 16U * 1024U,
+	64U * 1024U,
+	128U * 1024U, 128U * 1024U, 128U * 1024U, 128U * 1024U,
+	128U * 1024U, 128U * 1024U, 128U * 1024U
+};
+
+static uint8_t *Sim_Flash_Write_View;
+static uint8_t Sim_Flash_Locked = 1U;
+static uint8_t Sim_Flash_OB_Locked = 1U;
+static uint32_t Sim_Flash_Error = HAL_FLASH_ERROR_NONE;
+static uint32_t Sim_Flash_RDP_Level = OB_RDP_LEVEL_0;
+static uint32_t Sim_Flash_Voltage_Range = FLASH_VOLTAGE_RANGE_3;
+static double Sim_Flash_Time_Scale = 1.0;
+static uint64_t Sim_Flash_Busy_Until = 0U;
+static int Sim_Flash_Trace = 1;
+/* program operations since the last unlock */
+static uint32_t Sim_Flash_Program_Ops = 0U;
+static uint32_t Sim_Flash_Program_Bytes = 0U;
+static uint32_t Sim_Flash_Program_Widest = 0U;
+/* held by the interrupt driven erase while a sector erases, the BSY flag */
+static pthread_mutex_t Sim_Flash_Engine = PTHREAD_MUTEX_INITIALIZER;
+static volatile uint8_t Sim_Flash_Erase_IT_Active = 0U;
+static FLASH_EraseInitTypeDef Sim_Flash_Erase_IT_Init;
+/* end of operation or error interrupt waiting for HAL_FLASH_IRQHandler */
+static pthread_mutex_t Sim_Flash_IRQ_Lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t Sim_Flash_IRQ_Served = PTHREAD_COND_INITIALIZER;
+static uint8_t Sim_Flash_IRQ_Pending = 0U;
+static uint8_t Sim_Flash_IRQ_Error = 0U;
+static uint8_t Sim_Flash_IRQ_Last = 0U;
+static uint32_t Sim_Flash_IRQ_Value = 0U;
+
+static uint32_t Sim_Sector_Offset(uint32_t Sector)
+{
+	uint32_t Offset = 0U;
+	for(uint32_t Counter = 0U; Counter < Sector; Counter++)
+	{
+		Offset += Sim_Sector_Size[Counter];
+	}
+	return Offset;
+}
+
+static void Sim_Flash_Busy(uint64_t Duration_ns)
+{
+	uint64_t Now = Sim_Time_Now_ns();
+	if(Sim_Flash_Busy_Until < Now)
+	{
+		Sim_Flash_Busy_Until = Now;
+	}
+	Sim_Flash_Busy_Until += (uint64_t)((double)Duration_ns * Sim_Flash_Time_Scale);
+	if((Sim_Flash_Busy_Until - Now) >= SIM_FLASH_BUSY_BATCH_NS)
+	{
+		Sim_Sleep_Until_ns(Sim_Flash_Busy_Until);
+	}
+}
+
+static uint32_t Sim_Erase_Time_ms(uint32_t Sector, uint32_t VoltageRange)
+{
+	uint32_t Duration = 0U;
+	if(Sim_Sector_Size[Sector] == (16U * 1024U))
+	{
+		Duration = Sim_Erase_16K_ms[VoltageRange];
+	}
+	else if(Sim_Sector_Size[Sector] == (64U * 1024U))
+	{
+		Duration = Sim_Erase_64K_ms[VoltageRange];
+	}
+	else
+	{
+		Duration = Sim_Erase_128K_ms[VoltageRange];
+	}
+	return Duration;
+}
+
+/* FLASH_WaitForLastOperation: the sector under erase completes first */
+static void Sim_Flash_Wait_Engine(void)
+{
+	if(Sim_Flash_Erase_IT_Active)
+	{
+		pthread_mutex_lock(&Sim_Flash_Engine);
+		pthread_mutex_unlock(&Sim_Flash_Engine);
+	}
+}
+
+__attribute__((weak)) void HAL_FLASH_EndOfOperationCallback(uint32_t ReturnValue)
+{
+	(void)ReturnValue;
+}
+
+__attribute__((weak)) void HAL_FLASH_OperationErrorCallback(uint32_t ReturnValue)
+{
+	(void)ReturnValue;
+}
+
+static void Sim_Flash_IRQ_Deliver(uint8_t Error, uint8_t Last, uint32_t Value)
+{
+	if(Last)
+	{
+		Sim_Flash_Erase_IT_Active = 0U;
+	}
+	if(Error)
+	{
+		Sim_Flash_Error = HAL_FLASH_ERROR_PGS;
+		HAL_FLASH_OperationErrorCallback(Value);
+	}
+	else
+	{
+		HAL_FLASH_EndOfOperationCallback(Value);
+	}
+}
+
+/* Returns once the interrupt was served, the erase goes on from there */
+static void Sim_Flash_Raise_IRQ(uint8_t Error, uint8_t Last, uint32_t Value)
+{
+	if(Sim_IRQ_Enabled(FLASH_IRQn))
+	{
+		Sim_IRQ_Enter();
+		Sim_Flash_IRQ_Deliver(Error, Last, Value);
+		Sim_IRQ_Exit();
+		return;
+	}
+	pthread_mutex_lock(&Sim_Flash_IRQ_Lock);
+	Sim_Flash_IRQ_Error = Error;
+	Sim_Flash_IRQ_Last = Last;
+	Sim_Flash_IRQ_Value = Value;
+	Sim_Flash_IRQ_Pending = 1U;
+	while(Sim_Flash_IRQ_Pending)
+	{
+		pthread_cond_wait(&Sim_Flash_IRQ_Served, &Sim_Flash_IRQ_Lock);
+	}
+	pthread_mutex_unlock(&Sim_Flash_IRQ_Lock);
+}
+
+/* Serves a pending interrupt of the erase, nothing happens without one */
+void HAL_FLASH_IRQHandler(void)
+{
+	pthread_mutex_lock(&Sim_Flash_IRQ_Lock);
+	if(Sim_Flash_IRQ_Pending)
+	{
+		Sim_Flash_IRQ_Deliver(Sim_Flash_IRQ_Error, Sim_Flash_IRQ_Last, Sim_Flash_IRQ_Value);
+		Sim_Flash_IRQ_Pending = 0U;
+		pthread_cond_broadcast(&Sim_Flash_IRQ_Served);
+	}
+	pthread_mutex_unlock(&Sim_Flash_IRQ_Lock);
+}
+
+/* One sector at a time, the callbacks see what HAL_FLASH_IRQHandler passes on the target */
+static void *Sim_Flash_Erase_IT_Thread(void *Argument)
+{
+	FLASH_EraseInitTypeDef *Erase = Argument;
+	uint32_t VoltageRange = (Erase->VoltageRange > FLASH_VOLTAGE_RANGE_4) ? FLASH_VOLTAGE_RANGE_1 : Erase->VoltageRange;
+	uint32_t Last_Sector = Erase->Sector + Erase->NbSectors - 1U;
+
+	if(FLASH_TYPEERASE_MASSERASE == Erase->TypeErase)
+	{
+		pthread_mutex_lock(&Sim_Flash_Engine);
+		Sim_Flash_Busy((uint64_t)Sim_Mass_Erase_ms[VoltageRange] * 1000000ULL);
+		memset(Sim_Flash_Write_View, SIM_FLASH_ERASED_BYTE, SIM_FLASH_SIZE);
+		fprintf(stderr, "[sim] mass erase done\n");
+		pthread_mutex_unlock(&Sim_Flash_Engine);
+		Sim_Flash_Raise_IRQ(0U, 1U, Erase->Banks);
+		return NULL;
+	}
+	for(uint32_t Sector = Erase->Sector; Sector <= Last_Sector; Sector++)
+	{
+		if(Sector >= SIM_FLASH_SECTOR_COUNT)
+		{
+			Sim_Flash_Raise_IRQ(1U, 1U, Sector);
+			return NULL;
+		}
+		pthread_mutex_lock(&Sim_Flash_Engine);
+		Sim_Flash_Busy((uint64_t)Sim_Erase_Time_ms(Sector, VoltageRange) * 1000000ULL);
+		memset(&Sim_Flash_Write_View[Sim_Sector_Offset(Sector)], SIM_FLASH_ERASED_BYTE, Sim_Sector_Size[Sector]);
+		fprintf(stderr, "[sim] sector %u erased\n", Sector);
+		pthread_mutex_unlock(&Sim_Flash_Engine);
+
+		//end of operation interrupt, 0xFFFFFFFF once the last sector is done
+		Sim_Flash_Raise_IRQ(0U, (Sector == Last_Sector), (Sector == Last_Sector) ? 0xFFFFFFFFU : Sector);
+	}
+	return NULL;
+}
+
+void Sim_Flash_Init(void)
+{
+	const char *Image_Path = getenv("BL_SIM_FLASH");
+	struct stat Image_Stat;
+	int Fd;
+	void *Read_View;
+
+	if((NULL == Image_Path) || ('\0' == Image_Path[0]))
+	{
+		Image_Path = "flash.bin";
+	}
+	Sim_Flash_Time_Scale = Sim_Get_Env_Double("BL_SIM_TIME_SCALE", 1.0);
+	Sim_Flash_Trace = (Sim_Get_Env_Double("BL_SIM_FLASH_TRACE", 1.0) != 0.0);
+	Sim_Flash_Voltage_Range = (uint32_t)Sim_Get_Env_Double("BL_SIM_VOLTAGE_RANGE", 3.0) - 1U;
+	if(Sim_Flash_Voltage_Range > FLASH_VOLTAGE_RANGE_4)
+	{
+		Sim_Flash_Voltage_Range = FLASH_VOLTAGE_RANGE_3;
+	}
+
+	Fd = open(Image_Path, O_RDWR | O_CREAT, 0644);
+	if((Fd < 0) || (fstat(Fd, &Image_Stat) != 0))
+	{
+		perror("[sim] flash image");
+		exit(EXIT_FAILURE);
+	}
+	if(Image_Stat.st_size != (off_t)SIM_FLASH_SIZE)
+	{
+		//new or foreign image: start from a fully erased part
+		uint8_t *Erased = malloc(SIM_FLASH_SIZE);
+		memset(Erased, SIM_FLASH_ERASED_BYTE, SIM_FLASH_SIZE);
+		if((ftruncate(Fd, 0) != 0) || (pwrite(Fd, Erased, SIM_FLASH_SIZE, 0) != (ssize_t)SIM_FLASH_SIZE))
+		{
+			perror("[sim] flash image");
+			exit(EXIT_FAILURE);
+		}
+		free(Erased);
+	}
+
+	Read_View = mmap((void *)FLASH_BASE, SIM_FLASH_SIZE, PROT_READ, MAP_SHARED | MAP_FIXED_NOREPLACE, Fd, 0);
+	Sim_Flash_Write_View = mmap(NULL, SIM_FLASH_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, Fd, 0);
+	if((Read_View != (void *)FLASH_BASE) || (MAP_FAILED == Sim_Flash_Write_View))
+	{
+		fprintf(stderr, "[sim] unable to map the flash image at 0x%08lX\n", (unsigned long)FLASH_BASE);
+		exit(EXIT_FAILURE);
+	}
+	close(Fd);
+	fprintf(stderr, "[sim] flash image %s mapped at 0x%08lX\n", Image_Path, (unsigned long)FLASH_BASE);
+}
+
+HAL_StatusTypeDef HAL_FLASH_Unlock(void)
+{
+	Sim_Flash_Locked = 0U;
+	Sim_Flash_Program_Ops = 0U;
+	Sim_Flash_Program_Bytes = 0U;
+	Sim_Flash_Program_Widest = 0U;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Lock(void)
+{
+	//the last operations of a batch complete before the controller is locked
+	Sim_Flash_Wait_Engine();
+	Sim_Sleep_Until_ns(Sim_Flash_Busy_Until);
+	Sim_Flash_Locked = 1U;
+	if(Sim_Flash_Trace && (Sim_Flash_Program_Ops > 0U))
+	{
+		fprintf(stderr, "[sim] programmed %u bytes in %u operations (x%u), %.0f us\n",
+		        Sim_Flash_Program_Bytes, Sim_Flash_Program_Ops, Sim_Flash_Program_Widest * 8U,
+		        ((double)Sim_Flash_Program_Ops * (double)SIM_FLASH_PROGRAM_TIME_NS * Sim_Flash_Time_Scale) / 1000.0);
+		Sim_Flash_Program_Ops = 0U;
+	}
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_OB_Unlock(void)
+{
+	Sim_Flash_OB_Locked = 0U;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_OB_Lock(void)
+{
+	Sim_Flash_OB_Locked = 1U;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_OB_Launch(void)
+{
+	return HAL_OK;
+}
+
+uint32_t HAL_FLASH_GetError(void)
+{
+	return Sim_Flash_Error;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Program(uint32_t TypeProgram, uint32_t Address, uint64_t Data)
+{
+	uint32_t Width = 1U << TypeProgram;
+	uint32_t Offset = Address - FLASH_BASE;
+	uint8_t New_Bytes[8];
+
+	Sim_Flash_Wait_Engine();
+	Sim_Flash_Error = HAL_FLASH_ERROR_NONE;
+	if(Sim_Flash_Locked)
+	{
+		Sim_Flash_Error = HAL_FLASH_ERROR_WRP;
+		return HAL_ERROR;
+	}
+	if((TypeProgram > FLASH_TYPEPROGRAM_DOUBLEWORD) || (Address < FLASH_BASE) ||
+	   ((Offset + Width) > SIM_FLASH_SIZE) || ((Address & (Width - 1U)) != 0U))
+	{
+		Sim_Flash_Error = HAL_FLASH_ERROR_PGA;
+		return HAL_ERROR;
+	}
+	if(TypeProgram > Sim_Flash_Voltage_Range)
+	{
+		//the supply limits the parallelism, x64 needs the external VPP supply
+		fprintf(stderr, "[sim] program 0x%08X: x%u parallelism not allowed in voltage range %u\n",
+		        Address, Width * 8U, Sim_Flash_Voltage_Range + 1U);
+		Sim_Flash_Error = HAL_FLASH_ERROR_PGP;
+		return HAL_ERROR;
+	}
+
+	memcpy(New_Bytes, &Data, Width);
+	Sim_Flash_Busy(SIM_FLASH_PROGRAM_TIME_NS);
+	Sim_Flash_Program_Ops++;
+	Sim_Flash_Program_Bytes += Width;
+	if(Width > Sim_Flash_Program_Widest)
+	{
+		Sim_Flash_Program_Widest = Width;
+	}
+	for(uint32_t Counter = 0U; Counter < Width; Counter++)
+	{
+		uint8_t Old_Byte = Sim_Flash_Write_View[Offset + Counter];
+		//a program operation can only clear bits
+		Sim_Flash_Write_View[Offset + Counter] = Old_Byte & New_Bytes[Counter];
+		if((Old_Byte & New_Bytes[Counter]) != New_Bytes[Counter])
+		{
+			Sim_Flash_Error = HAL_FLASH_ERROR_PGS;
+		}
+	}
+	if(Sim_Flash_Error != HAL_FLASH_ERROR_NONE)
+	{
+		fprintf(stderr, "[sim] program 0x%08X: bits cannot be set without an erase\n", Address);
+		return HAL_ERROR;
+	}
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASHEx_Erase(FLASH_EraseInitTypeDef *pEraseInit, uint32_t *SectorError)
+{
+	uint32_t VoltageRange = pEraseInit->VoltageRange;
+
+	while(Sim_Flash_Erase_IT_Active)
+	{
+		Sim_Flash_Wait_Engine();
+	}
+	*SectorError = 0xFFFFFFFFU;
+	Sim_Flash_Error = HAL_FLASH_ERROR_NONE;
+	if(VoltageRange > FLASH_VOLTAGE_RANGE_4)
+	{
+		VoltageRange = FLASH_VOLTAGE_RANGE_1;
+	}
+	if(Sim_Flash_Locked)
+	{
+		Sim_Flash_Error = HAL_FLASH_ERROR_WRP;
+		*SectorError = pEraseInit->Sector;
+		return HAL_ERROR;
+	}
+
+	if(FLASH_TYPEERASE_MASSERASE == pEraseInit->TypeErase)
+	{
+		Sim_Flash_Busy((uint64_t)Sim_Mass_Erase_ms[VoltageRange] * 1000000ULL);
+		memset(Sim_Flash_Write_View, SIM_FLASH_ERASED_BYTE, SIM_FLASH_SIZE);
+		fprintf(stderr, "[sim] mass erase done\n");
+	}
+	else
+	{
+		for(uint32_t Sector = pEraseInit->Sector; Sector < (pEraseInit->Sector + pEraseInit->NbSectors); Sector++)
+		{
+			if(Sector >= SIM_FLASH_SECTOR_COUNT)
+			{
+				Sim_Flash_Error = HAL_FLASH_ERROR_PGS;
+				*SectorError = Sector;
+				return HAL_ERROR;
+			}
+			Sim_Flash_Busy((uint64_t)Sim_Erase_Time_ms(Sector, VoltageRange) * 1000000ULL);
+			memset(&Sim_Flash_Write_View[Sim_Sector_Offset(Sector)], SIM_FLASH_ERASED_BYTE, Sim_Sector_Size[Sector]);
+			fprintf(stderr, "[sim] sector %u erased\n", Sector);
+		}
+	}
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASHEx_Erase_IT(FLASH_EraseInitTypeDef *pEraseInit)
+{
+	pthread_t Thread;
+
+	if(Sim_Flash_Erase_IT_Active)
+	{
+		return HAL_BUSY;
+	}
+	Sim_Flash_Error = HAL_FLASH_ERROR_NONE;
+	if(Sim_Flash_Locked)
+	{
+		Sim_Flash_Error = HAL_FLASH_ERROR_WRP;
+		return HAL_ERROR;
+	}
+	Sim_Flash_Erase_IT_Init = *pEraseInit;
+	Sim_Flash_Erase_IT_Active = 1U;
+	if(pthread_create(&Thread, NULL, Sim_Flash_Erase_IT_Thread, &Sim_Flash_Erase_IT_Init) != 0)
+	{
+		Sim_Flash_Erase_IT_Active = 0U;
+		return HAL_ERROR;
+	}
+	pthread_detach(Thread);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASHEx_OBProgram(FLASH_OBProgramInitTypeDef *pOBInit)
+{
+	if(Sim_Flash_OB_Locked)
+	{
+		return HAL_ERROR;
+	}
+	if(pOBInit->OptionType & OPTIONBYTE_RDP)
+	{
+		Sim_Flash_RDP_Level = pOBInit->RDPLevel;
+	}
+	return HAL_OK;
+}
+
+void HAL_FLASHEx_OBGetConfig(FLASH_OBProgramInitTypeDef *pOBInit)
+{
+	memset(pOBInit, 0, sizeof(*pOBInit));
+	pOBInit->OptionType = OPTIONBYTE_WRP | OPTIONBYTE_RDP | OPTIONBYTE_USER | OPTIONBYTE_BOR;
+	pOBInit->WRPSector = 0x0FFFU;
+	pOBInit->RDPLevel = Sim_Flash_RDP_Level;
+	pOBInit->USERConfig = 0xE0U;
+}
@@ -0,0 +1,402 @@
+/*
+ * Host simulation of the HAL core: time base, RCC, PWR, Cortex-M intrinsics,
+ * the SysTick/NVIC/SCB registers, the DWT cycle counter and the memory map.
+ * Peripheral threads raise their interrupts under one lock which
+ * __disable_irq takes, like PRIMASK masks them. SRAM1/SRAM2 and CCM RAM are
+ * mapped at their real addresses so the bootloader can dereference target
+ * addresses directly; a jump into one of those regions (or into the flash
+ * image) is caught and reported with the time since the process started.
+ * The system memory page carries the 96-bit unique device ID, taken from
+ * BL_SIM_UID (24 hex digits) so several simulated boards can be told apart.
+ * The page of the backup domain with the RTC backup registers and the backup
+ * SRAM are a file (BL_SIM_BACKUP, default backup.bin), so they survive a
+ * restart like a reset.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "main.h"
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+uint32_t SystemCoreClock = 16000000U;
+static uint32_t Sim_APB1_Divider = 1U;
+
+/* STM32F407 DEV_ID 0x413, revision 0x1007 */
+DBGMCU_TypeDef Sim_DBGMCU = { 0x10076413U, 0U, 0U, 0U };
+CoreDebug_Type Sim_CoreDebug;
+SysTick_Type Sim_SysTick;
+NVIC_Type Sim_NVIC;
+SCB_Type Sim_SCB = { .CPUID = 0x410FC241U };
+
+static uint64_t Sim_Start_ns;
+static DWT_Type Sim_DWT;
+static uint64_t Sim_DWT_Last_ns;
+static pthread_mutex_t Sim_IRQ_Lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+static __thread uint32_t Sim_PRIMASK;
+static uint64_t Sim_Reset_ns;
+
+uint64_t Sim_Time_Now_ns(void)
+{
+	struct timespec Now;
+	clock_gettime(CLOCK_MONOTONIC, &Now);
+	return ((uint64_t)Now.tv_sec * 1000000000ULL) + (uint64_t)Now.tv_nsec;
+}
+
+/* Process start stands for the reset, before main() like the startup code */
+__attribute__((constructor)) static void Sim_Reset(void)
+{
+	Sim_Reset_ns = Sim_Time_Now_ns();
+}
+
+void Sim_Sleep_Until_ns(uint64_t Deadline_ns)
+{
+	struct timespec Deadline;
+	Deadline.tv_sec = (time_t)(Deadline_ns / 1000000000ULL);
+	Deadline.tv_nsec = (long)(Deadline_ns % 1000000000ULL);
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &Deadline, NULL) != 0)
+	{
+		//interrupted by a signal, sleep again
+	}
+}
+
+double Sim_Get_Env_Double(const char *Name, double Default_Value)
+{
+	const char *Value = getenv(Name);
+	if((NULL == Value) || ('\0' == Value[0]))
+	{
+		return Default_Value;
+	}
+	return strtod(Value, NULL);
+}
+
+static void Sim_Map_Region(uintptr_t Base, size_t Size, const char *Name)
+{
+	void *Region = mmap((void *)Base, Size, PROT_READ | PROT_WRITE,
+	                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+	if((MAP_FAILED == Region) || ((uintptr_t)Region != Base))
+	{
+		fprintf(stderr, "[sim] unable to map %s at 0x%08lX\n", Name, (unsigned long)Base);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static int Sim_Address_Is_Target_Memory(uintptr_t Address)
+{
+	return ((Address >= FLASH_BASE) && (Address < (FLASH_BASE + SIM_FLASH_SIZE)))
+	    || ((Address >= SRAM1_BASE) && (Address < (SRAM1_BASE + SIM_SRAM_SIZE)))
+	    || ((Address >= CCMDATARAM_BASE) && (Address < (CCMDATARAM_BASE + SIM_CCMRAM_SIZE)));
+}
+
+static int Sim_Fault_Is_Instruction_Fetch(uintptr_t Address, void *Context)
+{
+#if defined(__x86_64__)
+	return ((uintptr_t)((ucontext_t *)Context)->uc_mcontext.gregs[REG_RIP] == Address);
+#elif defined(__aarch64__)
+	return ((uintptr_t)((ucontext_t *)Context)->uc_mcontext.pc == Address);
+#else
+	(void)Address;
+	(void)Context;
+	return 1;
+#endif
+}
+
+static void Sim_Fault_Handler(int Signal, siginfo_t *Info, void *Context)
+{
+	char Message[112];
+	int Length;
+	uintptr_t Address = (uintptr_t)Info->si_addr;
+
+	if(Sim_Address_Is_Target_Memory(Address & ~(uintptr_t)1U) && Sim_Fault_Is_Instruction_Fetch(Address, Context))
+	{
+		//the bootloader branched into target memory: on the board the user code runs now
+		Length = snprintf(Message, sizeof(Message), "[sim] CPU jumped to 0x%08lX %lu us after reset, leaving the bootloader\n",
+		                  (unsigned long)Address, (unsigned long)((Sim_Time_Now_ns() - Sim_Reset_ns) / 1000ULL));
+		(void)write(STDERR_FILENO, Message, (size_t)Length);
+		_exit(EXIT_SUCCESS);
+	}
+	Length = snprintf(Message, sizeof(Message), "[sim] fault (signal %d) at 0x%08lX\n", Signal, (unsigned long)Address);
+	(void)write(STDERR_FILENO, Message, (size_t)Length);
+	_exit(EXIT_FAILURE);
+}
+
+static void Sim_UID_Init(void)
+{
+	const char *Value = getenv("BL_SIM_UID");
+	uint8_t *UID = (uint8_t *)UID_BASE;
+	/* lot and wafer coordinates of an arbitrary STM32F407 */
+	static const uint8_t Default_UID[12] = { 0x2F, 0x00, 0x3C, 0x00, 0x0B, 0x47, 0x33, 0x34, 0x36, 0x32, 0x38, 0x31 };
+
+	memset((void *)SIM_SYSTEM_MEMORY_BASE, 0xFF, SIM_SYSTEM_MEMORY_SIZE);
+	memcpy(UID, Default_UID, sizeof(Default_UID));
+	if(NULL != Value)
+	{
+		for(uint32_t Index = 0U; (Index < sizeof(Default_UID)) && (Value[2U * Index] != '\0') && (Value[(2U * Index) + 1U] != '\0'); Index++)
+		{
+			char Digits[3] = { Value[2U * Index], Value[(2U * Index) + 1U], '\0' };
+			UID[Index] = (uint8_t)strtoul(Digits, NULL, 16);
+		}
+	}
+}
+
+void Sim_Backup_Init(void)
+{
+	const char *Backup_Path = getenv("BL_SIM_BACKUP");
+	struct stat Backup_Stat;
+	void *Region;
+	int Fd;
+
+	if((NULL == Backup_Path) || ('\0' == Backup_Path[0]))
+	{
+		Backup_Path = "backup.bin";
+	}
+	Fd = open(Backup_Path, O_RDWR | O_CREAT, 0644);
+	if((Fd < 0) || (fstat(Fd, &Backup_Stat) != 0))
+	{
+		perror("[sim] backup domain");
+		exit(EXIT_FAILURE);
+	}
+	if(Backup_Stat.st_size != (off_t)(SIM_BACKUP_SIZE + SIM_BKPSRAM_SIZE))
+	{
+		//new or foreign file: backup domain reset, every register reads 0
+		if((ftruncate(Fd, 0) != 0) || (ftruncate(Fd, SIM_BACKUP_SIZE + SIM_BKPSRAM_SIZE) != 0))
+		{
+			perror("[sim] backup domain");
+			exit(EXIT_FAILURE);
+		}
+	}
+	Region = mmap((void *)SIM_BACKUP_BASE, SIM_BACKUP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED_NOREPLACE, Fd, 0);
+	if(Region != (void *)SIM_BACKUP_BASE)
+	{
+		fprintf(stderr, "[sim] unable to map the backup domain at 0x%08lX\n", (unsigned long)SIM_BACKUP_BASE);
+		exit(EXIT_FAILURE);
+	}
+	Region = mmap((void *)BKPSRAM_BASE, SIM_BKPSRAM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED_NOREPLACE, Fd, SIM_BACKUP_SIZE);
+	if(Region != (void *)BKPSRAM_BASE)
+	{
+		fprintf(stderr, "[sim] unable to map the backup SRAM at 0x%08lX\n", (unsigned long)BKPSRAM_BASE);
+		exit(EXIT_FAILURE);
+	}
+	close(Fd);
+}
+
+void Sim_Memory_Init(void)
+{
+	struct sigaction Action;
+
+	Sim_Map_Region(SRAM1_BASE, SIM_SRAM_SIZE, "SRAM1/SRAM2");
+	Sim_Map_Region(CCMDATARAM_BASE, SIM_CCMRAM_SIZE, "CCM RAM");
+	Sim_Map_Region(SIM_SYSTEM_MEMORY_BASE, SIM_SYSTEM_MEMORY_SIZE, "system memory");
+	Sim_UID_Init();
+	Sim_Backup_Init();
+
+	memset(&Action, 0, sizeof(Action));
+	Action.sa_sigaction = Sim_Fault_Handler;
+	Action.sa_flags = SA_SIGINFO;
+	sigaction(SIGSEGV, &Action, NULL);
+	sigaction(SIGBUS, &Action, NULL);
+	sigaction(SIGILL, &Action, NULL);
+}
+
+HAL_StatusTypeDef HAL_Init(void)
+{
+	Sim_Start_ns = Sim_Time_Now_ns();
+	setvbuf(stdout, NULL, _IONBF, 0);
+	Sim_Memory_Init();
+	Sim_Flash_Init();
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_DeInit(void)
+{
+	return HAL_OK;
+}
+
+uint32_t HAL_GetTick(void)
+{
+	return (uint32_t)((Sim_Time_Now_ns() - Sim_Start_ns) / 1000000ULL);
+}
+
+void HAL_Delay(uint32_t Delay)
+{
+	Sim_Sleep_Until_ns(Sim_Time_Now_ns() + ((uint64_t)Delay * 1000000ULL));
+}
+
+HAL_StatusTypeDef HAL_RCC_OscConfig(RCC_OscInitTypeDef *RCC_OscInitStruct)
+{
+	(void)RCC_OscInitStruct;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_RCC_ClockConfig(RCC_ClkInitTypeDef *RCC_ClkInitStruct, uint32_t FLatency)
+{
+	(void)FLatency;
+	//HSE 8 MHz / M 4 * N 168 / P 2
+	SystemCoreClock = 168000000U;
+	switch(RCC_ClkInitStruct->APB1CLKDivider)
+	{
+		case RCC_HCLK_DIV2: Sim_APB1_Divider = 2U; break;
+		case RCC_HCLK_DIV4: Sim_APB1_Divider = 4U; break;
+		default:            Sim_APB1_Divider = 1U; break;
+	}
+	return HAL_OK;
+}
+
+uint32_t HAL_RCC_GetPCLK1Freq(void)
+{
+	return SystemCoreClock / Sim_APB1_Divider;
+}
+
+void HAL_PWR_EnableBkUpAccess(void)
+{
+	//write protection of the backup domain is not modelled
+}
+
+void HAL_PWR_DisableBkUpAccess(void)
+{
+}
+
+HAL_StatusTypeDef HAL_PWREx_EnableBkUpReg(void)
+{
+	//the file keeps the backup SRAM, there is no regulator to wait for
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_RCC_DeInit(void)
+{
+	SystemCoreClock = 16000000U;
+	Sim_APB1_Divider = 1U;
+	return HAL_OK;
+}
+
+DWT_Type *Sim_DWT_Update(void)
+{
+	uint64_t Now = Sim_Time_Now_ns();
+	uint64_t Cycles;
+
+	//the counter runs at the core clock while tracing and CYCCNTENA are on
+	if((Sim_CoreDebug.DEMCR & CoreDebug_DEMCR_TRCENA_Msk) && (Sim_DWT.CTRL & DWT_CTRL_CYCCNTENA_Msk) && (0U != Sim_DWT_Last_ns))
+	{
+		Cycles = ((Now - Sim_DWT_Last_ns) * SystemCoreClock) / 1000000000ULL;
+		Sim_DWT.CYCCNT += (uint32_t)Cycles;
+		//the fraction of a cycle is kept for the next access
+		Sim_DWT_Last_ns += (Cycles * 1000000000ULL) / SystemCoreClock;
+	}
+	else
+	{
+		Sim_DWT_Last_ns = Now;
+	}
+	return &Sim_DWT;
+}
+
+void __set_MSP(uint32_t topOfMainStack)
+{
+	//the host stack stays in place, the value is only traced
+	fprintf(stderr, "[sim] MSP <- 0x%08X\n", topOfMainStack);
+}
+
+void __disable_irq(void)
+{
+	if(0U == Sim_PRIMASK)
+	{
+		pthread_mutex_lock(&Sim_IRQ_Lock);
+		Sim_PRIMASK = 1U;
+	}
+}
+
+void __enable_irq(void)
+{
+	if(0U != Sim_PRIMASK)
+	{
+		Sim_PRIMASK = 0U;
+		pthread_mutex_unlock(&Sim_IRQ_Lock);
+	}
+}
+
+void NVIC_SystemReset(void)
+{
+	char Message[80];
+	int Length;
+
+	Length = snprintf(Message, sizeof(Message), "[sim] system reset %lu us after reset\n",
+	                  (unsigned long)((Sim_Time_Now_ns() - Sim_Reset_ns) / 1000ULL));
+	(void)write(STDERR_FILENO, Message, (size_t)Length);
+	_exit(EXIT_SUCCESS);
+}
+
+void HAL_NVIC_SetPriority(IRQn_Type IRQn, uint32_t PreemptPriority, uint32_t SubPriority)
+{
+	//one level only, the peripheral threads are serialised by the interrupt lock
+	(void)IRQn;
+	(void)PreemptPriority;
+	(void)SubPriority;
+}
+
+/* ISER reads back the enabled lines on the target, here it simply keeps them */
+void HAL_NVIC_EnableIRQ(IRQn_Type IRQn)
+{
+	__atomic_or_fetch(&Sim_NVIC.ISER[(uint32_t)IRQn >> 5], 1UL << ((uint32_t)IRQn & 0x1FU), __ATOMIC_SEQ_CST);
+}
+
+void HAL_NVIC_DisableIRQ(IRQn_Type IRQn)
+{
+	__atomic_and_fetch(&Sim_NVIC.ISER[(uint32_t)IRQn >> 5], ~(1UL << ((uint32_t)IRQn & 0x1FU)), __ATOMIC_SEQ_CST);
+}
+
+void __DSB(void)
+{
+	__sync_synchronize();
+}
+
+void __ISB(void)
+{
+	__sync_synchronize();
+}
+
+uint32_t __get_PRIMASK(void)
+{
+	return Sim_PRIMASK;
+}
+
+void __set_PRIMASK(uint32_t priMask)
+{
+	if(priMask & 1U)
+	{
+		__disable_irq();
+	}
+	else
+	{
+		__enable_irq();
+	}
+}
+
+void Sim_IRQ_Enter(void)
+{
+	pthread_mutex_lock(&Sim_IRQ_Lock);
+}
+
+void Sim_IRQ_Exit(void)
+{
+	pthread_mutex_unlock(&Sim_IRQ_Lock);
+}
+
+int Sim_IRQ_Enabled(IRQn_Type IRQn)
+{
+	return (0U != (__atomic_load_n(&Sim_NVIC.ISER[(uint32_t)IRQn >> 5], __ATOMIC_SEQ_CST) & (1UL << ((uint32_t)IRQn & 0x1FU))));
+}
+
+uint32_t NVIC_GetEnableIRQ(IRQn_Type IRQn)
+{
+	return Sim_IRQ_Enabled(IRQn) ? 1U : 0U;
+}
@@ -0,0 +1,486 @@
+/*
+ * Host simulation of the UART HAL.
+ *
+ * Every USART is backed by a file descriptor (the pseudo-terminal master for
+ * the host link, stdout for the debug port). Traffic is paced at the configured
+ * baud rate with 8N1 framing (10 bit times per byte) so that transfer times
+ * measured through the simulator match the real link.
+ *
+ * DMA reception runs in a thread standing in for the DMA stream: it stores the
+ * bytes at the pace of the line, counts NDTR down and raises the half/full
+ * transfer and idle line events through HAL_UARTEx_RxEventCallback.
+ * DMA transmission has its own thread that sends the block at the pace of the
+ * line and raises HAL_UART_TxCpltCallback. A DMA1 Stream6 transfer stays busy
+ * for good when the stream interrupt is not enabled, like on the target.
+ *
+ * The rate the host configured on its side of the pseudo-terminal is compared
+ * with huart->Init.BaudRate: when they differ by more than the receivers
+ * tolerate, the bytes arrive garbled in both directions like on a real line.
+ * BL_SIM_MAX_BAUD sets the fastest rate the line carries cleanly (default no
+ * limit), BL_SIM_BAUD_CHECK=0 disables the model.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <asm/termbits.h>
+/* <asm/termbits.h> names clash with the USART register fields */
+#undef CR1
+#undef CR2
+#undef CR3
+#include "main.h"
+
+/* Time without a new character after which the line is reported idle */
+#define SIM_UART_IDLE_TIMEOUT_MS     1
+/* Rate difference an 8N1 receiver still samples correctly, percent */
+#define SIM_UART_BAUD_TOLERANCE      3U
+
+typedef struct{
+	UART_HandleTypeDef *huart;
+	pthread_t Thread;
+	volatile int Running;
+	uint8_t *Buffer;
+	uint16_t Size;
+}Sim_UART_DMA_Rx;
+
+typedef struct{
+	UART_HandleTypeDef *huart;
+	pthread_t Thread;
+	pthread_mutex_t Lock;
+	pthread_cond_t Start;
+	uint8_t *Buffer;
+	uint16_t Size;
+}Sim_UART_DMA_Tx;
+
+USART_TypeDef Sim_USART2 = { .Sim_Fd = -1 };
+USART_TypeDef Sim_USART3 = { .Sim_Fd = -1 };
+DMA_Stream_TypeDef Sim_DMA1_Stream1;
+DMA_Stream_TypeDef Sim_DMA1_Stream6;
+
+static uint64_t Sim_UART_Byte_Time_ns(UART_HandleTypeDef *huart)
+{
+	static int Pacing = -1;
+	if(Pacing < 0)
+	{
+		Pacing = (Sim_Get_Env_Double("BL_SIM_UART_PACING", 1.0) != 0.0);
+	}
+	if((0 == Pacing) || (0U == huart->Init.BaudRate))
+	{
+		return 0U;
+	}
+	return (10ULL * 1000000000ULL) / huart->Init.BaudRate;
+}
+
+/* The line corrupts the traffic: rates of both ends apart, or faster than the line carries */
+static int Sim_UART_Line_Garbles(UART_HandleTypeDef *huart)
+{
+	static int Check = -1;
+	static uint32_t Max_Baud = 0U;
+	struct termios2 Host_Settings;
+	uint32_t Host_Baud;
+
+	if(Check < 0)
+	{
+		Check = (Sim_Get_Env_Double("BL_SIM_BAUD_CHECK", 1.0) != 0.0);
+		Max_Baud = (uint32_t)Sim_Get_Env_Double("BL_SIM_MAX_BAUD", 0.0);
+	}
+	if((0 == Check) || huart->Instance->Sim_Console)
+	{
+		return 0;
+	}
+	if((0U != Max_Baud) && (huart->Init.BaudRate > Max_Baud))
+	{
+		return 1;
+	}
+	//the master side reports the settings made by the host on the slave side
+	if((ioctl(huart->Instance->Sim_Fd, TCGETS2, &Host_Settings) != 0) || (0U == Host_Settings.c_ospeed))
+	{
+		return 0;
+	}
+	Host_Baud = Host_Settings.c_ospeed;
+	return ((uint64_t)((Host_Baud > huart->Init.BaudRate) ? (Host_Baud - huart->Init.BaudRate) : (huart->Init.BaudRate - Host_Baud)) * 100U)
+	       > ((uint64_t)huart->Init.BaudRate * SIM_UART_BAUD_TOLERANCE);
+}
+
+static void Sim_UART_Garble(uint8_t *Data, size_t Length)
+{
+	for(size_t Index = 0U; Index < Length; Index++)
+	{
+		Data[Index] = (uint8_t)rand();
+	}
+}
+
+HAL_StatusTypeDef HAL_UART_Init(UART_HandleTypeDef *huart)
+{
+	huart->gState = 0x20U;
+	huart->RxState = 0x20U;
+	huart->ErrorCode = 0U;
+	huart->Instance->Sim_Rx_Line_Time = 0U;
+	huart->Instance->Sim_Tx_Line_Time = 0U;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_DeInit(UART_HandleTypeDef *huart)
+{
+	huart->gState = 0U;
+	huart->RxState = 0U;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Transmit(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size, uint32_t Timeout)
+{
+	USART_TypeDef *Port = huart->Instance;
+	uint64_t Now = Sim_Time_Now_ns();
+	uint16_t Sent = 0U;
+	uint8_t *Line_Data = NULL;
+	(void)Timeout;
+
+	if((NULL == pData) || (0U == Size))
+	{
+		return HAL_ERROR;
+	}
+	if(Sim_UART_Line_Garbles(huart) && (NULL != (Line_Data = malloc(Size))))
+	{
+		//what the host receives, the caller's buffer stays intact
+		memcpy(Line_Data, pData, Size);
+		Sim_UART_Garble(Line_Data, Size);
+		pData = Line_Data;
+	}
+	while(Sent < Size)
+	{
+		ssize_t Written = write(Port->Sim_Fd, &pData[Sent], (size_t)(Size - Sent));
+		if(Written < 0)
+		{
+			if(EINTR == errno)
+			{
+				continue;
+			}
+			free(Line_Data);
+			return HAL_ERROR;
+		}
+		Sent += (uint16_t)Written;
+	}
+	free(Line_Data);
+
+	//the call returns once the last stop bit has left the shift register
+	if(Port->Sim_Tx_Line_Time < Now)
+	{
+		Port->Sim_Tx_Line_Time = Now;
+	}
+	Port->Sim_Tx_Line_Time += Size * Sim_UART_Byte_Time_ns(huart);
+	Sim_Sleep_Until_ns(Port->Sim_Tx_Line_Time);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Receive(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size, uint32_t Timeout)
+{
+	USART_TypeDef *Port = huart->Instance;
+	uint64_t Byte_Time = Sim_UART_Byte_Time_ns(huart);
+	uint64_t Deadline = Sim_Time_Now_ns() + ((uint64_t)Timeout * 1000000ULL);
+	uint16_t Received = 0U;
+
+	if((NULL == pData) || (0U == Size))
+	{
+		return HAL_ERROR;
+	}
+	while(Received < Size)
+	{
+		struct pollfd Poll = { .fd = Port->Sim_Fd, .events = POLLIN };
+		int Wait_ms = -1;
+		ssize_t Count;
+		uint64_t Now;
+
+		if(Timeout != HAL_MAX_DELAY)
+		{
+			Now = Sim_Time_Now_ns();
+			if(Now >= Deadline)
+			{
+				return HAL_TIMEOUT;
+			}
+			Wait_ms = (int)(((Deadline - Now) + 999999ULL) / 1000000ULL);
+		}
+		if(poll(&Poll, 1, Wait_ms) <= 0)
+		{
+			continue;
+		}
+		Count = read(Port->Sim_Fd, &pData[Received], Size - Received);
+		if(Count <= 0)
+		{
+			//no host attached to the other end yet
+			HAL_Delay(1U);
+			continue;
+		}
+		if(Sim_UART_Line_Garbles(huart))
+		{
+			Sim_UART_Garble(&pData[Received], (size_t)Count);
+		}
+		Received += (uint16_t)Count;
+
+		//bytes written by the host at once still arrive one character time apart
+		Now = Sim_Time_Now_ns();
+		if(Port->Sim_Rx_Line_Time < Now)
+		{
+			Port->Sim_Rx_Line_Time = Now;
+		}
+		Port->Sim_Rx_Line_Time += (uint64_t)Count * Byte_Time;
+	}
+	Sim_Sleep_Until_ns(Port->Sim_Rx_Line_Time);
+	return HAL_OK;
+}
+
+uint32_t Sim_UART_Get_Flag(UART_HandleTypeDef *huart, uint32_t Flag)
+{
+	struct pollfd Poll = { .fd = huart->Instance->Sim_Fd, .events = POLLIN };
+
+	if((UART_FLAG_RXNE == Flag) && (poll(&Poll, 1, 0) > 0) && (Poll.revents & POLLIN))
+	{
+		return 1U;
+	}
+	return 0U;
+}
+
+__attribute__((weak)) void HAL_UARTEx_RxEventCallback(UART_HandleTypeDef *huart, uint16_t Size)
+{
+	(void)huart;
+	(void)Size;
+}
+
+__attribute__((weak)) void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart)
+{
+	(void)huart;
+}
+
+/* The simulated UART never reports a line error, kept for the firmware that overrides it */
+__attribute__((weak)) void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart)
+{
+	(void)huart;
+}
+
+static void *Sim_UART_DMA_Tx_Thread(void *Argument)
+{
+	Sim_UART_DMA_Tx *Tx = Argument;
+	UART_HandleTypeDef *huart = Tx->huart;
+	uint8_t *Buffer;
+	uint16_t Size;
+
+	while(1)
+	{
+		pthread_mutex_lock(&Tx->Lock);
+		while(0U == Tx->Size)
+		{
+			pthread_cond_wait(&Tx->Start, &Tx->Lock);
+		}
+		Buffer = Tx->Buffer;
+		Size = Tx->Size;
+		pthread_mutex_unlock(&Tx->Lock);
+
+		HAL_UART_Transmit(huart, Buffer, Size, HAL_MAX_DELAY);
+
+		//transfer complete interrupt, the callback may start the next transfer
+		Sim_IRQ_Enter();
+		pthread_mutex_lock(&Tx->Lock);
+		Tx->Size = 0U;
+		pthread_mutex_unlock(&Tx->Lock);
+		huart->hdmatx->Instance->NDTR = 0U;
+		if((DMA1_Stream6 == huart->hdmatx->Instance) && !Sim_IRQ_Enabled(DMA1_Stream6_IRQn))
+		{
+			//nothing ends the transfer for the HAL
+			Sim_IRQ_Exit();
+			continue;
+		}
+		huart->gState = 0x20U;
+		HAL_UART_TxCpltCallback(huart);
+		Sim_IRQ_Exit();
+	}
+	return NULL;
+}
+
+HAL_StatusTypeDef HAL_UART_Transmit_DMA(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size)
+{
+	Sim_UART_DMA_Tx *Tx = huart->Instance->Sim_Tx_DMA;
+
+	if((NULL == pData) || (0U == Size) || (NULL == huart->hdmatx))
+	{
+		return HAL_ERROR;
+	}
+	if(0x21U == huart->gState)
+	{
+		return HAL_BUSY;
+	}
+	if(NULL == Tx)
+	{
+		Tx = calloc(1, sizeof(*Tx));
+		Tx->huart = huart;
+		pthread_mutex_init(&Tx->Lock, NULL);
+		pthread_cond_init(&Tx->Start, NULL);
+		if(pthread_create(&Tx->Thread, NULL, Sim_UART_DMA_Tx_Thread, Tx) != 0)
+		{
+			free(Tx);
+			return HAL_ERROR;
+		}
+		huart->Instance->Sim_Tx_DMA = Tx;
+	}
+	huart->gState = 0x21U;
+	huart->hdmatx->Instance->M0AR = (uint32_t)(uintptr_t)pData;
+	huart->hdmatx->Instance->NDTR = Size;
+	pthread_mutex_lock(&Tx->Lock);
+	Tx->Buffer = pData;
+	Tx->Size = Size;
+	pthread_cond_signal(&Tx->Start);
+	pthread_mutex_unlock(&Tx->Lock);
+	return HAL_OK;
+}
+
+static void Sim_UART_DMA_Store(Sim_UART_DMA_Rx *Rx, uint8_t Data)
+{
+	UART_HandleTypeDef *huart = Rx->huart;
+	DMA_Stream_TypeDef *Stream = huart->hdmarx->Instance;
+	uint32_t Remaining = Stream->NDTR;
+
+	Rx->Buffer[Rx->Size - Remaining] = Data;
+	Remaining--;
+	if(0U == Remaining)
+	{
+		//full transfer: a circular stream reloads NDTR, a normal one stops
+		if(DMA_CIRCULAR == huart->hdmarx->Init.Mode)
+		{
+			__atomic_store_n(&Stream->NDTR, Rx->Size, __ATOMIC_RELEASE);
+		}
+		else
+		{
+			__atomic_store_n(&Stream->NDTR, 0U, __ATOMIC_RELEASE);
+			Rx->Running = 0;
+			huart->RxState = 0x20U;
+		}
+		Sim_IRQ_Enter();
+		HAL_UARTEx_RxEventCallback(huart, Rx->Size);
+		Sim_IRQ_Exit();
+	}
+	else
+	{
+		__atomic_store_n(&Stream->NDTR, Remaining, __ATOMIC_RELEASE);
+		if((Rx->Size - Remaining) == (Rx->Size / 2U))
+		{
+			Sim_IRQ_Enter();
+			HAL_UARTEx_RxEventCallback(huart, Rx->Size / 2U);
+			Sim_IRQ_Exit();
+		}
+	}
+}
+
+static void *Sim_UART_DMA_Rx_Thread(void *Argument)
+{
+	Sim_UART_DMA_Rx *Rx = Argument;
+	UART_HandleTypeDef *huart = Rx->huart;
+	USART_TypeDef *Port = huart->Instance;
+	uint8_t Data[256];
+	uint8_t Line_Active = 0U;
+
+	while(Rx->Running)
+	{
+		struct pollfd Poll = { .fd = Port->Sim_Fd, .events = POLLIN };
+		uint64_t Byte_Time = Sim_UART_Byte_Time_ns(huart);
+		size_t Chunk = sizeof(Data);
+		ssize_t Count;
+		uint64_t Now;
+
+		if(poll(&Poll, 1, Line_Active ? SIM_UART_IDLE_TIMEOUT_MS : 10) <= 0)
+		{
+			if(Line_Active)
+			{
+				Line_Active = 0U;
+				Sim_IRQ_Enter();
+				HAL_UARTEx_RxEventCallback(huart, (uint16_t)(Rx->Size - huart->hdmarx->Instance->NDTR));
+				Sim_IRQ_Exit();
+			}
+			continue;
+		}
+		//deliver about one millisecond of line time per step
+		if((Byte_Time > 0U) && ((1000000ULL / Byte_Time) < Chunk))
+		{
+			Chunk = (size_t)((1000000ULL / Byte_Time) + 1U);
+		}
+		Count = read(Port->Sim_Fd, Data, Chunk);
+		if(Count <= 0)
+		{
+			HAL_Delay(1U);
+			continue;
+		}
+		if(Sim_UART_Line_Garbles(huart))
+		{
+			Sim_UART_Garble(Data, (size_t)Count);
+		}
+
+		//the bytes land in memory once they have crossed the line
+		Now = Sim_Time_Now_ns();
+		if(Port->Sim_Rx_Line_Time < Now)
+		{
+			Port->Sim_Rx_Line_Time = Now;
+		}
+		Port->Sim_Rx_Line_Time += (uint64_t)Count * Byte_Time;
+		Sim_Sleep_Until_ns(Port->Sim_Rx_Line_Time);
+
+		for(ssize_t Index = 0; (Index < Count) && Rx->Running; Index++)
+		{
+			Sim_UART_DMA_Store(Rx, Data[Index]);
+		}
+		Line_Active = 1U;
+	}
+	return NULL;
+}
+
+HAL_StatusTypeDef HAL_UARTEx_ReceiveToIdle_DMA(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size)
+{
+	Sim_UART_DMA_Rx *Rx = huart->Instance->Sim_Rx_DMA;
+
+	if((NULL == pData) || (0U == Size) || (NULL == huart->hdmarx))
+	{
+		return HAL_ERROR;
+	}
+	if((NULL != Rx) && Rx->Running)
+	{
+		return HAL_BUSY;
+	}
+	if(NULL == Rx)
+	{
+		Rx = calloc(1, sizeof(*Rx));
+		huart->Instance->Sim_Rx_DMA = Rx;
+	}
+	else
+	{
+		pthread_join(Rx->Thread, NULL);
+	}
+	Rx->huart = huart;
+	Rx->Buffer = pData;
+	Rx->Size = Size;
+	huart->hdmarx->Instance->M0AR = (uint32_t)(uintptr_t)pData;
+	huart->hdmarx->Instance->NDTR = Size;
+	huart->ReceptionType = 1U;
+	huart->RxState = 0x22U;
+	Rx->Running = 1;
+	if(pthread_create(&Rx->Thread, NULL, Sim_UART_DMA_Rx_Thread, Rx) != 0)
+	{
+		Rx->Running = 0;
+		return HAL_ERROR;
+	}
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_DMAStop(UART_HandleTypeDef *huart)
+{
+	Sim_UART_DMA_Rx *Rx = huart->Instance->Sim_Rx_DMA;
+
+	if(NULL != Rx)
+	{
+		Rx->Running = 0;
+		pthread_join(Rx->Thread, NULL);
+		huart->Instance->Sim_Rx_DMA = NULL;
+		free(Rx);
+	}
+	huart->RxState = 0x20U;
+	return HAL_OK;
+}
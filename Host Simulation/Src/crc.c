@@ -0,0 +1,73 @@
+/*
+ * Host simulation stand-in for the CubeMX generated crc.c and the CRC HAL.
+ *
+ * The STM32F4 CRC unit computes CRC-32/MPEG-2 (polynomial 0x04C11DB7, initial
+ * value 0xFFFFFFFF, no reflection, no final XOR) one 32-bit word at a time,
+ * accumulating in the DR register until it is reset.
+ */
+#include "crc.h"
+
+CRC_HandleTypeDef hcrc;
+CRC_TypeDef Sim_CRC = { .DR = 0xFFFFFFFFU };
+
+static uint32_t Sim_CRC_Feed_Word(uint32_t CRC_Value, uint32_t Data)
+{
+	CRC_Value ^= Data;
+	for(uint8_t Bit = 0U; Bit < 32U; Bit++)
+	{
+		if(CRC_Value & 0x80000000U)
+		{
+			CRC_Value = (CRC_Value << 1) ^ 0x04C11DB7U;
+		}
+		else
+		{
+			CRC_Value = (CRC_Value << 1);
+		}
+	}
+	return CRC_Value;
+}
+
+void MX_CRC_Init(void)
+{
+	hcrc.Instance = CRC;
+	if (HAL_CRC_Init(&hcrc) != HAL_OK)
+	{
+		Error_Handler();
+	}
+}
+
+HAL_StatusTypeDef HAL_CRC_Init(CRC_HandleTypeDef *crc_handle)
+{
+	crc_handle->Lock = HAL_UNLOCKED;
+	crc_handle->State = 1U;
+	__HAL_CRC_DR_RESET(crc_handle);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_CRC_DeInit(CRC_HandleTypeDef *crc_handle)
+{
+	crc_handle->State = 0U;
+	__HAL_CRC_DR_RESET(crc_handle);
+	return HAL_OK;
+}
+
+uint32_t HAL_CRC_Accumulate(CRC_HandleTypeDef *crc_handle, uint32_t pBuffer[], uint32_t BufferLength)
+{
+	for(uint32_t Index = 0U; Index < BufferLength; Index++)
+	{
+		crc_handle->Instance->DR = Sim_CRC_Feed_Word(crc_handle->Instance->DR, pBuffer[Index]);
+	}
+	return crc_handle->Instance->DR;
+}
+
+/* A bus write to DR, as done by a DMA stream targeting the unit */
+void Sim_CRC_Write_DR(uint32_t Data)
+{
+	CRC->DR = Sim_CRC_Feed_Word(CRC->DR, Data);
+}
+
+uint32_t HAL_CRC_Calculate(CRC_HandleTypeDef *crc_handle, uint32_t pBuffer[], uint32_t BufferLength)
+{
+	__HAL_CRC_DR_RESET(crc_handle);
+	return HAL_CRC_Accumulate(crc_handle, pBuffer, BufferLength);
+}
@@ -0,0 +1,21 @@
+/*
+ * Host simulation stand-in for the CubeMX generated dma.c.
+ *
+ * Enables the DMA controller and the interrupt lines of the streams the
+ * bootloader uses, the streams themselves are linked in usart.c like
+ * HAL_UART_MspInit does on the target.
+ */
+#include "dma.h"
+
+void MX_DMA_Init(void)
+{
+	/* DMA controller clock enable */
+	__HAL_RCC_DMA1_CLK_ENABLE();
+
+	/* USART3_RX, host link */
+	HAL_NVIC_SetPriority(DMA1_Stream1_IRQn, 0, 0);
+	HAL_NVIC_EnableIRQ(DMA1_Stream1_IRQn);
+	/* USART2_TX, debug messages */
+	HAL_NVIC_SetPriority(DMA1_Stream6_IRQn, 0, 0);
+	HAL_NVIC_EnableIRQ(DMA1_Stream6_IRQn);
+}
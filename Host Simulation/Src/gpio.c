@@ -0,0 +1,20 @@
+/*
+ * Host simulation stand-in for the CubeMX generated gpio.c and the GPIO HAL.
+ * BL_SIM_BUTTON=1 holds the user button (PA0) down from reset on.
+ */
+#include "gpio.h"
+
+GPIO_TypeDef Sim_GPIOA;
+
+void MX_GPIO_Init(void)
+{
+	if(Sim_Get_Env_Double("BL_SIM_BUTTON", 0.0) != 0.0)
+	{
+		Sim_GPIOA.IDR |= GPIO_PIN_0;
+	}
+}
+
+GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin)
+{
+	return (GPIOx->IDR & GPIO_Pin) ? GPIO_PIN_SET : GPIO_PIN_RESET;
+}
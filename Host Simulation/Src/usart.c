@@ -0,0 +1,132 @@
+/*
+ * Host simulation stand-in for the CubeMX generated usart.c.
+ *
+ * USART3 (host link) is a pseudo-terminal: Host.py opens the slave side like
+ * any serial port. Its name is printed at start-up and, when BL_SIM_PTY_LINK
+ * is set, published as a symbolic link at that path.
+ * USART2 (debug messages) is written to stdout, its TX DMA stream included.
+ * BL_SIM_UART_DMA=0 leaves the DMA streams unlinked, like a CubeMX project
+ * without them.
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <unistd.h>
+/* <termios.h> names clash with the USART register fields */
+#undef CR1
+#undef CR2
+#undef CR3
+#include "usart.h"
+
+UART_HandleTypeDef huart2;
+UART_HandleTypeDef huart3;
+DMA_HandleTypeDef hdma_usart2_tx;
+DMA_HandleTypeDef hdma_usart3_rx;
+
+/* The slave side is kept open so the master never reports a hang-up between host sessions */
+static int Sim_Pty_Slave_Fd = -1;
+
+static void Sim_UART_Default_Init(UART_HandleTypeDef *huart, USART_TypeDef *Instance)
+{
+	huart->Instance = Instance;
+	huart->Init.BaudRate = 115200;
+	huart->Init.WordLength = UART_WORDLENGTH_8B;
+	huart->Init.StopBits = UART_STOPBITS_1;
+	huart->Init.Parity = UART_PARITY_NONE;
+	huart->Init.Mode = UART_MODE_TX_RX;
+	huart->Init.HwFlowCtl = UART_HWCONTROL_NONE;
+	huart->Init.OverSampling = UART_OVERSAMPLING_16;
+	if (HAL_UART_Init(huart) != HAL_OK)
+	{
+		Error_Handler();
+	}
+}
+
+void MX_USART2_UART_Init(void)
+{
+	USART2->Sim_Fd = STDOUT_FILENO;
+	USART2->Sim_Console = 1U;
+	Sim_UART_Default_Init(&huart2, USART2);
+
+	HAL_NVIC_SetPriority(USART2_IRQn, 0, 0);
+	HAL_NVIC_EnableIRQ(USART2_IRQn);
+	if(Sim_Get_Env_Double("BL_SIM_UART_DMA", 1.0) == 0.0)
+	{
+		return;
+	}
+	//USART2_TX on DMA1 Stream6 Channel4, as HAL_UART_MspInit links it
+	hdma_usart2_tx.Instance = DMA1_Stream6;
+	hdma_usart2_tx.Init.Channel = DMA_CHANNEL_4;
+	hdma_usart2_tx.Init.Direction = DMA_MEMORY_TO_PERIPH;
+	hdma_usart2_tx.Init.PeriphInc = DMA_PINC_DISABLE;
+	hdma_usart2_tx.Init.MemInc = DMA_MINC_ENABLE;
+	hdma_usart2_tx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+	hdma_usart2_tx.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+	hdma_usart2_tx.Init.Mode = DMA_NORMAL;
+	hdma_usart2_tx.Init.Priority = DMA_PRIORITY_LOW;
+	hdma_usart2_tx.Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+	if (HAL_DMA_Init(&hdma_usart2_tx) != HAL_OK)
+	{
+		Error_Handler();
+	}
+	huart2.hdmatx = &hdma_usart2_tx;
+	hdma_usart2_tx.Parent = &huart2;
+}
+
+void MX_USART3_UART_Init(void)
+{
+	struct termios Raw_Mode;
+	const char *Link_Path = getenv("BL_SIM_PTY_LINK");
+	int Master_Fd = posix_openpt(O_RDWR | O_NOCTTY);
+
+	if((Master_Fd < 0) || (grantpt(Master_Fd) != 0) || (unlockpt(Master_Fd) != 0))
+	{
+		perror("[sim] pseudo-terminal");
+		exit(EXIT_FAILURE);
+	}
+	Sim_Pty_Slave_Fd = open(ptsname(Master_Fd), O_RDWR | O_NOCTTY);
+	if((Sim_Pty_Slave_Fd >= 0) && (tcgetattr(Sim_Pty_Slave_Fd, &Raw_Mode) == 0))
+	{
+		cfmakeraw(&Raw_Mode);
+		tcsetattr(Sim_Pty_Slave_Fd, TCSANOW, &Raw_Mode);
+	}
+	if((NULL != Link_Path) && ('\0' != Link_Path[0]))
+	{
+		unlink(Link_Path);
+		if(symlink(ptsname(Master_Fd), Link_Path) != 0)
+		{
+			perror("[sim] BL_SIM_PTY_LINK");
+		}
+	}
+	fprintf(stderr, "[sim] host link (USART3) on %s\n", ptsname(Master_Fd));
+
+	USART3->Sim_Fd = Master_Fd;
+	USART3->Sim_Console = 0U;
+	Sim_UART_Default_Init(&huart3, USART3);
+
+	HAL_NVIC_SetPriority(USART3_IRQn, 0, 0);
+	HAL_NVIC_EnableIRQ(USART3_IRQn);
+	if(Sim_Get_Env_Double("BL_SIM_UART_DMA", 1.0) == 0.0)
+	{
+		return;
+	}
+	//USART3_RX on DMA1 Stream1 Channel4, as HAL_UART_MspInit links it
+	hdma_usart3_rx.Instance = DMA1_Stream1;
+	hdma_usart3_rx.Init.Channel = DMA_CHANNEL_4;
+	hdma_usart3_rx.Init.Direction = DMA_PERIPH_TO_MEMORY;
+	hdma_usart3_rx.Init.PeriphInc = DMA_PINC_DISABLE;
+	hdma_usart3_rx.Init.MemInc = DMA_MINC_ENABLE;
+	hdma_usart3_rx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+	hdma_usart3_rx.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+	hdma_usart3_rx.Init.Mode = DMA_NORMAL;
+	hdma_usart3_rx.Init.Priority = DMA_PRIORITY_LOW;
+	hdma_usart3_rx.Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+	if (HAL_DMA_Init(&hdma_usart3_rx) != HAL_OK)
+	{
+		Error_Handler();
+	}
+	huart3.hdmarx = &hdma_usart3_rx;
+	hdma_usart3_rx.Parent = &huart3;
+}
@@ -3,7 +3,18 @@ import struct
 import os
 import sys
 import glob
-from time import sleep
+import zlib
+import random
+import json
+import io
+import argparse
+import multiprocessing
+import queue
+import mmap
+import threading
+import re
+from collections import deque
+from time import sleep, perf_counter
 
 ''' Bootloader Commands '''
 CBL_GET_VER_CMD              = 0x10
@@ -18,23 +29,153 @@ CBL_MEM_READ_CMD             = 0x18
 CBL_READ_SECTOR_STATUS_CMD   = 0x19
 CBL_OTP_READ_CMD             = 0x20
 CBL_CHANGE_ROP_Level_CMD     = 0x21
+CBL_MEM_WRITE_WINDOW_CMD     = 0x22
+CBL_FRAME_NEGOTIATE_CMD      = 0x23
+CBL_FLASH_BLOCK_HASH_CMD     = 0x24
+CBL_MEM_WRITE_LZ4_CMD        = 0x25
+CBL_MEM_CRC_CMD              = 0x26
+CBL_CHANGE_BAUD_CMD          = 0x27
+CBL_SLOT_STATUS_CMD          = 0x28
+CBL_SLOT_SWITCH_CMD          = 0x29
+CBL_FLASH_ERASE_ASYNC_CMD    = 0x2A
+CBL_ERASE_STATUS_CMD         = 0x2B
+CBL_MEM_WRITE_STAGED_CMD     = 0x2C
+CBL_STAGE_COMMIT_CMD         = 0x2D
+CBL_RAM_RUN_CMD              = 0x2E
+CBL_FLASH_STATS_CMD          = 0x2F
+CBL_PROFILE_CMD              = 0x30
 
 INVALID_SECTOR_NUMBER        = 0x00
 VALID_SECTOR_NUMBER          = 0x01
 UNSUCCESSFUL_ERASE           = 0x02
 SUCCESSFUL_ERASE             = 0x03
+ERASE_ASYNC_BUSY             = 0x04
+CBL_FLASH_MASS_ERASE         = 0xFF
+
+''' Background erase: Marker | Sector | Status | Sectors_Done | Sectors_Total between two replies '''
+ERASE_EVENT_MARKER           = 0xE5
+ERASE_EVENT_LENGTH           = 5
+ERASE_STATUS_REPLY_LENGTH    = 8
+ERASE_STATE_NAMES            = ['idle', 'running', 'done', 'failed']
+''' Longest datasheet erase times (x8 parallelism), a sector that takes longer means a hung target '''
+ERASE_SECTOR_MAX_TIME        = { 0x4000 : 0.8, 0x10000 : 2.4, 0x20000 : 4.0 }
+ERASE_MASS_MAX_TIME          = 32.0
+ERASE_TIMEOUT_MARGIN         = 0.5
+ERASE_POLL_PERIOD            = 0.25
+
+''' Staged write: the frames are kept in the 64KB CCM RAM of the target until one commit programs them '''
+STAGE_LENGTH                 = 0x10000
+STAGE_CHUNK_LENGTH           = 256
+STAGE_COMMIT_REPLY_LENGTH    = 7
+''' The commit waits for a background erase, the timeout runs again after each of its events '''
+STAGE_COMMIT_TIMEOUT         = 5
 
 FLASH_PAYLOAD_WRITE_FAILED   = 0x00
 FLASH_PAYLOAD_WRITE_PASSED   = 0x01
 
+WINDOW_FRAME_WRITE_FAILED    = 0x00
+WINDOW_FRAME_ACCEPTED        = 0x01
+WINDOW_FRAME_RETRANSMIT      = 0x02
+WINDOW_REPLY_LENGTH          = 5
+WINDOW_PAYLOAD_LENGTH        = 128
+
+LARGE_FRAME_MARKER           = 0xFF
+LARGE_PAYLOAD_LENGTH         = 4096
+
+ADDRESS_IS_VALID             = 0x01
+IMAGE_IS_VALID               = 0x01
+
+CBL_SEND_ACK                 = 0xCD
+CBL_SEND_NACK                = 0xAB
+CBL_ACK_LONG_LENGTH          = 0xFF
+
+FLASH_HASH_HEADER_LENGTH     = 20
+DELTA_BLOCK_LENGTH           = 1024
+
+LZ4_MIN_MATCH_LENGTH         = 4
+LZ4_MAX_OFFSET               = 0xFFFF
+
+MEM_READ_REPLY_LENGTH        = 4
+MEM_READ_CHUNK_LENGTH        = 4096
+MEM_READ_RETRIES             = 3
+MEM_CRC_REPLY_LENGTH         = 12
+
+BAUD_CHANGE_REJECTED         = 0x00
+BAUD_CHANGE_ACCEPTED         = 0x01
+BAUD_CHANGE_CONFIRMED        = 0x02
+BAUD_CONFIRM_TIMEOUT         = 0.5
+BAUD_SWITCH_DELAY            = 0.01
+BAUD_PROBE_RATES             = [230400, 460800, 921600, 1000000, 1500000, 2000000, 2625000]
+BAUD_PROBE_LENGTH            = 0x4000
+
+FLASH_BASE_ADDRESS           = 0x08000000
+''' Image descriptor in the reserved vector table words: Magic | Length | CRC, checked before the application is started '''
+IMAGE_DESCRIPTOR_OFFSET      = 0x1C
+IMAGE_CRC_OFFSET             = IMAGE_DESCRIPTOR_OFFSET + 8
+IMAGE_MIN_LENGTH             = IMAGE_DESCRIPTOR_OFFSET + 12
+IMAGE_MAGIC                  = 0x4D494C42
+''' STM32F407 flash sectors: 4 x 16KB, 1 x 64KB, 7 x 128KB '''
+FLASH_SECTOR_SIZES           = [0x4000] * 4 + [0x10000] + [0x20000] * 7
+''' A/B application slots: sectors 5-7 and 8-10, an image is linked for the slot it runs from '''
+SLOT_NAMES                   = ['A', 'B']
+SLOT_BASE_ADDRESSES          = [0x08020000, 0x08080000]
+SLOT_FIRST_SECTORS           = [5, 8]
+SLOT_SECTORS                 = 3
+SLOT_SIZE                    = SLOT_SECTORS * 0x20000
+SLOT_NONE                    = 0xFF
+SLOT_STATE_NAMES             = ['never switched', 'confirmed', 'on trial']
+SLOT_STATUS_REPLY_LENGTH     = 18
+SLOT_SWITCH_REFUSED          = 0x00
+SLOT_SWITCH_DONE             = 0x01
+SLOT_SWITCH_FAILED           = 0x02
+''' RAM images: SRAM1 above the 32KB of the bootloader and SRAM2, the vector table on a VTOR boundary '''
+RAM_IMAGE_BASE_ADDRESS       = 0x20008000
+RAM_IMAGE_END_ADDRESS        = 0x20020000
+RAM_IMAGE_VTOR_ALIGN         = 512
+''' Per sector: Program_Total_ns(8) | Erase_Count | Erase_Timed | Erase_Min/Max/Total_ms | Program_Bytes | Program_Min/Max_ns per byte '''
+FLASH_STATS_FORMAT           = '<QIIIIIIII'
+''' Command latency: log2 histograms of cycles per command and phase, bucket 0 below 2^PROFILE_FIRST_BUCKET_SHIFT '''
+PROFILE_PHASES               = ['RX', 'CRC', 'HANDLER', 'PRINT', 'TX']
+PROFILE_BUCKETS              = 20
+PROFILE_FIRST_BUCKET_SHIFT   = 10
+PROFILE_ENTRY_FORMAT         = '<I%dH' % PROFILE_BUCKETS
+AGENT_PAYLOAD_LENGTH         = 128
+AGENT_RESTART_TIMEOUT        = 10
+''' Image files: the raw binary, Intel HEX or ELF (.axf), BL_IMAGE_FILE overrides the file name '''
+APPLICATION_IMAGE_FILE       = os.environ.get('BL_IMAGE_FILE', 'Application.bin')
+HEX_EXTENSIONS               = ['.hex', '.ihex']
+HEX_DATA_RECORD              = 0x00
+HEX_END_OF_FILE_RECORD       = 0x01
+HEX_SEGMENT_ADDRESS_RECORD   = 0x02
+HEX_LINEAR_ADDRESS_RECORD    = 0x04
+ELF_PT_LOAD                  = 1
+''' Runs of 0xFF at least this long are not sent, erased flash already holds them '''
+SPARSE_MIN_GAP               = 64
+''' Non-interactive flash command, one session per port '''
+FLEET_BAUD_RATE              = 115200
+FLEET_WINDOW_SIZE            = 4
+FLEET_RESULT_POLL            = 1
+''' USB serial converters and ST-LINK virtual COM ports on Linux and macOS '''
+SERIAL_PORT_PATTERNS         = ['/dev/ttyUSB*', '/dev/ttyACM*', '/dev/tty.usbserial*', '/dev/tty.usbmodem*']
+''' Last known flash hash map per chip, BL_HASH_CACHE overrides the file name '''
+HASH_CACHE_FILE              = os.environ.get('BL_HASH_CACHE', 'BL_Hash_Cache.json')
+
 verbose_mode = 1
 Memory_Write_Active = 0
+''' Frames, retransmissions and reply latencies of the last windowed transfer '''
+Window_Stats = {}
+''' Sectors of the last background erase, updated by its events '''
+Erase_Progress = {}
+''' Session of the last windowed transfer, the next one always differs from it '''
+Window_Session = random.randint(1, 255)
 
 def Check_Serial_Ports():
     Serial_Ports = []
     
     if sys.platform.startswith('win'):
         Ports = ['COM%s' % (i + 1) for i in range(256)]
+    elif sys.platform.startswith('linux') or sys.platform.startswith('darwin'):
+        Ports = sorted(Port for Pattern in SERIAL_PORT_PATTERNS for Port in glob.glob(Pattern))
     else:
         raise EnvironmentError("Error !! Unsupported Platform \n")
     
@@ -118,6 +259,10 @@ def Read_Data_From_Serial_Port(Command_Code):
                 Process_CBL_MEM_WRITE_CMD(Length_To_Follow)
             elif (Command_Code == CBL_CHANGE_ROP_Level_CMD):
                 Process_CBL_CHANGE_ROP_Level_CMD(Length_To_Follow)
+        elif(Command_Code == CBL_CHANGE_ROP_Level_CMD):
+            ''' Only a bootloader built with BL_ROP_CHANGE_ENABLE takes the command '''
+            print ("\n   Received Not-Acknowledgement from Bootloader, ROP Level Not Changed")
+            print ("   The bootloader has to be built with BL_ROP_CHANGE = BL_ROP_CHANGE_ENABLE for this command")
         else:
             print ("\n   Received Not-Acknowledgement from Bootloader")
             sys.exit()
@@ -201,7 +346,7 @@ def Process_CBL_CHANGE_ROP_Level_CMD(Data_Len):
         else:
             print("\n   ROP Level -> Unknown Error")
 
-def Calculate_CRC32(Buffer, Buffer_Length):
+def Calculate_CRC32_Bitwise(Buffer, Buffer_Length):
     CRC_Value = 0xFFFFFFFF
     for DataElem in Buffer[0:Buffer_Length]:
         CRC_Value = CRC_Value ^ DataElem
@@ -211,18 +356,1359 @@ def Calculate_CRC32(Buffer, Buffer_Length):
             else:
                 CRC_Value = (CRC_Value << 1)
     return CRC_Value
+
+'''
+The STM32 CRC unit computes CRC-32/MPEG-2 (polynomial 0x04C11DB7, initial value 0xFFFFFFFF,
+no reflection, no final XOR) one 32-bit word at a time, and Bootloader_CRC_Verify feeds it
+every frame byte as a zero-extended word. Clocking a word through the unit is linear, so it
+is precomputed per byte lane (table engine), or the whole buffer is handed to the zlib CRC-32,
+which is the same polynomial run bit-reflected (native engine).
+'''
+def CRC32_Clock_Word(CRC_Value):
+    for DataElemBitLen in range(32):
+        if(CRC_Value & 0x80000000):
+            CRC_Value = ((CRC_Value << 1) ^ 0x04C11DB7) & 0xFFFFFFFF
+        else:
+            CRC_Value = (CRC_Value << 1) & 0xFFFFFFFF
+    return CRC_Value
+
+def CRC32_Build_Slice_Tables():
+    ''' CRC32_Slice_Tables[Words][Lane][Byte]: register after clocking Byte, placed in byte Lane, through Words words '''
+    Slice_Tables = [None, [[CRC32_Clock_Word(Byte << (8 * Lane)) for Byte in range(256)] for Lane in range(4)]]
+    T0, T1, T2, T3 = Slice_Tables[1]
+    for Words in range(2, CRC32_SLICE_WORDS + 1):
+        Slice_Tables.append([[T0[Value & 0xFF] ^ T1[(Value >> 8) & 0xFF] ^ T2[(Value >> 16) & 0xFF] ^ T3[Value >> 24]
+                              for Value in Lane_Table] for Lane_Table in Slice_Tables[Words - 1]])
+    return Slice_Tables
+
+def CRC32_Table_Bytes(Data, CRC_Value):
+    ''' Slice-by-8: the register term costs 4 lookups per 8 bytes, every byte term one lookup '''
+    R0, R1, R2, R3 = CRC32_Slice_Tables[8]
+    B8, B7, B6, B5, B4, B3, B2, B1 = [CRC32_Slice_Tables[Words][0] for Words in range(8, 0, -1)]
+    T0, T1, T2, T3 = CRC32_Slice_Tables[1]
+    Index = 0
+    Slice_End = len(Data) - (len(Data) % 8)
+    while Index < Slice_End:
+        CRC_Value = (R0[CRC_Value & 0xFF] ^ R1[(CRC_Value >> 8) & 0xFF] ^ R2[(CRC_Value >> 16) & 0xFF] ^ R3[CRC_Value >> 24] ^
+                     B8[Data[Index]] ^ B7[Data[Index + 1]] ^ B6[Data[Index + 2]] ^ B5[Data[Index + 3]] ^
+                     B4[Data[Index + 4]] ^ B3[Data[Index + 5]] ^ B2[Data[Index + 6]] ^ B1[Data[Index + 7]])
+        Index = Index + 8
+    for DataElem in Data[Slice_End:]:
+        CRC_Value = CRC_Value ^ DataElem
+        CRC_Value = T0[CRC_Value & 0xFF] ^ T1[(CRC_Value >> 8) & 0xFF] ^ T2[(CRC_Value >> 16) & 0xFF] ^ T3[CRC_Value >> 24]
+    return CRC_Value
+
+def CRC32_Reverse_Bits(Value):
+    return int('{:032b}'.format(Value)[::-1], 2)
+
+def CRC32_Native_Bytes(Data, CRC_Value):
+    ''' Every byte becomes the big-endian word 00 00 00 xx, bit-reflected for zlib '''
+    Expanded = bytearray(4 * len(Data))
+    Expanded[3::4] = bytes(Data).translate(CRC32_Bit_Reverse_Table)
+    return CRC32_Reverse_Bits(zlib.crc32(Expanded, CRC32_Reverse_Bits(CRC_Value) ^ 0xFFFFFFFF) ^ 0xFFFFFFFF)
+
+def CRC32_Flash_Words(Data):
+    ''' CRC unit fed with little-endian flash words: every word is clocked from its highest byte '''
+    Swapped = bytearray(len(Data))
+    for Lane in range(4):
+        Swapped[Lane::4] = Data[3 - Lane::4]
+    return CRC32_Reverse_Bits(zlib.crc32(bytes(Swapped).translate(CRC32_Bit_Reverse_Table)) ^ 0xFFFFFFFF)
+
+def CRC32_Self_Test():
+    ''' Cross-check the selected engine against the bit-by-bit reference, fall back if it disagrees '''
+    global CRC32_Engine
+    Test_Vectors = [[], [0x05, CBL_GET_VER_CMD], list(range(256)), [(Index * 151 + 7) & 0xFF for Index in range(1021)]]
+    for Engine_Name in [CRC32_Engine, 'table']:
+        Engine = CRC32_Engines[Engine_Name]
+        if(all((Engine(Vector, 0xFFFFFFFF) == (Calculate_CRC32_Bitwise(Vector, len(Vector)) & 0xFFFFFFFF)) for Vector in Test_Vectors)):
+            CRC32_Engine = Engine_Name
+            return
+        print("Warning !! CRC32 engine '" + Engine_Name + "' does not match the bootloader CRC")
+    CRC32_Engine = 'bitwise'
+
+def Calculate_CRC32(Buffer, Buffer_Length):
+    return CRC32_Engines[CRC32_Engine](Buffer[0:Buffer_Length], 0xFFFFFFFF)
+
+CRC32_SLICE_WORDS = 8
+CRC32_Slice_Tables = CRC32_Build_Slice_Tables()
+CRC32_Bit_Reverse_Table = bytes(int('{:08b}'.format(Byte)[::-1], 2) for Byte in range(256))
+CRC32_Engines = {
+    'native'  : CRC32_Native_Bytes,
+    'table'   : CRC32_Table_Bytes,
+    'bitwise' : lambda Data, CRC_Value: Calculate_CRC32_Bitwise(Data, len(Data)) & 0xFFFFFFFF
+}
+''' BL_CRC32_ENGINE selects the native (default), table or bitwise engine '''
+CRC32_Engine = os.environ.get('BL_CRC32_ENGINE', 'native')
+if(CRC32_Engine not in CRC32_Engines):
+    CRC32_Engine = 'native'
+CRC32_Self_Test()
     
 def Word_Value_To_Byte_Value(Word_Value, Byte_Index, Byte_Lower_First):
     Byte_Value = (Word_Value >> (8 * (Byte_Index - 1)) & 0x000000FF)
     return Byte_Value
 
+def Stamp_Image_Descriptor(Image):
+    ''' Stamps the image descriptor into the reserved vector table words of a writable, word padded image.
+        The CRC covers every word of the image but itself. Words already in use are left alone, the bootloader
+        then keeps waiting for the host instead of starting the image '''
+    if(len(Image) < IMAGE_MIN_LENGTH):
+        return
+    Magic = struct.unpack_from('<I', Image, IMAGE_DESCRIPTOR_OFFSET)[0]
+    if((Image[IMAGE_DESCRIPTOR_OFFSET : IMAGE_MIN_LENGTH] != bytes(IMAGE_MIN_LENGTH - IMAGE_DESCRIPTOR_OFFSET)) and (Magic != IMAGE_MAGIC)):
+        return
+    struct.pack_into('<II', Image, IMAGE_DESCRIPTOR_OFFSET, IMAGE_MAGIC, len(Image))
+    Image_CRC = CRC32_Flash_Words(Image[0 : IMAGE_CRC_OFFSET] + Image[IMAGE_CRC_OFFSET + 4 :])
+    struct.pack_into('<I', Image, IMAGE_CRC_OFFSET, Image_CRC)
+
+def Load_HEX_Segments(File_Name):
+    ''' Data records of an Intel HEX file at their absolute address '''
+    Segments = []
+    Upper_Address = 0
+    with open(File_Name, 'r') as HEX_File:
+        for Line_Number, Line in enumerate(HEX_File, 1):
+            Line = Line.strip()
+            if(not Line):
+                continue
+            try:
+                Record = bytes.fromhex(Line[1:]) if (Line[0] == ':') else b''
+            except ValueError:
+                Record = b''
+            if((len(Record) < 5) or (len(Record) != Record[0] + 5) or (sum(Record) & 0xFF)):
+                raise ValueError("Error !! " + File_Name + " line " + str(Line_Number) + " is not a valid HEX record")
+            Record_Type = Record[3]
+            Data = Record[4 : 4 + Record[0]]
+            if(Record_Type == HEX_DATA_RECORD):
+                Segments.append((Upper_Address + ((Record[1] << 8) | Record[2]), Data))
+            elif(Record_Type == HEX_END_OF_FILE_RECORD):
+                break
+            elif(Record_Type == HEX_SEGMENT_ADDRESS_RECORD):
+                Upper_Address = int.from_bytes(Data, 'big') << 4
+            elif(Record_Type == HEX_LINEAR_ADDRESS_RECORD):
+                Upper_Address = int.from_bytes(Data, 'big') << 16
+    return Segments
+
+def Load_ELF_Segments(File_Name):
+    ''' Loadable segments at their physical address: initialised data is stored in flash behind the code
+        and copied to RAM by the startup code, so its load address is the one to program '''
+    Image = open(File_Name, 'rb').read()
+    Is_ELF64 = (Image[4] == 2)
+    Endian = '<' if (Image[5] == 1) else '>'
+    if(Is_ELF64):
+        Header_Table = struct.unpack_from(Endian + 'Q', Image, 0x20)[0]
+        Entry_Size, Entry_Count = struct.unpack_from(Endian + 'HH', Image, 0x36)
+        Entry_Format = Endian + 'IIQQQQ'
+    else:
+        Header_Table = struct.unpack_from(Endian + 'I', Image, 0x1C)[0]
+        Entry_Size, Entry_Count = struct.unpack_from(Endian + 'HH', Image, 0x2A)
+        Entry_Format = Endian + 'IIIIII'
+    Segments = []
+    for Index in range(Entry_Count):
+        Fields = struct.unpack_from(Entry_Format, Image, Header_Table + (Index * Entry_Size))
+        if(Is_ELF64):
+            Type, Flags, Offset, Virtual_Address, Address, File_Size = Fields
+        else:
+            Type, Offset, Virtual_Address, Address, File_Size, Memory_Size = Fields
+        if((Type == ELF_PT_LOAD) and (File_Size > 0)):
+            Segments.append((Address, Image[Offset : Offset + File_Size]))
+    if(not Segments):
+        raise ValueError("Error !! " + File_Name + " has no loadable segments")
+    return Segments
+
+def Load_Image_File(File_Name = APPLICATION_IMAGE_FILE):
+    ''' (Start address, image) of a binary, Intel HEX or ELF file. The segments of HEX and ELF files are laid out
+        from their lowest address with 0xFF between them, the start address of a binary is None.
+        The image is padded to whole words and carries the image descriptor. '''
+    with open(File_Name, 'rb') as Image_File:
+        Magic = Image_File.read(4)
+    if(Magic == b'\x7fELF'):
+        Segments = Load_ELF_Segments(File_Name)
+    elif(os.path.splitext(File_Name)[1].lower() in HEX_EXTENSIONS):
+        Segments = Load_HEX_Segments(File_Name)
+    else:
+        Image = bytearray(open(File_Name, 'rb').read())
+        Image += b'\xFF' * (-len(Image) % 4)
+        Stamp_Image_Descriptor(Image)
+        return (None, bytes(Image))
+    Base_Address = min(Address for Address, Data in Segments) & ~3
+    End_Address = max(Address + len(Data) for Address, Data in Segments)
+    Image = bytearray(b'\xFF' * ((End_Address - Base_Address + 3) & ~3))
+    for Address, Data in Segments:
+        Image[Address - Base_Address : Address - Base_Address + len(Data)] = Data
+    Stamp_Image_Descriptor(Image)
+    return (Base_Address, bytes(Image))
+
+def Load_Application_Image(File_Name = APPLICATION_IMAGE_FILE):
+    ''' The image file padded to whole words, with the image descriptor stamped in '''
+    return Load_Image_File(File_Name)[1]
+
+def Sparse_Segments(BaseMemoryAddress, Image):
+    ''' The populated ranges of the image: runs of SPARSE_MIN_GAP or more 0xFF bytes are left out,
+        cut on word boundaries. Erased flash already reads 0xFF and programming 0xFF changes nothing. '''
+    Image = memoryview(Image)
+    Segments = []
+    Start = 0
+    for Gap in re.finditer(b'\xFF{%d,}' % SPARSE_MIN_GAP, Image):
+        Gap_Start = (Gap.start() + 3) & ~3
+        Gap_End = Gap.end() & ~3 if (Gap.end() < len(Image)) else len(Image)
+        if(Gap_End - Gap_Start < SPARSE_MIN_GAP):
+            continue
+        if(Gap_Start > Start):
+            Segments.append((BaseMemoryAddress + Start, Image[Start : Gap_Start]))
+        Start = Gap_End
+    if(Start < len(Image)):
+        Segments.append((BaseMemoryAddress + Start, Image[Start:]))
+    return Segments
+
+def Input_Image_Address():
+    ''' The start address of a HEX or ELF image, asked for a binary '''
+    Base_Address = Load_Image_File()[0]
+    if(Base_Address is not None):
+        print("\n   Start address from", APPLICATION_IMAGE_FILE, ":", hex(Base_Address))
+        return Base_Address
+    return int(input("\n   Enter the start address : "), 16)
+
+def Map_Application_Image(File_Name = APPLICATION_IMAGE_FILE):
+    ''' Same content as Load_Application_Image without reading the file into memory: a private mapping,
+        the descriptor is stamped into its copy of the first page only. HEX and ELF files, and binaries
+        that are not whole words, are loaded instead. '''
+    with open(File_Name, 'rb') as Image_File:
+        Length = os.fstat(Image_File.fileno()).st_size
+        if((Length == 0) or (Length % 4) or (Image_File.read(4) == b'\x7fELF') or
+           (os.path.splitext(File_Name)[1].lower() in HEX_EXTENSIONS)):
+            return memoryview(Load_Application_Image(File_Name))
+        Image = mmap.mmap(Image_File.fileno(), 0, access = mmap.ACCESS_COPY)
+    Stamp_Image_Descriptor(Image)
+    return memoryview(Image)
+
 def CalulateBinFileLength():
-    BinFileLength = os.path.getsize("Application.bin")
+    BinFileLength = len(Map_Application_Image())
     return BinFileLength
 
-def OpenBinFile():
-    global BinFile
-    BinFile = open('Application.bin', 'rb')
+def Build_Frame(Header_Format, Header_Fields, Payload):
+    ''' Header | Payload | CRC(4) in one buffer, the payload (a slice of the mapped image) is copied once '''
+    Header_Length = struct.calcsize(Header_Format)
+    CRC_Offset = Header_Length + len(Payload)
+    Frame = bytearray(CRC_Offset + 4)
+    struct.pack_into(Header_Format, Frame, 0, *Header_Fields)
+    Frame[Header_Length : CRC_Offset] = Payload
+    struct.pack_into('<I', Frame, CRC_Offset, Calculate_CRC32(memoryview(Frame), CRC_Offset))
+    return Frame
+
+def Next_Window_Session():
+    ''' 1..255, the bootloader starts a transfer over when the session changes '''
+    global Window_Session
+    Window_Session = (Window_Session % 255) + 1
+    return Window_Session
+
+def Build_Window_Frame(Session, Seq, Address, Payload, Large_Frame = False, Command = CBL_MEM_WRITE_WINDOW_CMD):
+    if(Large_Frame):
+        ''' 0xFF | Len(2) | CMD | Session | Seq(2) | Address(4) | Payload_Len(2) | Payload | CRC(4) '''
+        return Build_Frame('<BHBBHIH', (LARGE_FRAME_MARKER, len(Payload) + 14, Command, Session, Seq & 0xFFFF, Address, len(Payload)), Payload)
+    return Build_Frame('<BBBHIB', (len(Payload) + 13, Command, Session, Seq & 0xFFFF, Address, len(Payload)), Payload)
+
+def Frame_Producer(Pipeline, Frame_Builder):
+    Ready = Pipeline['ready']
+    try:
+        for Index in range(Pipeline['count']):
+            Frame = Frame_Builder(Index)
+            with Ready:
+                Pipeline['frames'].append(Frame)
+                Ready.notify()
+    except Exception as Error:
+        with Ready:
+            Pipeline['error'] = Error
+            Ready.notify()
+
+def Start_Frame_Pipeline(Frame_Count, Frame_Builder):
+    ''' Frame_Builder(Index) is run for every frame in order by a producer thread, ahead of the link:
+        the consumer only writes finished frames. Frames are kept for retransmissions. '''
+    Pipeline = { 'count' : Frame_Count, 'frames' : [], 'error' : None, 'ready' : threading.Condition() }
+    threading.Thread(target = Frame_Producer, args = (Pipeline, Frame_Builder), daemon = True).start()
+    return Pipeline
+
+def Pipeline_Frame(Pipeline, Index):
+    ''' Frame Index of the pipeline, waits for the producer when it is not built yet '''
+    Ready = Pipeline['ready']
+    with Ready:
+        while((len(Pipeline['frames']) <= Index) and (Pipeline['error'] is None)):
+            Ready.wait()
+        if(len(Pipeline['frames']) <= Index):
+            raise Pipeline['error']
+        return Pipeline['frames'][Index]
+
+def Negotiate_Frame_Size(Requested_Payload):
+    ''' Returns the large frame payload, the bytes the bootloader can buffer and its decompression budget,
+        (0, 0, 0) for legacy frames only '''
+    Serial_Port_Obj.reset_input_buffer()
+    Send_Command_Frame(CBL_FRAME_NEGOTIATE_CMD, struct.pack('<H', Requested_Payload))
+    Reply = Read_Reply()
+    if((Reply is None) or (len(Reply) < 4)):
+        ''' Older bootloaders do not know the command and stay silent '''
+        Serial_Port_Obj.reset_input_buffer()
+        return (0, 0, 0)
+    ''' The decompression budget was added later, without it compressed writes are not supported '''
+    Payload, RX_Window = struct.unpack('<HH', Reply[0:4])
+    Budget = struct.unpack('<H', Reply[4:6])[0] if (len(Reply) >= 6) else 0
+    return (Payload, RX_Window, Budget)
+
+def Memory_Write_Window(BaseMemoryAddress, Window_Size, Payload_Length = WINDOW_PAYLOAD_LENGTH):
+    BinFileData = Map_Application_Image()
+    return Memory_Write_Segments(Sparse_Segments(BaseMemoryAddress, BinFileData), Window_Size, Payload_Length)
+
+def Memory_Write_Segments(Segments, Window_Size, Payload_Length = WINDOW_PAYLOAD_LENGTH, Command = CBL_MEM_WRITE_WINDOW_CMD):
+    ''' Keep Window_Size frames in flight, every frame is answered in order with one reply '''
+    Payloads = []
+    Frame_Address = []
+    Frame_End_Byte = []
+    Total_Bytes = 0
+    Session = Next_Window_Session()
+    Large_Frame = (Payload_Length > WINDOW_PAYLOAD_LENGTH)
+    for Address, Data in Segments:
+        Data = memoryview(Data)
+        for Offset in range(0, len(Data), Payload_Length):
+            Payloads.append(Data[Offset : Offset + Payload_Length])
+            Frame_Address.append(Address + Offset)
+            Total_Bytes = Total_Bytes + len(Payloads[-1])
+            Frame_End_Byte.append(Total_Bytes)
+    
+    Frames = Start_Frame_Pipeline(len(Payloads), lambda Seq: Build_Window_Frame(Session, Seq, Frame_Address[Seq], Payloads[Seq], Large_Frame, Command))
+    Result = Send_Window_Frames(Frames, Frame_Address, Frame_End_Byte, Window_Size)
+    if(Result is None):
+        return 0
+    Elapsed_Time, Retransmissions = Result
+    print("\n   Window (", Window_Size, "x", Payload_Length, "bytes ) :", Total_Bytes, "bytes in", round(Elapsed_Time, 2), "s ->",
+          round(Total_Bytes / max(Elapsed_Time, 1e-6) / 1024, 2), "KB/s,", len(Payloads), "frames in", len(Segments), "ranges,", Retransmissions, "retransmissions")
+    return 1
+
+def Stage_Blocks(Segments):
+    ''' Segments cut into stage blocks: STAGE_LENGTH bytes from the first address of the block,
+        rounded down to a chunk, as the bootloader sets the base of an empty stage '''
+    Blocks = []
+    Block_End = 0
+    for Address, Data in Segments:
+        Data = memoryview(Data)
+        Offset = 0
+        while(Offset < len(Data)):
+            if(Address + Offset >= Block_End):
+                Block_End = ((Address + Offset) & ~(STAGE_CHUNK_LENGTH - 1)) + STAGE_LENGTH
+                Blocks.append([])
+            Length = min(len(Data) - Offset, Block_End - (Address + Offset))
+            Blocks[-1].append((Address + Offset, Data[Offset : Offset + Length]))
+            Offset = Offset + Length
+    return Blocks
+
+def Stage_Chunk_Count(Block):
+    ''' Chunks of the stage the data of a block lands in, what the commit reports back '''
+    Chunks = set()
+    for Address, Data in Block:
+        if(len(Data)):
+            Chunks.update(range(Address // STAGE_CHUNK_LENGTH, (Address + len(Data) - 1) // STAGE_CHUNK_LENGTH + 1))
+    return len(Chunks)
+
+def Commit_Stage():
+    ''' Status | Base(4) | Chunks(2) once the stage is programmed, None without a reply '''
+    Send_Command_Frame(CBL_STAGE_COMMIT_CMD)
+    Reply = Read_Reply(STAGE_COMMIT_TIMEOUT)
+    if((Reply is None) or (len(Reply) != STAGE_COMMIT_REPLY_LENGTH)):
+        return None
+    return struct.unpack('<BIH', Reply)
+
+def Memory_Write_Staged(Segments, Window_Size, Payload_Length = WINDOW_PAYLOAD_LENGTH):
+    ''' Streams every 64KB block into the target RAM, acknowledged without waiting for the flash,
+        then has it programmed by one commit. A new session per block drops anything left staged. '''
+    Start_Time = perf_counter()
+    Commit_Time = 0.0
+    Total_Bytes = 0
+    for Block in Stage_Blocks(Segments):
+        if(Memory_Write_Segments(Block, Window_Size, Payload_Length, CBL_MEM_WRITE_STAGED_CMD) != 1):
+            return 0
+        Commit_Start = perf_counter()
+        Commit = Commit_Stage()
+        if((Commit is None) or (Commit[0] != FLASH_PAYLOAD_WRITE_PASSED)):
+            print("\n   Write Status -> Commit of the stage at", hex(Block[0][0]), "failed")
+            return 0
+        if(Commit[2] != Stage_Chunk_Count(Block)):
+            print("\n   Write Status -> Stage at", hex(Block[0][0]), "committed", Commit[2], "chunks of", Stage_Chunk_Count(Block))
+            return 0
+        Commit_Time = Commit_Time + perf_counter() - Commit_Start
+        Total_Bytes = Total_Bytes + sum(len(Data) for Address, Data in Block)
+        print("\n   Stage at", hex(Commit[1]), ":", Commit[2], "chunks committed in", round(perf_counter() - Commit_Start, 3), "s")
+    Elapsed_Time = perf_counter() - Start_Time
+    print("\n   Staged write :", Total_Bytes, "bytes in", round(Elapsed_Time, 2), "s ->", round(Total_Bytes / max(Elapsed_Time, 1e-6) / 1024, 2),
+          "KB/s,", round(Commit_Time, 2), "s of it programming")
+    return 1
+
+def Send_Window_Frames(Frames, Frame_Address, Frame_End_Byte, Window_Size):
+    ''' Go-back-N transmission of the frames of a pipeline, returns (elapsed seconds, retransmissions) or None on a write failure '''
+    global Window_Stats
+    Frame_Count = Frames['count']
+    Base_Seq = 0
+    Next_Seq = 0
+    Epoch = 0
+    In_Flight = deque()
+    Retransmissions = 0
+    Send_Time = [0.0] * Frame_Count
+    Latencies = []
+    Window_Stats = { 'frames' : Frame_Count, 'retransmissions' : 0, 'latencies' : Latencies }
+    Port_Timeout = Serial_Port_Obj.timeout
+    Start_Time = perf_counter()
+    while(Base_Seq < Frame_Count):
+        ''' Fill the window '''
+        while((Next_Seq < Frame_Count) and (len(In_Flight) < Window_Size)):
+            Serial_Port_Obj.write(Pipeline_Frame(Frames, Next_Seq))
+            Send_Time[Next_Seq] = perf_counter()
+            In_Flight.append((Next_Seq, Epoch))
+            Next_Seq = Next_Seq + 1
+        
+        ''' The frames wait in the bootloader while a background erase runs, one sector at most between two events '''
+        Serial_Port_Obj.timeout = max(Port_Timeout, Erase_Sector_Timeout(Erase_Sector_Under_Way())) if Erase_Progress.get('running') else Port_Timeout
+        ''' A lone NACK: the bootloader overran and flushed its receive ring '''
+        Reply = Serial_Port_Obj.read(1)
+        if((len(Reply) == 1) and (Reply[0] != CBL_SEND_NACK)):
+            Reply = Reply + Serial_Port_Obj.read(WINDOW_REPLY_LENGTH - 1)
+        if((len(Reply) == ERASE_EVENT_LENGTH) and (Reply[0] == ERASE_EVENT_MARKER)):
+            Erase_Event(Reply)
+            if(Erase_Progress['failed']):
+                Serial_Port_Obj.timeout = Port_Timeout
+                Serial_Port_Obj.reset_input_buffer()
+                return None
+            continue
+        if((len(Reply) < WINDOW_REPLY_LENGTH) or (Reply[0] != 0xCD)):
+            ''' Replies lost or frames dropped, restart from the oldest unacknowledged frame '''
+            print("\n   {0} !!, resending from frame".format('NACK' if (Reply == bytes([CBL_SEND_NACK])) else 'Timeout'), Base_Seq)
+            Serial_Port_Obj.reset_input_buffer()
+            In_Flight.clear()
+            Epoch = Epoch + 1
+            Next_Seq = Base_Seq
+            Retransmissions = Retransmissions + 1
+            continue
+        
+        Sent_Seq, Sent_Epoch = In_Flight.popleft() if In_Flight else (Base_Seq, Epoch)
+        Window_Status = Reply[2]
+        ''' Extend the 16-bit sequence number around the window base '''
+        Reply_Seq = Base_Seq + ((((Reply[3] | (Reply[4] << 8)) - Base_Seq + 0x8000) & 0xFFFF) - 0x8000)
+        if(Window_Status == WINDOW_FRAME_ACCEPTED):
+            if(Reply_Seq + 1 > Base_Seq):
+                ''' From the last time the frame was sent to its reply '''
+                Latencies.append(perf_counter() - Send_Time[Reply_Seq])
+                Base_Seq = Reply_Seq + 1
+                print("\r   Bytes acknowledged by the bootloader :{0}".format(Frame_End_Byte[Base_Seq - 1]), end = ' ')
+        elif(Window_Status == WINDOW_FRAME_RETRANSMIT):
+            ''' Replies to frames sent before the last rewind are stale '''
+            if(Sent_Epoch == Epoch):
+                Epoch = Epoch + 1
+                Next_Seq = Reply_Seq
+                Retransmissions = Retransmissions + 1
+        else:
+            print("\n   Write Status -> Write Failed or Invalid Address at", hex(Frame_Address[min(Reply_Seq, Frame_Count - 1)]))
+            Serial_Port_Obj.timeout = Port_Timeout
+            Serial_Port_Obj.reset_input_buffer()
+            return None
+    
+    Serial_Port_Obj.timeout = Port_Timeout
+    Window_Stats['retransmissions'] = Retransmissions
+    return (perf_counter() - Start_Time, Retransmissions)
+
+def LZ4_Parse(Data):
+    ''' Greedy LZ4 parse, list of (Literal_Start, Literal_Length, Match_Length, Offset) ending with a literals only entry '''
+    Sequences = []
+    Last_Position = {}
+    Position = 0
+    Literal_Start = 0
+    while(Position + LZ4_MIN_MATCH_LENGTH <= len(Data)):
+        Key = Data[Position : Position + LZ4_MIN_MATCH_LENGTH]
+        Candidate = Last_Position.get(Key, -1)
+        Last_Position[Key] = Position
+        if((Candidate < 0) or (Position - Candidate > LZ4_MAX_OFFSET)):
+            Position = Position + 1
+            continue
+        Match_Length = LZ4_MIN_MATCH_LENGTH
+        while((Position + Match_Length + 32 <= len(Data)) and
+              (Data[Candidate + Match_Length : Candidate + Match_Length + 32] == Data[Position + Match_Length : Position + Match_Length + 32])):
+            Match_Length = Match_Length + 32
+        while((Position + Match_Length < len(Data)) and (Data[Candidate + Match_Length] == Data[Position + Match_Length])):
+            Match_Length = Match_Length + 1
+        Sequences.append((Literal_Start, Position - Literal_Start, Match_Length, Position - Candidate))
+        for Inside in range(Position + 1, min(Position + Match_Length, len(Data) - LZ4_MIN_MATCH_LENGTH + 1)):
+            Last_Position[Data[Inside : Inside + LZ4_MIN_MATCH_LENGTH]] = Inside
+        Position = Position + Match_Length
+        Literal_Start = Position
+    Sequences.append((Literal_Start, len(Data) - Literal_Start, 0, 0))
+    return Sequences
+
+def LZ4_Length_Bytes(Length, Nibble_Limit):
+    return ((Length - Nibble_Limit) // 255 + 1) if (Length >= Nibble_Limit) else 0
+
+def LZ4_Sequence_Size(Literal_Length, Match_Length):
+    Size = 1 + Literal_Length + LZ4_Length_Bytes(Literal_Length, 15)
+    if(Match_Length):
+        Size = Size + 2 + LZ4_Length_Bytes(Match_Length - LZ4_MIN_MATCH_LENGTH, 15)
+    return Size
+
+def LZ4_Encode_Length(Length):
+    Encoded = bytearray()
+    if(Length >= 15):
+        Length = Length - 15
+        while(Length >= 255):
+            Encoded.append(255)
+            Length = Length - 255
+        Encoded.append(Length)
+    return Encoded
+
+def LZ4_Sequence(Literals, Match_Length, Offset):
+    ''' Token | [Literal_Len...] | Literals | Offset(2) | [Match_Len...], no match for the last sequence of a block '''
+    Match_Code = (Match_Length - LZ4_MIN_MATCH_LENGTH) if Match_Length else 0
+    Sequence = bytearray([(min(len(Literals), 15) << 4) | min(Match_Code, 15)])
+    Sequence += LZ4_Encode_Length(len(Literals))
+    Sequence += Literals
+    if(Match_Length):
+        Sequence += struct.pack('<H', Offset)
+        Sequence += LZ4_Encode_Length(Match_Code)
+    return Sequence
+
+def LZ4_Compress_Blocks(Data, Block_Limit, Raw_Limit):
+    ''' Split the parse of Data into LZ4 blocks of at most Block_Limit bytes decoding to at most Raw_Limit bytes,
+        returns a list of (Raw_Offset, Raw_Length, Block). A block ends after a literals only sequence,
+        matches keep referring back into the previous blocks. '''
+    Blocks = []
+    Block = bytearray()
+    Block_Start = 0
+    Block_Raw = 0
+    Sequences = LZ4_Parse(Data)
+    Index = 0
+    Literal_Start, Literal_Length, Match_Length, Offset = Sequences[0]
+    while(True):
+        Room = Block_Limit - len(Block)
+        Raw_Room = Raw_Limit - Block_Raw
+        if(Match_Length and (Literal_Length + LZ4_MIN_MATCH_LENGTH <= Raw_Room) and (LZ4_Sequence_Size(Literal_Length, LZ4_MIN_MATCH_LENGTH) <= Room)):
+            ''' The literals and at least the shortest match fit, the rest of a cut match continues in the next sequence '''
+            Part = min(Match_Length, Raw_Room - Literal_Length)
+            while(LZ4_Sequence_Size(Literal_Length, Part) > Room):
+                Part = Part - 1
+            Block += LZ4_Sequence(Data[Literal_Start : Literal_Start + Literal_Length], Part, Offset)
+            Block_Raw = Block_Raw + Literal_Length + Part
+            Remaining = Match_Length - Part
+            Position = Literal_Start + Literal_Length + Part
+            if(Remaining >= LZ4_MIN_MATCH_LENGTH):
+                Literal_Start, Literal_Length, Match_Length = Position, 0, Remaining
+                continue
+            ''' A remainder shorter than a match goes in front of the next literals '''
+            Index = Index + 1
+            Literal_Length, Match_Length, Offset = Sequences[Index][1:]
+            Literal_Start = Position
+            Literal_Length = Literal_Length + Remaining
+            continue
+        ''' Close the block with the literals that still fit '''
+        Count = min(Literal_Length, Raw_Room, Room)
+        while((Count > 0) and (LZ4_Sequence_Size(Count, 0) > Room)):
+            Count = Count - 1
+        if(Count > 0):
+            Block += LZ4_Sequence(Data[Literal_Start : Literal_Start + Count], 0, 0)
+            Block_Raw = Block_Raw + Count
+        if(Block_Raw):
+            Blocks.append((Block_Start, Block_Raw, bytes(Block)))
+        Block_Start = Block_Start + Block_Raw
+        Block = bytearray()
+        Block_Raw = 0
+        Literal_Start = Literal_Start + Count
+        Literal_Length = Literal_Length - Count
+        if((Match_Length == 0) and (Literal_Length == 0)):
+            return Blocks
+
+def Memory_Write_Compressed(BaseMemoryAddress, Window_Size, Payload_Length, Decompress_Budget):
+    ''' Windowed write of Application.bin as LZ4 blocks, decoded by the bootloader before programming '''
+    Image = Load_Application_Image()
+    Session = Next_Window_Session()
+    Large_Frame = (Payload_Length > WINDOW_PAYLOAD_LENGTH)
+    ''' Raw_Len(2) in front of every block '''
+    Blocks = LZ4_Compress_Blocks(Image, Payload_Length - 2, Decompress_Budget)
+    Frame_Address = [BaseMemoryAddress + Raw_Offset for Raw_Offset, Raw_Length, Block in Blocks]
+    Frame_End_Byte = [Raw_Offset + Raw_Length for Raw_Offset, Raw_Length, Block in Blocks]
+    Frames = Start_Frame_Pipeline(len(Blocks), lambda Seq: Build_Window_Frame(Session, Seq, Frame_Address[Seq], struct.pack('<H', Blocks[Seq][1]) + Blocks[Seq][2],
+                                                                              Large_Frame, CBL_MEM_WRITE_LZ4_CMD))
+    ''' Raw_Len(2) and the frame overhead on top of every block '''
+    Wire_Bytes = sum(len(Block) + (21 if Large_Frame else 18) for Raw_Offset, Raw_Length, Block in Blocks)
+    
+    Result = Send_Window_Frames(Frames, Frame_Address, Frame_End_Byte, Window_Size)
+    if(Result is None):
+        return 0
+    Elapsed_Time, Retransmissions = Result
+    Elapsed_Time = max(Elapsed_Time, 1e-6)
+    print("\n   Compressed (", Window_Size, "x", Payload_Length, "bytes ) :", len(Image), "bytes as", Wire_Bytes, "bytes on the link (",
+          round(100.0 * Wire_Bytes / max(len(Image), 1), 1), "% ) in", round(Elapsed_Time, 2), "s,", len(Blocks), "frames,", Retransmissions, "retransmissions")
+    print("   Link rate :", round(Wire_Bytes / Elapsed_Time / 1024, 2), "KB/s before decompression ->",
+          round(len(Image) / Elapsed_Time / 1024, 2), "KB/s of image written")
+    return 1
+
+def Build_Command_Frame(Command, Fields = b''):
+    ''' Legacy frame: Len | CMD | Fields | CRC(4) '''
+    return Build_Frame('<BB', (len(Fields) + 5, Command), Fields)
+
+def Build_Memory_Write_Frame(Address, Payload):
+    ''' Len | CMD | Address(4) | Payload_Len | Payload | CRC(4) '''
+    return Build_Frame('<BBIB', (len(Payload) + 10, CBL_MEM_WRITE_CMD, Address, len(Payload)), Payload)
+
+def Send_Command_Frame(Command, Fields = b''):
+    Serial_Port_Obj.write(Build_Command_Frame(Command, Fields))
+
+def Read_Exact(Data_Len, Timeout = 2):
+    Data = b''
+    Deadline = perf_counter() + Timeout
+    while((len(Data) < Data_Len) and (perf_counter() < Deadline)):
+        Data += Serial_Port_Obj.read(Data_Len - len(Data))
+    return Data
+
+def Read_Reply(Timeout = 2):
+    ''' ACK | Len | Data, or ACK | 0xFF | Len(2) | Data for long replies. None on NACK or timeout.
+        Erase events ahead of the reply are taken, the timeout runs again after each of them. '''
+    Header = Read_Exact(2, Timeout)
+    while((len(Header) == 2) and (Header[0] == ERASE_EVENT_MARKER)):
+        Event = Header + Read_Exact(ERASE_EVENT_LENGTH - 2, Timeout)
+        if(len(Event) < ERASE_EVENT_LENGTH):
+            return None
+        Erase_Event(Event)
+        Header = Read_Exact(2, Timeout)
+    if((len(Header) < 2) or (Header[0] != CBL_SEND_ACK)):
+        return None
+    Length_To_Follow = Header[1]
+    if(Length_To_Follow == CBL_ACK_LONG_LENGTH):
+        Long_Length = Read_Exact(2, Timeout)
+        if(len(Long_Length) < 2):
+            return None
+        Length_To_Follow = struct.unpack('<H', Long_Length)[0]
+    Data = Read_Exact(Length_To_Follow, Timeout)
+    return Data if (len(Data) == Length_To_Follow) else None
+
+def Query_Flash_Hashes(Address, Length, Block_Length):
+    ''' Unique ID, range CRC, blank sector bitmap and the block CRCs (none when Block_Length is 0) '''
+    Send_Command_Frame(CBL_FLASH_BLOCK_HASH_CMD, struct.pack('<III', Address, Length, Block_Length))
+    Reply = Read_Reply(10)
+    if((Reply is None) or (len(Reply) < FLASH_HASH_HEADER_LENGTH)):
+        return None
+    Range_CRC, Blank_Sectors, Block_Count = struct.unpack('<IHH', Reply[12:FLASH_HASH_HEADER_LENGTH])
+    return { 'uid' : Reply[0:12].hex(), 'range_crc' : Range_CRC, 'blank' : Blank_Sectors,
+             'hashes' : list(struct.unpack('<%dI' % Block_Count, Reply[FLASH_HASH_HEADER_LENGTH:])) }
+
+def Memory_Read_Stream(Address, Length, Chunk_Length):
+    ''' One request, then Chunk | CRC(4) pairs for the whole range. Returns the data with None for every
+        chunk that failed its CRC, or None when the bootloader refused the range '''
+    Serial_Port_Obj.reset_input_buffer()
+    Send_Command_Frame(CBL_MEM_READ_CMD, struct.pack('<IIH', Address, Length, Chunk_Length))
+    Reply = Read_Reply()
+    if((Reply is None) or (len(Reply) != MEM_READ_REPLY_LENGTH) or (struct.unpack('<I', Reply)[0] != Length)):
+        return None
+    ''' Twice the line time of a chunk before giving up on it '''
+    Chunk_Timeout = 1 + (20.0 * (Chunk_Length + 4) / Serial_Port_Obj.baudrate)
+    Chunks = []
+    for Offset in range(0, Length, Chunk_Length):
+        Chunk_Size = min(Chunk_Length, Length - Offset)
+        Chunk = Read_Exact(Chunk_Size + 4, Chunk_Timeout)
+        if(len(Chunk) < Chunk_Size + 4):
+            ''' The stream broke off, the rest is asked again '''
+            Chunks.extend([None] * len(range(Offset, Length, Chunk_Length)))
+            break
+        if(struct.unpack('<I', Chunk[Chunk_Size:])[0] == CRC32_Flash_Words(Chunk[0:Chunk_Size])):
+            Chunks.append(Chunk[0:Chunk_Size])
+        else:
+            Chunks.append(None)
+        print("\r   Bytes received from the bootloader :{0}".format(Offset + Chunk_Size), end = ' ')
+    return Chunks
+
+def Memory_Read_To_File(Address, Length, File_Name, Chunk_Length = MEM_READ_CHUNK_LENGTH):
+    ''' Stream [Address, Address + Length) into File_Name, damaged chunks are read again one by one '''
+    Start_Time = perf_counter()
+    Chunks = Memory_Read_Stream(Address, Length, Chunk_Length)
+    if(Chunks is None):
+        print("\n   Error !! The bootloader refused the range (alignment, bounds or read protection)")
+        return 0
+    Reread_Chunks = 0
+    for Index, Chunk in enumerate(Chunks):
+        Retries = 0
+        while((Chunk is None) and (Retries < MEM_READ_RETRIES)):
+            Offset = Index * Chunk_Length
+            Reply = Memory_Read_Stream(Address + Offset, min(Chunk_Length, Length - Offset), Chunk_Length)
+            Chunk = Reply[0] if Reply else None
+            Retries = Retries + 1
+            Reread_Chunks = Reread_Chunks + 1
+        if(Chunk is None):
+            print("\n   Error !! Chunk at", hex(Address + Index * Chunk_Length), "could not be read")
+            return 0
+        Chunks[Index] = Chunk
+    Elapsed_Time = max(perf_counter() - Start_Time, 1e-6)
+    with open(File_Name, 'wb') as Dump_File:
+        Dump_File.write(b''.join(Chunks))
+    print("\n   Read :", Length, "bytes in", round(Elapsed_Time, 2), "s ->", round(Length / Elapsed_Time / 1024, 2), "KB/s,",
+          len(Chunks), "chunks,", Reread_Chunks, "read again, saved to", File_Name)
+    return 1
+
+def Change_Baud_Rate(New_Baud):
+    ''' Asked at the current rate, confirmed by the same frame at the new one.
+        On any failure both ends are back at the current rate. '''
+    Old_Baud = Serial_Port_Obj.baudrate
+    Serial_Port_Obj.reset_input_buffer()
+    Send_Command_Frame(CBL_CHANGE_BAUD_CMD, struct.pack('<I', New_Baud))
+    Reply = Read_Reply()
+    if((Reply is None) or (len(Reply) != 1) or (Reply[0] != BAUD_CHANGE_ACCEPTED)):
+        return 0
+    Serial_Port_Obj.flush()
+    Serial_Port_Obj.baudrate = New_Baud
+    ''' Time for the bootloader to reprogram its UART after the status went out '''
+    sleep(BAUD_SWITCH_DELAY)
+    Send_Command_Frame(CBL_CHANGE_BAUD_CMD, struct.pack('<I', New_Baud))
+    Reply = Read_Reply(BAUD_CONFIRM_TIMEOUT)
+    if((Reply is not None) and (len(Reply) == 1) and (Reply[0] == BAUD_CHANGE_CONFIRMED)):
+        return 1
+    ''' The bootloader gives up on its own after the confirmation timeout '''
+    Serial_Port_Obj.baudrate = Old_Baud
+    sleep(BAUD_CONFIRM_TIMEOUT + 0.1)
+    Serial_Port_Obj.reset_input_buffer()
+    return 0
+
+def Link_Stable():
+    ''' A CRC checked readback of the first flash sector, every chunk has to come through '''
+    Chunks = Memory_Read_Stream(FLASH_BASE_ADDRESS, BAUD_PROBE_LENGTH, MEM_READ_CHUNK_LENGTH)
+    print("")
+    return (Chunks is not None) and (None not in Chunks)
+
+def Probe_Baud_Rate(Max_Baud):
+    ''' Walks up the rates until one is refused or does not carry data cleanly,
+        the link stays at the last one that did '''
+    Stable_Baud = Serial_Port_Obj.baudrate
+    for Baud in BAUD_PROBE_RATES:
+        if((Baud <= Stable_Baud) or (Baud > Max_Baud)):
+            continue
+        print("   Trying", Baud, "baud")
+        if(Change_Baud_Rate(Baud) == 0):
+            break
+        if(Link_Stable()):
+            Stable_Baud = Baud
+            continue
+        ''' Data errors at this rate, but commands may still get through: step back '''
+        for Attempt in range(MEM_READ_RETRIES):
+            if(Change_Baud_Rate(Stable_Baud) == 1):
+                break
+        break
+    print("   Link running at", Serial_Port_Obj.baudrate, "baud")
+    return Serial_Port_Obj.baudrate
+
+def Query_Memory_CRC(Address, Length):
+    ''' CRC of the range computed by the target, with the cycles it took and the core clock '''
+    Serial_Port_Obj.reset_input_buffer()
+    Send_Command_Frame(CBL_MEM_CRC_CMD, struct.pack('<II', Address, Length))
+    Reply = Read_Reply(5)
+    if((Reply is None) or (len(Reply) != MEM_CRC_REPLY_LENGTH)):
+        return None
+    Range_CRC, Cycles, Core_Clock = struct.unpack('<III', Reply)
+    return { 'crc' : Range_CRC, 'cycles' : Cycles, 'core_clock' : Core_Clock }
+
+def Verify_Image(BaseMemoryAddress, Image):
+    ''' One round trip: the target CRC of the range against the CRC of the image.
+        The unit takes whole words, a partial last word is compared with erased flash after it '''
+    Image = bytes(Image) + b'\xFF' * (-len(Image) % 4)
+    Result = Query_Memory_CRC(BaseMemoryAddress, len(Image))
+    if(Result is None):
+        print("\n   Error !! The bootloader refused the CRC of the range")
+        return 0
+    Expected_CRC = CRC32_Flash_Words(Image)
+    Seconds = Result['cycles'] / float(max(Result['core_clock'], 1))
+    print("\n   Target CRC", hex(Result['crc']), "image CRC", hex(Expected_CRC), ":", len(Image), "bytes in", Result['cycles'], "cycles",
+          "(", round(Seconds * 1e6, 1), "us,", round(len(Image) / max(Seconds, 1e-9) / 1e6, 1), "MB/s )")
+    return 1 if (Result['crc'] == Expected_CRC) else 0
+
+def Erase_Flash_Sectors(SectorNumber, NumberOfSectors):
+    Send_Command_Frame(CBL_FLASH_ERASE_CMD, bytes([SectorNumber, NumberOfSectors]))
+    ''' The status byte follows the ACK once every sector is erased, up to 2 s per 128 KB sector '''
+    return (Read_Reply(2 + 3 * NumberOfSectors) == bytes([SUCCESSFUL_ERASE]))
+
+def Erase_Sector_Timeout(SectorNumber):
+    ''' Longest erase time of the sector with a margin, the mass erase for CBL_FLASH_MASS_ERASE '''
+    if(SectorNumber >= len(FLASH_SECTOR_SIZES)):
+        return ERASE_MASS_MAX_TIME + ERASE_TIMEOUT_MARGIN
+    return ERASE_SECTOR_MAX_TIME[FLASH_SECTOR_SIZES[SectorNumber]] + ERASE_TIMEOUT_MARGIN
+
+def Erase_Flash_Async(SectorNumber, NumberOfSectors):
+    ''' Starts the background erase, answered before the first sector is done.
+        Returns the status byte, None when the bootloader does not know the command. '''
+    global Erase_Progress
+    Send_Command_Frame(CBL_FLASH_ERASE_ASYNC_CMD, bytes([SectorNumber, NumberOfSectors]))
+    Reply = Read_Reply()
+    if(Reply is None):
+        return None
+    if(Reply[0] == VALID_SECTOR_NUMBER):
+        Total = 1 if (SectorNumber == CBL_FLASH_MASS_ERASE) else min(NumberOfSectors, len(FLASH_SECTOR_SIZES) - SectorNumber)
+        Erase_Progress = { 'sector' : SectorNumber, 'done' : 0, 'total' : Total, 'running' : True, 'failed' : False,
+                           'start' : perf_counter(), 'seconds' : 0.0 }
+    return Reply[0]
+
+def Erase_Event(Event):
+    ''' Marker | Sector | Status | Sectors_Done | Sectors_Total, the last one ends the erase '''
+    if(not Erase_Progress):
+        return
+    Sector, Status, Done, Total = Event[1], Event[2], Event[3], Event[4]
+    Erase_Progress.update({ 'done' : Done, 'total' : Total })
+    Elapsed_Time = perf_counter() - Erase_Progress['start']
+    if(Status != SUCCESSFUL_ERASE):
+        Erase_Progress['failed'] = True
+        print("\n   Erase Status -> Unsuccessfule Erase of sector", Sector)
+    else:
+        print("\r   Sector", Sector, "erased (", Done, "of", Total, ") after", round(Elapsed_Time, 2), "s", end = ' ')
+    if((Status != SUCCESSFUL_ERASE) or (Done >= Total)):
+        Erase_Progress.update({ 'running' : False, 'seconds' : Elapsed_Time })
+
+def Erase_Sector_Under_Way():
+    return CBL_FLASH_MASS_ERASE if (Erase_Progress['sector'] == CBL_FLASH_MASS_ERASE) else (Erase_Progress['sector'] + Erase_Progress['done'])
+
+def Wait_Erase_Done():
+    ''' Follows the events of the background erase and polls its status whenever the link is quiet.
+        Each sector gets its longest datasheet erase time, so a hung target is found within one sector.
+        Returns 1 once every sector is erased. '''
+    Polls = 0
+    Done = -1
+    Port_Timeout = Serial_Port_Obj.timeout
+    Serial_Port_Obj.timeout = ERASE_POLL_PERIOD
+    while(Erase_Progress['running']):
+        if(Erase_Progress['done'] != Done):
+            Done = Erase_Progress['done']
+            Deadline = perf_counter() + Erase_Sector_Timeout(Erase_Sector_Under_Way())
+        Header = Read_Exact(1, ERASE_POLL_PERIOD)
+        if(Header == bytes([ERASE_EVENT_MARKER])):
+            Event = Header + Read_Exact(ERASE_EVENT_LENGTH - 1)
+            if(len(Event) == ERASE_EVENT_LENGTH):
+                Erase_Event(Event)
+        elif(Header == bytes([CBL_SEND_ACK])):
+            Reply = Read_Exact(1 + ERASE_STATUS_REPLY_LENGTH)
+            Polls = Polls - 1
+            if(len(Reply) == 1 + ERASE_STATUS_REPLY_LENGTH):
+                State, Sector, Sectors_Done, Total, Elapsed_ms = struct.unpack('<BBBBI', Reply[1:])
+                print("\r   Erasing sector", Sector, "(", Sectors_Done, "of", Total, "done ),", Elapsed_ms, "ms on the target", end = ' ')
+        elif(perf_counter() >= Deadline):
+            print("\n   Error !! Sector", Erase_Sector_Under_Way(), "not erased after", round(Erase_Sector_Timeout(Erase_Sector_Under_Way()), 1), "s,",
+                  "the bootloader stopped answering" if (Polls > 0) else "the erase does not end")
+            Serial_Port_Obj.timeout = Port_Timeout
+            return 0
+        elif(Polls == 0):
+            ''' Keepalive, answered whenever the core runs '''
+            Send_Command_Frame(CBL_ERASE_STATUS_CMD)
+            Polls = Polls + 1
+    Serial_Port_Obj.timeout = Port_Timeout
+    ''' Replies to the polls sent just before the last event '''
+    for Poll in range(Polls):
+        Read_Reply()
+    return 0 if Erase_Progress['failed'] else 1
+
+def Erase_Flash_Background(SectorNumber, NumberOfSectors):
+    ''' Starts the erase in the background when the bootloader can, the frames sent next wait in its receive ring.
+        Falls back to the blocking erase for older bootloaders. '''
+    global Erase_Progress
+    Status = Erase_Flash_Async(SectorNumber, NumberOfSectors)
+    if(Status is None):
+        Serial_Port_Obj.reset_input_buffer()
+        Erase_Progress = {}
+        return Erase_Flash_Sectors(SectorNumber, NumberOfSectors)
+    return (Status == VALID_SECTOR_NUMBER)
+
+def Query_Flash_Stats():
+    ''' Erase count and erase/program timing of every sector, None when the bootloader keeps none '''
+    Send_Command_Frame(CBL_FLASH_STATS_CMD)
+    Reply = Read_Reply()
+    Entry_Length = struct.calcsize(FLASH_STATS_FORMAT)
+    if((Reply is None) or (len(Reply) < 1) or (len(Reply) != 1 + (Reply[0] * Entry_Length))):
+        return None
+    Stats = []
+    for Sector in range(Reply[0]):
+        Total_ns, Erases, Timed, Erase_Min, Erase_Max, Erase_Total, Bytes, Program_Min, Program_Max = struct.unpack_from(FLASH_STATS_FORMAT, Reply, 1 + (Sector * Entry_Length))
+        Stats.append({ 'erases' : Erases,
+                       'erase_ms' : None if (Timed == 0) else (Erase_Min, Erase_Total / Timed, Erase_Max),
+                       'program_bytes' : Bytes,
+                       'program_ns_per_byte' : None if (Bytes == 0) else (Program_Min, Total_ns / Bytes, Program_Max) })
+    return Stats
+
+def Print_Flash_Stats(Stats):
+    print("\n   Sector   Size   Erases   Erase ms min / avg / max      Programmed   ns per byte min / avg / max")
+    for Sector, Entry in enumerate(Stats):
+        Erase_Time = '-' if (Entry['erase_ms'] is None) else '{0} / {1:.0f} / {2}'.format(*Entry['erase_ms'])
+        Program_Time = '-' if (Entry['program_ns_per_byte'] is None) else '{0} / {1:.0f} / {2}'.format(*Entry['program_ns_per_byte'])
+        Size = FLASH_SECTOR_SIZES[Sector] if (Sector < len(FLASH_SECTOR_SIZES)) else 0
+        print("   {0:>6}   {1:>3}KB   {2:>6}   {3:<28}  {4:>10}   {5}".format(Sector, Size // 1024, Entry['erases'], Erase_Time, Entry['program_bytes'], Program_Time))
+
+def Query_Profile(Clear):
+    ''' Latency histograms of every command seen since the last clear, None when the bootloader has no profiling '''
+    Send_Command_Frame(CBL_PROFILE_CMD, bytes([1 if Clear else 0]))
+    Reply = Read_Reply()
+    Entry_Length = struct.calcsize(PROFILE_ENTRY_FORMAT)
+    Command_Length = 1 + (len(PROFILE_PHASES) * Entry_Length)
+    if((Reply is None) or (len(Reply) < 5) or (len(Reply) != 5 + (Reply[4] * Command_Length))):
+        return None
+    Core_Clock = struct.unpack_from('<I', Reply, 0)[0]
+    Profile = { 'core_clock' : Core_Clock, 'commands' : {} }
+    for Index in range(Reply[4]):
+        Offset = 5 + (Index * Command_Length)
+        Phases = {}
+        for Phase, Name in enumerate(PROFILE_PHASES):
+            Entry = struct.unpack_from(PROFILE_ENTRY_FORMAT, Reply, Offset + 1 + (Phase * Entry_Length))
+            if(sum(Entry[1:]) > 0):
+                Phases[Name] = { 'count' : sum(Entry[1:]), 'max_us' : Entry[0] * 1e6 / Core_Clock, 'buckets' : list(Entry[1:]) }
+        Profile['commands'][Reply[Offset]] = Phases
+    return Profile
+
+def Profile_Percentile_us(Buckets, Fraction, Core_Clock):
+    ''' Upper edge of the bucket holding the given fraction of the samples, the last bucket has none '''
+    Samples = 0
+    for Bucket, Count in enumerate(Buckets):
+        Samples += Count
+        if(Samples >= Fraction * sum(Buckets)):
+            return None if (Bucket == PROFILE_BUCKETS - 1) else (1 << (PROFILE_FIRST_BUCKET_SHIFT + Bucket)) * 1e6 / Core_Clock
+    return None
+
+def Print_Profile(Profile):
+    Names = { Value : Name for Name, Value in globals().items() if Name.startswith('CBL_') and Name.endswith('_CMD') }
+    Core_Clock = Profile['core_clock']
+    print("\n   Core clock", Core_Clock // 1000000, "MHz, times in us, p50 and p99 are bucket upper edges capped at the max")
+    print("\n   Command                      Phase      Frames      p50 <=      p99 <=         max")
+    for Command, Phases in sorted(Profile['commands'].items()):
+        for Name, Phase in Phases.items():
+            Edges = [Profile_Percentile_us(Phase['buckets'], Fraction, Core_Clock) for Fraction in (0.5, 0.99)]
+            #no sample is above the maximum, whatever bucket it fell in
+            Edges = ['{0:.1f}'.format(Phase['max_us'] if (Edge is None) else min(Edge, Phase['max_us'])) for Edge in Edges]
+            print("   {0:<28} {1:<8} {2:>8} {3:>11} {4:>11} {5:>11.1f}".format(Names.get(Command, hex(Command)), Name, Phase['count'], Edges[0], Edges[1], Phase['max_us']))
+
+def Flash_Sector_Span(Address, Length):
+    ''' First and last sector holding [Address, Address + Length) and the start address of each sector '''
+    Sector_Starts = [FLASH_BASE_ADDRESS + sum(FLASH_SECTOR_SIZES[0:Sector]) for Sector in range(len(FLASH_SECTOR_SIZES) + 1)]
+    First_Sector = max(Sector for Sector in range(len(FLASH_SECTOR_SIZES)) if Sector_Starts[Sector] <= Address)
+    Last_Sector = max(Sector for Sector in range(len(FLASH_SECTOR_SIZES)) if Sector_Starts[Sector] < Address + Length)
+    return First_Sector, Last_Sector, Sector_Starts
+
+def Load_Hash_Cache():
+    try:
+        with open(HASH_CACHE_FILE, 'r') as Cache_File:
+            return json.load(Cache_File)
+    except (OSError, ValueError):
+        return {}
+
+def Save_Hash_Cache(Cache):
+    with open(HASH_CACHE_FILE, 'w') as Cache_File:
+        json.dump(Cache, Cache_File)
+
+def Delta_Update(BaseMemoryAddress, Window_Size, Payload_Length):
+    ''' Erase and write only the sectors and blocks of Application.bin that differ from the flash content '''
+    Image = Load_Application_Image()
+    First_Sector, Last_Sector, Sector_Starts = Flash_Sector_Span(BaseMemoryAddress, len(Image))
+    if(Sector_Starts[First_Sector] != BaseMemoryAddress):
+        print("\n   Error !! The image must start on a sector boundary")
+        return 0
+    Range_Length = Sector_Starts[Last_Sector + 1] - BaseMemoryAddress
+    ''' Target content of the range: the image, erased flash after it '''
+    Target = Image + b'\xFF' * (Range_Length - len(Image))
+    Target_Hashes = [CRC32_Flash_Words(Target[Offset : Offset + DELTA_BLOCK_LENGTH]) for Offset in range(0, Range_Length, DELTA_BLOCK_LENGTH)]
+    Blank_Hash = CRC32_Flash_Words(b'\xFF' * DELTA_BLOCK_LENGTH)
+    Queries = 1
+    
+    ''' A matching range CRC proves the cached map is still current '''
+    Summary = Query_Flash_Hashes(BaseMemoryAddress, Range_Length, 0)
+    if(Summary is None):
+        print("\n   Error !! The bootloader did not return the flash hashes")
+        return 0
+    Cache = Load_Hash_Cache()
+    Cache_Key = '{0:08X}:{1:08X}:{2}'.format(BaseMemoryAddress, Range_Length, DELTA_BLOCK_LENGTH)
+    Cached = Cache.get(Summary['uid'], {}).get(Cache_Key)
+    if((Cached is not None) and (Cached['range_crc'] == Summary['range_crc'])):
+        Device_Hashes = Cached['hashes']
+        print("\n   Using the cached hash map of chip", Summary['uid'])
+    else:
+        Full_Map = Query_Flash_Hashes(BaseMemoryAddress, Range_Length, DELTA_BLOCK_LENGTH)
+        Queries = Queries + 1
+        if((Full_Map is None) or (len(Full_Map['hashes']) != len(Target_Hashes))):
+            print("\n   Error !! The bootloader did not return the flash hashes")
+            return 0
+        Device_Hashes = Full_Map['hashes']
+    
+    Segments = []
+    Erase_Sectors = []
+    for Sector in range(First_Sector, Last_Sector + 1):
+        Sector_Blocks = range((Sector_Starts[Sector] - BaseMemoryAddress) // DELTA_BLOCK_LENGTH, (Sector_Starts[Sector + 1] - BaseMemoryAddress) // DELTA_BLOCK_LENGTH)
+        Changed_Blocks = [Block for Block in Sector_Blocks if Device_Hashes[Block] != Target_Hashes[Block]]
+        if(not Changed_Blocks):
+            continue
+        if(any(Device_Hashes[Block] != Blank_Hash for Block in Changed_Blocks) and not (Summary['blank'] & (1 << Sector))):
+            ''' Bits can only be cleared: the sector is erased and every non blank block written again '''
+            Erase_Sectors.append(Sector)
+            Write_Blocks = [Block for Block in Sector_Blocks if Target_Hashes[Block] != Blank_Hash]
+        else:
+            Write_Blocks = Changed_Blocks
+        for Block in Write_Blocks:
+            Offset = Block * DELTA_BLOCK_LENGTH
+            Data = Target[Offset : Offset + DELTA_BLOCK_LENGTH]
+            if(Segments and (Segments[-1][0] + len(Segments[-1][1]) == BaseMemoryAddress + Offset)):
+                Segments[-1] = (Segments[-1][0], Segments[-1][1] + Data)
+            else:
+                Segments.append((BaseMemoryAddress + Offset, Data))
+    
+    ''' Erased flash already reads 0xFF, the tail of a segment needs no programming '''
+    Segments = [(Address, Data.rstrip(b'\xFF')) for Address, Data in Segments if Data.rstrip(b'\xFF')]
+    Changed_Count = sum(1 for Block in range(len(Target_Hashes)) if Device_Hashes[Block] != Target_Hashes[Block])
+    Write_Bytes = sum(len(Data) for Address, Data in Segments)
+    print("\n   Delta :", Changed_Count, "of", len(Target_Hashes), "blocks differ, sectors to erase", Erase_Sectors,
+          ",", Write_Bytes, "of", len(Image), "bytes to write,", Queries, "hash queries")
+    
+    ''' Consecutive sectors are erased with one command '''
+    for Sector in Erase_Sectors:
+        if((Sector - 1) not in Erase_Sectors):
+            Count = 1
+            while((Sector + Count) in Erase_Sectors):
+                Count = Count + 1
+            if(not Erase_Flash_Sectors(Sector, Count)):
+                print("\n   Erase Status -> Unsuccessfule Erase of sector", Sector)
+                return 0
+    if(Segments and (Memory_Write_Segments(Segments, Window_Size, Payload_Length) != 1)):
+        return 0
+    
+    ''' The flash now holds the target everywhere, check it and remember the new map '''
+    Result = Query_Flash_Hashes(BaseMemoryAddress, Range_Length, 0)
+    if((Result is None) or (Result['range_crc'] != CRC32_Flash_Words(Target))):
+        print("\n   Error !! Flash content does not match the image after the update")
+        return 0
+    Cache.setdefault(Summary['uid'], {})[Cache_Key] = { 'range_crc' : Result['range_crc'], 'hashes' : Target_Hashes }
+    Save_Hash_Cache(Cache)
+    return 1
+
+def Query_Slot_Status():
+    ''' Active and previous slot, trial state, boot attempts, journal sequence, version and image validity per slot '''
+    Serial_Port_Obj.reset_input_buffer()
+    Send_Command_Frame(CBL_SLOT_STATUS_CMD)
+    Reply = Read_Reply(5)
+    if((Reply is None) or (len(Reply) != SLOT_STATUS_REPLY_LENGTH)):
+        return None
+    Active, Previous, State, Boot_Attempts, Sequence, Version_A, Version_B, Valid_A, Valid_B = struct.unpack('<BBBBIIIBB', Reply)
+    return { 'active' : Active, 'previous' : Previous, 'state' : State, 'attempts' : Boot_Attempts, 'sequence' : Sequence,
+             'versions' : [Version_A, Version_B], 'valid' : [Valid_A, Valid_B] }
+
+def Print_Slot_Status(Status):
+    for Slot in range(len(SLOT_NAMES)):
+        Mark = '*' if (Slot == Status['active']) else ' '
+        print("\n  ", Mark, "Slot", SLOT_NAMES[Slot], "at", hex(SLOT_BASE_ADDRESSES[Slot]), ": version", Status['versions'][Slot],
+              ", image", "valid" if Status['valid'][Slot] else "invalid", end = '')
+    print("\n   State :", SLOT_STATE_NAMES[Status['state']] if (Status['state'] < len(SLOT_STATE_NAMES)) else hex(Status['state']),
+          ", boot attempts", Status['attempts'], ", record", Status['sequence'])
+
+def Switch_Slot(Slot, Version):
+    ''' Makes Slot the active one on trial, or confirms it when it already is. Only the journal is written '''
+    Serial_Port_Obj.reset_input_buffer()
+    Send_Command_Frame(CBL_SLOT_SWITCH_CMD, struct.pack('<BI', Slot, Version))
+    ''' A full journal sector is erased first '''
+    Reply = Read_Reply(5)
+    return Reply[0] if ((Reply is not None) and (len(Reply) == 1)) else SLOT_SWITCH_FAILED
+
+def Slot_Image_File(Slot):
+    ''' Application_A.bin / Application_B.bin when built per slot, the image file otherwise '''
+    File_Name = 'Application_' + SLOT_NAMES[Slot] + '.bin'
+    return File_Name if os.path.exists(File_Name) else APPLICATION_IMAGE_FILE
+
+def Slot_Image(Slot):
+    ''' The image for Slot with its descriptor, None when it is not linked to run from there '''
+    File_Name = Slot_Image_File(Slot)
+    Base_Address, Image = Load_Image_File(File_Name)
+    Reset_Handler = struct.unpack_from('<I', Image, 4)[0] & ~1
+    if((len(Image) > SLOT_SIZE) or ((Base_Address is not None) and (Base_Address != SLOT_BASE_ADDRESSES[Slot])) or
+       not (SLOT_BASE_ADDRESSES[Slot] <= Reset_Handler < SLOT_BASE_ADDRESSES[Slot] + len(Image))):
+        print("\n   Error !!", File_Name, "is not linked for slot", SLOT_NAMES[Slot], "at", hex(SLOT_BASE_ADDRESSES[Slot]))
+        return None
+    print("\n   Writing", File_Name, "(", len(Image), "bytes ) into slot", SLOT_NAMES[Slot])
+    return Image
+
+def Slot_Update(Version, Window_Size, Payload_Length):
+    ''' Writes the slot that is not running and switches to it, the running image stays intact as rollback target '''
+    Status = Query_Slot_Status()
+    if(Status is None):
+        print("\n   Error !! The bootloader does not support application slots")
+        return 0
+    if(Status['active'] != SLOT_NONE):
+        Slot = 1 - Status['active']
+    else:
+        ''' Never switched: the bootloader starts the first valid slot '''
+        Slot = 1 if Status['valid'][0] else 0
+    Image = Slot_Image(Slot)
+    if(Image is None):
+        return 0
+    Start_Time = perf_counter()
+    if(not Erase_Flash_Background(SLOT_FIRST_SECTORS[Slot], SLOT_SECTORS)):
+        print("\n   Erase Status -> Unsuccessfule Erase of slot", SLOT_NAMES[Slot])
+        return 0
+    if(Memory_Write_Segments(Sparse_Segments(SLOT_BASE_ADDRESSES[Slot], Image), Window_Size, Payload_Length) != 1):
+        return 0
+    if(Verify_Image(SLOT_BASE_ADDRESSES[Slot], Image) != 1):
+        print("\n   Error !! Slot", SLOT_NAMES[Slot], "does not match the image, not switching")
+        return 0
+    Switch_Status = Switch_Slot(Slot, Version)
+    if(Switch_Status != SLOT_SWITCH_DONE):
+        print("\n   Error !! Switch to slot", SLOT_NAMES[Slot], "refused" if (Switch_Status == SLOT_SWITCH_REFUSED) else "failed")
+        return 0
+    print("\n   Slot", SLOT_NAMES[Slot], "active on trial after", round(perf_counter() - Start_Time, 2), "s, the next reset starts it")
+    return 1
+
+def Memory_Write_Frames(BaseMemoryAddress, Data, Payload_Length = AGENT_PAYLOAD_LENGTH):
+    ''' CBL_MEM_WRITE_CMD frames one at a time for the populated ranges of Data, each answered with its write status.
+        The next frame is built while the current one is on the link. '''
+    Chunks = [(Address + Offset, Range[Offset : Offset + Payload_Length]) for Address, Range in Sparse_Segments(BaseMemoryAddress, Data)
+              for Offset in range(0, len(Range), Payload_Length)]
+    Frames = Start_Frame_Pipeline(len(Chunks), lambda Index: Build_Memory_Write_Frame(*Chunks[Index]))
+    Written_Bytes = 0
+    for Index, (Address, Payload) in enumerate(Chunks):
+        Serial_Port_Obj.write(Pipeline_Frame(Frames, Index))
+        if(Read_Reply(5) != bytes([FLASH_PAYLOAD_WRITE_PASSED])):
+            print("\n   Write Status -> Write Failed or Invalid Address at", hex(Address))
+            return 0
+        Written_Bytes = Written_Bytes + len(Payload)
+        print("\r   Bytes written by the bootloader :{0}".format(Written_Bytes), end = ' ')
+    return 1
+
+def Agent_Update(Version):
+    ''' Update through the update agent of the running application, which keeps running meanwhile.
+        The agent writes the slot it does not run from, the handoff restarts the board and the bootloader
+        switches to that slot without waiting for the host. The new image then answers on the same link. '''
+    Status = Query_Slot_Status()
+    if((Status is None) or (Status['active'] == SLOT_NONE)):
+        print("\n   Error !! No update agent answering, or the application does not run from a slot")
+        return 0
+    Slot = 1 - Status['active']
+    Image = Slot_Image(Slot)
+    if(Image is None):
+        return 0
+    Start_Time = perf_counter()
+    if(not Erase_Flash_Sectors(SLOT_FIRST_SECTORS[Slot], SLOT_SECTORS)):
+        print("\n   Erase Status -> Unsuccessfule Erase of slot", SLOT_NAMES[Slot])
+        return 0
+    Erase_Time = perf_counter() - Start_Time
+    if(Memory_Write_Frames(SLOT_BASE_ADDRESSES[Slot], Image) != 1):
+        return 0
+    Write_Time = perf_counter() - Start_Time - Erase_Time
+    if(Verify_Image(SLOT_BASE_ADDRESSES[Slot], Image) != 1):
+        print("\n   Error !! Slot", SLOT_NAMES[Slot], "does not match the image, no handoff")
+        return 0
+    print("\n   Erase", round(Erase_Time, 2), "s, write", round(Write_Time, 2), "s (", round(len(Image) / max(Write_Time, 1e-6) / 1024, 2),
+          "KB/s ), the application kept running")
+    if(Switch_Slot(Slot, Version) != SLOT_SWITCH_DONE):
+        print("\n   Error !! Handoff to slot", SLOT_NAMES[Slot], "refused")
+        return 0
+    Handoff_Time = perf_counter()
+    ''' The board restarts, the new image answers once the bootloader started it '''
+    while(perf_counter() - Handoff_Time < AGENT_RESTART_TIMEOUT):
+        Status = Query_Slot_Status()
+        if(Status is not None):
+            break
+    if((Status is None) or (Status['active'] != Slot)):
+        print("\n   Error !! Slot", SLOT_NAMES[Slot], "is not running after the handoff")
+        return 0
+    print("\n   Slot", SLOT_NAMES[Slot], "running on trial", round(perf_counter() - Handoff_Time, 2), "s after the handoff")
+    return 1
+
+def Input_Window_Settings(Need_Decompress_Budget = False):
+    ''' Frames in flight, payload per frame and the bootloader decompression budget.
+        Large frames are negotiated with the bootloader, so is the budget when it is needed. '''
+    Window_Size = input("\n   Enter the number of frames in flight (1-8) : ")
+    Window_Size = max(1, min(8, int(Window_Size)))
+    Payload_Length = input("\n   Enter the payload per frame (128, or 1024-4096 for large frames) : ")
+    Payload_Length = max(1, min(LARGE_PAYLOAD_LENGTH, int(Payload_Length)))
+    Max_Baud = input("\n   Enter the fastest baud rate to probe (Enter keeps the current rate) : ")
+    if(Max_Baud.strip() != ''):
+        Probe_Baud_Rate(int(Max_Baud))
+    return Frame_Settings(Window_Size, Payload_Length, Need_Decompress_Budget)
+
+def Frame_Settings(Window_Size, Payload_Length, Need_Decompress_Budget = False):
+    ''' The frames in flight and payload the bootloader takes for the ones asked, with its decompression budget '''
+    Decompress_Budget = 0
+    if((Payload_Length > WINDOW_PAYLOAD_LENGTH) or Need_Decompress_Budget):
+        ''' Asking for a legacy payload keeps large frames off '''
+        Requested_Payload = Payload_Length if (Payload_Length > WINDOW_PAYLOAD_LENGTH) else 0
+        Negotiated_Payload, RX_Window, Decompress_Budget = Negotiate_Frame_Size(Requested_Payload)
+        if(Requested_Payload == 0):
+            Payload_Length = min(Payload_Length, WINDOW_PAYLOAD_LENGTH)
+        elif(Negotiated_Payload <= WINDOW_PAYLOAD_LENGTH):
+            print("\n   Large frames not supported by the bootloader, using", WINDOW_PAYLOAD_LENGTH, "bytes frames")
+            Payload_Length = WINDOW_PAYLOAD_LENGTH
+        else:
+            ''' The frames in flight must fit in the bootloader receive buffer '''
+            Payload_Length = Negotiated_Payload
+            Window_Size = max(1, min(Window_Size, RX_Window // (Payload_Length + 17)))
+            print("\n   Large frames :", Payload_Length, "bytes payload,", Window_Size, "frames in flight")
+    else:
+        Payload_Length = min(Payload_Length, WINDOW_PAYLOAD_LENGTH)
+    return Window_Size, Payload_Length, Decompress_Budget
+
+def Boot_Image(BaseMemoryAddress, Image):
+    ''' Jumps to the reset handler of the image written at BaseMemoryAddress '''
+    Reset_Handler = struct.unpack_from('<I', Image, 4)[0] & ~1
+    if(not (BaseMemoryAddress <= Reset_Handler < BaseMemoryAddress + len(Image))):
+        print("\n   Error !! The reset handler", hex(Reset_Handler), "is not inside the image at", hex(BaseMemoryAddress))
+        return 0
+    Serial_Port_Obj.reset_input_buffer()
+    Send_Command_Frame(CBL_GO_TO_ADDR_CMD, struct.pack('<I', Reset_Handler))
+    if(Read_Reply() != bytes([ADDRESS_IS_VALID])):
+        print("\n   Error !! The bootloader refused the jump to", hex(Reset_Handler))
+        return 0
+    return 1
+
+def Load_RAM_Image(BaseMemoryAddress, Image, Window_Size, Payload_Length):
+    ''' Copies the whole image into the target RAM, 0xFF runs included: RAM is not erased '''
+    if((BaseMemoryAddress < RAM_IMAGE_BASE_ADDRESS) or (BaseMemoryAddress + len(Image) > RAM_IMAGE_END_ADDRESS)):
+        print("\n   Error !! The image does not fit between", hex(RAM_IMAGE_BASE_ADDRESS), "and", hex(RAM_IMAGE_END_ADDRESS))
+        return 0
+    return Memory_Write_Segments([(BaseMemoryAddress, memoryview(Image))], Window_Size, Payload_Length)
+
+def Run_RAM_Image(BaseMemoryAddress):
+    ''' The bootloader checks the image, sets VTOR and MSP from its vector table and starts it '''
+    if(BaseMemoryAddress % RAM_IMAGE_VTOR_ALIGN):
+        print("\n   Error !! The vector table at", hex(BaseMemoryAddress), "is not on a", RAM_IMAGE_VTOR_ALIGN, "bytes boundary")
+        return 0
+    Serial_Port_Obj.reset_input_buffer()
+    Send_Command_Frame(CBL_RAM_RUN_CMD, struct.pack('<I', BaseMemoryAddress))
+    if(Read_Reply() != bytes([IMAGE_IS_VALID])):
+        print("\n   Error !! No valid image at", hex(BaseMemoryAddress), "in RAM")
+        return 0
+    return 1
+
+def Fleet_Erase(BaseMemoryAddress, Length):
+    ''' The erase runs on while the write phase sends its first frames '''
+    First_Sector, Last_Sector, Sector_Starts = Flash_Sector_Span(BaseMemoryAddress, Length)
+    if(not Erase_Flash_Background(First_Sector, Last_Sector - First_Sector + 1)):
+        print("\n   Erase Status -> Unsuccessfule Erase of sectors", First_Sector, "to", Last_Sector)
+        return 0
+    return 1
+
+def Latency_Summary(Latencies):
+    ''' Minimum, median, 95th percentile and maximum in ms '''
+    if(not Latencies):
+        return None
+    Sorted = sorted(Latencies)
+    return { 'min' : round(Sorted[0] * 1e3, 2), 'p50' : round(Sorted[len(Sorted) // 2] * 1e3, 2),
+             'p95' : round(Sorted[min(len(Sorted) - 1, (len(Sorted) * 95) // 100)] * 1e3, 2), 'max' : round(Sorted[-1] * 1e3, 2) }
+
+def Fleet_Session(Port, Options, Results):
+    ''' One board in its own process, so every session has its own port and module state.
+        The console output of the helpers is kept back, its last line is the error of a failed session. '''
+    global Serial_Port_Obj
+    Console = io.StringIO()
+    sys.stdout = Console
+    Result = { 'port' : Port, 'ok' : False, 'phase' : 'open', 'seconds' : {} }
+    Start_Time = perf_counter()
+    Serial_Port_Obj = None
+    try:
+        Serial_Port_Obj = serial.Serial(Port, Options.baud, timeout = 2)
+        Base_Address, Image = Load_Image_File(Options.image)
+        if(Options.address is None):
+            Options.address = Base_Address if (Base_Address is not None) else (RAM_IMAGE_BASE_ADDRESS if Options.ram else SLOT_BASE_ADDRESSES[0])
+        if(Options.max_baud):
+            Result['phase'] = 'baud'
+            Probe_Baud_Rate(Options.max_baud)
+        Result['phase'] = 'negotiate'
+        Window_Size, Payload_Length, Decompress_Budget = Frame_Settings(Options.window, Options.payload)
+        Result.update({ 'baud' : Serial_Port_Obj.baudrate, 'window' : Window_Size, 'payload' : Payload_Length, 'bytes' : len(Image) })
+        Phases = []
+        if(Options.erase):
+            Phases.append(('erase', lambda: Fleet_Erase(Options.address, len(Image))))
+        if(Options.ram):
+            Phases.append(('write', lambda: Load_RAM_Image(Options.address, Image, Window_Size, Payload_Length)))
+        else:
+            Write_Segments = Memory_Write_Staged if Options.staged else Memory_Write_Segments
+            Phases.append(('write', lambda: Write_Segments(Sparse_Segments(Options.address, Image), Window_Size, Payload_Length)))
+        if(Options.verify):
+            Phases.append(('verify', lambda: Verify_Image(Options.address, Image)))
+        if(Options.ram):
+            ''' A RAM image is always started, nothing else would run it '''
+            Phases.append(('boot', lambda: Run_RAM_Image(Options.address)))
+        elif(Options.boot):
+            Phases.append(('boot', lambda: Boot_Image(Options.address, Image)))
+        for Phase, Run_Phase in Phases:
+            Result['phase'] = Phase
+            Phase_Start = perf_counter()
+            if(Run_Phase() != 1):
+                break
+            Result['seconds'][Phase] = round(perf_counter() - Phase_Start, 3)
+        else:
+            Result['ok'] = True
+            del Result['phase']
+    except (OSError, serial.SerialException) as Error:
+        print("\n   Error !!", Error)
+    finally:
+        if(Serial_Port_Obj is not None):
+            Serial_Port_Obj.close()
+    
+    Result['seconds']['total'] = round(perf_counter() - Start_Time, 3)
+    if('write' in Result['seconds']):
+        Result['write_kbps'] = round(Result['bytes'] / max(Result['seconds']['write'], 1e-6) / 1024, 2)
+        Result['sent_bytes'] = len(Image) if Options.ram else sum(len(Data) for Address, Data in Sparse_Segments(Options.address, Image))
+        Result['frames'] = Window_Stats['frames']
+        Result['retransmissions'] = Window_Stats['retransmissions']
+        Result['frame_latency_ms'] = Latency_Summary(Window_Stats['latencies'])
+    if(Erase_Progress and not Erase_Progress['running']):
+        ''' The background erase ran on into the write phase '''
+        Result['seconds']['erase'] = round(Erase_Progress['seconds'], 3)
+    if(not Result['ok']):
+        Lines = [Line.strip() for Line in Console.getvalue().splitlines() if Line.strip()]
+        Result['error'] = Lines[-1] if Lines else 'no reply from the bootloader'
+    Results.put(Result)
+
+def Fleet_Main(Arguments):
+    ''' Host.py flash --ports ... --image ... [--erase] [--verify] [--boot]
+        Every port is flashed at the same time by its own session, one JSON line per port as it finishes
+        and a last one for the whole run. The exit code is 0 when every board was flashed. '''
+    Parser = argparse.ArgumentParser(prog = 'Host.py', description = 'Without arguments Host.py runs the interactive menu.')
+    Commands = Parser.add_subparsers(dest = 'command')
+    Commands.required = True
+    Flash = Commands.add_parser('flash', help = 'write one image into every board')
+    Flash.add_argument('--ports', nargs = '+', required = True, help = "serial ports, 'auto' for every port found")
+    Flash.add_argument('--image', default = APPLICATION_IMAGE_FILE, help = 'binary, Intel HEX or ELF (.axf) file (default ' + APPLICATION_IMAGE_FILE + ')')
+    Flash.add_argument('--address', type = lambda Text: int(Text, 0), default = None, help = 'start address (default from the HEX or ELF file, 0x08020000 for a binary)')
+    Flash.add_argument('--erase', action = 'store_true', help = 'erase the sectors of the image first')
+    Flash.add_argument('--verify', action = 'store_true', help = 'compare the target CRC of the range with the image')
+    Flash.add_argument('--boot', action = 'store_true', help = 'jump to the reset handler of the image')
+    Flash.add_argument('--staged', action = 'store_true', help = 'stage 64KB blocks in the target RAM, one flash commit per block')
+    Flash.add_argument('--ram', action = 'store_true', help = 'load the image into RAM and run it, the flash is not touched (default address 0x20008000)')
+    Flash.add_argument('--window', type = int, default = FLEET_WINDOW_SIZE, help = 'frames in flight (1-8)')
+    Flash.add_argument('--payload', type = int, default = WINDOW_PAYLOAD_LENGTH, help = 'payload per frame, 1024-4096 for large frames')
+    Flash.add_argument('--baud', type = int, default = FLEET_BAUD_RATE, help = 'rate the bootloader listens at')
+    Flash.add_argument('--max-baud', type = int, default = 0, help = 'fastest rate to probe before writing')
+    Options = Parser.parse_args(Arguments)
+    if(Options.ram and (Options.erase or Options.staged)):
+        Parser.error('--ram does not write the flash, --erase and --staged do not apply')
+    Options.window = max(1, min(8, Options.window))
+    Options.payload = max(1, min(LARGE_PAYLOAD_LENGTH, Options.payload))
+    
+    Ports = Check_Serial_Ports() if (Options.ports == ['auto']) else Options.ports
+    if(not Ports):
+        print(json.dumps({ 'ok' : False, 'error' : 'no serial ports found' }))
+        return 1
+    Results = multiprocessing.Queue()
+    Sessions = [multiprocessing.Process(target = Fleet_Session, args = (Port, Options, Results)) for Port in Ports]
+    Start_Time = perf_counter()
+    for Session in Sessions:
+        Session.start()
+    
+    Finished = []
+    while(len(Finished) < len(Sessions)):
+        try:
+            Result = Results.get(timeout = FLEET_RESULT_POLL)
+        except queue.Empty:
+            if(any(Session.is_alive() for Session in Sessions) or not Results.empty()):
+                continue
+            break
+        Finished.append(Result)
+        print(json.dumps(Result), flush = True)
+    for Port in Ports:
+        if(Port not in [Result['port'] for Result in Finished]):
+            Result = { 'port' : Port, 'ok' : False, 'error' : 'session ended without a result' }
+            Finished.append(Result)
+            print(json.dumps(Result), flush = True)
+    for Session in Sessions:
+        Session.join()
+    
+    ''' Every board gets the whole image, so the aggregate rate grows with the number of boards '''
+    Elapsed_Time = max(perf_counter() - Start_Time, 1e-6)
+    Flashed = [Result for Result in Finished if Result['ok']]
+    Total_Bytes = sum(Result['bytes'] for Result in Flashed)
+    print(json.dumps({ 'ports' : len(Ports), 'ok' : len(Flashed), 'failed' : len(Ports) - len(Flashed), 'bytes' : Total_Bytes,
+                       'seconds' : round(Elapsed_Time, 3), 'aggregate_kbps' : round(Total_Bytes / Elapsed_Time / 1024, 2) }), flush = True)
+    return 0 if (len(Flashed) == len(Ports)) else 1
 
 def Decode_CBL_Command(Command):
     BL_Host_Buffer = []
@@ -321,7 +1807,7 @@ def Decode_CBL_Command(Command):
         NumberOfSectors = 0
         BL_Host_Buffer[0] = CBL_FLASH_ERASE_CMD_Len - 1
         BL_Host_Buffer[1] = CBL_FLASH_ERASE_CMD
-        SectorNumber = input("\n   Please enter start sector number(0-11)          : ")
+        SectorNumber = input("\n   Please enter start sector number(4-11)          : ")
         SectorNumber = int(SectorNumber, 16)
         if(SectorNumber != 0xFF):
             NumberOfSectors = int(input("\n   Please enter number of sectors to erase (12 Max): "), 16)
@@ -339,91 +1825,28 @@ def Decode_CBL_Command(Command):
         Read_Data_From_Serial_Port(CBL_FLASH_ERASE_CMD)
     elif (Command == 7):
         print("Write data into different memories of the MCU command")
-        global Memory_Write_Is_Active
-        global Memory_Write_All
-        File_Total_Len = 0
-        BinFileRemainingBytes = 0
-        BinFileSentBytes = 0
-        BaseMemoryAddress = 0
-        BinFileReadLength = 0
-        Memory_Write_All = 1
-        
-        ''' Get the total length of the binary file '''
-        File_Total_Len = CalulateBinFileLength()
-        print("   Preparing writing a binary file with length (", File_Total_Len, ") Bytes")
-        ''' Open the binary file '''
-        OpenBinFile()
-        ''' Calculate the remaining payload '''
-        BinFileRemainingBytes = File_Total_Len - BinFileSentBytes
+        Image = Map_Application_Image()
+        print("   Preparing writing a binary file with length (", len(Image), ") Bytes")
         ''' Get the start address to write the payload '''
+        BaseMemoryAddress = Input_Image_Address()
+        Start_Time = perf_counter()
+        if(Memory_Write_Frames(BaseMemoryAddress, Image, WINDOW_PAYLOAD_LENGTH) == 1):
+            Elapsed_Time = max(perf_counter() - Start_Time, 1e-6)
+            print("\n   Written :", len(Image), "bytes in", round(Elapsed_Time, 2), "s ->", round(len(Image) / Elapsed_Time / 1024, 2), "KB/s")
+            print("\n\n Payload Written Successfully")
+    elif (Command == 9):
+        print("Read the MCU memory into a file command")
         BaseMemoryAddress = input("\n   Enter the start address : ")
         BaseMemoryAddress = int(BaseMemoryAddress, 16)
-        ''' Keep sending the write packet till the last payload byte '''
-        while(BinFileRemainingBytes):
-            ''' Memory write is active '''
-            Memory_Write_Is_Active = 1
-            
-            ''' Read 128 bytes from the binary file each time '''
-            if(BinFileRemainingBytes >= 128):
-                BinFileReadLength = 128
-            else:
-                BinFileReadLength = BinFileRemainingBytes
-            
-            for BinFileByte in range(BinFileReadLength):
-                BinFileByteValue = BinFile.read(1)
-                BinFileByteValue = bytearray(BinFileByteValue)
-                BL_Host_Buffer[7 + BinFileByte] = int(BinFileByteValue[0])
-            
-            ''' Update the Host packet with the command code ID '''
-            BL_Host_Buffer[1] = CBL_MEM_WRITE_CMD
-        
-            ''' Update the Host packet with the base address '''
-            BL_Host_Buffer[2] = Word_Value_To_Byte_Value(BaseMemoryAddress, 1, 1)
-            BL_Host_Buffer[3] = Word_Value_To_Byte_Value(BaseMemoryAddress, 2, 1)
-            BL_Host_Buffer[4] = Word_Value_To_Byte_Value(BaseMemoryAddress, 3, 1)
-            BL_Host_Buffer[5] = Word_Value_To_Byte_Value(BaseMemoryAddress, 4, 1)
-            
-            ''' Update the Host packet with the payload length '''
-            BL_Host_Buffer[6] = BinFileReadLength
-            
-            ''' Update the Host packet with the packet length '''
-            CBL_MEM_WRITE_CMD_Len = (BinFileReadLength + 11)
-            BL_Host_Buffer[0] = CBL_MEM_WRITE_CMD_Len - 1
-            
-            ''' Update the Host packet with the calculated CRC32 '''
-            CRC32_Value = Calculate_CRC32(BL_Host_Buffer, CBL_MEM_WRITE_CMD_Len - 4) 
-            CRC32_Value = CRC32_Value & 0xFFFFFFFF
-            BL_Host_Buffer[7 + BinFileReadLength] = Word_Value_To_Byte_Value(CRC32_Value, 1, 1)
-            BL_Host_Buffer[8 + BinFileReadLength] = Word_Value_To_Byte_Value(CRC32_Value, 2, 1)
-            BL_Host_Buffer[9 + BinFileReadLength] = Word_Value_To_Byte_Value(CRC32_Value, 3, 1)
-            BL_Host_Buffer[10+ BinFileReadLength] = Word_Value_To_Byte_Value(CRC32_Value, 4, 1)
-            
-            ''' Calculate the next Base memory address '''
-            BaseMemoryAddress = BaseMemoryAddress + BinFileReadLength
-            
-            ''' Send the packet length to the bootloader '''
-            Write_Data_To_Serial_Port(BL_Host_Buffer[0], 1)
-            
-            ''' Send the complete packet to the bootloader '''
-            for Data in BL_Host_Buffer[1 : CBL_MEM_WRITE_CMD_Len]:
-                Write_Data_To_Serial_Port(Data, CBL_MEM_WRITE_CMD_Len - 1)
-            
-            ''' Update the total number of bytes sent to the bootloader '''
-            BinFileSentBytes = BinFileSentBytes + BinFileReadLength
-            
-            ''' Calculate the remaining payload '''
-            BinFileRemainingBytes = File_Total_Len - BinFileSentBytes
-            print("\n   Bytes sent to the bootloader :{0}".format(BinFileSentBytes))
-            
-            ''' Read the response from the bootloader '''
-            BL_Return_Value = Read_Data_From_Serial_Port(CBL_MEM_WRITE_CMD)
-            sleep(0.1)
-        ''' Memory write is inactive '''
-        Memory_Write_Is_Active = 0
-        if(Memory_Write_All == 1):
-            print("\n\n Payload Written Successfully")
+        Read_Length = input("\n   Enter the number of bytes to read (multiple of 4) : ")
+        Read_Length = int(Read_Length, 0)
+        File_Name = input("\n   Enter the output file name (Memory_Dump.bin) : ")
+        if(not File_Name):
+            File_Name = 'Memory_Dump.bin'
+        if(Memory_Read_To_File(BaseMemoryAddress, Read_Length, File_Name) == 1):
+            print("\n\n Memory Read Successfully")
     elif (Command == 12):
-        print("Change read protection level of the user flash command")
+        print("Change read protection level of the user flash command (requires BL_ROP_CHANGE_ENABLE)")
         Protection_level = input("\n   Please Enter one of these Protection levels : 0,1,2 : ")
         Protection_level = int(Protection_level, 8)
         if(Protection_level == 2):
@@ -446,35 +1869,171 @@ def Decode_CBL_Command(Command):
             Read_Data_From_Serial_Port(CBL_CHANGE_ROP_Level_CMD)
         else:
             print("\n   Protection level (", Protection_level, ") not supported !!")
+    elif (Command == 13):
+        print("Pipelined write of the binary file into the MCU flash command")
+        File_Total_Len = CalulateBinFileLength()
+        print("   Preparing writing a binary file with length (", File_Total_Len, ") Bytes")
+        BaseMemoryAddress = Input_Image_Address()
+        Window_Size, Payload_Length, Decompress_Budget = Input_Window_Settings()
+        if(Memory_Write_Window(BaseMemoryAddress, Window_Size, Payload_Length) == 1):
+            print("\n\n Payload Written Successfully")
+    elif (Command == 14):
+        print("Delta update of the MCU flash from the per-block hashes command")
+        File_Total_Len = CalulateBinFileLength()
+        print("   Preparing writing a binary file with length (", File_Total_Len, ") Bytes")
+        BaseMemoryAddress = input("\n   Enter the start address (sector boundary) : ")
+        BaseMemoryAddress = int(BaseMemoryAddress, 16)
+        Window_Size, Payload_Length, Decompress_Budget = Input_Window_Settings()
+        if(Delta_Update(BaseMemoryAddress, Window_Size, Payload_Length) == 1):
+            print("\n\n Payload Written Successfully")
+    elif (Command == 15):
+        print("Compressed write of the binary file into the MCU flash command")
+        File_Total_Len = CalulateBinFileLength()
+        print("   Preparing writing a binary file with length (", File_Total_Len, ") Bytes")
+        BaseMemoryAddress = Input_Image_Address()
+        Window_Size, Payload_Length, Decompress_Budget = Input_Window_Settings(True)
+        if(Decompress_Budget == 0):
+            print("\n   Error !! The bootloader does not support compressed writes")
+        elif(Memory_Write_Compressed(BaseMemoryAddress, Window_Size, Payload_Length, Decompress_Budget) == 1):
+            print("\n\n Payload Written Successfully")
+    elif (Command == 16):
+        print("Verify the binary file against the MCU memory command")
+        BaseMemoryAddress = Input_Image_Address()
+        if(Verify_Image(BaseMemoryAddress, Load_Application_Image()) == 1):
+            print("\n\n Memory content matches the binary file")
+        else:
+            print("\n\n Memory content does not match the binary file")
+    elif (Command == 17):
+        print("Change the baud rate of the bootloader link command")
+        New_Baud = input("\n   Enter the baud rate : ")
+        if(Change_Baud_Rate(int(New_Baud)) == 1):
+            print("\n   Link running at", Serial_Port_Obj.baudrate, "baud")
+        else:
+            print("\n   Rate refused or not confirmed, link stays at", Serial_Port_Obj.baudrate, "baud")
+    elif (Command == 18):
+        print("Read the application slots command")
+        Status = Query_Slot_Status()
+        if(Status is None):
+            print("\n   Error !! The bootloader does not support application slots")
+        else:
+            Print_Slot_Status(Status)
+    elif (Command == 19):
+        print("Switch the active application slot command")
+        Slot = input("\n   Enter the slot (A or B), the active one confirms it : ").strip().upper()
+        if(Slot not in SLOT_NAMES):
+            print("\n   Error !! Unknown slot")
+        else:
+            Version = int(input("\n   Enter the version of the image : "), 0)
+            Switch_Status = Switch_Slot(SLOT_NAMES.index(Slot), Version)
+            if(Switch_Status == SLOT_SWITCH_DONE):
+                print("\n   Slot", Slot, "is the active slot")
+            elif(Switch_Status == SLOT_SWITCH_REFUSED):
+                print("\n   Switch refused, slot", Slot, "holds no valid image")
+            else:
+                print("\n   Switch failed, the journal could not be written")
+    elif (Command == 20):
+        print("A/B update of the inactive application slot command")
+        Version = int(input("\n   Enter the version of the image : "), 0)
+        Window_Size, Payload_Length, Decompress_Budget = Input_Window_Settings()
+        if(Slot_Update(Version, Window_Size, Payload_Length) == 1):
+            print("\n\n Payload Written Successfully")
+    elif (Command == 21):
+        print("Update through the update agent of the running application command")
+        Version = int(input("\n   Enter the version of the image : "), 0)
+        if(Agent_Update(Version) == 1):
+            print("\n\n Payload Written Successfully")
+    elif (Command == 22):
+        print("Erase sectors in the background command")
+        SectorNumber = int(input("\n   Please enter start sector number(4-11)          : "), 16)
+        NumberOfSectors = 0
+        if(SectorNumber != CBL_FLASH_MASS_ERASE):
+            NumberOfSectors = int(input("\n   Please enter number of sectors to erase (12 Max): "), 16)
+        Status = Erase_Flash_Async(SectorNumber, NumberOfSectors)
+        if(Status is None):
+            print("\n   Error !! The bootloader does not support the background erase")
+        elif(Status == ERASE_ASYNC_BUSY):
+            print("\n   Erase Status -> An erase is still running")
+        elif(Status != VALID_SECTOR_NUMBER):
+            print("\n   Erase Status -> Invalid Sector Number")
+        elif(Wait_Erase_Done() == 1):
+            print("\n   Erase Status -> Successful Erase of", Erase_Progress['total'], "sectors in", round(Erase_Progress['seconds'], 2), "s")
+    elif (Command == 23):
+        print("Staged write of the binary file through the target RAM command")
+        BaseMemoryAddress = Input_Image_Address()
+        Window_Size, Payload_Length, Decompress_Budget = Input_Window_Settings()
+        if(Memory_Write_Staged(Sparse_Segments(BaseMemoryAddress, Map_Application_Image()), Window_Size, Payload_Length) == 1):
+            print("\n\n Payload Written Successfully")
+    elif (Command == 24):
+        print("Load the binary file into RAM and run it command")
+        Base_Address = Load_Image_File()[0]
+        BaseMemoryAddress = Base_Address if (Base_Address is not None) else RAM_IMAGE_BASE_ADDRESS
+        print("\n   RAM image at", hex(BaseMemoryAddress))
+        Window_Size, Payload_Length, Decompress_Budget = Input_Window_Settings()
+        Start_Time = perf_counter()
+        if((Load_RAM_Image(BaseMemoryAddress, Load_Application_Image(), Window_Size, Payload_Length) == 1) and (Run_RAM_Image(BaseMemoryAddress) == 1)):
+            print("\n\n RAM image running", round(perf_counter() - Start_Time, 2), "s after the first frame")
+    elif (Command == 25):
+        print("Read the flash wear and timing statistics command")
+        Stats = Query_Flash_Stats()
+        if(Stats is None):
+            print("\n   Error !! The bootloader does not keep flash statistics")
+        else:
+            Print_Flash_Stats(Stats)
+    elif (Command == 26):
+        print("Read the command latency histograms command")
+        Clear = input("\n   Clear them once read (y/n): ").strip().lower() == 'y'
+        Profile = Query_Profile(Clear)
+        if(Profile is None):
+            print("\n   Error !! The bootloader was built without command profiling")
+        else:
+            Print_Profile(Profile)
             
         
 
-SerialPortName = input("Enter the Port Name of your device(Ex: COM3):")
-Serial_Port_Configuration(SerialPortName)
-        
-while True:
-    print("\nSTM32F407 Custome BootLoader")
-    print("==============================")
-    print("Which command you need to send to the bootLoader :");
-    print("   CBL_GET_VER_CMD              --> 1")
-    print("   CBL_GET_HELP_CMD             --> 2")
-    print("   CBL_GET_CID_CMD              --> 3")
-    print("   CBL_GET_RDP_STATUS_CMD       --> 4")
-    print("   CBL_GO_TO_ADDR_CMD           --> 5")
-    print("   CBL_FLASH_ERASE_CMD          --> 6")
-    print("   CBL_MEM_WRITE_CMD            --> 7")
-    print("   CBL_ED_W_PROTECT_CMD         --> 8")
-    print("   CBL_MEM_READ_CMD             --> 9")
-    print("   CBL_READ_SECTOR_STATUS_CMD   --> 10")
-    print("   CBL_OTP_READ_CMD             --> 11")
-    print("   CBL_CHANGE_ROP_Level_CMD     --> 12")
-    
-    CBL_Command = input("\nEnter the command code : ")
-    
-    if(not CBL_Command.isdigit()):
-        print("   Error !!, Please enter a valid command !! \n")
-    else:
-        Decode_CBL_Command(int(CBL_Command))
+if __name__ == '__main__':
+    if(len(sys.argv) > 1):
+        sys.exit(Fleet_Main(sys.argv[1:]))
     
-    input("\nPlease press any key to continue ...")
-    Serial_Port_Obj.reset_input_buffer()
\ No newline at end of file
+    SerialPortName = input("Enter the Port Name of your device(Ex: COM3):")
+    Serial_Port_Configuration(SerialPortName)
+            
+    while True:
+        print("\nSTM32F407 Custome BootLoader")
+        print("==============================")
+        print("Which command you need to send to the bootLoader :");
+        print("   CBL_GET_VER_CMD              --> 1")
+        print("   CBL_GET_HELP_CMD             --> 2")
+        print("   CBL_GET_CID_CMD              --> 3")
+        print("   CBL_GET_RDP_STATUS_CMD       --> 4")
+        print("   CBL_GO_TO_ADDR_CMD           --> 5")
+        print("   CBL_FLASH_ERASE_CMD          --> 6")
+        print("   CBL_MEM_WRITE_CMD            --> 7")
+        print("   CBL_ED_W_PROTECT_CMD         --> 8")
+        print("   CBL_MEM_READ_CMD             --> 9")
+        print("   CBL_READ_SECTOR_STATUS_CMD   --> 10")
+        print("   CBL_OTP_READ_CMD             --> 11")
+        print("   CBL_CHANGE_ROP_Level_CMD     --> 12 (requires BL_ROP_CHANGE_ENABLE)")
+        print("   CBL_MEM_WRITE_WINDOW_CMD     --> 13")
+        print("   CBL_FLASH_BLOCK_HASH_CMD     --> 14")
+        print("   CBL_MEM_WRITE_LZ4_CMD        --> 15")
+        print("   CBL_MEM_CRC_CMD              --> 16")
+        print("   CBL_CHANGE_BAUD_CMD          --> 17")
+        print("   CBL_SLOT_STATUS_CMD          --> 18")
+        print("   CBL_SLOT_SWITCH_CMD          --> 19")
+        print("   A/B UPDATE (inactive slot)   --> 20")
+        print("   IN-APP UPDATE (update agent) --> 21")
+        print("   CBL_FLASH_ERASE_ASYNC_CMD    --> 22")
+        print("   CBL_MEM_WRITE_STAGED_CMD     --> 23")
+        print("   CBL_RAM_RUN_CMD              --> 24")
+        print("   CBL_FLASH_STATS_CMD          --> 25")
+        print("   CBL_PROFILE_CMD              --> 26")
+        
+        CBL_Command = input("\nEnter the command code : ")
+        
+        if(not CBL_Command.isdigit()):
+            print("   Error !!, Please enter a valid command !! \n")
+        else:
+            Decode_CBL_Command(int(CBL_Command))
+        
+        input("\nPlease press any key to continue ...")
+        Serial_Port_Obj.reset_input_buffer()
\ No newline at end of file
@@ -0,0 +1,125 @@
+import serial
+import struct
+import os
+import re
+import sys
+
+'''
+Decoder of the tokenized bootloader log (BL_LOG_FORMAT_TOKEN in Bootloader.h).
+Every record is Sync | Format address(4) | Args length(1) | Args: the target sends the address
+of the format string instead of the text, the string itself is read from the firmware image.
+
+   python Log_Decode.py <image .axf / ELF> <capture file | - for stdin | serial port> [baud rate]
+
+The image must be the one running on the target (the host simulation binary for the simulator).
+'''
+LOG_TOKEN_SYNC               = 0xA5
+LOG_TOKEN_HEADER_LENGTH      = 6
+LOG_FORMAT_MAX_LENGTH        = 256
+LOG_DEFAULT_BAUD_RATE        = 115200
+
+SHF_ALLOC                    = 0x2
+SHT_NOBITS                   = 8
+
+''' One argument per conversion, flags, width and length modifiers as the target skips them '''
+Format_Conversion = re.compile(r'%([-+ #0-9.]*)[lh]*([a-zA-Z%])')
+
+def Load_Image_Sections(Image_File_Name):
+    ''' Address and contents of every section loaded on the target, ELF32 (.axf) or ELF64 '''
+    Image = open(Image_File_Name, 'rb').read()
+    if(Image[0:4] != b'\x7fELF'):
+        raise ValueError("Error !! " + Image_File_Name + " is not an ELF image")
+    Is_ELF64 = (Image[4] == 2)
+    Endian = '<' if (Image[5] == 1) else '>'
+    if(Is_ELF64):
+        Section_Table = struct.unpack_from(Endian + 'Q', Image, 0x28)[0]
+        Entry_Size, Entry_Count = struct.unpack_from(Endian + 'HH', Image, 0x3A)
+        Entry_Format = Endian + 'IQQQQ'
+    else:
+        Section_Table = struct.unpack_from(Endian + 'I', Image, 0x20)[0]
+        Entry_Size, Entry_Count = struct.unpack_from(Endian + 'HH', Image, 0x2E)
+        Entry_Format = Endian + 'IIIII'
+    Sections = []
+    for Index in range(Entry_Count):
+        Type, Flags, Address, Offset, Size = struct.unpack_from(Entry_Format, Image, Section_Table + (Index * Entry_Size) + 4)
+        if((Flags & SHF_ALLOC) and (Type != SHT_NOBITS) and (Address != 0)):
+            Sections.append((Address, Image[Offset:Offset + Size]))
+    return Sections
+
+def Format_String(Sections, Address):
+    ''' None when the address is not the start of a printable string, the record is then out of sync '''
+    for Section_Address, Data in Sections:
+        if(Section_Address <= Address < Section_Address + len(Data)):
+            Start = Address - Section_Address
+            End = Data.find(b'\x00', Start, Start + LOG_FORMAT_MAX_LENGTH)
+            if(End <= Start):
+                return None
+            Text = Data[Start:End].decode('latin-1')
+            return Text if all((Char >= ' ') or (Char in '\r\n\t') for Char in Text) else None
+    return None
+
+def Format_Record(Format, Args):
+    ''' The C conversions rebuilt with the arguments of the record, None if they do not match '''
+    Position = 0
+    Text = ''
+    Cursor = 0
+    for Match in Format_Conversion.finditer(Format):
+        Text += Format[Cursor:Match.start()]
+        Cursor = Match.end()
+        Flags, Conversion = Match.group(1), Match.group(2)
+        if(Conversion == '%'):
+            Text += '%'
+            continue
+        if(Conversion == 's'):
+            if(Position >= len(Args)):
+                return None
+            String_Length = Args[Position]
+            Text += ('%' + Flags + 's') % Args[Position + 1:Position + 1 + String_Length].decode('latin-1')
+            Position += 1 + String_Length
+            continue
+        if(Position + 4 > len(Args)):
+            return None
+        Value = struct.unpack_from('<i' if (Conversion in 'di') else '<I', Args, Position)[0]
+        Position += 4
+        Text += ('%' + Flags + ('d' if (Conversion in 'diu') else Conversion)) % Value
+    return Text + Format[Cursor:]
+
+def Decode_Log(Sections, Read_Chunk):
+    Stream = bytearray()
+    while True:
+        Chunk = Read_Chunk()
+        if(Chunk is None):
+            break
+        Stream += Chunk
+        while(len(Stream) >= LOG_TOKEN_HEADER_LENGTH):
+            if(Stream[0] != LOG_TOKEN_SYNC):
+                del Stream[0]
+                continue
+            Format_Address, Args_Length = struct.unpack_from('<IB', Stream, 1)
+            if(len(Stream) < LOG_TOKEN_HEADER_LENGTH + Args_Length):
+                break
+            Format = Format_String(Sections, Format_Address)
+            Text = None if (Format is None) else Format_Record(Format, bytes(Stream[LOG_TOKEN_HEADER_LENGTH:LOG_TOKEN_HEADER_LENGTH + Args_Length]))
+            if(Text is None):
+                ''' Not a record, look for the next sync byte '''
+                del Stream[0]
+                continue
+            sys.stdout.write(Text.replace('\r\n', '\n'))
+            sys.stdout.flush()
+            del Stream[0:LOG_TOKEN_HEADER_LENGTH + Args_Length]
+
+if __name__ == '__main__':
+    if(len(sys.argv) < 3):
+        print("Usage : python Log_Decode.py <image .axf / ELF> <capture file | - | serial port> [baud rate]")
+        sys.exit(1)
+    Image_Sections = Load_Image_Sections(sys.argv[1])
+    if(sys.argv[2] == '-'):
+        Log_Source = sys.stdin.buffer
+        Decode_Log(Image_Sections, lambda: Log_Source.read1(4096) or None)
+    elif(os.path.isfile(sys.argv[2])):
+        Log_Source = open(sys.argv[2], 'rb')
+        Decode_Log(Image_Sections, lambda: Log_Source.read(4096) or None)
+    else:
+        Baud_Rate = int(sys.argv[3]) if (len(sys.argv) > 3) else LOG_DEFAULT_BAUD_RATE
+        Log_Source = serial.Serial(sys.argv[2], Baud_Rate, timeout = 1)
+        Decode_Log(Image_Sections, lambda: Log_Source.read(Log_Source.in_waiting or 1))
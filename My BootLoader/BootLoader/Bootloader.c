@@ -6,18 +6,99 @@ static void Bootloader_Read_Protection_Level(uint8_t *Host_Buffer);
 static void Bootloader_Jump_To_Address(uint8_t *Host_Buffer);
 static void Bootloader_Erase_Flash(uint8_t *Host_Buffer);
 static void Bootloader_Memory_Write(uint8_t *Host_Buffer);
+static void Bootloader_Memory_Write_Window(uint8_t *Host_Buffer);
+static void Bootloader_Negotiate_Frame_Size(uint8_t *Host_Buffer);
+static void Bootloader_Flash_Block_Hash(uint8_t *Host_Buffer);
+static void Bootloader_Memory_Read(uint8_t *Host_Buffer);
+static void Bootloader_Memory_CRC(uint8_t *Host_Buffer);
+static void Bootloader_Change_Baud_Rate(uint8_t *Host_Buffer);
+#if (BL_ROP_CHANGE == BL_ROP_CHANGE_ENABLE)
 static void Bootloader_Change_Read_Protection_Level(uint8_t *Host_Buffer);
+#endif
+static void Bootloader_Slot_Status(uint8_t *Host_Buffer);
+static void Bootloader_Slot_Switch(uint8_t *Host_Buffer);
+static void Bootloader_Erase_Flash_Async(uint8_t *Host_Buffer);
+static void Bootloader_Erase_Status(uint8_t *Host_Buffer);
+static void Bootloader_Stage_Commit(uint8_t *Host_Buffer);
+static void Bootloader_Run_RAM_Image(uint8_t *Host_Buffer);
+static void Bootloader_Flash_Stats(uint8_t *Host_Buffer);
+#if (BL_PROFILE == BL_PROFILE_ENABLE)
+static void Bootloader_Profile(uint8_t *Host_Buffer);
+#endif
 
+static BL_Status Bootloader_Dispatch_Command(uint8_t *Host_Buffer, uint32_t Command_Len);
 static uint8_t Bootloader_CRC_Verify(uint8_t *pData, uint32_t Data_Len, uint32_t Host_CRC);
 static void Bootloader_Send_ACK(uint8_t Replay_Len);
+static void Bootloader_Send_Long_ACK(uint16_t Replay_Len);
 static void Bootloader_Send_NACK(void);
+static void Bootloader_Send_Window_Reply(uint8_t Window_Status, uint16_t Seq);
 static void Bootloader_Send_Data_To_Host(uint8_t *Host_Buffer, uint32_t Data_Len);
 static uint8_t Host_Address_Verification(uint32_t Jump_Address);
+static uint8_t Host_Write_Verification(uint32_t Write_Address);
+static uint8_t Host_Erase_Verification(uint8_t SectorNumber);
+static uint8_t Host_Range_Verification(uint32_t Range_Address, uint32_t Range_Length);
+static uint8_t Bootloader_Image_Verification(uint32_t Image_Address, uint32_t Region_Length);
+static uint32_t BL_Slot_Address(uint8_t Slot);
+static uint8_t BL_Slot_Other(uint8_t Slot);
+static uint8_t BL_Slot_Bootable(const BL_Slot_Record *Record, uint8_t Slot);
+static uint8_t BL_Slot_Select(void);
+static uint8_t BL_Slot_Activate(uint8_t Slot, uint32_t Version);
+static uint8_t BL_Slot_Handoff(void);
+static void BL_Slot_Count_Boot_Attempt(void);
+static uint32_t BL_Slot_Journal_Find(BL_Slot_Record *Record);
+static uint8_t BL_Slot_Journal_Append(BL_Slot_Record *Record);
+static uint32_t BL_Slot_Record_CRC(const BL_Slot_Record *Record);
+static HAL_StatusTypeDef Bootloader_CRC_Range_DMA(uint32_t Range_Address, uint32_t Range_Length, uint32_t *Range_CRC);
+static uint8_t Flash_Erase_Setup(uint8_t SectorNumber, uint8_t NumberOfSectors, FLASH_EraseInitTypeDef *Erase);
 static uint8_t Perform_Flash_Erase(uint8_t SectorNumber, uint8_t NumberOfSectors);
+static void BL_Erase_Poll(void);
+static void BL_Erase_Wait(void);
+static void BL_Flash_Stats_Init(void);
+static void BL_Flash_Stats_Erase(uint8_t SectorNumber, uint32_t Elapsed_ms);
+static void BL_Flash_Stats_Program(uint32_t Address, uint32_t Length, uint32_t Cycles);
+static uint8_t Flash_Address_Sector(uint32_t Address);
+static uint8_t Memory_Write_Payload(uint8_t *Host_Payload, uint32_t Payload_Start_Address, uint16_t Payload_Len);
 static uint8_t Flash_Memory_Write_Payload(uint8_t *Host_Payload, uint32_t Payload_Start_Address, uint16_t Payload_Len);
+static uint8_t Flash_Program_Payload(uint8_t *Host_Payload, uint32_t Payload_Start_Address, uint32_t Payload_Len);
+static uint8_t BL_Stage_Payload(uint8_t *Payload, uint32_t Payload_Start_Address, uint16_t Payload_Len);
+static void BL_Stage_Discard(void);
+static uint8_t *Bootloader_Decompress_Payload(uint8_t *Payload, uint16_t *Payload_Len, uint32_t Payload_Start_Address);
+static uint16_t LZ4_Decode_Block(uint8_t *Source, uint16_t Source_Len, uint32_t Block_Address, uint8_t *Destination, uint16_t Destination_Len);
+static uint32_t Flash_Program_Width(uint32_t Address, uint32_t Remaining_Len);
+static uint32_t Flash_Sector_Size(uint8_t SectorNumber);
+static uint16_t Flash_Blank_Sectors(uint32_t Address, uint32_t Length);
+#if (BL_ROP_CHANGE == BL_ROP_CHANGE_ENABLE)
 static uint8_t Change_ROP_Level(uint32_t ROP_Level);
+#endif
 static uint8_t CBL_STM32F407_Get_RDP_Level();
-static uint8_t Bootloader_Supported_Commands[12] = {
+static HAL_StatusTypeDef BL_Host_Receive(uint8_t *pData, uint16_t Data_Len);
+static HAL_StatusTypeDef BL_Host_Receive_Timeout(uint8_t *pData, uint16_t Data_Len, uint32_t Timeout);
+static uint8_t BL_Host_Baud_Rate_Verification(uint32_t Baud_Rate);
+static void BL_Host_Set_Baud_Rate(uint32_t Baud_Rate);
+static void BL_Host_Discard(uint32_t Data_Len);
+static uint8_t BL_Host_Rx_Flush_Overrun(void);
+static uint8_t *BL_Host_Frame_Payload(uint8_t *Host_Buffer, uint8_t Payload_Len_Offset, uint16_t *Payload_Len);
+static uint8_t BL_Boot_Host_Activity(uint32_t Timeout);
+static void bootloader_jump_to_user_app(uint32_t Image_Address);
+#if (BL_DEBUG_METHOD == BL_ENABLE_UART_DEBUG_MESSAGE)
+static uint8_t BL_Log_Record(const char *format, va_list List);
+static uint8_t BL_Log_Record_Args(const char *format, ...);
+static uint8_t BL_Log_Enqueue(const uint8_t *pData, uint32_t Data_Len);
+static void BL_Log_Start_Transfer(void);
+static void BL_Log_Flush(void);
+#endif
+#if (BL_HOST_RX_METHOD == BL_HOST_RX_DMA)
+static void BL_Host_Rx_Start(void);
+static uint32_t BL_Host_Rx_Available(void);
+static void BL_Host_Rx_Report_Overlap(void);
+#endif
+#if (BL_PROFILE == BL_PROFILE_ENABLE)
+static void BL_Profile_Frame_Start(void);
+static void BL_Profile_Add(uint8_t Phase, uint32_t Start_Cycles);
+static void BL_Profile_Book(uint8_t Command);
+static uint8_t BL_Profile_Has_Samples(uint8_t Index);
+#endif
+static uint8_t Bootloader_Supported_Commands[] = {
 		
 		CBL_GET_VER_CMD,
     CBL_GET_HELP_CMD,
@@ -30,11 +111,252 @@ static uint8_t Bootloader_Supported_Commands[12] = {
     CBL_MEM_READ_CMD,
     CBL_READ_SECTOR_STATUS_CMD,
     CBL_OTP_READ_CMD,
-    CBL_CHANGE_ROP_Level_CMD
+#if (BL_ROP_CHANGE == BL_ROP_CHANGE_ENABLE)
+    CBL_CHANGE_ROP_Level_CMD,
+#endif
+    CBL_MEM_WRITE_WINDOW_CMD,
+    CBL_FRAME_NEGOTIATE_CMD,
+    CBL_FLASH_BLOCK_HASH_CMD,
+    CBL_MEM_WRITE_LZ4_CMD,
+    CBL_MEM_CRC_CMD,
+    CBL_CHANGE_BAUD_CMD,
+    CBL_SLOT_STATUS_CMD,
+    CBL_SLOT_SWITCH_CMD,
+    CBL_FLASH_ERASE_ASYNC_CMD,
+    CBL_ERASE_STATUS_CMD,
+    CBL_MEM_WRITE_STAGED_CMD,
+    CBL_STAGE_COMMIT_CMD,
+    CBL_RAM_RUN_CMD,
+    CBL_FLASH_STATS_CMD,
+#if (BL_PROFILE == BL_PROFILE_ENABLE)
+    CBL_PROFILE_CMD
+#endif
 
 }; 
 
+static const BL_Command_Descriptor Bootloader_Commands[BL_COMMAND_TABLE_LENGTH] = {
+	
+	[CBL_GET_VER_CMD - BL_COMMAND_FIRST]          = { Bootloader_Get_Version, BL_COMMAND_LENGTH(0), BL_COMMAND_LENGTH(0), 4, BL_CMD_DURING_ERASE },
+	[CBL_GET_HELP_CMD - BL_COMMAND_FIRST]         = { Bootloader_Get_Help, BL_COMMAND_LENGTH(0), BL_COMMAND_LENGTH(0), sizeof(Bootloader_Supported_Commands), BL_CMD_DURING_ERASE },
+	[CBL_GET_CID_CMD - BL_COMMAND_FIRST]          = { Bootloader_Get_Chip_Identification_Number, BL_COMMAND_LENGTH(0), BL_COMMAND_LENGTH(0), 2, BL_CMD_DURING_ERASE },
+	[CBL_GET_RDP_STATUS_CMD - BL_COMMAND_FIRST]   = { Bootloader_Read_Protection_Level, BL_COMMAND_LENGTH(0), BL_COMMAND_LENGTH(0), 1, BL_CMD_DURING_ERASE },
+	[CBL_GO_TO_ADDR_CMD - BL_COMMAND_FIRST]       = { Bootloader_Jump_To_Address, BL_COMMAND_LENGTH(4), BL_COMMAND_LENGTH(4), 1, 0 },
+	[CBL_FLASH_ERASE_CMD - BL_COMMAND_FIRST]      = { Bootloader_Erase_Flash, BL_COMMAND_LENGTH(2), BL_COMMAND_LENGTH(2), 1, 0 },
+	//Address(4) | Payload_Len(1, 2 in a large frame) | Payload
+	[CBL_MEM_WRITE_CMD - BL_COMMAND_FIRST]        = { Bootloader_Memory_Write, BL_COMMAND_LENGTH(6), BL_COMMAND_LENGTH(6 + BL_HOST_LARGE_PAYLOAD_LENGTH), 1, BL_CMD_LARGE_FRAME },
+	[CBL_MEM_READ_CMD - BL_COMMAND_FIRST]         = { Bootloader_Memory_Read, BL_COMMAND_LENGTH(10), BL_COMMAND_LENGTH(10), BL_REPLY_BY_HANDLER, 0 },
+#if (BL_ROP_CHANGE == BL_ROP_CHANGE_ENABLE)
+	//Level
+	[CBL_CHANGE_ROP_Level_CMD - BL_COMMAND_FIRST] = { Bootloader_Change_Read_Protection_Level, BL_COMMAND_LENGTH(1), BL_COMMAND_LENGTH(1), 1, 0 },
+#endif
+	//Session | Seq(2) | Address(4) | Payload_Len(1, 2 in a large frame) | Payload
+	[CBL_MEM_WRITE_WINDOW_CMD - BL_COMMAND_FIRST] = { Bootloader_Memory_Write_Window, BL_COMMAND_LENGTH(8), BL_COMMAND_LENGTH(9 + BL_HOST_LARGE_PAYLOAD_LENGTH), BL_REPLY_BY_HANDLER, BL_CMD_LARGE_FRAME | BL_CMD_WINDOWED },
+	[CBL_FRAME_NEGOTIATE_CMD - BL_COMMAND_FIRST]  = { Bootloader_Negotiate_Frame_Size, BL_COMMAND_LENGTH(2), BL_COMMAND_LENGTH(2), FRAME_NEGOTIATE_REPLY_LENGTH, BL_CMD_DURING_ERASE },
+	[CBL_FLASH_BLOCK_HASH_CMD - BL_COMMAND_FIRST] = { Bootloader_Flash_Block_Hash, BL_COMMAND_LENGTH(12), BL_COMMAND_LENGTH(12), BL_REPLY_BY_HANDLER, 0 },
+	[CBL_MEM_WRITE_LZ4_CMD - BL_COMMAND_FIRST]    = { Bootloader_Memory_Write_Window, BL_COMMAND_LENGTH(8), BL_COMMAND_LENGTH(9 + BL_HOST_LARGE_PAYLOAD_LENGTH), BL_REPLY_BY_HANDLER, BL_CMD_LARGE_FRAME | BL_CMD_WINDOWED },
+	[CBL_MEM_CRC_CMD - BL_COMMAND_FIRST]          = { Bootloader_Memory_CRC, BL_COMMAND_LENGTH(8), BL_COMMAND_LENGTH(8), BL_REPLY_BY_HANDLER, 0 },
+	[CBL_CHANGE_BAUD_CMD - BL_COMMAND_FIRST]      = { Bootloader_Change_Baud_Rate, BL_COMMAND_LENGTH(4), BL_COMMAND_LENGTH(4), 1, 0 },
+	[CBL_SLOT_STATUS_CMD - BL_COMMAND_FIRST]      = { Bootloader_Slot_Status, BL_COMMAND_LENGTH(0), BL_COMMAND_LENGTH(0), SLOT_STATUS_REPLY_LENGTH, 0 },
+	//Slot | Version(4)
+	[CBL_SLOT_SWITCH_CMD - BL_COMMAND_FIRST]      = { Bootloader_Slot_Switch, BL_COMMAND_LENGTH(5), BL_COMMAND_LENGTH(5), 1, 0 },
+	//Sector | Count, answered before the erase is done, a second one while it runs is refused
+	[CBL_FLASH_ERASE_ASYNC_CMD - BL_COMMAND_FIRST] = { Bootloader_Erase_Flash_Async, BL_COMMAND_LENGTH(2), BL_COMMAND_LENGTH(2), 1, BL_CMD_DURING_ERASE },
+	[CBL_ERASE_STATUS_CMD - BL_COMMAND_FIRST]     = { Bootloader_Erase_Status, BL_COMMAND_LENGTH(0), BL_COMMAND_LENGTH(0), ERASE_STATUS_REPLY_LENGTH, BL_CMD_DURING_ERASE },
+	//CBL_MEM_WRITE_WINDOW_CMD frame, copied into the stage only
+	[CBL_MEM_WRITE_STAGED_CMD - BL_COMMAND_FIRST] = { Bootloader_Memory_Write_Window, BL_COMMAND_LENGTH(8), BL_COMMAND_LENGTH(9 + BL_HOST_LARGE_PAYLOAD_LENGTH), BL_REPLY_BY_HANDLER, BL_CMD_LARGE_FRAME | BL_CMD_WINDOWED | BL_CMD_DURING_ERASE },
+	[CBL_STAGE_COMMIT_CMD - BL_COMMAND_FIRST]     = { Bootloader_Stage_Commit, BL_COMMAND_LENGTH(0), BL_COMMAND_LENGTH(0), STAGE_COMMIT_REPLY_LENGTH, 0 },
+	[CBL_RAM_RUN_CMD - BL_COMMAND_FIRST]          = { Bootloader_Run_RAM_Image, BL_COMMAND_LENGTH(4), BL_COMMAND_LENGTH(4), 1, 0 },
+	[CBL_FLASH_STATS_CMD - BL_COMMAND_FIRST]      = { Bootloader_Flash_Stats, BL_COMMAND_LENGTH(0), BL_COMMAND_LENGTH(0), BL_REPLY_BY_HANDLER, BL_CMD_DURING_ERASE },
+#if (BL_PROFILE == BL_PROFILE_ENABLE)
+	//Clear
+	[CBL_PROFILE_CMD - BL_COMMAND_FIRST]          = { Bootloader_Profile, BL_COMMAND_LENGTH(1), BL_COMMAND_LENGTH(1), BL_REPLY_BY_HANDLER, BL_CMD_DURING_ERASE }
+#endif
+	
+};
+
 static uint8_t BL_Host_Buffer[BL_HOST_BUFFER_RX_LENGTH];
+//offset of CMD in the fetched frame (1 legacy, 3 large) and frame length including the CRC
+static uint16_t BL_Host_Frame_Header = 1;
+static uint16_t BL_Host_Frame_Length = 0;
+//large frame payload agreed with CBL_FRAME_NEGOTIATE_CMD, 0 until then
+static uint16_t BL_Host_Large_Payload_Length = 0;
+
+//background erase, the counters are written by the flash interrupt
+static volatile uint8_t BL_Erase_State = BL_ERASE_IDLE;
+static volatile uint8_t BL_Erase_Sectors_Done = 0;
+static uint8_t BL_Erase_Sectors_Total = 0;
+static uint8_t BL_Erase_Sectors_Reported = 0;
+//first sector or CBL_FLASH_MASS_ERASE
+static uint8_t BL_Erase_First_Sector = 0;
+//flash left unlocked until the end of the erase is reported
+static uint8_t BL_Erase_Unlocked = 0;
+static uint32_t BL_Erase_Start_Tick = 0;
+static volatile uint32_t BL_Erase_End_Tick = 0;
+//start of the sector under erase, for the flash statistics
+static volatile uint32_t BL_Erase_Sector_Tick = 0;
+
+#if (BL_HOST_RX_METHOD == BL_HOST_RX_DMA)
+//USART3 DMA receive ring, the DMA writes and BL_Host_Receive reads
+static uint8_t BL_Host_Rx_Ring[BL_HOST_RX_RING_LENGTH];
+static uint32_t BL_Host_Rx_Read_Index = 0;
+static uint8_t BL_Host_Rx_Started = 0;
+static volatile uint8_t BL_Host_Rx_Line_Idle = 0;
+//times the DMA and the reader went around the ring, the DMA counts in the transfer complete event
+static volatile uint32_t BL_Host_Rx_Write_Wraps = 0;
+static uint32_t BL_Host_Rx_Read_Wraps = 0;
+//the DMA overwrote unread bytes or a UART error ended the reception
+static volatile uint8_t BL_Host_Rx_Overrun = 0;
+//bytes of a frame that were already received when the frame was fetched
+static uint32_t BL_Host_Rx_Overlapped_Bytes = 0;
+static uint32_t BL_Host_Rx_Total_Bytes = 0;
+static uint32_t BL_Host_Rx_Frames = 0;
+#endif
+
+#if (BL_DEBUG_METHOD == BL_ENABLE_UART_DEBUG_MESSAGE)
+//debug message ring, BootLoader_Print_Message writes at the head and the USART2 DMA sends from the tail
+static uint8_t BL_Log_Ring[BL_LOG_RING_LENGTH];
+static volatile uint32_t BL_Log_Head = 0;
+static volatile uint32_t BL_Log_Tail = 0;
+static volatile uint32_t BL_Log_In_Flight = 0;
+static uint32_t BL_Log_Dropped = 0;
+static const char BL_Log_Dropped_Format[] = "... %d messages dropped \r\n";
+#endif
+
+//CBL_MEM_WRITE_WINDOW_CMD transfer state, a new session number restarts the sequence
+static uint8_t BL_Window_Session = 0;
+static uint16_t BL_Window_Expected_Seq = 0;
+
+//CBL_MEM_WRITE_STAGED_CMD stage in the CCM RAM, one bit per chunk that received data
+static uint32_t BL_Stage_Base = 0;
+static uint16_t BL_Stage_Chunks = 0;
+static uint32_t BL_Stage_Map[BL_STAGE_CHUNK_COUNT / 32];
+static const uint64_t BL_Stage_Blank = 0xFFFFFFFFFFFFFFFFULL;
+
+#if (BL_PROFILE == BL_PROFILE_ENABLE)
+//CBL_PROFILE_CMD histograms per command and phase, and the cycles of the frame being processed
+static uint16_t BL_Profile_Buckets[BL_COMMAND_TABLE_LENGTH][BL_PROFILE_PHASES][BL_PROFILE_BUCKETS];
+static uint32_t BL_Profile_Max_Cycles[BL_COMMAND_TABLE_LENGTH][BL_PROFILE_PHASES];
+static uint32_t BL_Profile_Frame_Cycles[BL_PROFILE_PHASES];
+#endif
+
+//CBL_MEM_WRITE_LZ4_CMD staging buffer, a block is decoded here before it is programmed
+static uint8_t BL_Decompress_Buffer[BL_DECOMPRESS_RAM_BUDGET];
+
+//CBL_MEM_CRC_CMD memory to memory stream, source the range, destination the CRC data register
+static DMA_HandleTypeDef BL_CRC_DMA_Handle;
+
+//time since main() in us, every interval is converted with the core clock it ran at
+static uint8_t BL_Boot_Timer_Started = 0;
+static uint32_t BL_Boot_Last_Cycles = 0;
+static uint32_t BL_Boot_Elapsed_us = 0;
+
+//journal record the slot chosen after reset was started from
+static BL_Slot_Record BL_Slot_Boot_Record;
+static const BL_Slot_Record BL_Slot_Erased_Record = {
+	0xFFFFFFFFU, 0xFFFFFFFFU, 0xFF, 0xFF, 0xFF, 0xFF, { 0xFFFFFFFFU, 0xFFFFFFFFU }, { 0xFFFFFFFFU, 0xFFFFFFFFU }, 0xFFFFFFFFU
+};
+
+/*
+ * Called first thing in main() and again before every core clock change, so the
+ * cycles counted so far are converted with the clock they were counted at.
+ */
+void BL_Boot_Time_Mark(void)
+{
+	uint32_t Cycles = 0;
+	
+	if(0 == BL_Boot_Timer_Started)
+	{
+		CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+		DWT->CYCCNT = 0;
+		DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+		BL_Boot_Last_Cycles = 0;
+		BL_Boot_Timer_Started = 1;
+	}
+	else
+	{
+		Cycles = DWT->CYCCNT;
+		BL_Boot_Elapsed_us += (Cycles - BL_Boot_Last_Cycles) / (SystemCoreClock / 1000000U);
+		BL_Boot_Last_Cycles = Cycles;
+	}
+}
+
+/*
+ * Returns when the bootloader has to stay for the host, otherwise the application
+ * is started and this never returns.
+ */
+void BL_Boot_Decision(void)
+{
+	uint32_t Last_Latency = 0;
+	char *Stay_Reason = NULL;
+	uint8_t Boot_Slot = BL_SLOT_NONE;
+	uint8_t Handed_Off = 0;
+	
+	__HAL_RCC_PWR_CLK_ENABLE();
+	HAL_PWR_EnableBkUpAccess();
+	BL_BOOT_BUTTON_CLK_ENABLE();
+	BL_Flash_Stats_Init();
+	Last_Latency = BL_BOOT_LATENCY_REGISTER;
+	
+	//the image came through the application, nothing is expected from the host
+	Handed_Off = (SLOT_SWITCH_DONE == BL_Slot_Handoff());
+	
+	if(BL_BOOT_REQUEST_MAGIC == BL_BOOT_REQUEST_REGISTER)
+	{
+		//one shot, the next reset starts the application again
+		BL_BOOT_REQUEST_REGISTER = 0;
+		Stay_Reason = "update requested by the application";
+	}
+	else if(BL_BOOT_BUTTON_PRESSED == HAL_GPIO_ReadPin(BL_BOOT_BUTTON_PORT, BL_BOOT_BUTTON_PIN))
+	{
+		Stay_Reason = "button held";
+	}
+	else if(BL_SLOT_NONE == (Boot_Slot = BL_Slot_Select()))
+	{
+		Stay_Reason = "no valid application";
+	}
+	else if((0 == Handed_Off) && (BL_BOOT_UPDATE_WINDOW > 0) && BL_Boot_Host_Activity(BL_BOOT_UPDATE_WINDOW))
+	{
+		Stay_Reason = "host active";
+	}
+	else
+	{
+		BL_Slot_Count_Boot_Attempt();
+		bootloader_jump_to_user_app(BL_Slot_Address(Boot_Slot));
+	}
+	
+#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
+	BootLoader_Print_Message("Staying in the bootloader: %s \r\n", Stay_Reason);
+	if(Last_Latency > 0)
+	{
+		BootLoader_Print_Message("Last application start %d us after reset \r\n", Last_Latency);
+	}
+#endif
+}
+
+/* Any byte from the host within Timeout ms, left in the receiver for the first frame */
+static uint8_t BL_Boot_Host_Activity(uint32_t Timeout)
+{
+	uint32_t Start_Tick = HAL_GetTick();
+	uint8_t Host_Active = 0;
+	
+#if (BL_HOST_RX_METHOD == BL_HOST_RX_DMA)
+	BL_Host_Rx_Start();
+#endif
+	while((0 == Host_Active) && ((HAL_GetTick() - Start_Tick) < Timeout))
+	{
+#if (BL_HOST_RX_METHOD == BL_HOST_RX_DMA)
+		if(0 != BL_Host_Rx_Started)
+		{
+			Host_Active = (BL_Host_Rx_Available() > 0);
+		}
+		else
+#endif
+		{
+			Host_Active = (0 != __HAL_UART_GET_FLAG(BL_HOST_COMMUNICATION_UART, UART_FLAG_RXNE));
+		}
+	}
+	return Host_Active;
+}
 
 BL_Status BL_UART_Fetch_Host_Command(void)
 {
@@ -42,646 +364,2607 @@ BL_Status BL_UART_Fetch_Host_Command(void)
 	HAL_StatusTypeDef HAL_Status = HAL_ERROR;
 	
 	uint32_t DataLength;
-	//clear buffer to receive from Host
-	memset(BL_Host_Buffer,0,BL_HOST_BUFFER_RX_LENGTH);
+#if (BL_PROFILE == BL_PROFILE_ENABLE)
+	uint32_t Rx_Start_Cycles = 0;
+#endif
+#if (BL_HOST_RX_METHOD == BL_HOST_RX_DMA)
+	//whatever is waiting in the ring arrived while the previous frame was processed
+	uint32_t Overlapped_Length = BL_Host_Rx_Available();
 	
+	//report the background erase until the next frame comes in
+	do
+	{
+		BL_Erase_Poll();
+	}while((BL_ERASE_RUNNING == BL_Erase_State) && (0 == BL_Host_Rx_Available()));
+#else
+	//HAL_UART_Receive would hold the events back, the erase is finished first
+	BL_Erase_Wait();
+#endif
 	//Read the length of the command packet received from the Host
-	HAL_Status = HAL_UART_Receive(BL_HOST_COMMUNICATION_UART, BL_Host_Buffer, 1, HAL_MAX_DELAY);
+	HAL_Status = BL_Host_Receive(BL_Host_Buffer, 1);
+#if (BL_PROFILE == BL_PROFILE_ENABLE)
+	//the frame starts with its first byte, the time spent waiting for it is the host's
+	Rx_Start_Cycles = DWT->CYCCNT;
+	BL_Profile_Frame_Start();
+#endif
 	//check if u received or not
 	if(HAL_Status != HAL_OK)
 	{
 		Status = BL_NACK;
 	}
+	else if(BL_HOST_LARGE_FRAME_MARKER == BL_Host_Buffer[0])
+	{
+		//large frame, the length follows the marker on 2 bytes
+		BL_Host_Frame_Header = BL_HOST_LARGE_HEADER_LENGTH;
+		HAL_Status = BL_Host_Receive(&BL_Host_Buffer[1], 2);
+		DataLength = BL_Host_Buffer[1] | (BL_Host_Buffer[2] << 8);
+	}
 	else
 	{
 		//the lenght is in the first bit
+		BL_Host_Frame_Header = 1;
 		DataLength = BL_Host_Buffer[0];
+	}
 	
+	if(HAL_Status != HAL_OK)
+	{
+		if(0 != BL_Host_Rx_Flush_Overrun())
+		{
+			Bootloader_Send_NACK();
+		}
+		Status = BL_NACK;
+	}
+	else if((BL_HOST_LARGE_HEADER_LENGTH == BL_Host_Frame_Header) && 
+	        (DataLength > ((uint32_t)BL_Host_Large_Payload_Length + BL_HOST_LARGE_FIELDS_LENGTH)))
+	{
+		//not negotiated or longer than agreed, drop it to stay in step with the host
+		BL_Host_Discard(DataLength);
+		BL_Host_Rx_Flush_Overrun();
+#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
+		BootLoader_Print_Message("Large frame of %d bytes refused \r\n", DataLength);
+#endif
+		Bootloader_Send_NACK();
+		Status = BL_NACK;
+	}
+	else
+	{
+		BL_Host_Frame_Length = BL_Host_Frame_Header + DataLength;
+		
 		//after that get all bytes depending on length
-		HAL_Status = HAL_UART_Receive(BL_HOST_COMMUNICATION_UART, &BL_Host_Buffer[1], DataLength, HAL_MAX_DELAY);
+		HAL_Status = BL_Host_Receive(&BL_Host_Buffer[BL_Host_Frame_Header], DataLength);
 		if(HAL_Status != HAL_OK){
+			if(0 != BL_Host_Rx_Flush_Overrun())
+			{
+				Bootloader_Send_NACK();
+			}
 			Status = BL_NACK;
 		}
 		else
 		{
-			switch(BL_Host_Buffer[1])
-			{
-				case CBL_GET_VER_CMD:
-					Bootloader_Get_Version(BL_Host_Buffer);
-					Status = BL_ACK;
-					break;
-				case CBL_GET_HELP_CMD:
-					Bootloader_Get_Help(BL_Host_Buffer);
-					Status = BL_ACK;
-					break;
-				case CBL_GET_CID_CMD:
-					Bootloader_Get_Chip_Identification_Number(BL_Host_Buffer);
-					Status = BL_ACK;
-					break;
-				case CBL_GET_RDP_STATUS_CMD:
-					Bootloader_Read_Protection_Level(BL_Host_Buffer);
-					Status = BL_ACK;
-					break;
-				case CBL_GO_TO_ADDR_CMD:
-					Bootloader_Jump_To_Address(BL_Host_Buffer);
-					Status = BL_ACK;
-					break;
-				case CBL_FLASH_ERASE_CMD:
-					Bootloader_Erase_Flash(BL_Host_Buffer);
-					Status = BL_ACK;
-					break;
-				case CBL_MEM_WRITE_CMD:
-					Bootloader_Memory_Write(BL_Host_Buffer);
-					Status = BL_ACK;
-					break;
-				default:
-					BootLoader_Print_Message("Invalid command code received from host !! \r\n");
-					break;
-			}
+#if (BL_HOST_RX_METHOD == BL_HOST_RX_DMA)
+			BL_Host_Rx_Frames++;
+			BL_Host_Rx_Total_Bytes += BL_Host_Frame_Length;
+			BL_Host_Rx_Overlapped_Bytes += (Overlapped_Length < BL_Host_Frame_Length) ? Overlapped_Length : BL_Host_Frame_Length;
+#endif
+#if (BL_PROFILE == BL_PROFILE_ENABLE)
+			BL_Profile_Add(BL_PROFILE_PHASE_RX, Rx_Start_Cycles);
+#endif
+			Status = Bootloader_Dispatch_Command(BL_Host_Buffer, DataLength);
+#if (BL_PROFILE == BL_PROFILE_ENABLE)
+			BL_Profile_Book(BL_Host_Buffer[BL_Host_Frame_Header]);
+#endif
 		}
 	}
 	return Status;
 }
 
 
-
-void BootLoader_Print_Message(char *format, ...)
-{
-	char message[100] = {0};
-	va_list List;
-	//Enables access to the variable arguments
-	va_start(List,format);
-	//Write formatted data from variable argument list to string 
-	vsprintf(message,format,List);
-	#if(BL_DEBUG_METHOD == BL_ENABLE_UART_DEBUG_MESSAGE) 
-	//Trasmit the formatted data through the defined UART
-	HAL_UART_Transmit(&huart2, (uint8_t *)message, sizeof(message), HAL_MAX_DELAY);
-	#endif
-	
-	#if(BL_DEBUG_METHOD == BL_ENABLE_SPI_DEBUG_MESSAGE) 
-	//Trasmit the formatted data through the defined SPI
-	#endif
-	
-	#if(BL_DEBUG_METHOD == BL_ENABLE_CAN_DEBUG_MESSAGE) 
-	//Trasmit the formatted data through the defined CAN
-	#endif
-	//Performs cleanup for an ap object
-	va_end(List);
-}
-
-static void Bootloader_Get_Version(uint8_t *Host_Buffer)
+/*
+ * The only place a frame is checked: command code, frame format, length and CRC.
+ * Command_Len counts the bytes from CMD to the end of the CRC.
+ */
+static BL_Status Bootloader_Dispatch_Command(uint8_t *Host_Buffer, uint32_t Command_Len)
 {
-	uint16_t HostPacket_Len = 0;
+	uint8_t Command = Host_Buffer[BL_Host_Frame_Header];
+	const BL_Command_Descriptor *Descriptor = NULL;
 	uint32_t Host_CRC = 0;
-	uint8_t BL_Version[4] = { CBL_VENDOR_ID, CBL_SW_MAJOR_VERSION, CBL_SW_MINOR_VERSION, CBL_SW_PATCH_VERSION };
-	
-#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
-	BootLoader_Print_Message("Read the bootloader version from the MCU \r\n");
+	uint8_t CRC_Status = CRC_VERIFICATION_FAILED;
+#if (BL_PROFILE == BL_PROFILE_ENABLE)
+	uint32_t Phase_Start_Cycles = 0;
+	uint32_t Nested_Cycles = 0;
 #endif
 	
-	//extract length of packet and CRC
-	HostPacket_Len = Host_Buffer[0] + 1;
-	Host_CRC = *((uint32_t *)((Host_Buffer + HostPacket_Len) - 4));
-	
-	//CRC calculation on received data
-	if(CRC_VERIFICATION_PASSED == Bootloader_CRC_Verify(&Host_Buffer[0] ,HostPacket_Len - 4 ,Host_CRC))
+	if((Command >= BL_COMMAND_FIRST) && (Command <= BL_COMMAND_LAST))
+	{
+		Descriptor = &Bootloader_Commands[Command - BL_COMMAND_FIRST];
+	}
+	if((NULL == Descriptor) || (NULL == Descriptor->Handler))
 	{
 #if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
-		BootLoader_Print_Message("CRC Verification Passed \r\n");
+		BootLoader_Print_Message("Invalid command code received from host !! \r\n");
 #endif
-		Bootloader_Send_ACK(4);
-		Bootloader_Send_Data_To_Host((uint8_t *)(&BL_Version[0]),4);//BL_Version also is corect
-		
-#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
-    BootLoader_Print_Message("Bootloader Ver. %d.%d.%d \r\n", BL_Version[1], BL_Version[2], BL_Version[3]);
-		//bootloader_jump_to_user_app(); for testing
-#endif  
+		Bootloader_Send_NACK();
+		return BL_NACK;
 	}
-	else
+	if(((BL_HOST_LARGE_HEADER_LENGTH == BL_Host_Frame_Header) && (0 == (Descriptor->Flags & BL_CMD_LARGE_FRAME))) ||
+	   (Command_Len < Descriptor->Min_Length) || (Command_Len > Descriptor->Max_Length))
 	{
 #if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
-	BootLoader_Print_Message("CRC Verification Failed \r\n");
-#endif		
+		BootLoader_Print_Message("Command 0x%X refused, frame of %d bytes \r\n", Command, BL_Host_Frame_Length);
+#endif
 		Bootloader_Send_NACK();
+		return BL_NACK;
 	}
 	
-}
-static void Bootloader_Get_Help(uint8_t *Host_Buffer)
-{
-	uint16_t HostPacket_Len = 0;
-	uint32_t Host_CRC = 0;
-	
-#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
-	BootLoader_Print_Message("Read the commands supported by this bootloader \r\n");
+	//the CRC closes the frame at any alignment
+	memcpy(&Host_CRC, &Host_Buffer[BL_Host_Frame_Length - CRC_TYPE_SIZE_BYTE], CRC_TYPE_SIZE_BYTE);
+#if (BL_PROFILE == BL_PROFILE_ENABLE)
+	Phase_Start_Cycles = DWT->CYCCNT;
 #endif
-	
-	//extract length of packet and CRC
-	HostPacket_Len = Host_Buffer[0] + 1;
-	Host_CRC = *((uint32_t *)((Host_Buffer + HostPacket_Len) - 4));
-	
-	//CRC calculation on received data
-	if(CRC_VERIFICATION_PASSED == Bootloader_CRC_Verify((uint8_t *)&Host_Buffer[0] ,HostPacket_Len - 4 ,Host_CRC))
+	CRC_Status = Bootloader_CRC_Verify(Host_Buffer, BL_Host_Frame_Length - CRC_TYPE_SIZE_BYTE, Host_CRC);
+#if (BL_PROFILE == BL_PROFILE_ENABLE)
+	BL_Profile_Add(BL_PROFILE_PHASE_CRC, Phase_Start_Cycles);
+#endif
+	if(CRC_VERIFICATION_PASSED != CRC_Status)
 	{
+		if(Descriptor->Flags & BL_CMD_WINDOWED)
+		{
 #if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
-		BootLoader_Print_Message("CRC Verification Passed \r\n");
+			BootLoader_Print_Message("CRC Verification Failed, request frame %d again \r\n", BL_Window_Expected_Seq);
 #endif
-		Bootloader_Send_ACK(4);
-		Bootloader_Send_Data_To_Host((uint8_t *)(&Bootloader_Supported_Commands[0]),12);
-	}
-	else
-	{
+			Bootloader_Send_Window_Reply(WINDOW_FRAME_RETRANSMIT, BL_Window_Expected_Seq);
+		}
+		else
+		{
 #if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
-	BootLoader_Print_Message("CRC Verification Failed \r\n");
-#endif		
-		
-		Bootloader_Send_NACK();
+			BootLoader_Print_Message("CRC Verification Failed \r\n");
+#endif
+			Bootloader_Send_NACK();
+		}
+		return BL_NACK;
 	}
-}
-static void Bootloader_Get_Chip_Identification_Number(uint8_t *Host_Buffer)
-{
-	uint16_t HostPacket_Len = 0;
-	uint32_t Host_CRC = 0;
-	uint16_t MCU_Device_ID = 0;
 	
-#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
-	BootLoader_Print_Message("Read MCU ID \r\n");
+#if (BL_PROFILE == BL_PROFILE_ENABLE)
+	//messages and replies of the handler are booked to their own phases
+	Phase_Start_Cycles = DWT->CYCCNT;
+	Nested_Cycles = BL_Profile_Frame_Cycles[BL_PROFILE_PHASE_PRINT] + BL_Profile_Frame_Cycles[BL_PROFILE_PHASE_TX];
 #endif
-	
-	//extract length of packet and CRC
-	HostPacket_Len = Host_Buffer[0] + 1;
-	Host_CRC = *((uint32_t *)((Host_Buffer + HostPacket_Len) - 4));
-	
-	//CRC calculation on received data
-	if(CRC_VERIFICATION_PASSED == Bootloader_CRC_Verify((uint8_t *)&Host_Buffer[0] ,HostPacket_Len - 4 ,Host_CRC))
+	if(0 == (Descriptor->Flags & BL_CMD_DURING_ERASE))
 	{
-#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
-		BootLoader_Print_Message("CRC Verification Passed \r\n");
-#endif
-		
-		//get MCU chip ID Number
-		MCU_Device_ID = ((uint16_t)((DBGMCU->IDCODE)& 0x00000FFF));
-		Bootloader_Send_ACK(2);
-		Bootloader_Send_Data_To_Host((uint8_t *)&MCU_Device_ID,2);
+		//the flash is busy, the following frames stay in the RX ring meanwhile
+		BL_Erase_Wait();
 	}
-	else
+	if(BL_REPLY_BY_HANDLER != Descriptor->Reply_Length)
 	{
-#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
-	BootLoader_Print_Message("CRC Verification Failed \r\n");
-#endif		
-		
-		Bootloader_Send_NACK();
+		Bootloader_Send_ACK(Descriptor->Reply_Length);
 	}
-	
+	Descriptor->Handler(Host_Buffer);
+#if (BL_PROFILE == BL_PROFILE_ENABLE)
+	Nested_Cycles = BL_Profile_Frame_Cycles[BL_PROFILE_PHASE_PRINT] + BL_Profile_Frame_Cycles[BL_PROFILE_PHASE_TX] - Nested_Cycles;
+	BL_Profile_Add(BL_PROFILE_PHASE_HANDLER, Phase_Start_Cycles + Nested_Cycles);
+#endif
+	return BL_ACK;
 }
-static void Bootloader_Read_Protection_Level(uint8_t *Host_Buffer)
+
+static HAL_StatusTypeDef BL_Host_Receive(uint8_t *pData, uint16_t Data_Len)
 {
-	uint16_t HostPacket_Len = 0;
-	uint32_t Host_CRC = 0;
-	uint8_t Protection_Level = 0;
-#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
-	BootLoader_Print_Message("Read FLASH Read Protection Out level \r\n");
-#endif
-	
-	//extract length of packet and CRC
-	HostPacket_Len = Host_Buffer[0] + 1;
-	Host_CRC = *((uint32_t *)((Host_Buffer + HostPacket_Len) - 4));
+	return BL_Host_Receive_Timeout(pData, Data_Len, HAL_MAX_DELAY);
+}
+
+static HAL_StatusTypeDef BL_Host_Receive_Timeout(uint8_t *pData, uint16_t Data_Len, uint32_t Timeout)
+{
+	HAL_StatusTypeDef HAL_Status = HAL_ERROR;
+#if (BL_HOST_RX_METHOD == BL_HOST_RX_BLOCKING)
+	HAL_Status = HAL_UART_Receive(BL_HOST_COMMUNICATION_UART, pData, Data_Len, Timeout);
+#elif (BL_HOST_RX_METHOD == BL_HOST_RX_DMA)
+	uint32_t Counter = 0;
+	uint32_t Start_Tick = HAL_GetTick();
 	
-	//CRC calculation on received data
-	if(CRC_VERIFICATION_PASSED == Bootloader_CRC_Verify((uint8_t *)&Host_Buffer[0] ,HostPacket_Len - 4 ,Host_CRC))
+	if(NULL == (BL_HOST_COMMUNICATION_UART)->hdmarx)
 	{
-#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
-		BootLoader_Print_Message("CRC Verification Passed \r\n");
-#endif
-		Bootloader_Send_ACK(1);
-		
-		Protection_Level = CBL_STM32F407_Get_RDP_Level();
-		
-		Bootloader_Send_Data_To_Host((uint8_t *)&Protection_Level, 1);
+		//no USART3_RX DMA stream linked, receive like BL_HOST_RX_BLOCKING
+		return HAL_UART_Receive(BL_HOST_COMMUNICATION_UART, pData, Data_Len, Timeout);
 	}
-	else
+	if(0 == BL_Host_Rx_Started)
 	{
-#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
-	BootLoader_Print_Message("CRC Verification Failed \r\n");
-#endif		
-		
-		Bootloader_Send_NACK();
+		BL_Host_Rx_Start();
 	}
-}
-static void Bootloader_Jump_To_Address(uint8_t *Host_Buffer)
-{
-	uint16_t HostPacket_Len = 0;
-  uint32_t Host_CRC = 0;
-	uint32_t Jump_Address = 0;
-	uint8_t Address_Verification = ADDRESS_IS_INVALID;
-#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
-	BootLoader_Print_Message("Jump bootloader to specified address \r\n");
-#endif
 	
-	//extract length of packet and CRC
-	HostPacket_Len = Host_Buffer[0] + 1;
-	Host_CRC = *((uint32_t *)((Host_Buffer + HostPacket_Len) - 4));
-	
-	if(CRC_VERIFICATION_PASSED == Bootloader_CRC_Verify((uint8_t *)&Host_Buffer[0] ,HostPacket_Len - 4 ,Host_CRC))
+	//wait for the DMA to deliver the requested bytes
+	while(BL_Host_Rx_Available() < Data_Len)
 	{
-#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
-		BootLoader_Print_Message("CRC Verification Passed \r\n");
-#endif
-		
-		Bootloader_Send_ACK(1);
-		//extract Address From HOST Packet
-		Jump_Address = *((uint32_t *)&Host_Buffer[2]);
-		
-		//Verify the Extracted address
-		Address_Verification = Host_Address_Verification(Jump_Address);
-		if(ADDRESS_IS_VALID == Address_Verification)
+		if(0 != BL_Host_Rx_Overrun)
 		{
-#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
-			BootLoader_Print_Message("Address verification succeeded \r\n");
-#endif
-			Bootloader_Send_Data_To_Host((uint8_t *)&Address_Verification, 1);
-			//Get jumping ADDRESS_IS_INVALID and add 1 for Tbit
-			Jump_Ptr JumpAddress = (Jump_Ptr)(Jump_Address + 1);
-#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
-			BootLoader_Print_Message("Jump to : 0x%X \r\n", Jump_Address);
-#endif
-			JumpAddress();
+			//the ring no longer holds the bytes in order
+			return HAL_ERROR;
 		}
-		else
+		if(BL_Host_Rx_Line_Idle && (0 == BL_Host_Rx_Available()))
 		{
-			// Report address verification failed
-			Bootloader_Send_Data_To_Host((uint8_t *)&Address_Verification, 1);
+			//the host stopped sending, a good moment for the statistics
+			BL_Host_Rx_Line_Idle = 0;
+			BL_Host_Rx_Report_Overlap();
+		}
+		if((HAL_MAX_DELAY != Timeout) && ((HAL_GetTick() - Start_Tick) >= Timeout))
+		{
+			//what arrived so far stays in the ring
+			return HAL_TIMEOUT;
 		}
 	}
-	else
+	
+	for(Counter = 0; Counter < Data_Len; Counter++)
 	{
-#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
-	BootLoader_Print_Message("CRC Verification Failed \r\n");
-#endif		
-		
-		Bootloader_Send_NACK();
+		pData[Counter] = BL_Host_Rx_Ring[BL_Host_Rx_Read_Index];
+		BL_Host_Rx_Read_Index++;
+		if(BL_HOST_RX_RING_LENGTH == BL_Host_Rx_Read_Index)
+		{
+			BL_Host_Rx_Read_Index = 0;
+			BL_Host_Rx_Read_Wraps++;
+		}
 	}
+	HAL_Status = HAL_OK;
+#endif
+	return HAL_Status;
+}
+
+/* 16x oversampling: BRR = PCLK1 / Baud in 1/16 steps, the rounding error must stay small */
+static uint8_t BL_Host_Baud_Rate_Verification(uint32_t Baud_Rate)
+{
+	uint32_t PCLK1_Frequency = HAL_RCC_GetPCLK1Freq();
+	uint32_t Divider = 0;
+	uint32_t Generated_Rate = 0;
+	uint32_t Rate_Error = 0;
 	
+	if((Baud_Rate < BL_HOST_BAUD_MIN) || (Baud_Rate > (PCLK1_Frequency / 16)))
+	{
+		return BAUD_CHANGE_REJECTED;
+	}
+	Divider = (PCLK1_Frequency + (Baud_Rate / 2)) / Baud_Rate;
+	Generated_Rate = PCLK1_Frequency / Divider;
+	Rate_Error = (Generated_Rate > Baud_Rate) ? (Generated_Rate - Baud_Rate) : (Baud_Rate - Generated_Rate);
+	return (((uint64_t)Rate_Error * 1000) <= ((uint64_t)Baud_Rate * BL_HOST_BAUD_MAX_ERROR)) ? BAUD_CHANGE_ACCEPTED : BAUD_CHANGE_REJECTED;
 }
-static void Bootloader_Erase_Flash(uint8_t *Host_Buffer)
+
+static void BL_Host_Set_Baud_Rate(uint32_t Baud_Rate)
 {
-	uint16_t HostPacket_Len = 0;
-	uint32_t Host_CRC = 0;
-	uint8_t Erase_Status = 0;
+	UART_HandleTypeDef *Host_UART = BL_HOST_COMMUNICATION_UART;
 	
-#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
-	BootLoader_Print_Message("erase or sector erase of the user flash \r\n");
+#if (BL_HOST_RX_METHOD == BL_HOST_RX_DMA)
+	//the ring restarts empty with the next receive
+	HAL_UART_DMAStop(Host_UART);
+	BL_Host_Rx_Started = 0;
 #endif
+	//with the handle already initialized HAL_UART_Init only reprograms BRR
+	Host_UART->Init.BaudRate = Baud_Rate;
+	HAL_UART_Init(Host_UART);
+}
+
+static void BL_Host_Discard(uint32_t Data_Len)
+{
+	uint32_t Chunk_Len = 0;
 	
-	//extract length of packet and CRC
-	HostPacket_Len = Host_Buffer[0] + 1;
-	Host_CRC = *((uint32_t *)((Host_Buffer + HostPacket_Len) - 4));
+	while(Data_Len > 0)
+	{
+		Chunk_Len = (Data_Len < BL_HOST_BUFFER_RX_LENGTH) ? Data_Len : BL_HOST_BUFFER_RX_LENGTH;
+		BL_Host_Receive(BL_Host_Buffer, Chunk_Len);
+		Data_Len -= Chunk_Len;
+	}
+}
+
+/*
+ * After an overrun the ring restarts empty until the line stays quiet for BL_HOST_RX_FLUSH_IDLE_MS,
+ * the rest of the frames in flight is dropped with it. Returns 1 when it flushed, the caller NACKs.
+ */
+static uint8_t BL_Host_Rx_Flush_Overrun(void)
+{
+#if (BL_HOST_RX_METHOD == BL_HOST_RX_DMA)
+	if(0 == BL_Host_Rx_Overrun)
+	{
+		return 0;
+	}
+#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
+	BootLoader_Print_Message("Host RX overrun, receive ring flushed \r\n");
+#endif
+	do
+	{
+		HAL_UART_DMAStop(BL_HOST_COMMUNICATION_UART);
+		BL_Host_Rx_Started = 0;
+		BL_Host_Rx_Start();
+		HAL_Delay(BL_HOST_RX_FLUSH_IDLE_MS);
+	}while((0 != BL_Host_Rx_Available()) || (0 != BL_Host_Rx_Overrun));
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+/*
+ * Locate the payload of a memory write frame, Payload_Len_Offset is the position of the
+ * payload length field after CMD. The field is 1 byte in legacy frames and 2 bytes in
+ * large frames. Returns NULL when the payload does not end right before the CRC.
+ */
+static uint8_t *BL_Host_Frame_Payload(uint8_t *Host_Buffer, uint8_t Payload_Len_Offset, uint16_t *Payload_Len)
+{
+	uint8_t *Length_Field = &Host_Buffer[BL_Host_Frame_Header + Payload_Len_Offset];
+	uint8_t *Payload = NULL;
+	
+	if(BL_HOST_LARGE_HEADER_LENGTH == BL_Host_Frame_Header)
+	{
+		*Payload_Len = Length_Field[0] | (Length_Field[1] << 8);
+		Payload = &Length_Field[2];
+	}
+	else
+	{
+		*Payload_Len = Length_Field[0];
+		Payload = &Length_Field[1];
+	}
+	if(((Payload - Host_Buffer) + *Payload_Len + CRC_TYPE_SIZE_BYTE) != BL_Host_Frame_Length)
+	{
+		Payload = NULL;
+	}
+	return Payload;
+}
+
+#if (BL_HOST_RX_METHOD == BL_HOST_RX_DMA)
+static void BL_Host_Rx_Start(void)
+{
+	UART_HandleTypeDef *Host_UART = BL_HOST_COMMUNICATION_UART;
+	
+	if(NULL == Host_UART->hdmarx)
+	{
+		//DMA not set up in CubeMX, BL_Host_Receive falls back to blocking reception
+		return;
+	}
+	//the ring is reused forever, make sure the stream wraps around
+	Host_UART->hdmarx->Init.Mode = DMA_CIRCULAR;
+	HAL_DMA_Init(Host_UART->hdmarx);
+	
+	BL_Host_Rx_Read_Index = 0;
+	BL_Host_Rx_Read_Wraps = 0;
+	BL_Host_Rx_Write_Wraps = 0;
+	BL_Host_Rx_Overrun = 0;
+	if(HAL_OK == HAL_UARTEx_ReceiveToIdle_DMA(Host_UART, BL_Host_Rx_Ring, BL_HOST_RX_RING_LENGTH))
+	{
+		BL_Host_Rx_Started = 1;
+	}
+}
+
+/* Unread bytes in the ring, 0 once it overran */
+static uint32_t BL_Host_Rx_Available(void)
+{
+	UART_HandleTypeDef *Host_UART = BL_HOST_COMMUNICATION_UART;
+	uint32_t Write_Wraps = 0;
+	uint32_t Write_Index = 0;
+	uint32_t Fill = 0;
+	
+	if((0 == BL_Host_Rx_Started) || (0 != BL_Host_Rx_Overrun))
+	{
+		return 0;
+	}
+	//the wraps first, a wrap in between shows up in the index
+	Write_Wraps = BL_Host_Rx_Write_Wraps;
+	//NDTR counts down the bytes left until the DMA wraps to the start of the ring
+	Write_Index = (BL_HOST_RX_RING_LENGTH - __HAL_DMA_GET_COUNTER(Host_UART->hdmarx)) % BL_HOST_RX_RING_LENGTH;
+	if((int32_t)(Write_Wraps - BL_Host_Rx_Read_Wraps) < 0)
+	{
+		//the reader already followed the DMA around the ring
+		Write_Wraps = BL_Host_Rx_Read_Wraps;
+	}
+	if((Write_Wraps == BL_Host_Rx_Read_Wraps) && (Write_Index < BL_Host_Rx_Read_Index))
+	{
+		//the DMA wrapped, its transfer complete event is not served yet
+		Write_Wraps++;
+	}
+	Fill = ((Write_Wraps - BL_Host_Rx_Read_Wraps) * BL_HOST_RX_RING_LENGTH) + Write_Index - BL_Host_Rx_Read_Index;
+	if(Fill > BL_HOST_RX_RING_LENGTH)
+	{
+		BL_Host_Rx_Overrun = 1;
+		Fill = 0;
+	}
+	return Fill;
+}
+
+static void BL_Host_Rx_Report_Overlap(void)
+{
+#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
+	if(BL_Host_Rx_Total_Bytes > 0)
+	{
+		BootLoader_Print_Message("RX overlap: %d frames, %d of %d bytes received while busy (%d%%) \r\n",
+		                         BL_Host_Rx_Frames, BL_Host_Rx_Overlapped_Bytes, BL_Host_Rx_Total_Bytes,
+		                         (BL_Host_Rx_Overlapped_Bytes * 100) / BL_Host_Rx_Total_Bytes);
+	}
+#endif
+	BL_Host_Rx_Frames = 0;
+	BL_Host_Rx_Overlapped_Bytes = 0;
+	BL_Host_Rx_Total_Bytes = 0;
+}
+
+void HAL_UARTEx_RxEventCallback(UART_HandleTypeDef *huart, uint16_t Size)
+{
+	//raised on idle line, half and full ring, the line is idle when the DMA stopped short of those
+	if((BL_HOST_COMMUNICATION_UART == huart) && (Size != (BL_HOST_RX_RING_LENGTH / 2)) && (Size != BL_HOST_RX_RING_LENGTH))
+	{
+		BL_Host_Rx_Line_Idle = 1;
+	}
+	else if((BL_HOST_COMMUNICATION_UART == huart) && (BL_HOST_RX_RING_LENGTH == Size))
+	{
+		BL_Host_Rx_Write_Wraps++;
+	}
+}
+
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart)
+{
+	//an overrun, framing or noise error stops the DMA reception, the next receive flushes and restarts it
+	if(BL_HOST_COMMUNICATION_UART == huart)
+	{
+		BL_Host_Rx_Overrun = 1;
+	}
+}
+#endif
+
+void BootLoader_Print_Message(char *format, ...)
+{
+	va_list List;
+#if (BL_PROFILE == BL_PROFILE_ENABLE)
+	uint32_t Print_Start_Cycles = DWT->CYCCNT;
+#endif
+	//Enables access to the variable arguments
+	va_start(List,format);
+	#if(BL_DEBUG_METHOD == BL_ENABLE_UART_DEBUG_MESSAGE) 
+	//Queue the message for the defined UART, never wait for the line
+	if((0 != BL_Log_Dropped) && BL_Log_Record_Args(BL_Log_Dropped_Format, BL_Log_Dropped))
+	{
+		BL_Log_Dropped = 0;
+	}
+	if(0 == BL_Log_Record(format, List))
+	{
+		BL_Log_Dropped++;
+	}
+	#endif
+	
+	#if(BL_DEBUG_METHOD == BL_ENABLE_SPI_DEBUG_MESSAGE) 
+	//Trasmit the formatted data through the defined SPI
+	#endif
+	
+	#if(BL_DEBUG_METHOD == BL_ENABLE_CAN_DEBUG_MESSAGE) 
+	//Trasmit the formatted data through the defined CAN
+	#endif
+	//Performs cleanup for an ap object
+	va_end(List);
+#if (BL_PROFILE == BL_PROFILE_ENABLE)
+	BL_Profile_Add(BL_PROFILE_PHASE_PRINT, Print_Start_Cycles);
+#endif
+}
+
+#if (BL_DEBUG_METHOD == BL_ENABLE_UART_DEBUG_MESSAGE)
+static uint8_t BL_Log_Record(const char *format, va_list List)
+{
+#if (BL_LOG_FORMAT == BL_LOG_FORMAT_TEXT)
+	char Message[BL_LOG_MESSAGE_LENGTH];
+	int Message_Len = vsnprintf(Message, sizeof(Message), format, List);
+	
+	if(Message_Len <= 0)
+	{
+		return 1;
+	}
+	//a truncated message still goes out with what fitted
+	return BL_Log_Enqueue((uint8_t *)Message, ((uint32_t)Message_Len < sizeof(Message)) ? (uint32_t)Message_Len : (sizeof(Message) - 1));
+#elif (BL_LOG_FORMAT == BL_LOG_FORMAT_TOKEN)
+	uint8_t Record[BL_LOG_MESSAGE_LENGTH];
+	uint32_t Record_Len = BL_LOG_TOKEN_HEADER_LENGTH;
+	uint32_t Format_Address = (uint32_t)format;
+	uint32_t Argument = 0;
+	const char *String_Argument = NULL;
+	uint32_t String_Len = 0;
+	
+	Record[0] = BL_LOG_TOKEN_SYNC;
+	memcpy(&Record[1], &Format_Address, 4);
+	//one argument per conversion, flags, width and length modifiers are left to the host
+	for(const char *Format_Char = format; '\0' != *Format_Char; Format_Char++)
+	{
+		if('%' != *Format_Char)
+		{
+			continue;
+		}
+		Format_Char++;
+		while(('\0' != *Format_Char) && (NULL != strchr("-+ #0123456789.lh", *Format_Char)))
+		{
+			Format_Char++;
+		}
+		if('\0' == *Format_Char)
+		{
+			break;
+		}
+		else if('%' == *Format_Char)
+		{
+			continue;
+		}
+		else if('s' == *Format_Char)
+		{
+			String_Argument = va_arg(List, const char *);
+			String_Len = strnlen(String_Argument, BL_LOG_TOKEN_STRING_LENGTH);
+			if((Record_Len + 1 + String_Len) > sizeof(Record))
+			{
+				break;
+			}
+			Record[Record_Len] = (uint8_t)String_Len;
+			memcpy(&Record[Record_Len + 1], String_Argument, String_Len);
+			Record_Len += 1 + String_Len;
+		}
+		else
+		{
+			Argument = va_arg(List, uint32_t);
+			if((Record_Len + 4) > sizeof(Record))
+			{
+				break;
+			}
+			memcpy(&Record[Record_Len], &Argument, 4);
+			Record_Len += 4;
+		}
+	}
+	Record[5] = (uint8_t)(Record_Len - BL_LOG_TOKEN_HEADER_LENGTH);
+	return BL_Log_Enqueue(Record, Record_Len);
+#endif
+}
+
+static uint8_t BL_Log_Record_Args(const char *format, ...)
+{
+	uint8_t Queued = 0;
+	va_list List;
+	va_start(List, format);
+	Queued = BL_Log_Record(format, List);
+	va_end(List);
+	return Queued;
+}
+
+/* All or nothing, one byte of the ring stays free to tell full from empty */
+static uint8_t BL_Log_Enqueue(const uint8_t *pData, uint32_t Data_Len)
+{
+	uint32_t Primask = __get_PRIMASK();
+	uint32_t Free_Space = 0;
+	uint32_t First_Part = 0;
+	
+	if(NULL == (BL_DEBUG_START)->hdmatx)
+	{
+		//no USART2_TX DMA stream linked, the caller waits for the line after all, never with the interrupts masked
+		return (HAL_OK == HAL_UART_Transmit(BL_DEBUG_START, (uint8_t *)pData, (uint16_t)Data_Len, HAL_MAX_DELAY)) ? 1 : 0;
+	}
+	//the transfer complete interrupt moves the tail and starts the next transfer
+	__disable_irq();
+	Free_Space = (BL_Log_Tail + BL_LOG_RING_LENGTH - BL_Log_Head - 1) % BL_LOG_RING_LENGTH;
+	if(Data_Len > Free_Space)
+	{
+		__set_PRIMASK(Primask);
+		return 0;
+	}
+	First_Part = BL_LOG_RING_LENGTH - BL_Log_Head;
+	if(First_Part > Data_Len)
+	{
+		First_Part = Data_Len;
+	}
+	memcpy(&BL_Log_Ring[BL_Log_Head], pData, First_Part);
+	memcpy(&BL_Log_Ring[0], &pData[First_Part], Data_Len - First_Part);
+	BL_Log_Head = (BL_Log_Head + Data_Len) % BL_LOG_RING_LENGTH;
+	if(0 == BL_Log_In_Flight)
+	{
+		BL_Log_Start_Transfer();
+	}
+	__set_PRIMASK(Primask);
+	return 1;
+}
+
+/* Called with the interrupts masked or from the transfer complete interrupt */
+static void BL_Log_Start_Transfer(void)
+{
+	uint32_t Head = BL_Log_Head;
+	uint32_t Transfer_Len = 0;
+	
+	if(Head == BL_Log_Tail)
+	{
+		return;
+	}
+	//up to the head, or up to the end of the ring when the data wraps
+	Transfer_Len = (Head > BL_Log_Tail) ? (Head - BL_Log_Tail) : (BL_LOG_RING_LENGTH - BL_Log_Tail);
+	BL_Log_In_Flight = Transfer_Len;
+	if(HAL_OK != HAL_UART_Transmit_DMA(BL_DEBUG_START, &BL_Log_Ring[BL_Log_Tail], (uint16_t)Transfer_Len))
+	{
+		BL_Log_In_Flight = 0;
+	}
+}
+
+/* Lets the queued messages out before the CPU leaves the bootloader */
+static void BL_Log_Flush(void)
+{
+	uint32_t Start_Tick = HAL_GetTick();
+	
+	while(((BL_Log_Head != BL_Log_Tail) || (0 != BL_Log_In_Flight)) && ((HAL_GetTick() - Start_Tick) < BL_LOG_FLUSH_TIMEOUT))
+	{
+	}
+}
+
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart)
+{
+	if(BL_DEBUG_START == huart)
+	{
+		BL_Log_Tail = (BL_Log_Tail + BL_Log_In_Flight) % BL_LOG_RING_LENGTH;
+		BL_Log_In_Flight = 0;
+		BL_Log_Start_Transfer();
+	}
+}
+#endif
+
+static void Bootloader_Get_Version(uint8_t *Host_Buffer)
+{
+	uint8_t BL_Version[4] = { CBL_VENDOR_ID, CBL_SW_MAJOR_VERSION, CBL_SW_MINOR_VERSION, CBL_SW_PATCH_VERSION };
+	
+	(void)Host_Buffer;
+#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
+	BootLoader_Print_Message("Read the bootloader version from the MCU \r\n");
+#endif
+	
+	Bootloader_Send_Data_To_Host((uint8_t *)(&BL_Version[0]),4);//BL_Version also is corect
+	
+#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
+    BootLoader_Print_Message("Bootloader Ver. %d.%d.%d \r\n", BL_Version[1], BL_Version[2], BL_Version[3]);
+	//bootloader_jump_to_user_app(); for testing
+#endif  
+	
+}
+static void Bootloader_Get_Help(uint8_t *Host_Buffer)
+{
+	(void)Host_Buffer;
+#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
+	BootLoader_Print_Message("Read the commands supported by this bootloader \r\n");
+#endif
+	
+	Bootloader_Send_Data_To_Host((uint8_t *)(&Bootloader_Supported_Commands[0]),sizeof(Bootloader_Supported_Commands));
+}
+static void Bootloader_Get_Chip_Identification_Number(uint8_t *Host_Buffer)
+{
+	uint16_t MCU_Device_ID = 0;
+	
+	(void)Host_Buffer;
+#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
+	BootLoader_Print_Message("Read MCU ID \r\n");
+#endif
+	
+	//get MCU chip ID Number
+	MCU_Device_ID = ((uint16_t)((DBGMCU->IDCODE)& 0x00000FFF));
+	Bootloader_Send_Data_To_Host((uint8_t *)&MCU_Device_ID,2);
+	
+}
+static void Bootloader_Read_Protection_Level(uint8_t *Host_Buffer)
+{
+	uint8_t Protection_Level = 0;
+	
+	(void)Host_Buffer;
+#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
+	BootLoader_Print_Message("Read FLASH Read Protection Out level \r\n");
+#endif
+	
+	Protection_Level = CBL_STM32F407_Get_RDP_Level();
+	
+	Bootloader_Send_Data_To_Host((uint8_t *)&Protection_Level, 1);
+}
+static void Bootloader_Jump_To_Address(uint8_t *Host_Buffer)
+{
+	uint32_t Jump_Address = 0;
+	uint8_t Address_Verification = ADDRESS_IS_INVALID;
+#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
+	BootLoader_Print_Message("Jump bootloader to specified address \r\n");
+#endif
+	
+	//extract Address From HOST Packet
+	memcpy(&Jump_Address, &Host_Buffer[2], 4);
+	
+	//Verify the Extracted address
+	Address_Verification = Host_Address_Verification(Jump_Address);
+	if(ADDRESS_IS_VALID == Address_Verification)
+	{
+#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
+		BootLoader_Print_Message("Address verification succeeded \r\n");
+#endif
+		Bootloader_Send_Data_To_Host((uint8_t *)&Address_Verification, 1);
+		//Get jumping ADDRESS_IS_INVALID and add 1 for Tbit
+		Jump_Ptr JumpAddress = (Jump_Ptr)(uintptr_t)(Jump_Address + 1);
+#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
+		BootLoader_Print_Message("Jump to : 0x%X \r\n", Jump_Address);
+#endif
+#if (BL_DEBUG_METHOD == BL_ENABLE_UART_DEBUG_MESSAGE)
+		BL_Log_Flush();
+#endif
+		JumpAddress();
+	}
+	else
+	{
+		// Report address verification failed
+		Bootloader_Send_Data_To_Host((uint8_t *)&Address_Verification, 1);
+	}
+	
+}
+
+/*
+ * Frame: Len | CMD | Address(4) | CRC(4)
+ * Starts the image loaded at Address in RAM like an application, it never returns when the image is valid.
+ */
+static void Bootloader_Run_RAM_Image(uint8_t *Host_Buffer)
+{
+	uint32_t Image_Address = 0;
+	uint8_t Image_Verification = IMAGE_IS_INVALID;
+	
+	memcpy(&Image_Address, &Host_Buffer[2], 4);
+	if((Image_Address >= BL_RAM_IMAGE_BASE) && (Image_Address < BL_RAM_IMAGE_END) &&
+	   (0 == (Image_Address & (BL_RAM_IMAGE_VTOR_ALIGN - 1))))
+	{
+		Image_Verification = Bootloader_Image_Verification(Image_Address, BL_RAM_IMAGE_END - Image_Address);
+	}
+	Bootloader_Send_Data_To_Host(&Image_Verification, 1);
+	if(IMAGE_IS_VALID == Image_Verification)
+	{
+#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
+		BootLoader_Print_Message("Run the RAM image at 0x%X \r\n", Image_Address);
+#endif
+		bootloader_jump_to_user_app(Image_Address);
+	}
+	else
+	{
+#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
+		BootLoader_Print_Message("No valid RAM image at 0x%X \r\n", Image_Address);
+#endif
+	}
+}
+static void Bootloader_Erase_Flash(uint8_t *Host_Buffer)
+{
+	uint8_t Erase_Status = 0;
+	
+#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
+	BootLoader_Print_Message("erase or sector erase of the user flash \r\n");
+#endif
+	
+	//perform the erase
+	Erase_Status = Host_Erase_Verification(Host_Buffer[2]);
+	if(VALID_SECTOR_NUMBER == Erase_Status)
+	{
+		Erase_Status = Perform_Flash_Erase(Host_Buffer[2],Host_Buffer[3]);
+	}
+	
+	if(SUCCESSFUL_ERASE == Erase_Status)
+	{
+		Bootloader_Send_Data_To_Host((uint8_t *)&Erase_Status, 1);
+#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
+		BootLoader_Print_Message("Successful Erase \r\n");
+#endif
+	}
+	else
+	{
+		Bootloader_Send_Data_To_Host((uint8_t *)&Erase_Status, 1);
+#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
+		BootLoader_Print_Message("Erase request failed !!\r\n");
+#endif
+	}
+}
+
+/*
+ * Frame: Len | CMD | Sector | Count | CRC(4)
+ * Starts the erase and answers right away, the sectors are reported by BL_Erase_Poll.
+ */
+static void Bootloader_Erase_Flash_Async(uint8_t *Host_Buffer)
+{
+	FLASH_EraseInitTypeDef Erase;
+	uint8_t Erase_Status = INVALID_SECTOR_NUMBER;
+	
+#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
+	BootLoader_Print_Message("Erase in the background \r\n");
+#endif
+	if(BL_ERASE_RUNNING == BL_Erase_State)
+	{
+		Erase_Status = ERASE_ASYNC_BUSY;
+	}
+	else if((VALID_SECTOR_NUMBER == Host_Erase_Verification(Host_Buffer[2])) &&
+	        (VALID_SECTOR_NUMBER == Flash_Erase_Setup(Host_Buffer[2], Host_Buffer[3], &Erase)))
+	{
+		//the end of the previous erase is reported first
+		BL_Erase_Poll();
+		
+		if(FLASH_TYPEERASE_MASSERASE == Erase.TypeErase)
+		{
+			BL_Erase_First_Sector = CBL_FLASH_MASS_ERASE;
+			BL_Erase_Sectors_Total = 1;
+		}
+		else
+		{
+			BL_Erase_First_Sector = (uint8_t)Erase.Sector;
+			BL_Erase_Sectors_Total = (uint8_t)Erase.NbSectors;
+		}
+		BL_Erase_Sectors_Done = 0;
+		BL_Erase_Sectors_Reported = 0;
+		BL_Erase_Start_Tick = HAL_GetTick();
+		BL_Erase_End_Tick = BL_Erase_Start_Tick;
+		BL_Erase_Sector_Tick = BL_Erase_Start_Tick;
+		BL_Erase_State = BL_ERASE_RUNNING;
+		BL_Erase_Unlocked = 1;
+		
+		HAL_FLASH_Unlock();
+		if(HAL_OK == HAL_FLASHEx_Erase_IT(&Erase))
+		{
+			Erase_Status = VALID_SECTOR_NUMBER;
+		}
+		else
+		{
+			BL_Erase_State = BL_ERASE_FAILED;
+			BL_Erase_Unlocked = 0;
+			HAL_FLASH_Lock();
+			Erase_Status = UNSUCCESSFUL_ERASE;
+		}
+	}
+	Bootloader_Send_Data_To_Host(&Erase_Status, 1);
+}
+
+/*
+ * Frame: Len | CMD | CRC(4)
+ * Reply: State | Sector | Sectors_Done | Sectors_Total | Elapsed_ms(4)
+ * Also the keepalive of the host while it waits for the erase.
+ */
+static void Bootloader_Erase_Status(uint8_t *Host_Buffer)
+{
+	uint8_t Status_Reply[ERASE_STATUS_REPLY_LENGTH];
+	uint8_t State = BL_Erase_State;
+	uint8_t Sectors_Done = BL_Erase_Sectors_Done;
+	uint32_t Elapsed = 0;
+	
+	(void)Host_Buffer;
+	if(BL_ERASE_RUNNING == State)
+	{
+		Elapsed = HAL_GetTick() - BL_Erase_Start_Tick;
+	}
+	else
+	{
+		Elapsed = BL_Erase_End_Tick - BL_Erase_Start_Tick;
+	}
+	Status_Reply[0] = State;
+	//sector under erase, or where the erase stopped
+	Status_Reply[1] = (CBL_FLASH_MASS_ERASE == BL_Erase_First_Sector) ? CBL_FLASH_MASS_ERASE : (BL_Erase_First_Sector + Sectors_Done);
+	Status_Reply[2] = Sectors_Done;
+	Status_Reply[3] = BL_Erase_Sectors_Total;
+	memcpy(&Status_Reply[4], &Elapsed, 4);
+	Bootloader_Send_Data_To_Host(Status_Reply, ERASE_STATUS_REPLY_LENGTH);
+}
+
+/*
+ * Frame: Len | CMD | CRC(4)
+ * Reply: Sector_Count | BL_Sector_Stats x Sector_Count from the backup SRAM, Program_Total_Cycles in ns
+ */
+static void Bootloader_Flash_Stats(uint8_t *Host_Buffer)
+{
+	uint8_t Sector_Count = CBL_FLASH_MAX_SECTOR_NUMBER;
+	BL_Sector_Stats Stats;
+	
+	(void)Host_Buffer;
+	Bootloader_Send_Long_ACK(FLASH_STATS_REPLY_LENGTH);
+	Bootloader_Send_Data_To_Host(&Sector_Count, 1);
+	for(uint8_t SectorNumber = 0; SectorNumber < CBL_FLASH_MAX_SECTOR_NUMBER; SectorNumber++)
+	{
+		Stats = BL_FLASH_STATS[SectorNumber];
+		Stats.Program_Total_Cycles = (Stats.Program_Total_Cycles * 1000U) / (SystemCoreClock / 1000000U);
+		Bootloader_Send_Data_To_Host((uint8_t *)&Stats, sizeof(BL_Sector_Stats));
+	}
+}
+
+#if (BL_PROFILE == BL_PROFILE_ENABLE)
+/*
+ * Frame: Len | CMD | Clear | CRC(4)
+ * Reply: Core_Clock(4) | Command_Count | per command with samples, CMD | Max_Cycles(4) | Buckets per phase
+ */
+static void Bootloader_Profile(uint8_t *Host_Buffer)
+{
+	uint8_t Clear = Host_Buffer[BL_Host_Frame_Header + 1];
+	uint8_t Reply[5] = {0};
+	uint8_t Command_Count = 0;
+	uint8_t Index = 0;
+	uint8_t Phase = 0;
+	uint8_t Command = 0;
+	
+	for(Index = 0; Index < BL_COMMAND_TABLE_LENGTH; Index++)
+	{
+		Command_Count += BL_Profile_Has_Samples(Index);
+	}
+	memcpy(&Reply[0], (const void *)&SystemCoreClock, 4);
+	Reply[4] = Command_Count;
+	Bootloader_Send_Long_ACK(5 + (Command_Count * BL_PROFILE_ENTRY_LENGTH));
+	Bootloader_Send_Data_To_Host(Reply, 5);
+	for(Index = 0; Index < BL_COMMAND_TABLE_LENGTH; Index++)
+	{
+		if(BL_Profile_Has_Samples(Index))
+		{
+			Command = BL_COMMAND_FIRST + Index;
+			Bootloader_Send_Data_To_Host(&Command, 1);
+			for(Phase = 0; Phase < BL_PROFILE_PHASES; Phase++)
+			{
+				Bootloader_Send_Data_To_Host((uint8_t *)&BL_Profile_Max_Cycles[Index][Phase], 4);
+				Bootloader_Send_Data_To_Host((uint8_t *)BL_Profile_Buckets[Index][Phase], sizeof(BL_Profile_Buckets[Index][Phase]));
+			}
+		}
+	}
+	if(0 != Clear)
+	{
+		//this frame is booked once it is done, it opens the next histograms
+		memset(BL_Profile_Buckets, 0, sizeof(BL_Profile_Buckets));
+		memset(BL_Profile_Max_Cycles, 0, sizeof(BL_Profile_Max_Cycles));
+	}
+}
+
+static void BL_Profile_Frame_Start(void)
+{
+	memset(BL_Profile_Frame_Cycles, 0, sizeof(BL_Profile_Frame_Cycles));
+}
+
+static void BL_Profile_Add(uint8_t Phase, uint32_t Start_Cycles)
+{
+	BL_Profile_Frame_Cycles[Phase] += DWT->CYCCNT - Start_Cycles;
+}
+
+/* Adds the phases of the frame just processed to the histograms of its command */
+static void BL_Profile_Book(uint8_t Command)
+{
+	uint8_t Phase = 0;
+	uint8_t Bucket = 0;
+	uint32_t Cycles = 0;
+	uint16_t *Count = NULL;
+	
+	if((Command < BL_COMMAND_FIRST) || (Command > BL_COMMAND_LAST))
+	{
+		return;
+	}
+	for(Phase = 0; Phase < BL_PROFILE_PHASES; Phase++)
+	{
+		Cycles = BL_Profile_Frame_Cycles[Phase];
+		if(0 == Cycles)
+		{
+			//the phase did not happen for this frame
+			continue;
+		}
+		//log2 of the cycles, counted from BL_PROFILE_FIRST_BUCKET_SHIFT
+		Bucket = 0;
+		while((Bucket < (BL_PROFILE_BUCKETS - 1)) && ((Cycles >> (BL_PROFILE_FIRST_BUCKET_SHIFT + Bucket)) > 0))
+		{
+			Bucket++;
+		}
+		Count = &BL_Profile_Buckets[Command - BL_COMMAND_FIRST][Phase][Bucket];
+		if(*Count < BL_PROFILE_COUNT_MAX)
+		{
+			(*Count)++;
+		}
+		if(Cycles > BL_Profile_Max_Cycles[Command - BL_COMMAND_FIRST][Phase])
+		{
+			BL_Profile_Max_Cycles[Command - BL_COMMAND_FIRST][Phase] = Cycles;
+		}
+	}
+}
+
+/* 1 once a frame of the command at Index was booked since the last clear */
+static uint8_t BL_Profile_Has_Samples(uint8_t Index)
+{
+	uint8_t Phase = 0;
+	
+	for(Phase = 0; Phase < BL_PROFILE_PHASES; Phase++)
+	{
+		if(0 != BL_Profile_Max_Cycles[Index][Phase])
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+#endif
+static void Bootloader_Memory_Write(uint8_t *Host_Buffer)
+{
+	uint32_t HOST_Address = 0;
+	uint16_t Payload_Len = 0;
+	uint8_t *Payload = NULL;
+	uint8_t Address_Verification = ADDRESS_IS_INVALID;
+	uint8_t Flash_Payload_Write_Status = FLASH_PAYLOAD_WRITE_FAILED;
+#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
+	BootLoader_Print_Message("Write data into different sections of the MCU \r\n");
+#endif
+	
+	//extracting Payload and Address need to Write on
+	memcpy(&HOST_Address, &Host_Buffer[BL_Host_Frame_Header + 1], 4);
+#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
+	BootLoader_Print_Message("HOST_Address = 0x%X \r\n", HOST_Address);
+#endif
+	Payload = BL_Host_Frame_Payload(Host_Buffer, 5, &Payload_Len);
+	
+	//check for valid address
+	Address_Verification = Host_Write_Verification(HOST_Address);
+	if((ADDRESS_IS_VALID == Address_Verification) && (NULL != Payload))
+	{
+		//write data to flash memory in specific address
+		Flash_Payload_Write_Status = Memory_Write_Payload(Payload,HOST_Address,Payload_Len);
+		if(FLASH_PAYLOAD_WRITE_PASSED == Flash_Payload_Write_Status)
+		{
+			Bootloader_Send_Data_To_Host((uint8_t *)&Flash_Payload_Write_Status, 1);
+#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
+			BootLoader_Print_Message("Payload Valid \r\n");
+#endif
+		}
+		else
+		{
+#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
+			BootLoader_Print_Message("Payload InValid \r\n");
+#endif
+			Bootloader_Send_Data_To_Host((uint8_t *)&Flash_Payload_Write_Status, 1);
+		}
+	}
+	else
+	{
+		Address_Verification = ADDRESS_IS_INVALID;
+		Bootloader_Send_Data_To_Host((uint8_t *)&Address_Verification, 1);
+	}
+}
+/*
+ * Frame: Len | CMD | Session | Seq(2) | Address(4) | Payload_Len | Payload | CRC(4)
+ * or the large frame 0xFF | Len(2) | CMD | Session | Seq(2) | Address(4) | Payload_Len(2) | Payload | CRC(4)
+ * The host keeps several frames in flight. Every frame is answered with a cumulative
+ * acknowledgement of the last frame written in order, or with a retransmit request
+ * for the first missing frame (go-back-N), so no frame is ever written twice.
+ * A new Session, or frame 0 of the same one, starts the transfer over.
+ * CBL_MEM_WRITE_LZ4_CMD frames carry a compressed payload, decoded before programming.
+ * Writing strictly in order is what lets their matches refer to the earlier frames.
+ */
+static void Bootloader_Memory_Write_Window(uint8_t *Host_Buffer)
+{
+	uint8_t Session = 0;
+	uint16_t Seq = 0;
+	uint32_t HOST_Address = 0;
+	uint16_t Payload_Len = 0;
+	uint8_t *Payload = NULL;
+	uint8_t *Fields = &Host_Buffer[BL_Host_Frame_Header];
+	uint8_t Flash_Payload_Write_Status = FLASH_PAYLOAD_WRITE_FAILED;
+	
+	Session = Fields[1];
+	Seq = (uint16_t)(Fields[2] | (Fields[3] << 8));
+	
+	if((Session != BL_Window_Session) || ((0 == Seq) && (0 != BL_Window_Expected_Seq)))
+	{
+		//first frame of a new transfer, a frame 0 written again holds the same data
+		BL_Window_Session = Session;
+		BL_Window_Expected_Seq = 0;
+		if(CBL_MEM_WRITE_STAGED_CMD == Fields[0])
+		{
+			BL_Stage_Discard();
+		}
+#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
+		BootLoader_Print_Message("Window write session %d started \r\n", Session);
+#endif
+	}
+	
+	if(Seq == BL_Window_Expected_Seq)
+	{
+		memcpy(&HOST_Address, &Fields[4], 4);
+		Payload = BL_Host_Frame_Payload(Host_Buffer, 8, &Payload_Len);
+		if((NULL != Payload) && (CBL_MEM_WRITE_LZ4_CMD == Fields[0]))
+		{
+			Payload = Bootloader_Decompress_Payload(Payload, &Payload_Len, HOST_Address);
+		}
+		if((NULL != Payload) && (CBL_MEM_WRITE_STAGED_CMD == Fields[0]))
+		{
+			Flash_Payload_Write_Status = BL_Stage_Payload(Payload,HOST_Address,Payload_Len);
+		}
+		else if((ADDRESS_IS_VALID == Host_Write_Verification(HOST_Address)) && (NULL != Payload))
+		{
+			Flash_Payload_Write_Status = Memory_Write_Payload(Payload,HOST_Address,Payload_Len);
+		}
+		if(FLASH_PAYLOAD_WRITE_PASSED == Flash_Payload_Write_Status)
+		{
+			BL_Window_Expected_Seq++;
+			Bootloader_Send_Window_Reply(WINDOW_FRAME_ACCEPTED, Seq);
+		}
+		else
+		{
+#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
+			BootLoader_Print_Message("Window frame %d write failed at 0x%X \r\n", Seq, HOST_Address);
+#endif
+			Bootloader_Send_Window_Reply(WINDOW_FRAME_WRITE_FAILED, Seq);
+		}
+	}
+	else if((int16_t)(Seq - BL_Window_Expected_Seq) < 0)
+	{
+		//duplicate of a frame already written, only repeat the acknowledgement
+		Bootloader_Send_Window_Reply(WINDOW_FRAME_ACCEPTED, BL_Window_Expected_Seq - 1);
+	}
+	else
+	{
+		//an earlier frame was lost, everything after it is discarded
+		Bootloader_Send_Window_Reply(WINDOW_FRAME_RETRANSMIT, BL_Window_Expected_Seq);
+	}
+}
+
+/* Copies a CBL_MEM_WRITE_STAGED_CMD payload into the stage, the first one of an empty stage sets its base */
+static uint8_t BL_Stage_Payload(uint8_t *Payload, uint32_t Payload_Start_Address, uint16_t Payload_Len)
+{
+	uint32_t Offset = 0;
+	uint32_t Chunk = 0;
+	
+	//the bootloader and the journal are never staged, see Host_Write_Verification
+	if((0 == Payload_Len) || (Payload_Start_Address < BL_PROTECTED_FLASH_END) ||
+	   ((Payload_Start_Address + Payload_Len) > STM32F407XX_FLASH_END))
+	{
+		return FLASH_PAYLOAD_WRITE_FAILED;
+	}
+	if(0 == BL_Stage_Chunks)
+	{
+		BL_Stage_Base = Payload_Start_Address & ~(BL_STAGE_CHUNK_LENGTH - 1U);
+		memset(BL_STAGE_BUFFER, 0xFF, BL_STAGE_LENGTH);
+	}
+	if((Payload_Start_Address < BL_Stage_Base) ||
+	   ((Payload_Start_Address + Payload_Len) > (BL_Stage_Base + BL_STAGE_LENGTH)))
+	{
+#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
+		BootLoader_Print_Message("0x%X is outside the stage at 0x%X \r\n", Payload_Start_Address, BL_Stage_Base);
+#endif
+		return FLASH_PAYLOAD_WRITE_FAILED;
+	}
+	Offset = Payload_Start_Address - BL_Stage_Base;
+	memcpy(&BL_STAGE_BUFFER[Offset], Payload, Payload_Len);
+	for(Chunk = Offset / BL_STAGE_CHUNK_LENGTH; Chunk <= ((Offset + Payload_Len - 1) / BL_STAGE_CHUNK_LENGTH); Chunk++)
+	{
+		if(0 == (BL_Stage_Map[Chunk / 32] & (1U << (Chunk % 32))))
+		{
+			BL_Stage_Map[Chunk / 32] |= (1U << (Chunk % 32));
+			BL_Stage_Chunks++;
+		}
+	}
+	return FLASH_PAYLOAD_WRITE_PASSED;
+}
+
+static void BL_Stage_Discard(void)
+{
+	memset(BL_Stage_Map, 0, sizeof(BL_Stage_Map));
+	BL_Stage_Chunks = 0;
+}
+
+/*
+ * Programs every chunk of the stage that received data within a single unlock/lock cycle.
+ * The chunks are aligned on BL_STAGE_CHUNK_LENGTH, every program operation has the widest size
+ * the parallelism allows, and words left at 0xFF are not programmed at all. Each run of
+ * consecutive words to program is one Flash_Program_Payload call.
+ */
+static void Bootloader_Stage_Commit(uint8_t *Host_Buffer)
+{
+	uint8_t Commit_Reply[STAGE_COMMIT_REPLY_LENGTH] = {0};
+	uint8_t Flash_Payload_Write_Status = FLASH_PAYLOAD_WRITE_PASSED;
+	uint32_t Chunk = 0;
+	uint32_t Offset = 0;
+	uint32_t Run_Start = 0;
+	uint32_t Run_Length = 0;
+	uint32_t Start_Tick = HAL_GetTick();
+	
+	(void)Host_Buffer;
+	if(0 != BL_Stage_Chunks)
+	{
+		if(HAL_OK != HAL_FLASH_Unlock())
+		{
+			Flash_Payload_Write_Status = FLASH_PAYLOAD_WRITE_FAILED;
+		}
+		for(Offset = 0; (Offset <= BL_STAGE_LENGTH) && (FLASH_PAYLOAD_WRITE_PASSED == Flash_Payload_Write_Status); Offset += BL_FLASH_PROGRAM_MAX_WIDTH)
+		{
+			Chunk = Offset / BL_STAGE_CHUNK_LENGTH;
+			//past the end, in a chunk without data or on a blank word the run is over
+			if((Offset < BL_STAGE_LENGTH) && (0 != (BL_Stage_Map[Chunk / 32] & (1U << (Chunk % 32)))) &&
+			   (0 != memcmp(&BL_STAGE_BUFFER[Offset], &BL_Stage_Blank, BL_FLASH_PROGRAM_MAX_WIDTH)))
+			{
+				Run_Start = (0 == Run_Length) ? Offset : Run_Start;
+				Run_Length += BL_FLASH_PROGRAM_MAX_WIDTH;
+			}
+			else if(0 != Run_Length)
+			{
+				Flash_Payload_Write_Status = Flash_Program_Payload(&BL_STAGE_BUFFER[Run_Start], BL_Stage_Base + Run_Start, Run_Length);
+				Run_Length = 0;
+			}
+		}
+		if(HAL_OK != HAL_FLASH_Lock())
+		{
+			Flash_Payload_Write_Status = FLASH_PAYLOAD_WRITE_FAILED;
+		}
+	}
+#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
+	BootLoader_Print_Message("Stage at 0x%X, %d chunks committed in %d ms, status %d \r\n", BL_Stage_Base, BL_Stage_Chunks, HAL_GetTick() - Start_Tick, Flash_Payload_Write_Status);
+#else
+	(void)Start_Tick;
+#endif
+	Commit_Reply[0] = Flash_Payload_Write_Status;
+	memcpy(&Commit_Reply[1], &BL_Stage_Base, 4);
+	memcpy(&Commit_Reply[5], &BL_Stage_Chunks, 2);
+	BL_Stage_Discard();
+	Bootloader_Send_Data_To_Host(Commit_Reply, STAGE_COMMIT_REPLY_LENGTH);
+}
+
+/*
+ * Payload of CBL_MEM_WRITE_LZ4_CMD: Raw_Len(2) | LZ4 block
+ * Returns the staging buffer holding the Raw_Len decoded bytes, or NULL when the
+ * block is malformed or does not decode to exactly Raw_Len bytes.
+ */
+static uint8_t *Bootloader_Decompress_Payload(uint8_t *Payload, uint16_t *Payload_Len, uint32_t Payload_Start_Address)
+{
+	uint16_t Raw_Len = 0;
+	
+	if(*Payload_Len < 2)
+	{
+		return NULL;
+	}
+	Raw_Len = (uint16_t)(Payload[0] | (Payload[1] << 8));
+	if((0 == Raw_Len) || (Raw_Len > BL_DECOMPRESS_RAM_BUDGET) ||
+	   (Raw_Len != LZ4_Decode_Block(&Payload[2], *Payload_Len - 2, Payload_Start_Address, BL_Decompress_Buffer, Raw_Len)))
+	{
+#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
+		BootLoader_Print_Message("Compressed block at 0x%X does not decode to %d bytes \r\n", Payload_Start_Address, Raw_Len);
+#endif
+		return NULL;
+	}
+	*Payload_Len = Raw_Len;
+	return BL_Decompress_Buffer;
+}
+
+/*
+ * LZ4 block format: sequences of Token | [Literal_Len...] | Literals | Offset(2) | [Match_Len...],
+ * the last sequence of a block has literals only. The end of block restrictions of the
+ * reference encoder (last 5 bytes literals) are not needed by this decoder.
+ * A match reaching before the block start is read from Block_Address - distance,
+ * the output of the previous frames.
+ * Returns the decoded length, 0 for a malformed block.
+ */
+static uint16_t LZ4_Decode_Block(uint8_t *Source, uint16_t Source_Len, uint32_t Block_Address, uint8_t *Destination, uint16_t Destination_Len)
+{
+	uint8_t *Source_End = Source + Source_Len;
+	uint32_t Out = 0;
+	uint32_t Length = 0;
+	uint32_t Offset = 0;
+	uint8_t Token = 0;
+	uint8_t Extra = 0;
+	uint32_t History_Address = 0;
+	
+	while(Source < Source_End)
+	{
+		Token = *Source++;
+		
+		//literals
+		Length = Token >> 4;
+		if(15 == Length)
+		{
+			do
+			{
+				if(Source >= Source_End)
+				{
+					return 0;
+				}
+				Extra = *Source++;
+				Length += Extra;
+			}while(255 == Extra);
+		}
+		if((Length > (uint32_t)(Source_End - Source)) || (Length > (Destination_Len - Out)))
+		{
+			return 0;
+		}
+		memcpy(&Destination[Out], Source, Length);
+		Source += Length;
+		Out += Length;
+		if(Source == Source_End)
+		{
+			break;
+		}
+		
+		//match
+		if((Source_End - Source) < 2)
+		{
+			return 0;
+		}
+		Offset = (uint32_t)(Source[0] | (Source[1] << 8));
+		Source += 2;
+		Length = (Token & 0x0F) + LZ4_MIN_MATCH_LENGTH;
+		if((15 + LZ4_MIN_MATCH_LENGTH) == Length)
+		{
+			do
+			{
+				if(Source >= Source_End)
+				{
+					return 0;
+				}
+				Extra = *Source++;
+				Length += Extra;
+			}while(255 == Extra);
+		}
+		if((0 == Offset) || (Length > (Destination_Len - Out)))
+		{
+			return 0;
+		}
+		if(Offset > Out)
+		{
+			//the match starts in an earlier frame, already programmed at its address
+			History_Address = Block_Address - (Offset - Out);
+			if(ADDRESS_IS_INVALID == Host_Address_Verification(History_Address))
+			{
+				return 0;
+			}
+			while((Length > 0) && (Offset > Out))
+			{
+				Destination[Out++] = *((uint8_t *)(uintptr_t)History_Address++);
+				Length--;
+			}
+		}
+		//byte by byte, a match may overlap the bytes it produces
+		while(Length > 0)
+		{
+			Destination[Out] = Destination[Out - Offset];
+			Out++;
+			Length--;
+		}
+	}
+	return (uint16_t)Out;
+}
+
+/*
+ * Frame: Len | CMD | Requested_Payload(2) | CRC(4)
+ * Reply: Accepted_Payload(2) | RX_Window(2) | Decompress_Budget(2), the host may then send large frames carrying up
+ * to Accepted_Payload bytes and keep at most RX_Window bytes in flight. 0 disables large frames.
+ */
+static void Bootloader_Negotiate_Frame_Size(uint8_t *Host_Buffer)
+{
+	uint16_t Requested_Payload = 0;
+	uint8_t Negotiate_Reply[FRAME_NEGOTIATE_REPLY_LENGTH] = {0};
+	//a single frame buffer when the receive ring has no DMA stream behind it
+	uint16_t Rx_Window_Length = (NULL != (BL_HOST_COMMUNICATION_UART)->hdmarx) ? BL_HOST_RX_WINDOW_LENGTH : BL_HOST_BUFFER_RX_LENGTH;
+	
+	Requested_Payload = (uint16_t)(Host_Buffer[2] | (Host_Buffer[3] << 8));
+	if(Requested_Payload > BL_HOST_LARGE_PAYLOAD_LENGTH)
+	{
+		Requested_Payload = BL_HOST_LARGE_PAYLOAD_LENGTH;
+	}
+	//whole program units, an aligned transfer then never needs a narrower flash write
+	Requested_Payload -= Requested_Payload % BL_FLASH_PROGRAM_MAX_WIDTH;
+	BL_Host_Large_Payload_Length = Requested_Payload;
+#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
+	BootLoader_Print_Message("Large frames with %d bytes payload \r\n", BL_Host_Large_Payload_Length);
+#endif
+	
+	Negotiate_Reply[0] = (uint8_t)(BL_Host_Large_Payload_Length & 0xFF);
+	Negotiate_Reply[1] = (uint8_t)(BL_Host_Large_Payload_Length >> 8);
+	Negotiate_Reply[2] = (uint8_t)(Rx_Window_Length & 0xFF);
+	Negotiate_Reply[3] = (uint8_t)(Rx_Window_Length >> 8);
+	Negotiate_Reply[4] = (uint8_t)(BL_DECOMPRESS_RAM_BUDGET & 0xFF);
+	Negotiate_Reply[5] = (uint8_t)(BL_DECOMPRESS_RAM_BUDGET >> 8);
+	Bootloader_Send_Data_To_Host(Negotiate_Reply, FRAME_NEGOTIATE_REPLY_LENGTH);
+}
+
+/*
+ * Frame: Len | CMD | Address(4) | Length(4) | Chunk_Size(2) | CRC(4)
+ * The range is sent straight from memory, the CRC of each chunk follows it so the
+ * host can ask again for a damaged chunk only. The link is the limit: computing the
+ * CRC of a 4KB chunk takes a few microseconds, sending it hundreds of milliseconds.
+ */
+static void Bootloader_Memory_Read(uint8_t *Host_Buffer)
+{
+	uint32_t Range_Address = 0;
+	uint32_t Range_Length = 0;
+	uint16_t Chunk_Size = 0;
+	uint32_t Chunk_Length = 0;
+	uint32_t Chunk_CRC = 0;
+	
+#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
+	BootLoader_Print_Message("Read the memory \r\n");
+#endif
+	
+	memcpy(&Range_Address, &Host_Buffer[2], 4);
+	memcpy(&Range_Length, &Host_Buffer[6], 4);
+	Chunk_Size = (uint16_t)(Host_Buffer[10] | (Host_Buffer[11] << 8));
+	
+	if((ADDRESS_IS_INVALID == Host_Range_Verification(Range_Address, Range_Length)) ||
+	   (0 != (Range_Address & 0x3)) || (0 != (Range_Length & 0x3)) ||
+	   (0 == Chunk_Size) || (Chunk_Size > MEM_READ_CHUNK_MAX_LENGTH) || (0 != (Chunk_Size & 0x3)))
+	{
+#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
+		BootLoader_Print_Message("Invalid read range 0x%X + %d \r\n", Range_Address, Range_Length);
+#endif
+		Bootloader_Send_NACK();
+	}
+	else if(OB_RDP_LEVEL_0 != CBL_STM32F407_Get_RDP_Level())
+	{
+#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
+		BootLoader_Print_Message("Memory read refused, read protection active \r\n");
+#endif
+		Bootloader_Send_NACK();
+	}
+	else
+	{
+		Bootloader_Send_ACK(MEM_READ_REPLY_LENGTH);
+		Bootloader_Send_Data_To_Host((uint8_t *)&Range_Length, MEM_READ_REPLY_LENGTH);
+		
+		for(uint32_t Offset = 0; Offset < Range_Length; Offset += Chunk_Length)
+		{
+			Chunk_Length = ((Range_Length - Offset) < Chunk_Size) ? (Range_Length - Offset) : Chunk_Size;
+			Chunk_CRC = HAL_CRC_Calculate(CRC_ENGINE_OBJ, (uint32_t *)(uintptr_t)(Range_Address + Offset), Chunk_Length / 4);
+			Bootloader_Send_Data_To_Host((uint8_t *)(uintptr_t)(Range_Address + Offset), Chunk_Length);
+			Bootloader_Send_Data_To_Host((uint8_t *)&Chunk_CRC, 4);
+		}
+	}
+	//leave the unit ready for the next frame check
+	__HAL_CRC_DR_RESET(CRC_ENGINE_OBJ);
+}
+
+/*
+ * Frame: Len | CMD | Address(4) | Length(4) | CRC(4)
+ * Post-flash verification in one round trip, the host compares the result with the
+ * CRC of its image fed to the unit the same way (little endian words).
+ */
+static void Bootloader_Memory_CRC(uint8_t *Host_Buffer)
+{
+	uint32_t Range_Address = 0;
+	uint32_t Range_Length = 0;
+	uint32_t Range_CRC = 0;
+	uint32_t Start_Cycles = 0;
+	uint32_t CRC_Reply[MEM_CRC_REPLY_LENGTH / 4] = {0};
+	
+#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
+	BootLoader_Print_Message("CRC of a memory range \r\n");
+#endif
+	
+	memcpy(&Range_Address, &Host_Buffer[2], 4);
+	memcpy(&Range_Length, &Host_Buffer[6], 4);
+	
+	if((ADDRESS_IS_INVALID == Host_Range_Verification(Range_Address, Range_Length)) ||
+	   ((Range_Address >= CCMDATARAM_BASE) && (Range_Address <= STM32F407XX_SRAM3_END)) ||
+	   (0 != (Range_Address & 0x3)) || (0 != (Range_Length & 0x3)))
+	{
+#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
+		BootLoader_Print_Message("Invalid CRC range 0x%X + %d \r\n", Range_Address, Range_Length);
+#endif
+		Bootloader_Send_NACK();
+	}
+	else
+	{
+		//cycle counter of the DWT unit, enabled through the debug monitor control register
+		CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+		DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+		Start_Cycles = DWT->CYCCNT;
+		__HAL_CRC_DR_RESET(CRC_ENGINE_OBJ);
+		if(HAL_OK == Bootloader_CRC_Range_DMA(Range_Address, Range_Length, &Range_CRC))
+		{
+			CRC_Reply[1] = DWT->CYCCNT - Start_Cycles;
+			CRC_Reply[0] = Range_CRC;
+			CRC_Reply[2] = SystemCoreClock;
+#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
+			BootLoader_Print_Message("CRC 0x%X over %d bytes in %d cycles \r\n", Range_CRC, Range_Length, CRC_Reply[1]);
+#endif
+			Bootloader_Send_ACK(MEM_CRC_REPLY_LENGTH);
+			Bootloader_Send_Data_To_Host((uint8_t *)CRC_Reply, MEM_CRC_REPLY_LENGTH);
+		}
+		else
+		{
+			Bootloader_Send_NACK();
+		}
+	}
+	//leave the unit ready for the next frame check
+	__HAL_CRC_DR_RESET(CRC_ENGINE_OBJ);
+}
+
+/*
+ * Frame: Len | CMD | Baud(4) | CRC(4)
+ * The status goes out at the current rate, then the frame has to come back unchanged at
+ * the new rate. A host that cannot follow only costs BL_HOST_BAUD_CONFIRM_TIMEOUT.
+ */
+static void Bootloader_Change_Baud_Rate(uint8_t *Host_Buffer)
+{
+	uint32_t New_Baud_Rate = 0;
+	uint32_t Old_Baud_Rate = 0;
+	uint8_t Baud_Status = BAUD_CHANGE_REJECTED;
+	uint8_t Confirm_Frame[CHANGE_BAUD_FRAME_LENGTH] = {0};
+	
+#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
+	BootLoader_Print_Message("Change the host link rate \r\n");
+#endif
+	
+	memcpy(&New_Baud_Rate, &Host_Buffer[2], 4);
+	Old_Baud_Rate = (BL_HOST_COMMUNICATION_UART)->Init.BaudRate;
+	Baud_Status = BL_Host_Baud_Rate_Verification(New_Baud_Rate);
+	Bootloader_Send_Data_To_Host(&Baud_Status, 1);
+	
+	if(BAUD_CHANGE_ACCEPTED == Baud_Status)
+	{
+		BL_Host_Set_Baud_Rate(New_Baud_Rate);
+		if((HAL_OK == BL_Host_Receive_Timeout(Confirm_Frame, CHANGE_BAUD_FRAME_LENGTH, BL_HOST_BAUD_CONFIRM_TIMEOUT)) &&
+		   (0 == memcmp(Confirm_Frame, Host_Buffer, CHANGE_BAUD_FRAME_LENGTH)))
+		{
+			Baud_Status = BAUD_CHANGE_CONFIRMED;
+			Bootloader_Send_ACK(1);
+			Bootloader_Send_Data_To_Host(&Baud_Status, 1);
+#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
+			BootLoader_Print_Message("Host link at %d baud \r\n", New_Baud_Rate);
+#endif
+		}
+		else
+		{
+			BL_Host_Set_Baud_Rate(Old_Baud_Rate);
+#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
+			BootLoader_Print_Message("No confirmation at %d baud, back to %d baud \r\n", New_Baud_Rate, Old_Baud_Rate);
+#endif
+		}
+	}
+}
+
+/*
+ * Frame: Len | CMD | CRC(4)
+ * Reply: Active | Previous | State | Boot_Attempts | Sequence(4) | Version(4) x 2 | Image_Valid x 2
+ */
+static void Bootloader_Slot_Status(uint8_t *Host_Buffer)
+{
+	BL_Slot_Record Record;
+	uint8_t Status_Reply[SLOT_STATUS_REPLY_LENGTH] = {0};
+	
+	(void)Host_Buffer;
+#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
+	BootLoader_Print_Message("Read the application slots \r\n");
+#endif
+	
+	if(0 == BL_Slot_Journal_Find(&Record))
+	{
+		memset(&Record, 0, sizeof(Record));
+		Record.Active_Slot = BL_SLOT_NONE;
+		Record.Previous_Slot = BL_SLOT_NONE;
+		Record.State = BL_SLOT_STATE_NONE;
+	}
+	Status_Reply[0] = Record.Active_Slot;
+	Status_Reply[1] = Record.Previous_Slot;
+	Status_Reply[2] = Record.State;
+	Status_Reply[3] = Record.Boot_Attempts;
+	memcpy(&Status_Reply[4], &Record.Sequence, 4);
+	memcpy(&Status_Reply[8], Record.Version, 8);
+	Status_Reply[16] = Bootloader_Image_Verification(BL_SLOT_A_BASE_ADDRESS, BL_SLOT_SIZE);
+	Status_Reply[17] = Bootloader_Image_Verification(BL_SLOT_B_BASE_ADDRESS, BL_SLOT_SIZE);
+	Bootloader_Send_Data_To_Host(Status_Reply, SLOT_STATUS_REPLY_LENGTH);
+}
+
+/*
+ * Frame: Len | CMD | Slot | Version(4) | CRC(4)
+ * Only a slot holding a valid image is accepted. It becomes active on trial with the other
+ * slot as rollback target, or is confirmed when it is the active slot already.
+ */
+static void Bootloader_Slot_Switch(uint8_t *Host_Buffer)
+{
+	uint8_t Slot = Host_Buffer[2];
+	uint32_t Version = 0;
+	uint8_t Switch_Status = SLOT_SWITCH_REFUSED;
+	
+#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
+	BootLoader_Print_Message("Switch the application slot \r\n");
+#endif
+	
+	memcpy(&Version, &Host_Buffer[3], 4);
+	Switch_Status = BL_Slot_Activate(Slot, Version);
+	Bootloader_Send_Data_To_Host(&Switch_Status, 1);
+}
+
+/*
+ * Frame: Len | CMD | Address(4) | Length(4) | Block_Size(4) | CRC(4)
+ * Reply: Unique_ID(12) | Range_CRC(4) | Blank_Sectors(2) | Block_Count(2) | Block_CRC(4) x Block_Count
+ * The CRCs are computed by the CRC unit over the flash words, the last block may be shorter.
+ * Bit N of Blank_Sectors is set when sector N overlaps the range and reads all 0xFF.
+ * A Block_Size of 0 only returns the header, enough to check a hash map cached by the host.
+ */
+static void Bootloader_Flash_Block_Hash(uint8_t *Host_Buffer)
+{
+	uint32_t Range_Address = 0;
+	uint32_t Range_Length = 0;
+	uint32_t Block_Size = 0;
+	uint32_t Block_Length = 0;
+	uint16_t Block_Count = 0;
+	uint16_t Blank_Sectors = 0;
+	uint32_t Hash = 0;
+	uint8_t Hash_Header[FLASH_HASH_HEADER_LENGTH] = {0};
+	
+#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
+	BootLoader_Print_Message("Hash the flash blocks \r\n");
+#endif
+	
+	memcpy(&Range_Address, &Host_Buffer[2], 4);
+	memcpy(&Range_Length, &Host_Buffer[6], 4);
+	memcpy(&Block_Size, &Host_Buffer[10], 4);
+	
+	if((Range_Address < FLASH_BASE) || (Range_Address >= STM32F407XX_FLASH_END) || (Range_Length > (STM32F407XX_FLASH_END - Range_Address)) || 
+	   (0 == Range_Length) || (0 != (Range_Address & 0x3)) || (0 != (Range_Length & 0x3)) ||
+	   ((0 != Block_Size) && ((Block_Size < FLASH_HASH_BLOCK_MIN_LENGTH) || (0 != (Block_Size & 0x3)))))
+	{
+#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
+		BootLoader_Print_Message("Invalid hash range 0x%X + %d \r\n", Range_Address, Range_Length);
+#endif
+		Bootloader_Send_NACK();
+	}
+	else
+	{
+		if(0 != Block_Size)
+		{
+			Block_Count = (uint16_t)((Range_Length + Block_Size - 1) / Block_Size);
+		}
+		Blank_Sectors = Flash_Blank_Sectors(Range_Address, Range_Length);
+		Hash = HAL_CRC_Calculate(CRC_ENGINE_OBJ, (uint32_t *)(uintptr_t)Range_Address, Range_Length / 4);
+		
+		memcpy(&Hash_Header[0], (uint8_t *)UID_BASE, STM32F407XX_UID_LENGTH);
+		memcpy(&Hash_Header[12], &Hash, 4);
+		memcpy(&Hash_Header[16], &Blank_Sectors, 2);
+		memcpy(&Hash_Header[18], &Block_Count, 2);
+		Bootloader_Send_Long_ACK(FLASH_HASH_HEADER_LENGTH + (Block_Count * 4));
+		Bootloader_Send_Data_To_Host(Hash_Header, FLASH_HASH_HEADER_LENGTH);
+		
+		//the hashes are streamed as they are computed, no buffer for the whole map
+		for(uint32_t Offset = 0; Offset < ((uint32_t)Block_Count * Block_Size); Offset += Block_Size)
+		{
+			Block_Length = ((Range_Length - Offset) < Block_Size) ? (Range_Length - Offset) : Block_Size;
+			Hash = HAL_CRC_Calculate(CRC_ENGINE_OBJ, (uint32_t *)(uintptr_t)(Range_Address + Offset), Block_Length / 4);
+			Bootloader_Send_Data_To_Host((uint8_t *)&Hash, 4);
+		}
+	}
+	//leave the unit ready for the next frame check
+	__HAL_CRC_DR_RESET(CRC_ENGINE_OBJ);
+}
+
+#if (BL_ROP_CHANGE == BL_ROP_CHANGE_ENABLE)
+static void Bootloader_Change_Read_Protection_Level(uint8_t *Host_Buffer)
+{
+	uint8_t ROP_Level_Status = ROP_LEVEL_CHANGE_INVALID;
+	uint8_t Host_ROP_Level = 0;
+#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
+	BootLoader_Print_Message("Read FLASH Read Protection Out level \r\n");
+#endif
+	
+	//get the protection level
+	Host_ROP_Level = Host_Buffer[2];
+	
+	if((CBL_ROP_LEVEL_2 == Host_ROP_Level)||(OB_RDP_LEVEL_2 == Host_ROP_Level))
+	{
+		ROP_Level_Status = ROP_LEVEL_CHANGE_INVALID;
+	}
+	else
+	{
+		if(CBL_ROP_LEVEL_0 == Host_ROP_Level)
+		{
+			Host_ROP_Level = 0xAA; 
+		}
+		else if(CBL_ROP_LEVEL_1 == Host_ROP_Level)
+		{
+			Host_ROP_Level = 0x55; 
+		}
+		ROP_Level_Status = Change_ROP_Level(Host_ROP_Level);
+	}
+	Bootloader_Send_Data_To_Host((uint8_t *)&ROP_Level_Status, 1);
+}
+#endif
+
+static uint8_t Bootloader_CRC_Verify(uint8_t *pData, uint32_t Data_Len, uint32_t Host_CRC)
+{
+	uint8_t CRC_Status = CRC_VERIFICATION_FAILED;
+	uint32_t CRC_Calculated = 0;
+	uint32_t Data_Buffer = 0;
+	
+	//calculate CRC
+	for(uint32_t Counter = 0; Counter < Data_Len; Counter++){
+		Data_Buffer = (uint32_t)pData[Counter];
+		CRC_Calculated = HAL_CRC_Accumulate(CRC_ENGINE_OBJ, &Data_Buffer, 1);
+	}
+	
+	__HAL_CRC_DR_RESET(CRC_ENGINE_OBJ);
+	
+	if(CRC_Calculated == Host_CRC)
+	{
+		CRC_Status = CRC_VERIFICATION_PASSED;
+	}
+	else
+	{
+		CRC_Status = CRC_VERIFICATION_FAILED;
+	}
+	
+	return CRC_Status;
+}
+
+static void Bootloader_Send_ACK(uint8_t Replay_Len)
+{
+	//will send 2bytes ACK and LENGTH
+	uint8_t Ack_Value[2] = {0};
+	
+	Ack_Value[0] = CBL_SEND_ACK;
+	Ack_Value[1] = Replay_Len;
+	
+	Bootloader_Send_Data_To_Host((uint8_t *)Ack_Value, 2);
+}
+static void Bootloader_Send_Long_ACK(uint16_t Replay_Len)
+{
+	//will send ACK, the long length marker then the 2bytes LENGTH
+	uint8_t Ack_Value[4] = {0};
+	
+	if(Replay_Len < CBL_ACK_LONG_LENGTH)
+	{
+		Bootloader_Send_ACK((uint8_t)Replay_Len);
+	}
+	else
+	{
+		Ack_Value[0] = CBL_SEND_ACK;
+		Ack_Value[1] = CBL_ACK_LONG_LENGTH;
+		Ack_Value[2] = (uint8_t)(Replay_Len & 0xFF);
+		Ack_Value[3] = (uint8_t)(Replay_Len >> 8);
+		Bootloader_Send_Data_To_Host((uint8_t *)Ack_Value, 4);
+	}
+}
+static void Bootloader_Send_NACK(void)
+{
+	//will send 1byte the NACK
+	uint8_t Ack_Value = CBL_SEND_NACK;
+	Bootloader_Send_Data_To_Host(&Ack_Value, 1);
+
+}
+
+static void Bootloader_Send_Window_Reply(uint8_t Window_Status, uint16_t Seq)
+{
+	//will send ACK, LENGTH then STATUS and the 2bytes sequence number
+	uint8_t Window_Reply[2 + WINDOW_REPLY_LENGTH] = {0};
+	
+	Window_Reply[0] = CBL_SEND_ACK;
+	Window_Reply[1] = WINDOW_REPLY_LENGTH;
+	Window_Reply[2] = Window_Status;
+	Window_Reply[3] = (uint8_t)(Seq & 0xFF);
+	Window_Reply[4] = (uint8_t)(Seq >> 8);
+	
+	Bootloader_Send_Data_To_Host((uint8_t *)Window_Reply, sizeof(Window_Reply));
+}
+
+static void Bootloader_Send_Data_To_Host(uint8_t *Host_Buffer, uint32_t Data_Len)
+{
+#if (BL_PROFILE == BL_PROFILE_ENABLE)
+	uint32_t Tx_Start_Cycles = DWT->CYCCNT;
+#endif
+	HAL_UART_Transmit(BL_HOST_COMMUNICATION_UART, Host_Buffer, Data_Len, HAL_MAX_DELAY);
+#if (BL_PROFILE == BL_PROFILE_ENABLE)
+	BL_Profile_Add(BL_PROFILE_PHASE_TX, Tx_Start_Cycles);
+#endif
+}
+static uint8_t Host_Address_Verification(uint32_t Jump_Address)
+{
+	uint8_t Address_Verification = ADDRESS_IS_INVALID;
+	if((Jump_Address >= SRAM1_BASE) && (Jump_Address <= STM32F407XX_SRAM1_END))
+	{
+		Address_Verification = ADDRESS_IS_VALID;
+	}
+	else if((Jump_Address >= SRAM2_BASE) && (Jump_Address <= STM32F407XX_SRAM2_END))
+	{
+		Address_Verification = ADDRESS_IS_VALID;
+	}
+	else if((Jump_Address >= CCMDATARAM_BASE) && (Jump_Address <= STM32F407XX_SRAM3_END))
+	{
+		Address_Verification = ADDRESS_IS_VALID;
+	}
+	else if((Jump_Address >= FLASH_BASE) && (Jump_Address <= STM32F407XX_FLASH_END))
+	{
+		Address_Verification = ADDRESS_IS_VALID;
+	}
+	else
+	{
+		Address_Verification = ADDRESS_IS_INVALID;
+	}
+	return Address_Verification;
+}
+/* Host writes reach flash above the bootloader and the journal only */
+static uint8_t Host_Write_Verification(uint32_t Write_Address)
+{
+	uint8_t Address_Verification = Host_Address_Verification(Write_Address);
+	
+	if((Write_Address >= FLASH_BASE) && (Write_Address < BL_PROTECTED_FLASH_END))
+	{
+		Address_Verification = ADDRESS_IS_INVALID;
+	}
+	return Address_Verification;
+}
+
+/* Host erases start above the bootloader and the journal, a mass erase would take them too */
+static uint8_t Host_Erase_Verification(uint8_t SectorNumber)
+{
+	if((CBL_FLASH_MASS_ERASE == SectorNumber) || (SectorNumber < BL_PROTECTED_SECTORS))
+	{
+#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
+		BootLoader_Print_Message("Sector %d is protected \r\n", SectorNumber);
+#endif
+		return INVALID_SECTOR_NUMBER;
+	}
+	return VALID_SECTOR_NUMBER;
+}
+
+/* Fills Erase for NumberOfSectors sectors from SectorNumber, cut at the last sector, or a mass erase */
+static uint8_t Flash_Erase_Setup(uint8_t SectorNumber, uint8_t NumberOfSectors, FLASH_EraseInitTypeDef *Erase)
+{
+	uint8_t Sector_Status = INVALID_SECTOR_NUMBER;
+	uint8_t Remaining_Sectors = 0;
+	
+	if(NumberOfSectors > CBL_FLASH_MAX_SECTOR_NUMBER){
+		/* Number Of sectors is out of range */
+		Sector_Status = INVALID_SECTOR_NUMBER;
+	}
+	//erase from between
+	else if((NumberOfSectors <= (CBL_FLASH_MAX_SECTOR_NUMBER - 1))||(CBL_FLASH_MASS_ERASE == SectorNumber))
+	{
+		if(CBL_FLASH_MASS_ERASE == SectorNumber)
+		{
+			Erase->TypeErase = FLASH_TYPEERASE_MASSERASE;
+#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
+			BootLoader_Print_Message("Flash Mass erase activation \r\n");
+#endif
+		}
+		else
+		{
+#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
+			BootLoader_Print_Message("User needs Sector erase \r\n");
+#endif
+			//need to erase from sector 5 20 sectors but the avalibale will be from 5 to 11 (6)
+			Remaining_Sectors = CBL_FLASH_MAX_SECTOR_NUMBER - SectorNumber;//12-5
+			if(NumberOfSectors > Remaining_Sectors)//is this number grater that remaining
+			{
+				//force write the remaing sector 
+				NumberOfSectors = Remaining_Sectors;
+			}
+			else{/*nothig*/}
+			Erase->TypeErase = FLASH_TYPEERASE_SECTORS;
+			
+			//this sector is errased
+			Erase->Sector = SectorNumber;
+			
+			//Number of sectors to be erased
+			Erase->NbSectors = NumberOfSectors;
+		}
+		Erase->Banks = FLASH_BANK_1;
+		Erase->VoltageRange = BL_FLASH_VOLTAGE_RANGE;
+		Sector_Status = VALID_SECTOR_NUMBER;
+	}
+	
+	return Sector_Status;
+}
+static uint8_t Perform_Flash_Erase(uint8_t SectorNumber, uint8_t NumberOfSectors)
+{
+	uint8_t Sector_Status = INVALID_SECTOR_NUMBER;
+	FLASH_EraseInitTypeDef Erase;
+	HAL_StatusTypeDef HAL_Status = HAL_ERROR;
+	uint32_t SectorError = HAL_SUCCESSFUL_ERASE;
+	uint32_t Last_Sector = 0;
+	uint32_t Start_Tick = 0;
+	
+	if(VALID_SECTOR_NUMBER == Flash_Erase_Setup(SectorNumber, NumberOfSectors, &Erase))
+	{
+		//unlock FCRegister
+		HAL_Status = HAL_FLASH_Unlock();
+		
+		//perform the Erasing, one sector at a time so each of them is timed
+		if((HAL_OK == HAL_Status) && (FLASH_TYPEERASE_MASSERASE == Erase.TypeErase))
+		{
+			HAL_Status = HAL_FLASHEx_Erase(&Erase,&SectorError);
+			BL_Flash_Stats_Erase(CBL_FLASH_MASS_ERASE, 0);
+		}
+		else
+		{
+			Last_Sector = Erase.Sector + Erase.NbSectors;
+			for(Erase.NbSectors = 1; (Erase.Sector < Last_Sector) && (HAL_OK == HAL_Status) && (HAL_SUCCESSFUL_ERASE == SectorError); Erase.Sector++)
+			{
+				Start_Tick = HAL_GetTick();
+				HAL_Status = HAL_FLASHEx_Erase(&Erase,&SectorError);
+				if((HAL_OK == HAL_Status) && (HAL_SUCCESSFUL_ERASE == SectorError))
+				{
+					BL_Flash_Stats_Erase((uint8_t)Erase.Sector, HAL_GetTick() - Start_Tick);
+				}
+			}
+		}
+		if((HAL_OK == HAL_Status) && (HAL_SUCCESSFUL_ERASE == SectorError))
+		{
+			Sector_Status = SUCCESSFUL_ERASE;
+		}
+		else
+		{
+			Sector_Status = UNSUCCESSFUL_ERASE;
+		}
+		//lock FCRegister
+		HAL_FLASH_Lock();
+	}
+	
+	return Sector_Status;
+	
+}
+
+/* From the main loop only, so an event never lands inside a reply */
+static void BL_Erase_Poll(void)
+{
+	uint8_t Event[BL_ERASE_EVENT_LENGTH];
+	uint8_t State = 0;
+	uint8_t Sectors_Done = 0;
+	
+	if((BL_ERASE_RUNNING == BL_Erase_State) && (0 == NVIC_GetEnableIRQ(FLASH_IRQn)))
+	{
+		//FLASH global interrupt not enabled, the end of each sector is served from here
+		HAL_FLASH_IRQHandler();
+	}
+	//the state first, Sectors_Done is final once the erase is over
+	State = BL_Erase_State;
+	Sectors_Done = BL_Erase_Sectors_Done;
+	
+	while(BL_Erase_Sectors_Reported < Sectors_Done)
+	{
+		Event[0] = BL_ERASE_EVENT_MARKER;
+		Event[1] = (CBL_FLASH_MASS_ERASE == BL_Erase_First_Sector) ? CBL_FLASH_MASS_ERASE : (BL_Erase_First_Sector + BL_Erase_Sectors_Reported);
+		Event[2] = SUCCESSFUL_ERASE;
+		Event[3] = ++BL_Erase_Sectors_Reported;
+		Event[4] = BL_Erase_Sectors_Total;
+		Bootloader_Send_Data_To_Host(Event, BL_ERASE_EVENT_LENGTH);
+	}
+	if(BL_Erase_Unlocked && (BL_ERASE_RUNNING != State))
+	{
+		if(BL_ERASE_FAILED == State)
+		{
+			Event[0] = BL_ERASE_EVENT_MARKER;
+			Event[1] = (CBL_FLASH_MASS_ERASE == BL_Erase_First_Sector) ? CBL_FLASH_MASS_ERASE : (BL_Erase_First_Sector + Sectors_Done);
+			Event[2] = UNSUCCESSFUL_ERASE;
+			Event[3] = Sectors_Done;
+			Event[4] = BL_Erase_Sectors_Total;
+			Bootloader_Send_Data_To_Host(Event, BL_ERASE_EVENT_LENGTH);
+		}
+		BL_Erase_Unlocked = 0;
+		HAL_FLASH_Lock();
+#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
+		BootLoader_Print_Message("Background erase over, %d of %d sectors in %d ms \r\n", Sectors_Done, BL_Erase_Sectors_Total, BL_Erase_End_Tick - BL_Erase_Start_Tick);
+#endif
+	}
+}
+
+static void BL_Erase_Wait(void)
+{
+	while(BL_ERASE_RUNNING == BL_Erase_State)
+	{
+		BL_Erase_Poll();
+	}
+	BL_Erase_Poll();
+}
+
+/* HAL_FLASH_IRQHandler: the sector just erased, HAL_SUCCESSFUL_ERASE after the last one, the bank after a mass erase */
+void HAL_FLASH_EndOfOperationCallback(uint32_t ReturnValue)
+{
+	uint32_t Tick = HAL_GetTick();
+	
+	if(BL_ERASE_RUNNING == BL_Erase_State)
+	{
+		if(CBL_FLASH_MASS_ERASE == BL_Erase_First_Sector)
+		{
+			BL_Flash_Stats_Erase(CBL_FLASH_MASS_ERASE, 0);
+		}
+		else
+		{
+			BL_Flash_Stats_Erase(BL_Erase_First_Sector + BL_Erase_Sectors_Done, Tick - BL_Erase_Sector_Tick);
+		}
+		BL_Erase_Sector_Tick = Tick;
+		BL_Erase_Sectors_Done++;
+		if((HAL_SUCCESSFUL_ERASE == ReturnValue) || (BL_Erase_Sectors_Done >= BL_Erase_Sectors_Total))
+		{
+			BL_Erase_Sectors_Done = BL_Erase_Sectors_Total;
+			BL_Erase_End_Tick = HAL_GetTick();
+			BL_Erase_State = BL_ERASE_DONE;
+		}
+	}
+}
+
+void HAL_FLASH_OperationErrorCallback(uint32_t ReturnValue)
+{
+	//the sector in error, BL_Erase_Sectors_Done already points at it
+	(void)ReturnValue;
+	if(BL_ERASE_RUNNING == BL_Erase_State)
+	{
+		BL_Erase_End_Tick = HAL_GetTick();
+		BL_Erase_State = BL_ERASE_FAILED;
+	}
+}
+/* Payloads for the RAM image area are copied, other RAM belongs to the bootloader, the rest goes to the flash */
+static uint8_t Memory_Write_Payload(uint8_t *Host_Payload, uint32_t Payload_Start_Address, uint16_t Payload_Len)
+{
+	uint8_t Write_Status = FLASH_PAYLOAD_WRITE_FAILED;
+	
+	if((Payload_Start_Address >= BL_RAM_IMAGE_BASE) && ((Payload_Start_Address + Payload_Len) <= BL_RAM_IMAGE_END))
+	{
+		memcpy((void *)(uintptr_t)Payload_Start_Address, Host_Payload, Payload_Len);
+		Write_Status = FLASH_PAYLOAD_WRITE_PASSED;
+	}
+	else if((Payload_Start_Address >= FLASH_BASE) && ((Payload_Start_Address + Payload_Len) <= STM32F407XX_FLASH_END))
+	{
+		Write_Status = Flash_Memory_Write_Payload(Host_Payload, Payload_Start_Address, Payload_Len);
+	}
+	return Write_Status;
+}
+
+static uint8_t Flash_Memory_Write_Payload(uint8_t *Host_Payload, uint32_t Payload_Start_Address, uint16_t Payload_Len)
+{
+	HAL_StatusTypeDef HAL_Status = HAL_ERROR;
+	uint8_t Flash_Payload_Write_Status = FLASH_PAYLOAD_WRITE_FAILED;
+	
+	//Unlock FCRegister
+	HAL_Status = HAL_FLASH_Unlock();
+	
+	if(HAL_Status != HAL_OK){
+		Flash_Payload_Write_Status = FLASH_PAYLOAD_WRITE_FAILED;
+	}
+	else
+	{
+		Flash_Payload_Write_Status = Flash_Program_Payload(Host_Payload,Payload_Start_Address,Payload_Len);
+	}
+	if(FLASH_PAYLOAD_WRITE_PASSED == Flash_Payload_Write_Status)
+	{
+		HAL_Status = HAL_FLASH_Lock();
+		if(HAL_Status != HAL_OK)
+		{
+		Flash_Payload_Write_Status = FLASH_PAYLOAD_WRITE_FAILED;
+		}
+		else
+		{
+			Flash_Payload_Write_Status = FLASH_PAYLOAD_WRITE_PASSED;
+		}
+	}
+	else
+	{
+		Flash_Payload_Write_Status = FLASH_PAYLOAD_WRITE_FAILED;
+	}
+	return Flash_Payload_Write_Status;
+}
+
+/* Programs the payload with the widest writes, the flash has to be unlocked already */
+static uint8_t Flash_Program_Payload(uint8_t *Host_Payload, uint32_t Payload_Start_Address, uint32_t Payload_Len)
+{
+	HAL_StatusTypeDef HAL_Status = HAL_ERROR;
+	uint8_t Flash_Payload_Write_Status = FLASH_PAYLOAD_WRITE_FAILED;
+	uint32_t Counter = 0;
+	uint32_t Width = 0;
+	uint64_t Data = 0;
+	uint32_t Start_Cycles = DWT->CYCCNT;
+	
+	for(Counter =0;Counter<Payload_Len;Counter+=Width)
+	{
+		Width = Flash_Program_Width(Payload_Start_Address+Counter,Payload_Len-Counter);
+		//the payload is not aligned in the host buffer, the flash is little endian like the frame
+		Data = 0;
+		memcpy(&Data,&Host_Payload[Counter],Width);
+		switch(Width)
+		{
+			case 8:
+				HAL_Status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_DOUBLEWORD,Payload_Start_Address+Counter,Data);
+				break;
+			case 4:
+				HAL_Status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD,Payload_Start_Address+Counter,Data);
+				break;
+			case 2:
+				HAL_Status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD,Payload_Start_Address+Counter,Data);
+				break;
+			default:
+				HAL_Status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_BYTE,Payload_Start_Address+Counter,Data);
+				break;
+		}
+		if(HAL_Status != HAL_OK)
+		{
+			Flash_Payload_Write_Status = FLASH_PAYLOAD_WRITE_FAILED;
+			break;
+		}
+		else
+		{
+			Flash_Payload_Write_Status = FLASH_PAYLOAD_WRITE_PASSED;
+		}
+		
+	}
+	if(FLASH_PAYLOAD_WRITE_PASSED == Flash_Payload_Write_Status)
+	{
+		BL_Flash_Stats_Program(Payload_Start_Address, Payload_Len, DWT->CYCCNT - Start_Cycles);
+	}
+	return Flash_Payload_Write_Status;
+}
+
+/* Sector holding Address, CBL_FLASH_MAX_SECTOR_NUMBER outside the flash */
+static uint8_t Flash_Address_Sector(uint32_t Address)
+{
+	uint8_t SectorNumber = 0;
+	uint32_t Sector_Start = FLASH_BASE;
+	
+	if(Address < FLASH_BASE)
+	{
+		return CBL_FLASH_MAX_SECTOR_NUMBER;
+	}
+	while((SectorNumber < CBL_FLASH_MAX_SECTOR_NUMBER) && (Address >= (Sector_Start + Flash_Sector_Size(SectorNumber))))
+	{
+		Sector_Start += Flash_Sector_Size(SectorNumber);
+		SectorNumber++;
+	}
+	return SectorNumber;
+}
+
+/* The backup SRAM keeps its content on VBAT with the backup regulator, a table without the magic starts cleared */
+static void BL_Flash_Stats_Init(void)
+{
+	__HAL_RCC_BKPSRAM_CLK_ENABLE();
+	HAL_PWREx_EnableBkUpReg();
+	if(BL_FLASH_STATS_MAGIC != BL_FLASH_STATS_MAGIC_WORD)
+	{
+		memset(BL_FLASH_STATS, 0, CBL_FLASH_MAX_SECTOR_NUMBER * sizeof(BL_Sector_Stats));
+		for(uint8_t SectorNumber = 0; SectorNumber < CBL_FLASH_MAX_SECTOR_NUMBER; SectorNumber++)
+		{
+			BL_FLASH_STATS[SectorNumber].Erase_Min_ms = 0xFFFFFFFFU;
+			BL_FLASH_STATS[SectorNumber].Program_Min_ns = 0xFFFFFFFFU;
+		}
+		BL_FLASH_STATS_MAGIC_WORD = BL_FLASH_STATS_MAGIC;
+	}
+}
+
+/* One erase of SectorNumber, CBL_FLASH_MASS_ERASE counts every sector without a duration */
+static void BL_Flash_Stats_Erase(uint8_t SectorNumber, uint32_t Elapsed_ms)
+{
+	BL_Sector_Stats *Stats = NULL;
+	
+	if(CBL_FLASH_MASS_ERASE == SectorNumber)
+	{
+		for(SectorNumber = 0; SectorNumber < CBL_FLASH_MAX_SECTOR_NUMBER; SectorNumber++)
+		{
+			BL_FLASH_STATS[SectorNumber].Erase_Count++;
+		}
+	}
+	else if(SectorNumber < CBL_FLASH_MAX_SECTOR_NUMBER)
+	{
+		Stats = &BL_FLASH_STATS[SectorNumber];
+		Stats->Erase_Count++;
+		Stats->Erase_Timed++;
+		Stats->Erase_Total_ms += Elapsed_ms;
+		if(Elapsed_ms < Stats->Erase_Min_ms)
+		{
+			Stats->Erase_Min_ms = Elapsed_ms;
+		}
+		if(Elapsed_ms > Stats->Erase_Max_ms)
+		{
+			Stats->Erase_Max_ms = Elapsed_ms;
+		}
+	}
+}
+
+/* One programmed payload, the cycles add up exactly and are only converted for the reply */
+static void BL_Flash_Stats_Program(uint32_t Address, uint32_t Length, uint32_t Cycles)
+{
+	uint8_t SectorNumber = Flash_Address_Sector(Address);
+	BL_Sector_Stats *Stats = NULL;
+	uint64_t Elapsed_ns = ((uint64_t)Cycles * 1000U) / (SystemCoreClock / 1000000U);
+	uint32_t Byte_ns = 0;
+	
+	if((SectorNumber >= CBL_FLASH_MAX_SECTOR_NUMBER) || (0 == Length))
+	{
+		return;
+	}
+	Stats = &BL_FLASH_STATS[SectorNumber];
+	Byte_ns = (uint32_t)(Elapsed_ns / Length);
+	Stats->Program_Bytes += Length;
+	Stats->Program_Total_Cycles += Cycles;
+	if(Byte_ns < Stats->Program_Min_ns)
+	{
+		Stats->Program_Min_ns = Byte_ns;
+	}
+	if(Byte_ns > Stats->Program_Max_ns)
+	{
+		Stats->Program_Max_ns = Byte_ns;
+	}
+}
+
+static uint32_t Flash_Program_Width(uint32_t Address, uint32_t Remaining_Len)
+{
+	uint32_t Width = 1;
+	
+	//widest write the parallelism allows that is aligned on the address and fits the remaining bytes
+	while(((Width * 2) <= BL_FLASH_PROGRAM_MAX_WIDTH) && (0 == (Address & ((Width * 2) - 1))) && ((Width * 2) <= Remaining_Len))
+	{
+		Width *= 2;
+	}
+	return Width;
+}
+
+static uint32_t Flash_Sector_Size(uint8_t SectorNumber)
+{
+	uint32_t Sector_Size = 0;
 	
-	//CRC calculation on received data
-	if(CRC_VERIFICATION_PASSED == Bootloader_CRC_Verify((uint8_t *)&Host_Buffer[0] ,HostPacket_Len - 4 ,Host_CRC))
+	//4 x 16KB, 1 x 64KB then 7 x 128KB
+	if(SectorNumber < 4)
 	{
-#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
-		BootLoader_Print_Message("CRC Verification Passed \r\n");
-#endif
-		Bootloader_Send_ACK(1);
-		//perform the erase
-		Erase_Status = Perform_Flash_Erase(Host_Buffer[2],Host_Buffer[3]);
-		
-		if(SUCCESSFUL_ERASE == Erase_Status)
-		{
-			Bootloader_Send_Data_To_Host((uint8_t *)&Erase_Status, 1);
-#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
-			BootLoader_Print_Message("Successful Erase \r\n");
-#endif
-		}
-		else
-		{
-			Bootloader_Send_Data_To_Host((uint8_t *)&Erase_Status, 1);
-#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
-			BootLoader_Print_Message("Erase request failed !!\r\n");
-#endif
-		}
+		Sector_Size = 16 * 1024;
 	}
-	else
+	else if(4 == SectorNumber)
 	{
-#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
-	BootLoader_Print_Message("CRC Verification Failed \r\n");
-#endif		
-		Bootloader_Send_NACK();
+		Sector_Size = 64 * 1024;
 	}
+	else if(SectorNumber < CBL_FLASH_MAX_SECTOR_NUMBER)
+	{
+		Sector_Size = 128 * 1024;
+	}
+	return Sector_Size;
 }
-static void Bootloader_Memory_Write(uint8_t *Host_Buffer)
+
+static uint16_t Flash_Blank_Sectors(uint32_t Address, uint32_t Length)
 {
-	uint16_t HostPacket_Len = 0;
-  uint32_t Host_CRC = 0;
-	uint32_t HOST_Address = 0;
-	uint8_t Payload_Len = 0;
-	uint8_t Address_Verification = ADDRESS_IS_INVALID;
-	uint8_t Flash_Payload_Write_Status = FLASH_PAYLOAD_WRITE_FAILED;
-#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
-	BootLoader_Print_Message("Write data into different sections of the MCU \r\n");
-#endif
+	uint16_t Blank_Sectors = 0;
+	uint32_t Sector_Address = FLASH_BASE;
+	uint32_t Sector_Size = 0;
+	uint32_t *Sector_Word = NULL;
 	
-	//extract length of packet and CRC
-	HostPacket_Len = Host_Buffer[0] + 1;
-	Host_CRC = *((uint32_t *)((Host_Buffer + HostPacket_Len) - 4));
-	
-	if(CRC_VERIFICATION_PASSED == Bootloader_CRC_Verify((uint8_t *)&Host_Buffer[0] ,HostPacket_Len - 4 ,Host_CRC))
+	for(uint8_t SectorNumber = 0; SectorNumber < CBL_FLASH_MAX_SECTOR_NUMBER; SectorNumber++)
 	{
-#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
-		BootLoader_Print_Message("CRC Verification Passed \r\n");
-#endif
-		
-		Bootloader_Send_ACK(1);
-		
-		//extracting Payload and Address need to Write on
-		HOST_Address = *((uint32_t *)(&Host_Buffer[2]));
-#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
-		BootLoader_Print_Message("HOST_Address = 0x%X \r\n", HOST_Address);
-#endif
-		Payload_Len = Host_Buffer[6];
-		
-		//check for valid address
-		Address_Verification = Host_Address_Verification(HOST_Address);
-		if(ADDRESS_IS_VALID == Address_Verification)
+		Sector_Size = Flash_Sector_Size(SectorNumber);
+		if((Sector_Address < (Address + Length)) && ((Sector_Address + Sector_Size) > Address))
 		{
-			//write data to flash memory in specific address
-			Flash_Payload_Write_Status = Flash_Memory_Write_Payload((uint8_t *)&Host_Buffer[7],HOST_Address,Payload_Len);
-			if(FLASH_PAYLOAD_WRITE_PASSED == Flash_Payload_Write_Status)
-			{
-				Bootloader_Send_Data_To_Host((uint8_t *)&Flash_Payload_Write_Status, 1);
-#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
-				BootLoader_Print_Message("Payload Valid \r\n");
-#endif
-			}
-			else
+			Blank_Sectors |= (1 << SectorNumber);
+			for(Sector_Word = (uint32_t *)(uintptr_t)Sector_Address; Sector_Word < (uint32_t *)(uintptr_t)(Sector_Address + Sector_Size); Sector_Word++)
 			{
-#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
-				BootLoader_Print_Message("Payload InValid \r\n");
-#endif
-				Bootloader_Send_Data_To_Host((uint8_t *)&Flash_Payload_Write_Status, 1);
+				if(0xFFFFFFFFU != *Sector_Word)
+				{
+					Blank_Sectors &= ~(1 << SectorNumber);
+					break;
+				}
 			}
 		}
-		else
-		{
-			Address_Verification = ADDRESS_IS_INVALID;
-			Bootloader_Send_Data_To_Host((uint8_t *)&Address_Verification, 1);
-		}
-	}
-	else
-	{
-#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
-	BootLoader_Print_Message("CRC Verification Failed \r\n");
-#endif		
-		
-		Bootloader_Send_NACK();
+		Sector_Address += Sector_Size;
 	}
+	return Blank_Sectors;
 }
 
-static void Bootloader_Change_Read_Protection_Level(uint8_t *Host_Buffer)
+/*
+ * CRC of [Range_Address, Range_Address + Range_Length) by the CRC unit, fed word by word by
+ * BL_CRC_DMA_STREAM instead of the CPU. Range_Length is a multiple of 4. The unit goes on
+ * from its current value, the caller resets it first.
+ */
+static HAL_StatusTypeDef Bootloader_CRC_Range_DMA(uint32_t Range_Address, uint32_t Range_Length, uint32_t *Range_CRC)
 {
-	uint16_t HostPacket_Len = 0;
-	uint32_t Host_CRC = 0;
-	uint8_t ROP_Level_Status = ROP_LEVEL_CHANGE_INVALID;
-	uint8_t Host_ROP_Level = 0;
-#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
-	BootLoader_Print_Message("Read FLASH Read Protection Out level \r\n");
-#endif
+	HAL_StatusTypeDef HAL_Status = HAL_OK;
+	uint32_t Remaining_Words = Range_Length / 4;
+	uint32_t Transfer_Words = 0;
 	
-	//extract length of packet and CRC
-	HostPacket_Len = Host_Buffer[0] + 1;
-	Host_CRC = *((uint32_t *)((Host_Buffer + HostPacket_Len) - 4));
+	__HAL_RCC_DMA2_CLK_ENABLE();
+	BL_CRC_DMA_Handle.Instance = BL_CRC_DMA_STREAM;
+	BL_CRC_DMA_Handle.Init.Channel = BL_CRC_DMA_CHANNEL;
+	BL_CRC_DMA_Handle.Init.Direction = DMA_MEMORY_TO_MEMORY;
+	//in memory to memory mode the peripheral port reads the source
+	BL_CRC_DMA_Handle.Init.PeriphInc = DMA_PINC_ENABLE;
+	BL_CRC_DMA_Handle.Init.MemInc = DMA_MINC_DISABLE;
+	BL_CRC_DMA_Handle.Init.PeriphDataAlignment = DMA_PDATAALIGN_WORD;
+	BL_CRC_DMA_Handle.Init.MemDataAlignment = DMA_MDATAALIGN_WORD;
+	BL_CRC_DMA_Handle.Init.Mode = DMA_NORMAL;
+	BL_CRC_DMA_Handle.Init.Priority = DMA_PRIORITY_HIGH;
+	//direct mode is not allowed for memory to memory transfers
+	BL_CRC_DMA_Handle.Init.FIFOMode = DMA_FIFOMODE_ENABLE;
+	BL_CRC_DMA_Handle.Init.FIFOThreshold = DMA_FIFO_THRESHOLD_FULL;
+	BL_CRC_DMA_Handle.Init.MemBurst = DMA_MBURST_SINGLE;
+	BL_CRC_DMA_Handle.Init.PeriphBurst = DMA_PBURST_SINGLE;
+	HAL_Status = HAL_DMA_Init(&BL_CRC_DMA_Handle);
 	
-	//CRC calculation on received data
-	if(CRC_VERIFICATION_PASSED == Bootloader_CRC_Verify((uint8_t *)&Host_Buffer[0] ,HostPacket_Len - 4 ,Host_CRC))
+	while((HAL_OK == HAL_Status) && (Remaining_Words > 0))
 	{
-#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
-		BootLoader_Print_Message("CRC Verification Passed \r\n");
-#endif
-		Bootloader_Send_ACK(1);
-		
-		//get the protection level
-		Host_ROP_Level = Host_Buffer[2];
-		
-		if((CBL_ROP_LEVEL_2 == Host_ROP_Level)||(OB_RDP_LEVEL_2 == Host_ROP_Level))
-		{
-			ROP_Level_Status = ROP_LEVEL_CHANGE_INVALID;
-		}
-		else
+		Transfer_Words = (Remaining_Words > BL_CRC_DMA_MAX_WORDS) ? BL_CRC_DMA_MAX_WORDS : Remaining_Words;
+		HAL_Status = HAL_DMA_Start(&BL_CRC_DMA_Handle, Range_Address, (uint32_t)(uintptr_t)&(hcrc.Instance->DR), Transfer_Words);
+		if(HAL_OK == HAL_Status)
 		{
-			if(CBL_ROP_LEVEL_0 == Host_ROP_Level)
-			{
-				Host_ROP_Level = 0xAA; 
-			}
-			else if(CBL_ROP_LEVEL_1 == Host_ROP_Level)
-			{
-				Host_ROP_Level = 0x55; 
-			}
-			ROP_Level_Status = Change_ROP_Level(Host_ROP_Level);
+			HAL_Status = HAL_DMA_PollForTransfer(&BL_CRC_DMA_Handle, HAL_DMA_FULL_TRANSFER, HAL_MAX_DELAY);
 		}
-		Bootloader_Send_Data_To_Host((uint8_t *)&ROP_Level_Status, 1);
+		Range_Address += Transfer_Words * 4;
+		Remaining_Words -= Transfer_Words;
+	}
+	*Range_CRC = hcrc.Instance->DR;
+	HAL_DMA_DeInit(&BL_CRC_DMA_Handle);
+	return HAL_Status;
+}
+
+/* The whole range must lie in one memory region */
+static uint8_t Host_Range_Verification(uint32_t Range_Address, uint32_t Range_Length)
+{
+	uint8_t Range_Verification = ADDRESS_IS_INVALID;
+	if((0 == Range_Length) || (ADDRESS_IS_INVALID == Host_Address_Verification(Range_Address)))
+	{
+		Range_Verification = ADDRESS_IS_INVALID;
+	}
+	else if(Range_Address >= SRAM1_BASE)
+	{
+		//SRAM1 and SRAM2 are contiguous
+		Range_Verification = (Range_Length <= (STM32F407XX_SRAM2_END - Range_Address)) ? ADDRESS_IS_VALID : ADDRESS_IS_INVALID;
+	}
+	else if(Range_Address >= CCMDATARAM_BASE)
+	{
+		Range_Verification = (Range_Length <= (STM32F407XX_SRAM3_END - Range_Address)) ? ADDRESS_IS_VALID : ADDRESS_IS_INVALID;
 	}
 	else
 	{
-#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
-	BootLoader_Print_Message("CRC Verification Failed \r\n");
-#endif		
-		
-		Bootloader_Send_NACK();
+		Range_Verification = (Range_Length <= (STM32F407XX_FLASH_END - Range_Address)) ? ADDRESS_IS_VALID : ADDRESS_IS_INVALID;
 	}
+	return Range_Verification;
 }
 
-static uint8_t Bootloader_CRC_Verify(uint8_t *pData, uint32_t Data_Len, uint32_t Host_CRC)
+/*
+ * Image at Image_Address startable: descriptor present, image within Region_Length, initial MSP
+ * in SRAM1/SRAM2 or CCM RAM, Thumb reset handler inside the image and the CRC of the image
+ * matching the descriptor.
+ */
+static uint8_t Bootloader_Image_Verification(uint32_t Image_Address, uint32_t Region_Length)
 {
-	uint8_t CRC_Status = CRC_VERIFICATION_FAILED;
-	uint32_t CRC_Calculated = 0;
-	uint32_t Data_Buffer = 0;
+	BL_Image_Descriptor *Descriptor = (BL_Image_Descriptor *)(uintptr_t)(Image_Address + BL_IMAGE_DESCRIPTOR_OFFSET);
+	uint32_t MSP_Value = *((volatile uint32_t *)(uintptr_t)Image_Address);
+	uint32_t Reset_Handler = *((volatile uint32_t *)(uintptr_t)(Image_Address + 4));
+	uint32_t Image_CRC = 0;
+	uint8_t Image_Verification = IMAGE_IS_INVALID;
 	
-	//calculate CRC
-	for(uint8_t Counter = 0; Counter < Data_Len; Counter++){
-		Data_Buffer = (uint32_t)pData[Counter];
-		CRC_Calculated = HAL_CRC_Accumulate(CRC_ENGINE_OBJ, &Data_Buffer, 1);
+	if((BL_IMAGE_MAGIC != Descriptor->Magic) || (Descriptor->Length < BL_IMAGE_MIN_LENGTH) ||
+	   (0 != (Descriptor->Length & 0x3)) || (Descriptor->Length > Region_Length))
+	{
+		Image_Verification = IMAGE_IS_INVALID;
 	}
-	
-	__HAL_CRC_DR_RESET(CRC_ENGINE_OBJ);
-	
-	if(CRC_Calculated == Host_CRC)
+	else if((0 != (MSP_Value & 0x3)) ||
+	        (((MSP_Value <= SRAM1_BASE) || (MSP_Value > STM32F407XX_SRAM2_END)) &&
+	         ((MSP_Value <= CCMDATARAM_BASE) || (MSP_Value > STM32F407XX_SRAM3_END))))
 	{
-		CRC_Status = CRC_VERIFICATION_PASSED;
+		Image_Verification = IMAGE_IS_INVALID;
+	}
+	else if((0 == (Reset_Handler & 0x1)) || ((Reset_Handler & ~0x1U) < (Image_Address + BL_IMAGE_MIN_LENGTH)) ||
+	        ((Reset_Handler & ~0x1U) >= (Image_Address + Descriptor->Length)))
+	{
+		Image_Verification = IMAGE_IS_INVALID;
 	}
 	else
 	{
-		CRC_Status = CRC_VERIFICATION_FAILED;
+		//everything before the CRC word, then everything after it
+		__HAL_CRC_DR_RESET(CRC_ENGINE_OBJ);
+		if((HAL_OK == Bootloader_CRC_Range_DMA(Image_Address, BL_IMAGE_CRC_OFFSET, &Image_CRC)) &&
+		   (HAL_OK == Bootloader_CRC_Range_DMA(Image_Address + BL_IMAGE_CRC_OFFSET + 4, Descriptor->Length - BL_IMAGE_CRC_OFFSET - 4, &Image_CRC)) &&
+		   (Image_CRC == Descriptor->Image_CRC))
+		{
+			Image_Verification = IMAGE_IS_VALID;
+		}
+		__HAL_CRC_DR_RESET(CRC_ENGINE_OBJ);
 	}
-	
-	return CRC_Status;
+	return Image_Verification;
 }
 
-static void Bootloader_Send_ACK(uint8_t Replay_Len)
-{
-	//will send 2bytes ACK and LENGTH
-	uint8_t Ack_Value[2] = {0};
-	
-	Ack_Value[0] = CBL_SEND_ACK;
-	Ack_Value[1] = Replay_Len;
-	
-	HAL_UART_Transmit(BL_HOST_COMMUNICATION_UART, (uint8_t *)Ack_Value, 2, HAL_MAX_DELAY);
-}
-static void Bootloader_Send_NACK(void)
+static uint32_t BL_Slot_Address(uint8_t Slot)
 {
-	//will send 1byte the NACK
-	uint8_t Ack_Value = CBL_SEND_NACK;
-	HAL_UART_Transmit(BL_HOST_COMMUNICATION_UART, &Ack_Value, 1, HAL_MAX_DELAY);
-
+	return (BL_SLOT_A == Slot) ? BL_SLOT_A_BASE_ADDRESS : BL_SLOT_B_BASE_ADDRESS;
 }
 
-static void Bootloader_Send_Data_To_Host(uint8_t *Host_Buffer, uint32_t Data_Len)
+static uint8_t BL_Slot_Other(uint8_t Slot)
 {
-	HAL_UART_Transmit(BL_HOST_COMMUNICATION_UART, Host_Buffer, Data_Len, HAL_MAX_DELAY);
+	return (BL_SLOT_A == Slot) ? BL_SLOT_B : BL_SLOT_A;
 }
-static uint8_t Host_Address_Verification(uint32_t Jump_Address)
+
+/* A valid image, and with a record the very image that was switched to */
+static uint8_t BL_Slot_Bootable(const BL_Slot_Record *Record, uint8_t Slot)
 {
-	uint8_t Address_Verification = ADDRESS_IS_INVALID;
-	if((Jump_Address >= SRAM1_BASE) && (Jump_Address <= STM32F407XX_SRAM1_END))
+	uint32_t Slot_Address = 0;
+	uint8_t Slot_Bootable = IMAGE_IS_INVALID;
+	
+	if(Slot < BL_SLOT_COUNT)
 	{
-		Address_Verification = ADDRESS_IS_VALID;
+		Slot_Address = BL_Slot_Address(Slot);
+		Slot_Bootable = Bootloader_Image_Verification(Slot_Address, BL_SLOT_SIZE);
+		if((IMAGE_IS_VALID == Slot_Bootable) && (NULL != Record) &&
+		   (Record->Image_CRC[Slot] != ((BL_Image_Descriptor *)(uintptr_t)(Slot_Address + BL_IMAGE_DESCRIPTOR_OFFSET))->Image_CRC))
+		{
+			Slot_Bootable = IMAGE_IS_INVALID;
+		}
 	}
-	else if((Jump_Address >= SRAM2_BASE) && (Jump_Address <= STM32F407XX_SRAM2_END))
+	return Slot_Bootable;
+}
+
+/*
+ * Slot to start after reset, BL_SLOT_NONE when none is bootable. A confirmation left by the
+ * trial image and the rollbacks are recorded here, the boot attempt only right before the jump.
+ */
+static uint8_t BL_Slot_Select(void)
+{
+	BL_Slot_Record *Record = &BL_Slot_Boot_Record;
+	uint8_t Confirmed = (BL_SLOT_CONFIRM_MAGIC == BL_SLOT_CONFIRM_REGISTER);
+	uint8_t Boot_Slot = BL_SLOT_NONE;
+	
+	//only a confirmation from the run that follows counts
+	BL_SLOT_CONFIRM_REGISTER = 0;
+	
+	if(0 == BL_Slot_Journal_Find(Record))
 	{
-		Address_Verification = ADDRESS_IS_VALID;
+		//never switched, the first valid image is started as it is
+		Record->State = BL_SLOT_STATE_NONE;
+		if(IMAGE_IS_VALID == BL_Slot_Bootable(NULL, BL_SLOT_A))
+		{
+			Boot_Slot = BL_SLOT_A;
+		}
+		else if(IMAGE_IS_VALID == BL_Slot_Bootable(NULL, BL_SLOT_B))
+		{
+			Boot_Slot = BL_SLOT_B;
+		}
+		return Boot_Slot;
 	}
-	else if((Jump_Address >= CCMDATARAM_BASE) && (Jump_Address <= STM32F407XX_SRAM3_END))
+	
+	if((BL_SLOT_STATE_TRIAL == Record->State) && Confirmed)
 	{
-		Address_Verification = ADDRESS_IS_VALID;
+		Record->State = BL_SLOT_STATE_CONFIRMED;
+		Record->Boot_Attempts = 0;
+		BL_Slot_Journal_Append(Record);
 	}
-	else if((Jump_Address >= FLASH_BASE) && (Jump_Address <= STM32F407XX_FLASH_END))
+	if(((BL_SLOT_STATE_TRIAL == Record->State) && (Record->Boot_Attempts >= BL_SLOT_MAX_BOOT_ATTEMPTS)) ||
+	   (IMAGE_IS_INVALID == BL_Slot_Bootable(Record, Record->Active_Slot)))
 	{
-		Address_Verification = ADDRESS_IS_VALID;
+		if(IMAGE_IS_VALID == BL_Slot_Bootable(Record, Record->Previous_Slot))
+		{
+#if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
+			BootLoader_Print_Message("Slot %d rolled back to slot %d \r\n", Record->Active_Slot, Record->Previous_Slot);
+#endif
+			Boot_Slot = Record->Previous_Slot;
+			Record->Previous_Slot = Record->Active_Slot;
+			Record->Active_Slot = Boot_Slot;
+			Record->State = BL_SLOT_STATE_CONFIRMED;
+			Record->Boot_Attempts = 0;
+			BL_Slot_Journal_Append(Record);
+		}
+		else if(BL_SLOT_STATE_TRIAL == Record->State)
+		{
+			//nothing to go back to, the trial image keeps its chance
+			Boot_Slot = (IMAGE_IS_VALID == BL_Slot_Bootable(Record, Record->Active_Slot)) ? Record->Active_Slot : BL_SLOT_NONE;
+		}
 	}
 	else
 	{
-		Address_Verification = ADDRESS_IS_INVALID;
+		Boot_Slot = Record->Active_Slot;
 	}
-	return Address_Verification;
+	return Boot_Slot;
 }
-static uint8_t Perform_Flash_Erase(uint8_t SectorNumber, uint8_t NumberOfSectors)
+
+/*
+ * One record making Slot the active slot on trial with the other slot as rollback target,
+ * or confirming it when it is the active slot already. Refused unless Slot holds a valid image.
+ */
+static uint8_t BL_Slot_Activate(uint8_t Slot, uint32_t Version)
 {
-	uint8_t Sector_Status = INVALID_SECTOR_NUMBER;
-	FLASH_EraseInitTypeDef Erase;
-	uint8_t Remaining_Sectors = 0;
-	HAL_StatusTypeDef HAL_Status = HAL_ERROR;
-	uint32_t SectorError = 0;
+	BL_Slot_Record Record;
+	uint8_t Other_Slot = 0;
+	uint8_t Switch_Status = SLOT_SWITCH_REFUSED;
 	
-	if(NumberOfSectors > CBL_FLASH_MAX_SECTOR_NUMBER){
-		/* Number Of sectors is out of range */
-		Sector_Status = INVALID_SECTOR_NUMBER;
+	if((Slot >= BL_SLOT_COUNT) || (IMAGE_IS_INVALID == Bootloader_Image_Verification(BL_Slot_Address(Slot), BL_SLOT_SIZE)))
+	{
+		return SLOT_SWITCH_REFUSED;
 	}
-	else
+	
+	Other_Slot = BL_Slot_Other(Slot);
+	if(0 == BL_Slot_Journal_Find(&Record))
 	{
-		//erase from between
-		if((NumberOfSectors <= (CBL_FLASH_MAX_SECTOR_NUMBER - 1))||(CBL_FLASH_MASS_ERASE == SectorNumber))
+		//first record, the image already in the other slot becomes the rollback target
+		memset(&Record, 0, sizeof(Record));
+		Record.Active_Slot = BL_SLOT_NONE;
+		if(IMAGE_IS_VALID == Bootloader_Image_Verification(BL_Slot_Address(Other_Slot), BL_SLOT_SIZE))
 		{
-			if(CBL_FLASH_MASS_ERASE == SectorNumber)
-			{
-				Erase.TypeErase = FLASH_TYPEERASE_MASSERASE;
+			Record.Image_CRC[Other_Slot] = ((BL_Image_Descriptor *)(uintptr_t)(BL_Slot_Address(Other_Slot) + BL_IMAGE_DESCRIPTOR_OFFSET))->Image_CRC;
+		}
+	}
+	Record.State = (Slot == Record.Active_Slot) ? BL_SLOT_STATE_CONFIRMED : BL_SLOT_STATE_TRIAL;
+	Record.Active_Slot = Slot;
+	Record.Previous_Slot = Other_Slot;
+	Record.Boot_Attempts = 0;
+	Record.Version[Slot] = Version;
+	Record.Image_CRC[Slot] = ((BL_Image_Descriptor *)(uintptr_t)(BL_Slot_Address(Slot) + BL_IMAGE_DESCRIPTOR_OFFSET))->Image_CRC;
+	Switch_Status = (FLASH_PAYLOAD_WRITE_PASSED == BL_Slot_Journal_Append(&Record)) ? SLOT_SWITCH_DONE : SLOT_SWITCH_FAILED;
 #if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
-				BootLoader_Print_Message("Flash Mass erase activation \r\n");
+	BootLoader_Print_Message("Slot %d version %d %s, record %d \r\n", Slot, Version,
+	                         (BL_SLOT_STATE_TRIAL == Record.State) ? "on trial" : "confirmed", Record.Sequence);
 #endif
-			}
-			else
-			{
+	return Switch_Status;
+}
+
+/*
+ * Slot written by the update agent of the application, recorded like CBL_SLOT_SWITCH_CMD.
+ * SLOT_SWITCH_REFUSED without a handoff or for an image that does not verify, the slot
+ * that was running then stays active.
+ */
+static uint8_t BL_Slot_Handoff(void)
+{
+	uint32_t Handoff = BL_UPDATE_HANDOFF_REGISTER;
+	uint32_t Version = BL_UPDATE_HANDOFF_VERSION_REGISTER;
+	uint8_t Handoff_Status = SLOT_SWITCH_REFUSED;
+	
+	if(BL_UPDATE_HANDOFF_MAGIC == (Handoff & ~BL_UPDATE_HANDOFF_SLOT_MASK))
+	{
+		//one shot, a reset during the switch does not repeat it
+		BL_UPDATE_HANDOFF_REGISTER = 0;
+		Handoff_Status = BL_Slot_Activate((uint8_t)(Handoff & BL_UPDATE_HANDOFF_SLOT_MASK), Version);
 #if (BL_DEBUG_ENABLE == DEBUG_INFO_ENABLE)
-				BootLoader_Print_Message("User needs Sector erase \r\n");
+		BootLoader_Print_Message("Update agent handoff to slot %d %s \r\n", Handoff & BL_UPDATE_HANDOFF_SLOT_MASK,
+		                         (SLOT_SWITCH_DONE == Handoff_Status) ? "recorded" : "refused");
 #endif
-				//need to erase from sector 5 20 sectors but the avalibale will be from 5 to 11 (6)
-				Remaining_Sectors = CBL_FLASH_MAX_SECTOR_NUMBER - SectorNumber;//12-5
-				if(NumberOfSectors > Remaining_Sectors)//is this number grater that remaining
-				{
-					//force write the remaing sector 
-					NumberOfSectors = Remaining_Sectors;
-				}
-				else{/*nothig*/}
-				Erase.TypeErase = FLASH_TYPEERASE_SECTORS;
-				
-				//this sector is errased
-				Erase.Sector = SectorNumber;
-				
-				//Number of sectors to be erased
-				Erase.NbSectors = NumberOfSectors;
-			}
-			Erase.Banks = FLASH_BANK_1;
-			Erase.VoltageRange = FLASH_VOLTAGE_RANGE_3;
-			
-			//unlock FCRegister
-			HAL_Status = HAL_FLASH_Unlock();
-			
-			//perform the Erasing
-			HAL_Status = HAL_FLASHEx_Erase(&Erase,&SectorError);
-			if(HAL_SUCCESSFUL_ERASE == SectorError)
-			{
-				Sector_Status = SUCCESSFUL_ERASE;
-			}
-			else
-			{
-				Sector_Status = UNSUCCESSFUL_ERASE;
-			}
-			//lock FCRegister
-			HAL_Status = HAL_FLASH_Lock();
-		}
-		else
-		{
-			Sector_Status = UNSUCCESSFUL_ERASE;
-		}
 	}
-	
-	return Sector_Status;
-	
+	return Handoff_Status;
 }
-static uint8_t Flash_Memory_Write_Payload(uint8_t *Host_Payload, uint32_t Payload_Start_Address, uint16_t Payload_Len)
+
+/* Every start of a trial image is recorded, BL_SLOT_MAX_BOOT_ATTEMPTS of them end the trial */
+static void BL_Slot_Count_Boot_Attempt(void)
 {
-	HAL_StatusTypeDef HAL_Status = HAL_ERROR;
-	uint8_t Flash_Payload_Write_Status = FLASH_PAYLOAD_WRITE_FAILED;
-	uint16_t Counter = 0;
-	
-	//Unlock FCRegister
-	HAL_Status = HAL_FLASH_Unlock();
-	
-	if(HAL_Status != HAL_OK){
-		Flash_Payload_Write_Status = FLASH_PAYLOAD_WRITE_FAILED;
+	if((BL_SLOT_STATE_TRIAL == BL_Slot_Boot_Record.State) && (BL_Slot_Boot_Record.Boot_Attempts < 0xFF))
+	{
+		BL_Slot_Boot_Record.Boot_Attempts++;
+		BL_Slot_Journal_Append(&BL_Slot_Boot_Record);
 	}
-	else
+}
+
+/*
+ * Newest valid record of the two journal sectors into Record.
+ * Returns its flash address, 0 when the journal holds no valid record.
+ */
+static uint32_t BL_Slot_Journal_Find(BL_Slot_Record *Record)
+{
+	const BL_Slot_Record *Entry = NULL;
+	uint32_t Record_Address = 0;
+	
+	for(uint32_t Sector = 0; Sector < 2; Sector++)
 	{
-		for(Counter =0;Counter<Payload_Len;Counter++)
+		Entry = (const BL_Slot_Record *)(uintptr_t)(BL_SLOT_JOURNAL_ADDRESS + (Sector * BL_SLOT_JOURNAL_SECTOR_SIZE));
+		//records are appended in order, the first erased magic ends the sector
+		for(uint32_t Index = 0; (Index < BL_SLOT_JOURNAL_RECORDS) && (0xFFFFFFFFU != Entry->Magic); Index++, Entry++)
 		{
-			HAL_Status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_BYTE,Payload_Start_Address+Counter,Host_Payload[Counter]);
-			if(HAL_Status != HAL_OK)
-			{
-				Flash_Payload_Write_Status = FLASH_PAYLOAD_WRITE_FAILED;
-				break;
-			}
-			else
+			if((BL_SLOT_RECORD_MAGIC == Entry->Magic) && (Entry->Record_CRC == BL_Slot_Record_CRC(Entry)) &&
+			   ((0 == Record_Address) || ((int32_t)(Entry->Sequence - Record->Sequence) > 0)))
 			{
-				Flash_Payload_Write_Status = FLASH_PAYLOAD_WRITE_PASSED;
+				memcpy(Record, Entry, sizeof(BL_Slot_Record));
+				Record_Address = (uint32_t)(uintptr_t)Entry;
 			}
-			
 		}
 	}
-	if((FLASH_PAYLOAD_WRITE_PASSED == Flash_Payload_Write_Status)&&(HAL_OK == HAL_Status))
+	return Record_Address;
+}
+
+/*
+ * Record goes in after the newest one, or at the start of the other journal sector once
+ * that sector is full. Magic is programmed first and the CRC last, a record torn by a
+ * power loss never verifies and the previous one stays current.
+ */
+static uint8_t BL_Slot_Journal_Append(BL_Slot_Record *Record)
+{
+	BL_Slot_Record Last_Record;
+	uint32_t Last_Address = BL_Slot_Journal_Find(&Last_Record);
+	uint32_t Sector = 0;
+	uint32_t Entry_Address = BL_SLOT_JOURNAL_ADDRESS;
+	uint32_t Sector_End = 0;
+	uint8_t Write_Status = FLASH_PAYLOAD_WRITE_FAILED;
+	
+	if(0 != Last_Address)
 	{
-		HAL_Status = HAL_FLASH_Lock();
-		if(HAL_Status != HAL_OK)
-		{
-		Flash_Payload_Write_Status = FLASH_PAYLOAD_WRITE_FAILED;
-		}
-		else
+		Sector = (Last_Address - BL_SLOT_JOURNAL_ADDRESS) / BL_SLOT_JOURNAL_SECTOR_SIZE;
+		Entry_Address = Last_Address + sizeof(BL_Slot_Record);
+	}
+	Sector_End = BL_SLOT_JOURNAL_ADDRESS + ((Sector + 1) * BL_SLOT_JOURNAL_SECTOR_SIZE);
+	//skip whatever a torn write left behind, programming can only clear bits
+	while((Entry_Address < Sector_End) && (0 != memcmp((void *)(uintptr_t)Entry_Address, &BL_Slot_Erased_Record, sizeof(BL_Slot_Record))))
+	{
+		Entry_Address += sizeof(BL_Slot_Record);
+	}
+	if(Entry_Address >= Sector_End)
+	{
+		Sector ^= 1;
+		Entry_Address = BL_SLOT_JOURNAL_ADDRESS + (Sector * BL_SLOT_JOURNAL_SECTOR_SIZE);
+		if(SUCCESSFUL_ERASE != Perform_Flash_Erase(BL_SLOT_JOURNAL_FIRST_SECTOR + Sector, 1))
 		{
-			Flash_Payload_Write_Status = FLASH_PAYLOAD_WRITE_PASSED;
+			return FLASH_PAYLOAD_WRITE_FAILED;
 		}
 	}
-	else
+	
+	Record->Magic = BL_SLOT_RECORD_MAGIC;
+	Record->Sequence = (0 != Last_Address) ? (Last_Record.Sequence + 1) : 1;
+	Record->Record_CRC = BL_Slot_Record_CRC(Record);
+	Write_Status = Flash_Memory_Write_Payload((uint8_t *)Record, Entry_Address, sizeof(BL_Slot_Record));
+	if((FLASH_PAYLOAD_WRITE_PASSED == Write_Status) && (0 != memcmp((void *)(uintptr_t)Entry_Address, Record, sizeof(BL_Slot_Record))))
 	{
-		Flash_Payload_Write_Status = FLASH_PAYLOAD_WRITE_FAILED;
+		Write_Status = FLASH_PAYLOAD_WRITE_FAILED;
 	}
-	return Flash_Payload_Write_Status;
+	return Write_Status;
+}
+
+/* CRC unit over the words in front of Record_CRC */
+static uint32_t BL_Slot_Record_CRC(const BL_Slot_Record *Record)
+{
+	uint32_t Record_CRC = HAL_CRC_Calculate(CRC_ENGINE_OBJ, (uint32_t *)Record, (sizeof(BL_Slot_Record) - 4) / 4);
+	
+	//leave the unit ready for the next frame check
+	__HAL_CRC_DR_RESET(CRC_ENGINE_OBJ);
+	return Record_CRC;
 }
 
 static uint8_t CBL_STM32F407_Get_RDP_Level()
@@ -692,6 +2975,7 @@ static uint8_t CBL_STM32F407_Get_RDP_Level()
 	
 	return (uint8_t)(FLASH_OBProgram.RDPLevel);
 }
+#if (BL_ROP_CHANGE == BL_ROP_CHANGE_ENABLE)
 static uint8_t Change_ROP_Level(uint32_t ROP_Level)
 {
 	HAL_StatusTypeDef HAL_Status = HAL_ERROR;
@@ -757,25 +3041,57 @@ static uint8_t Change_ROP_Level(uint32_t ROP_Level)
 	}
 	return ROP_Level_Status;
 }
+#endif
 
-static void bootloader_jump_to_user_app(void)
+static void bootloader_jump_to_user_app(uint32_t Image_Address)
 {
 		uint32_t MSP_Value,MainAppAddr;
 		//Value of the main stack pointer of our main application
-		MSP_Value = *((volatile uint32_t *)FLASH_SECTOR2_BASE_ADDRESS);
+		MSP_Value = *((volatile uint32_t *)(uintptr_t)Image_Address);
 	
 		//Reset Handler definition function of our main application
-		MainAppAddr = *((volatile uint32_t *)(FLASH_SECTOR2_BASE_ADDRESS + 4));
+		MainAppAddr = *((volatile uint32_t *)(uintptr_t)(Image_Address + 4));
 			
 		//fetch reset handler
-		MainApp ResetHandler_Address = (MainApp)MainAppAddr;
+		MainApp ResetHandler_Address = (MainApp)(uintptr_t)MainAppAddr;
 		
-		//set MSP
-		__set_MSP(MSP_Value);
+#if (BL_DEBUG_METHOD == BL_ENABLE_UART_DEBUG_MESSAGE)
+		//the DMA must not keep running into the application
+		BL_Log_Flush();
+#endif
+		
+		//the backup domain is still writable, the reset below closes it again
+		BL_Boot_Time_Mark();
+		BL_BOOT_LATENCY_REGISTER = BL_Boot_Elapsed_us;
 		
-		//Disable all modules
+		//Disable all modules, the application finds them in their reset state
+		HAL_UART_DeInit(BL_HOST_COMMUNICATION_UART);
+		HAL_UART_DeInit(BL_DEBUG_START);
+		HAL_CRC_DeInit(CRC_ENGINE_OBJ);
 		HAL_RCC_DeInit();
+		HAL_DeInit();
+		
+		//no SysTick or pending interrupt of the bootloader may fire into the application
+		__disable_irq();
+		SysTick->CTRL = 0;
+		SysTick->LOAD = 0;
+		SysTick->VAL = 0;
+		for(uint32_t Counter = 0; Counter < (sizeof(NVIC->ICER) / sizeof(NVIC->ICER[0])); Counter++)
+		{
+			NVIC->ICER[Counter] = 0xFFFFFFFFU;
+			NVIC->ICPR[Counter] = 0xFFFFFFFFU;
+		}
+		
+		//exceptions are taken from the vector table of the application
+		SCB->VTOR = Image_Address;
+		
+		//set MSP
+		__set_MSP(MSP_Value);
+		__DSB();
+		__ISB();
+		//PRIMASK as after a reset, nothing is enabled any more
+		__enable_irq();
 		
 		//jump to resetHandler to se if going to main or sysinit
 		ResetHandler_Address();
-}
\ No newline at end of file
+}
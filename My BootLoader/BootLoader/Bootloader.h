@@ -21,6 +21,49 @@ typedef enum{
 typedef void (*MainApp)(void);
 typedef void (*Jump_Ptr)(void);
 
+typedef void (*BL_Command_Handler)(uint8_t *Host_Buffer);
+
+typedef struct{
+	BL_Command_Handler Handler;
+	uint16_t Min_Length;
+	uint16_t Max_Length;
+	uint8_t Reply_Length;
+	uint8_t Flags;
+}BL_Command_Descriptor;
+
+/* Reserved words 7 to 9 of the application vector table */
+typedef struct{
+	uint32_t Magic;
+	uint32_t Length;
+	uint32_t Image_CRC;
+}BL_Image_Descriptor;
+
+/* Slot metadata record, appended to the journal in BL_SLOT_JOURNAL_FIRST_SECTOR.. */
+typedef struct{
+	uint32_t Magic;
+	uint32_t Sequence;
+	uint8_t Active_Slot;
+	uint8_t Previous_Slot;
+	uint8_t State;
+	uint8_t Boot_Attempts;
+	uint32_t Version[2];
+	uint32_t Image_CRC[2];
+	uint32_t Record_CRC;
+}BL_Slot_Record;
+
+/* Wear and timing of one flash sector, kept in the backup SRAM */
+typedef struct{
+	uint64_t Program_Total_Cycles;  /* core cycles, sent in ns */
+	uint32_t Erase_Count;      /* every erase, mass erases included */
+	uint32_t Erase_Timed;      /* erases of the sector alone, with a duration */
+	uint32_t Erase_Min_ms;
+	uint32_t Erase_Max_ms;
+	uint32_t Erase_Total_ms;
+	uint32_t Program_Bytes;
+	uint32_t Program_Min_ns;   /* per byte, over one payload */
+	uint32_t Program_Max_ns;
+}BL_Sector_Stats;
+
 //---------------------------------------
 //-*-*-*-*-*-*-*-*-*-*-*-
 //Macros for Configurations
@@ -33,13 +76,90 @@ typedef void (*Jump_Ptr)(void);
 #define DEBUG_INFO_ENABLE            1
 #define BL_DEBUG_ENABLE              DEBUG_INFO_ENABLE
 
-#define BL_HOST_BUFFER_RX_LENGTH     200
+/*
+ * Host frames
+ * Legacy : Len | CMD | fields | CRC(4), Len is one byte and counts the bytes after it
+ * Large  : 0xFF | Len(2) | CMD | fields | CRC(4), Len counts the bytes after the length field.
+ *          Accepted for the memory write commands once CBL_FRAME_NEGOTIATE_CMD agreed on
+ *          a payload size, their payload length field is then 2 bytes wide.
+ */
+#define BL_HOST_LARGE_FRAME_MARKER   0xFF
+#define BL_HOST_LARGE_HEADER_LENGTH  3
+#define BL_HOST_LARGE_PAYLOAD_LENGTH 4096
+/* CMD, Session, Seq(2), Address(4), Payload_Len(2) and CRC(4) around the largest payload */
+#define BL_HOST_LARGE_FIELDS_LENGTH  14
+#define BL_HOST_BUFFER_RX_LENGTH     (BL_HOST_LARGE_HEADER_LENGTH + BL_HOST_LARGE_FIELDS_LENGTH + BL_HOST_LARGE_PAYLOAD_LENGTH)
+
+/*
+ * USART3 reception from the host
+ * BL_HOST_RX_BLOCKING : HAL_UART_Receive, the link is idle while a frame is processed
+ * BL_HOST_RX_DMA      : circular DMA into a ring of BL_HOST_RX_FRAME_DEPTH frame buffers,
+ *                       the next frames arrive while frame N is verified and programmed.
+ *                       Needs the USART3_RX DMA stream (DMA1 Stream1 Channel4) and the
+ *                       USART3/DMA1_Stream1 interrupts enabled in CubeMX (MX_DMA_Init).
+ *                       Without a stream linked to the UART it receives like BL_HOST_RX_BLOCKING.
+ * The host must not keep more than BL_HOST_RX_WINDOW_LENGTH bytes in flight, the value
+ * is reported by CBL_FRAME_NEGOTIATE_CMD. One frame buffer of the ring is kept out of the
+ * window. A ring or UART overrun drops everything received until the line is quiet for
+ * BL_HOST_RX_FLUSH_IDLE_MS and is answered with a NACK, the host resends from its last ACK.
+ */
+#define BL_HOST_RX_BLOCKING          0x00
+#define BL_HOST_RX_DMA               0x01
+#define BL_HOST_RX_METHOD            (BL_HOST_RX_DMA)
+#define BL_HOST_RX_FRAME_DEPTH       3
+#define BL_HOST_RX_RING_LENGTH       (BL_HOST_RX_FRAME_DEPTH * BL_HOST_BUFFER_RX_LENGTH)
+#define BL_HOST_RX_FLUSH_IDLE_MS     5
+#if (BL_HOST_RX_METHOD == BL_HOST_RX_DMA)
+#define BL_HOST_RX_WINDOW_LENGTH     (BL_HOST_RX_RING_LENGTH - BL_HOST_BUFFER_RX_LENGTH)
+#else
+#define BL_HOST_RX_WINDOW_LENGTH     BL_HOST_BUFFER_RX_LENGTH
+#endif
 
 #define BL_ENABLE_UART_DEBUG_MESSAGE 0x00
 #define BL_ENABLE_SPI_DEBUG_MESSAGE  0x01
 #define BL_ENABLE_CAN_DEBUG_MESSAGE  0x02
 #define BL_DEBUG_METHOD (BL_ENABLE_UART_DEBUG_MESSAGE)
 
+/*
+ * UART debug messages
+ * Messages are queued in a ring drained by the USART2_TX DMA stream (DMA1 Stream6 Channel4,
+ * DMA1_Stream6/USART2 interrupts enabled in CubeMX), the caller never waits for the line.
+ * Without a stream linked to the UART every message skips the ring and is sent with
+ * HAL_UART_Transmit by the caller, with the interrupts enabled.
+ * A message that does not fit is dropped and counted, the count goes out with the next one.
+ * BL_LOG_FORMAT_TEXT  : the formatted text, real length only
+ * BL_LOG_FORMAT_TOKEN : Sync | Format address(4) | Args length(1) | Args, nothing is formatted
+ *                       on the target. Integer arguments take 4 bytes, strings Len(1) | chars.
+ *                       Log_Decode.py rebuilds the text from the format strings of the image.
+ */
+#define BL_LOG_FORMAT_TEXT           0x00
+#define BL_LOG_FORMAT_TOKEN          0x01
+#define BL_LOG_FORMAT                (BL_LOG_FORMAT_TEXT)
+#define BL_LOG_RING_LENGTH           1024
+#define BL_LOG_MESSAGE_LENGTH        100
+#define BL_LOG_TOKEN_SYNC            0xA5
+#define BL_LOG_TOKEN_HEADER_LENGTH   6
+#define BL_LOG_TOKEN_STRING_LENGTH   32
+/* Time given to the queued messages before the bootloader hands over the CPU, ms */
+#define BL_LOG_FLUSH_TIMEOUT         100
+
+/*
+ * Flash program parallelism, limited by the supply voltage (RM0090 3.6.2)
+ * BL_FLASH_PROGRAM_X8  : byte writes, 1.8V - 2.1V
+ * BL_FLASH_PROGRAM_X16 : up to half-word writes, 2.1V - 2.7V
+ * BL_FLASH_PROGRAM_X32 : up to word writes, 2.7V - 3.6V
+ * BL_FLASH_PROGRAM_X64 : up to double-word writes, needs the external VPP supply
+ * Aligned spans of a payload use the widest write, unaligned head/tail bytes use narrower ones.
+ */
+#define BL_FLASH_PROGRAM_X8          0x00
+#define BL_FLASH_PROGRAM_X16         0x01
+#define BL_FLASH_PROGRAM_X32         0x02
+#define BL_FLASH_PROGRAM_X64         0x03
+#define BL_FLASH_PROGRAM_PARALLELISM (BL_FLASH_PROGRAM_X32)
+/* Widest single write in bytes and the matching erase voltage range */
+#define BL_FLASH_PROGRAM_MAX_WIDTH   (1U << BL_FLASH_PROGRAM_PARALLELISM)
+#define BL_FLASH_VOLTAGE_RANGE       (FLASH_VOLTAGE_RANGE_1 + BL_FLASH_PROGRAM_PARALLELISM)
+
 /* CBL_FLASH_ERASE_CMD */
 #define CBL_FLASH_MAX_SECTOR_NUMBER  12
 #define CBL_FLASH_MASS_ERASE         0xFF   
@@ -65,12 +185,233 @@ typedef void (*Jump_Ptr)(void);
 #define CBL_READ_SECTOR_STATUS_CMD   0x19
 #define CBL_OTP_READ_CMD             0x20
 
+/*
+ * CBL_MEM_READ_CMD: Address(4) | Length(4) | Chunk_Size(2), answered with ACK | 4 | Length(4)
+ * and then the whole range as Chunk | CRC(4) pairs without further requests.
+ * The chunk CRC is the CRC unit result over the little endian words of the chunk.
+ * Refused while the flash read protection is active.
+ */
+#define MEM_READ_REPLY_LENGTH        4
+#define MEM_READ_CHUNK_MAX_LENGTH    4096
+
 /* CBL_MEM_WRITE_CMD */
 #define FLASH_PAYLOAD_WRITE_FAILED   0x00
 #define FLASH_PAYLOAD_WRITE_PASSED   0x01
 
-/* Change Read Out Protection Level */
+/*
+ * Change Read Out Protection Level
+ * BL_ROP_CHANGE_DISABLE : the command is not supported, a wrong level cannot lock the part
+ * BL_ROP_CHANGE_ENABLE  : Frame: Len | CMD | Level | CRC(4)
+ */
 #define CBL_CHANGE_ROP_Level_CMD     0x21
+#define BL_ROP_CHANGE_DISABLE        0
+#define BL_ROP_CHANGE_ENABLE         1
+#define BL_ROP_CHANGE                (BL_ROP_CHANGE_DISABLE)
+/* Pipelined memory write with sequence numbers */
+#define CBL_MEM_WRITE_WINDOW_CMD     0x22
+
+/* CBL_MEM_WRITE_WINDOW_CMD */
+#define WINDOW_FRAME_WRITE_FAILED    0x00   /* frame Seq could not be written, transfer aborted */
+#define WINDOW_FRAME_ACCEPTED        0x01   /* cumulative: every frame up to Seq is written */
+#define WINDOW_FRAME_RETRANSMIT      0x02   /* resend starting at frame Seq */
+#define WINDOW_REPLY_LENGTH          3
+
+/* Agree on the large frame payload size */
+#define CBL_FRAME_NEGOTIATE_CMD      0x23
+/* Reply: Large_Payload(2) | RX_Window(2) | Decompress_Budget(2) */
+#define FRAME_NEGOTIATE_REPLY_LENGTH 6
+
+/* Per-block flash hashes for delta updates */
+#define CBL_FLASH_BLOCK_HASH_CMD     0x24
+/* Reply header: Unique_ID(12) | Range_CRC(4) | Blank_Sectors(2) | Block_Count(2) */
+#define FLASH_HASH_HEADER_LENGTH     20
+#define FLASH_HASH_BLOCK_MIN_LENGTH  256
+
+/*
+ * Compressed memory write, same frame as CBL_MEM_WRITE_WINDOW_CMD with the payload
+ * Raw_Len(2) | LZ4 block. The block is decoded into a staging buffer of
+ * BL_DECOMPRESS_RAM_BUDGET bytes and programmed from there, so Raw_Len may not exceed it.
+ * Matches may reach up to 64KB back into the output of the earlier frames of the
+ * session, which is read back from flash: the staging buffer is all the RAM the
+ * decoder needs.
+ */
+#define CBL_MEM_WRITE_LZ4_CMD        0x25
+#define BL_DECOMPRESS_RAM_BUDGET     4096
+#define LZ4_MIN_MATCH_LENGTH         4
+
+/*
+ * CRC over a range computed on the target: Address(4) | Length(4), answered with
+ * CRC(4) | Cycles(4) | Core_Clock(4). A memory to memory DMA stream feeds the CRC unit
+ * with the words of the range while the CPU waits, Cycles is the DWT cycle count of the
+ * computation. Only DMA2 does memory to memory transfers, and it cannot reach CCM RAM.
+ */
+#define CBL_MEM_CRC_CMD              0x26
+#define MEM_CRC_REPLY_LENGTH         12
+#define BL_CRC_DMA_STREAM            DMA2_Stream0
+#define BL_CRC_DMA_CHANNEL           DMA_CHANNEL_0
+/* NDTR is 16 bits wide, longer ranges take several transfers */
+#define BL_CRC_DMA_MAX_WORDS         0xFFFF
+
+/*
+ * Change the host link rate: Baud(4), answered at the current rate with ACK | 1 | Status.
+ * Once accepted the bootloader switches and expects the very same frame again at the new
+ * rate within BL_HOST_BAUD_CONFIRM_TIMEOUT ms, answered with BAUD_CHANGE_CONFIRMED.
+ * Anything else and it falls back to the previous rate.
+ * USART3 runs from PCLK1 with 16x oversampling: PCLK1 / 16 at most, 2.625 Mbaud at 42 MHz.
+ */
+#define CBL_CHANGE_BAUD_CMD          0x27
+#define BAUD_CHANGE_REJECTED         0x00
+#define BAUD_CHANGE_ACCEPTED         0x01
+#define BAUD_CHANGE_CONFIRMED        0x02
+#define CHANGE_BAUD_FRAME_LENGTH     10
+#define BL_HOST_BAUD_MIN             9600
+/* Largest difference between the requested and the generated rate, per mille */
+#define BL_HOST_BAUD_MAX_ERROR       20
+#define BL_HOST_BAUD_CONFIRM_TIMEOUT 500
+
+/*
+ * A/B application slots, reply: Active(1) | Previous(1) | State(1) | Boot_Attempts(1) | Sequence(4) |
+ * Version(4) x 2 | Image_Valid(1) x 2. Active is BL_SLOT_NONE and State BL_SLOT_STATE_NONE while the
+ * journal holds no record.
+ */
+#define CBL_SLOT_STATUS_CMD          0x28
+#define SLOT_STATUS_REPLY_LENGTH     18
+/*
+ * Slot(1) | Version(4), answered with ACK | 1 | Status. The image in Slot is checked, then one
+ * record makes it the active slot on trial, the other slot becomes the rollback target. Naming
+ * the active slot again confirms it. Nothing but the journal is written.
+ */
+#define CBL_SLOT_SWITCH_CMD          0x29
+#define SLOT_SWITCH_REFUSED          0x00
+#define SLOT_SWITCH_DONE             0x01
+#define SLOT_SWITCH_FAILED           0x02
+
+/*
+ * Erase in the background: Sector | Count as CBL_FLASH_ERASE_CMD, answered at once with ACK | 1 |
+ * VALID_SECTOR_NUMBER when the erase started. HAL_FLASHEx_Erase_IT then erases one sector after the
+ * other and each of them is reported by an event between two replies:
+ * BL_ERASE_EVENT_MARKER | Sector | SUCCESSFUL_ERASE or UNSUCCESSFUL_ERASE | Sectors_Done | Sectors_Total
+ * The erase is over with Sectors_Done == Sectors_Total or an UNSUCCESSFUL_ERASE event, a mass
+ * erase is one event for sector CBL_FLASH_MASS_ERASE.
+ * Commands without BL_CMD_DURING_ERASE wait for the end of the erase, the frames sent meanwhile
+ * are kept in the RX DMA ring. The F407 has a single flash bank, the core stalls on its next flash
+ * fetch until the sector under erase is done: the bootloader answers between two sectors.
+ * Needs the FLASH global interrupt enabled in CubeMX (MX_NVIC_Init), FLASH_IRQHandler calls
+ * HAL_FLASH_IRQHandler. With the interrupt disabled BL_Erase_Poll calls it instead.
+ */
+#define CBL_FLASH_ERASE_ASYNC_CMD    0x2A
+#define ERASE_ASYNC_BUSY             0x04
+#define BL_ERASE_EVENT_MARKER        0xE5
+#define BL_ERASE_EVENT_LENGTH        5
+/* State(1) | Sector(1) | Sectors_Done(1) | Sectors_Total(1) | Elapsed_ms(4), the last erase or the running one */
+#define CBL_ERASE_STATUS_CMD         0x2B
+#define ERASE_STATUS_REPLY_LENGTH    8
+#define BL_ERASE_IDLE                0x00
+#define BL_ERASE_RUNNING             0x01
+#define BL_ERASE_DONE                0x02
+#define BL_ERASE_FAILED              0x03
+
+/*
+ * Staged memory write, same frame as CBL_MEM_WRITE_WINDOW_CMD. The payloads are only copied into
+ * the CCM RAM and acknowledged, the flash is not touched until CBL_STAGE_COMMIT_CMD. The first frame
+ * of an empty stage sets its base, Address rounded down to BL_STAGE_CHUNK_LENGTH, and every frame has
+ * to fall in the BL_STAGE_LENGTH bytes from there. A bitmap records the chunks that received data.
+ * Staging also runs while CBL_FLASH_ERASE_ASYNC_CMD erases. A new session discards the stage.
+ * Only flash addresses, LZ4 payloads are not accepted: their matches read back the flash.
+ */
+#define CBL_MEM_WRITE_STAGED_CMD     0x2C
+/*
+ * Program the stage in one unlock/lock cycle with the widest program size and empty it, reply:
+ * Status(1) | Base(4) | Chunks(2), FLASH_PAYLOAD_WRITE_PASSED or FAILED. Words still 0xFF are skipped.
+ */
+#define CBL_STAGE_COMMIT_CMD         0x2D
+#define STAGE_COMMIT_REPLY_LENGTH    7
+#define BL_STAGE_BUFFER              ((uint8_t *)CCMDATARAM_BASE)
+#define BL_STAGE_LENGTH              STM32F407XX_SRAM3_SIZE
+#define BL_STAGE_CHUNK_LENGTH        256
+#define BL_STAGE_CHUNK_COUNT         (BL_STAGE_LENGTH / BL_STAGE_CHUNK_LENGTH)
+
+/*
+ * RAM images, for test firmware that runs without touching the flash. The memory write commands
+ * copy payloads inside BL_RAM_IMAGE_BASE..BL_RAM_IMAGE_END with memcpy, any other RAM address is
+ * refused. The first BL_RAM_RESERVED_LENGTH bytes of SRAM1 belong to the bootloader, its IRAM1
+ * region may not grow past them. The F407 fetches instructions from SRAM1/SRAM2 only, not CCM RAM.
+ * Run: Address(4) of the vector table, answered with ACK | 1 | IMAGE_IS_VALID or IMAGE_IS_INVALID.
+ * The image is checked like a slot image (descriptor, MSP, reset handler and CRC), then started
+ * with VTOR and MSP taken from its vector table. Address must suit VTOR, a multiple of
+ * BL_RAM_IMAGE_VTOR_ALIGN.
+ */
+#define CBL_RAM_RUN_CMD              0x2E
+#define BL_RAM_RESERVED_LENGTH       (32 * 1024)
+#define BL_RAM_IMAGE_BASE            (SRAM1_BASE + BL_RAM_RESERVED_LENGTH)
+#define BL_RAM_IMAGE_END             STM32F407XX_SRAM2_END
+#define BL_RAM_IMAGE_VTOR_ALIGN      512
+
+/*
+ * Flash wear and timing per sector, answered with ACK | 0xFF | Len(2) | Sector_Count(1) | BL_Sector_Stats x Sector_Count.
+ * The table lives in the 4KB backup SRAM with the backup regulator on, so it outlives resets and,
+ * with a VBAT supply, power cycles. Every erase counts, the blocking erase and the background one
+ * time each sector alone in ms (a mass erase is counted but not timed). Programming is timed per
+ * payload with the DWT cycle counter and booked to the sector of its first byte.
+ */
+#define CBL_FLASH_STATS_CMD          0x2F
+#define FLASH_STATS_REPLY_LENGTH     (1 + (CBL_FLASH_MAX_SECTOR_NUMBER * sizeof(BL_Sector_Stats)))
+#define BL_FLASH_STATS_MAGIC         0x57454153U
+#define BL_FLASH_STATS_MAGIC_WORD    (*((volatile uint32_t *)BKPSRAM_BASE))
+/* 8 bytes in, the 64-bit totals stay aligned */
+#define BL_FLASH_STATS               ((BL_Sector_Stats *)(BKPSRAM_BASE + 8))
+
+/*
+ * Command latency, counted with the DWT cycle counter
+ * BL_PROFILE_DISABLE : nothing is measured and the command is not supported
+ * BL_PROFILE_ENABLE  : every frame is split in phases, each phase adds its cycles to a log2
+ *                      histogram of its command. Bucket 0 counts below 2^BL_PROFILE_FIRST_BUCKET_SHIFT
+ *                      cycles, bucket b up to twice the start of b, the last one everything above.
+ * RX      : from the length byte to the last CRC byte
+ * CRC     : Bootloader_CRC_Verify of the frame
+ * HANDLER : the wait for a background erase and the handler, its messages and replies excluded
+ * PRINT   : BootLoader_Print_Message calls, formatting and queueing
+ * TX      : ACK, NACK and reply bytes sent to the host
+ * Frame: Len | CMD | Clear(1) | CRC(4), Clear 1 resets the histograms once they are sent.
+ * Reply: ACK | 0xFF | Len(2) | Core_Clock(4) | Command_Count(1) | per command with samples:
+ *        CMD | per phase: Max_Cycles(4) | Bucket counts(2) x BL_PROFILE_BUCKETS, counts stop at 0xFFFF.
+ * The histograms take BL_COMMAND_TABLE_LENGTH * BL_PROFILE_PHASES * (4 + 2 * BL_PROFILE_BUCKETS) bytes of RAM.
+ */
+#define BL_PROFILE_DISABLE           0
+#define BL_PROFILE_ENABLE            1
+#define BL_PROFILE                   (BL_PROFILE_ENABLE)
+#define CBL_PROFILE_CMD              0x30
+#define BL_PROFILE_PHASE_RX          0
+#define BL_PROFILE_PHASE_CRC         1
+#define BL_PROFILE_PHASE_HANDLER     2
+#define BL_PROFILE_PHASE_PRINT       3
+#define BL_PROFILE_PHASE_TX          4
+#define BL_PROFILE_PHASES            5
+#define BL_PROFILE_BUCKETS           20
+#define BL_PROFILE_FIRST_BUCKET_SHIFT 10
+#define BL_PROFILE_COUNT_MAX         0xFFFF
+#define BL_PROFILE_ENTRY_LENGTH      (1 + (BL_PROFILE_PHASES * (4 + (2 * BL_PROFILE_BUCKETS))))
+
+/*
+ * Command table, indexed by command code - BL_COMMAND_FIRST
+ * The dispatcher checks every frame once before its handler runs: known command, frame format,
+ * length from CMD to CRC within Min_Length..Max_Length, and CRC. It then sends ACK | Reply_Length,
+ * handlers with BL_REPLY_BY_HANDLER send their own acknowledgement (or NACK invalid fields).
+ * BL_CMD_LARGE_FRAME : also accepted in the large frame format
+ * BL_CMD_WINDOWED    : a CRC error is answered with a window retransmit request, not a NACK
+ * BL_CMD_DURING_ERASE: runs while CBL_FLASH_ERASE_ASYNC_CMD erases, the others wait for its end
+ */
+#define BL_COMMAND_FIRST             CBL_GET_VER_CMD
+#define BL_COMMAND_LAST              CBL_PROFILE_CMD
+#define BL_COMMAND_TABLE_LENGTH      (BL_COMMAND_LAST - BL_COMMAND_FIRST + 1)
+#define BL_COMMAND_LENGTH(Fields)    (1 + (Fields) + CRC_TYPE_SIZE_BYTE)
+#define BL_REPLY_BY_HANDLER          0
+#define BL_CMD_LARGE_FRAME           0x01
+#define BL_CMD_WINDOWED              0x02
+#define BL_CMD_DURING_ERASE          0x04
+
+/* ACK with a 2 bytes length: ACK | 0xFF | Len(2), for replies longer than 254 bytes */
+#define CBL_ACK_LONG_LENGTH          0xFF
 
 #define CBL_VENDOR_ID                100
 #define CBL_SW_MAJOR_VERSION         1
@@ -84,8 +425,92 @@ typedef void (*Jump_Ptr)(void);
 #define CBL_SEND_NACK                0xAB
 #define CBL_SEND_ACK                 0xCD
 
-/* Start address of sector 2 */
-#define FLASH_SECTOR2_BASE_ADDRESS   0x08008000U
+/*
+ * Flash layout
+ * Sectors 0-1  : bootloader
+ * Sectors 2-3  : slot journal, two 16KB sectors of BL_Slot_Record
+ * Sectors 5-7  : slot A, 384KB
+ * Sectors 8-10 : slot B, 384KB
+ * An image is linked for the slot it runs from. The host writes the slot that is not active,
+ * then CBL_SLOT_SWITCH_CMD appends a record: the switch and the rollback never erase a slot.
+ * The journal is append only, the valid record with the highest Sequence is the current one.
+ * When a journal sector is full the other one is erased and takes the next record, so the
+ * current record survives a power loss at any point.
+ */
+#define BL_SLOT_COUNT                2
+#define BL_SLOT_A                    0x00
+#define BL_SLOT_B                    0x01
+#define BL_SLOT_NONE                 0xFF
+#define BL_SLOT_A_FIRST_SECTOR       5
+#define BL_SLOT_B_FIRST_SECTOR       8
+#define BL_SLOT_SECTORS              3
+#define BL_SLOT_A_BASE_ADDRESS       0x08020000U
+#define BL_SLOT_B_BASE_ADDRESS       0x08080000U
+#define BL_SLOT_SIZE                 (BL_SLOT_SECTORS * 128 * 1024)
+#define BL_SLOT_JOURNAL_FIRST_SECTOR 2
+#define BL_SLOT_JOURNAL_ADDRESS      0x08008000U
+#define BL_SLOT_JOURNAL_SECTOR_SIZE  (16 * 1024)
+#define BL_SLOT_JOURNAL_RECORDS      (BL_SLOT_JOURNAL_SECTOR_SIZE / sizeof(BL_Slot_Record))
+/*
+ * The bootloader and the journal, sectors 0-3. Host erases and writes that reach into them are
+ * refused with INVALID_SECTOR_NUMBER or ADDRESS_IS_INVALID, a mass erase included.
+ */
+#define BL_PROTECTED_SECTORS         (BL_SLOT_JOURNAL_FIRST_SECTOR + 2)
+#define BL_PROTECTED_FLASH_END       (BL_SLOT_JOURNAL_ADDRESS + (2 * BL_SLOT_JOURNAL_SECTOR_SIZE))
+/* "BLMD" */
+#define BL_SLOT_RECORD_MAGIC         0x444D4C42U
+#define BL_SLOT_STATE_NONE           0x00
+#define BL_SLOT_STATE_CONFIRMED      0x01
+#define BL_SLOT_STATE_TRIAL          0x02
+/*
+ * A trial image confirms itself by leaving BL_SLOT_CONFIRM_MAGIC in BL_SLOT_CONFIRM_REGISTER,
+ * the next reset records it. A trial image started BL_SLOT_MAX_BOOT_ATTEMPTS times without
+ * confirming is rolled back to the previous slot. The register is cleared before every start.
+ */
+#define BL_SLOT_CONFIRM_REGISTER     (RTC->BKP2R)
+#define BL_SLOT_CONFIRM_MAGIC        0xC0FF1A3DU
+#define BL_SLOT_MAX_BOOT_ATTEMPTS    3
+/*
+ * Handoff from the update agent linked into the application (Update Agent/Update_Agent.c),
+ * which writes the slot that is not running while the application keeps going. It leaves
+ * BL_UPDATE_HANDOFF_MAGIC | Slot in BL_UPDATE_HANDOFF_REGISTER, the version of the image in
+ * BL_UPDATE_HANDOFF_VERSION_REGISTER, and resets. The next reset switches to Slot like
+ * CBL_SLOT_SWITCH_CMD would and starts it without waiting for the host. One shot, cleared here.
+ */
+#define BL_UPDATE_HANDOFF_REGISTER   (RTC->BKP3R)
+#define BL_UPDATE_HANDOFF_VERSION_REGISTER (RTC->BKP4R)
+#define BL_UPDATE_HANDOFF_MAGIC      0x4A0FF500U
+#define BL_UPDATE_HANDOFF_SLOT_MASK  0x000000FFU
+
+/*
+ * Boot decision after reset
+ * The bootloader stays for the host while the user button is held or when the application
+ * left BL_BOOT_REQUEST_MAGIC in BL_BOOT_REQUEST_REGISTER (one shot, cleared here). Otherwise
+ * the image of the active slot is checked and started right away, a bad image falls back to
+ * the other slot. Without any journal record the first slot holding a valid image is started.
+ * Image descriptor, stamped by Host.py into the reserved vector table words at
+ * BL_IMAGE_DESCRIPTOR_OFFSET: Magic(4) | Length(4) | CRC(4). Length is a multiple of 4, the CRC
+ * is the CRC unit result over the words of the image except the CRC word itself.
+ * BL_BOOT_UPDATE_WINDOW : ms given to the host to start talking before a valid image is
+ *                         started, 0 starts it without waiting. Skipped after an agent handoff.
+ * The time from main() to the jump is left in BL_BOOT_LATENCY_REGISTER, in us.
+ */
+#define BL_BOOT_BUTTON_PORT          GPIOA
+#define BL_BOOT_BUTTON_PIN           GPIO_PIN_0
+#define BL_BOOT_BUTTON_PRESSED       GPIO_PIN_SET
+#define BL_BOOT_BUTTON_CLK_ENABLE()  __HAL_RCC_GPIOA_CLK_ENABLE()
+#define BL_BOOT_REQUEST_REGISTER     (RTC->BKP0R)
+#define BL_BOOT_LATENCY_REGISTER     (RTC->BKP1R)
+#define BL_BOOT_REQUEST_MAGIC        0xB00710ADU
+#define BL_BOOT_UPDATE_WINDOW        5
+#define BL_IMAGE_DESCRIPTOR_OFFSET   0x1C
+#define BL_IMAGE_CRC_OFFSET          (BL_IMAGE_DESCRIPTOR_OFFSET + 8)
+/* "BLIM" */
+#define BL_IMAGE_MAGIC               0x4D494C42U
+/* Vector table up to the descriptor and the descriptor itself */
+#define BL_IMAGE_MIN_LENGTH          (BL_IMAGE_DESCRIPTOR_OFFSET + sizeof(BL_Image_Descriptor))
+#define IMAGE_IS_INVALID             0x00
+#define IMAGE_IS_VALID               0x01
 #define ADDRESS_IS_INVALID           0x00
 #define ADDRESS_IS_VALID             0x01
 
@@ -97,6 +522,7 @@ typedef void (*Jump_Ptr)(void);
 #define STM32F407XX_SRAM2_END          (SRAM2_BASE + STM32F407XX_SRAM2_SIZE)
 #define STM32F407XX_SRAM3_END          (CCMDATARAM_BASE + STM32F407XX_SRAM3_SIZE)
 #define STM32F407XX_FLASH_END          (FLASH_BASE + STM32F407XX_FLASH_SIZE)
+#define STM32F407XX_UID_LENGTH         12
 
 /* CBL_GET_RDP_STATUS_CMD */
 #define ROP_LEVEL_READ_INVALID       0x00
@@ -117,6 +543,9 @@ typedef void (*Jump_Ptr)(void);
 void BootLoader_Print_Message(char *format, ...);
 
 BL_Status BL_UART_Fetch_Host_Command(void);
+
+void BL_Boot_Time_Mark(void);
+void BL_Boot_Decision(void);
 //---------------------------------------
 
 #endif /*BOOTLOADER_H*/
\ No newline at end of file
@@ -20,6 +20,7 @@
 /* Includes ------------------------------------------------------------------*/
 #include "main.h"
 #include "crc.h"
+#include "dma.h"
 #include "usart.h"
 #include "gpio.h"
 
@@ -52,6 +53,7 @@
 
 /* Private function prototypes -----------------------------------------------*/
 void SystemClock_Config(void);
+static void MX_NVIC_Init(void);
 /* USER CODE BEGIN PFP */
 
 /* USER CODE END PFP */
@@ -71,7 +73,8 @@ void SystemClock_Config(void);
 int main(void)
 {
   /* USER CODE BEGIN 1 */
-	
+	//reset to application latency, counted from here
+	BL_Boot_Time_Mark();
   /* USER CODE END 1 */
 
   /* MCU Configuration--------------------------------------------------------*/
@@ -80,7 +83,8 @@ int main(void)
   HAL_Init();
 
   /* USER CODE BEGIN Init */
-	
+	//still on HSI, the cycles so far count at 16 MHz
+	BL_Boot_Time_Mark();
   //BL_Print_Message("Bootloader Started \r\n");
   /* USER CODE END Init */
 
@@ -93,15 +97,17 @@ int main(void)
 
   /* Initialize all configured peripherals */
   MX_GPIO_Init();
+  MX_DMA_Init();
   MX_CRC_Init();
   MX_USART2_UART_Init();
   MX_USART3_UART_Init();
+
+  /* Initialize interrupts */
+  MX_NVIC_Init();
   /* USER CODE BEGIN 2 */
 	
-	BL_Status Status = BL_NACK;
-	
-	
-	
+	//starts a valid application unless the host is expected, returns to serve the host
+	BL_Boot_Decision();
 	
   /* Infinite loop */
   /* USER CODE BEGIN WHILE */
@@ -116,7 +122,8 @@ int main(void)
   {
     /* USER CODE END WHILE */
     /* USER CODE BEGIN 3 */
-		Status = BL_UART_Fetch_Host_Command();
+		//a refused frame is answered with a NACK already, nothing left to do here
+		(void)BL_UART_Fetch_Host_Command();
 		
   }
   /* USER CODE END 3 */
@@ -165,6 +172,17 @@ void SystemClock_Config(void)
   }
 }
 
+/**
+  * @brief NVIC Configuration.
+  * @retval None
+  */
+static void MX_NVIC_Init(void)
+{
+  /* FLASH_IRQn interrupt configuration */
+  HAL_NVIC_SetPriority(FLASH_IRQn, 0, 0);
+  HAL_NVIC_EnableIRQ(FLASH_IRQn);
+}
+
 /* USER CODE BEGIN 4 */
 
 /* USER CODE END 4 */
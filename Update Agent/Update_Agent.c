@@ -0,0 +1,569 @@
+#include "Update_Agent.h"
+
+static uint32_t UA_Fetch_Frame(uint8_t *Frame);
+static void UA_Dispatch(uint8_t *Frame, uint32_t Frame_Length);
+static uint32_t UA_Rx_Available(void);
+static void UA_Rx_Drop(uint32_t Data_Len);
+static void UA_Slot_Status(void);
+static void UA_Erase_Start(uint8_t *Frame);
+static void UA_Erase_Step(void);
+static void UA_Memory_Write(uint8_t *Frame, uint32_t Frame_Length);
+static void UA_CRC_Start(uint8_t *Frame);
+static void UA_CRC_Step(void);
+static void UA_Handoff(uint8_t *Frame);
+static uint8_t UA_Running_Slot(void);
+static uint8_t UA_Target_Slot(void);
+static uint32_t UA_Slot_Address(uint8_t Slot);
+static uint8_t UA_Slot_Range_Verification(uint32_t Address, uint32_t Length);
+static uint8_t UA_Image_Descriptor_Check(uint8_t Slot);
+static uint32_t UA_Journal_Find(BL_Slot_Record *Record);
+static uint8_t UA_Flash_Write(uint8_t *Payload, uint32_t Address, uint16_t Payload_Len);
+static uint32_t UA_CRC_Words(uint32_t CRC_Value, const uint32_t *Words, uint32_t Word_Count);
+static uint32_t UA_CRC_Word(uint32_t CRC_Value, uint32_t Data);
+static void UA_Send_ACK(uint8_t Reply_Len);
+static void UA_Send_NACK(void);
+static void UA_Send_Data(uint8_t *pData, uint32_t Data_Len);
+
+static UART_HandleTypeDef *UA_Host_UART = NULL;
+static Update_Agent_State UA_State = UPDATE_AGENT_IDLE;
+
+//circular DMA ring, NDTR tells how far the stream got
+static uint8_t UA_Rx_Ring[UPDATE_AGENT_RX_RING_LENGTH];
+static uint32_t UA_Rx_Read_Index = 0;
+static uint32_t UA_Rx_Last_Available = 0;
+static uint32_t UA_Rx_Last_Tick = 0;
+static uint8_t UA_Frame[UPDATE_AGENT_FRAME_LENGTH];
+
+//sector erase spread over several calls
+static uint8_t UA_Erase_Sector = 0;
+static uint8_t UA_Erase_Remaining = 0;
+static uint8_t UA_Erase_Status = SUCCESSFUL_ERASE;
+
+//range CRC spread over several calls
+static uint32_t UA_CRC_Address = 0;
+static uint32_t UA_CRC_Remaining = 0;
+static uint32_t UA_CRC_Value = 0;
+static uint32_t UA_CRC_Cycles = 0;
+
+/* CRC unit polynomial 0x04C11DB7 applied to each value of a nibble, 4 bits per lookup */
+static const uint32_t UA_CRC_Nibble_Table[16] = {
+	0x00000000U, 0x04C11DB7U, 0x09823B6EU, 0x0D4326D9U, 0x130476DCU, 0x17C56B6BU, 0x1A864DB2U, 0x1E475005U,
+	0x2608EDB8U, 0x22C9F00FU, 0x2F8AD6D6U, 0x2B4BCB61U, 0x350C9B64U, 0x31CD86D3U, 0x3C8EA00AU, 0x384FBDBDU
+};
+
+/* huart is the link to the host, its RX DMA stream is switched to circular mode */
+HAL_StatusTypeDef Update_Agent_Init(UART_HandleTypeDef *huart)
+{
+	UA_Host_UART = huart;
+	UA_State = UPDATE_AGENT_IDLE;
+	UA_Rx_Read_Index = 0;
+	UA_Rx_Last_Available = 0;
+	
+	//the handoff goes through the backup registers
+	__HAL_RCC_PWR_CLK_ENABLE();
+	HAL_PWR_EnableBkUpAccess();
+	//cycles taken from the application, reported with the CRC
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+	
+	//the ring is reused forever, make sure the stream wraps around
+	huart->hdmarx->Init.Mode = DMA_CIRCULAR;
+	HAL_DMA_Init(huart->hdmarx);
+	return HAL_UARTEx_ReceiveToIdle_DMA(huart, UA_Rx_Ring, UPDATE_AGENT_RX_RING_LENGTH);
+}
+
+/* One step of the update, returns at once when nothing is waiting */
+Update_Agent_State Update_Agent_Process(void)
+{
+	uint32_t Frame_Length = 0;
+	
+	switch(UA_State)
+	{
+		case UPDATE_AGENT_ERASING:
+			UA_Erase_Step();
+			break;
+		case UPDATE_AGENT_CHECKING:
+			UA_CRC_Step();
+			break;
+		case UPDATE_AGENT_HANDOFF:
+			//armed, waiting for Update_Agent_Reboot
+			break;
+		default:
+			Frame_Length = UA_Fetch_Frame(UA_Frame);
+			if(Frame_Length > 0)
+			{
+				UA_Dispatch(UA_Frame, Frame_Length);
+			}
+			break;
+	}
+	return UA_State;
+}
+
+/* Restart into the bootloader, which switches to the handed off slot and starts it */
+void Update_Agent_Reboot(void)
+{
+	NVIC_SystemReset();
+}
+
+/* Called by an image on trial once it works, the next reset confirms its slot */
+void Update_Agent_Confirm(void)
+{
+	BL_SLOT_CONFIRM_REGISTER = BL_SLOT_CONFIRM_MAGIC;
+}
+
+/*
+ * Next complete legacy frame copied out of the ring, returns its length with the Len byte
+ * or 0 while none is complete. Large frames and frames that stopped arriving are dropped.
+ */
+static uint32_t UA_Fetch_Frame(uint8_t *Frame)
+{
+	uint32_t Available = UA_Rx_Available();
+	uint32_t Frame_Length = 0;
+	uint32_t First_Part = 0;
+	
+	if(0 == Available)
+	{
+		return 0;
+	}
+	if(Available != UA_Rx_Last_Available)
+	{
+		UA_Rx_Last_Available = Available;
+		UA_Rx_Last_Tick = HAL_GetTick();
+	}
+	
+	//Len counts the bytes after it
+	Frame_Length = UA_Rx_Ring[UA_Rx_Read_Index] + 1;
+	if((BL_HOST_LARGE_FRAME_MARKER == UA_Rx_Ring[UA_Rx_Read_Index]) || (Frame_Length < (1 + BL_COMMAND_LENGTH(0))))
+	{
+		//no telling where it ends, start over with whatever comes next
+		UA_Rx_Drop(Available);
+		UA_Send_NACK();
+		return 0;
+	}
+	if(Available < Frame_Length)
+	{
+		if((HAL_GetTick() - UA_Rx_Last_Tick) >= UPDATE_AGENT_FRAME_TIMEOUT)
+		{
+			UA_Rx_Drop(Available);
+		}
+		return 0;
+	}
+	
+	First_Part = UPDATE_AGENT_RX_RING_LENGTH - UA_Rx_Read_Index;
+	if(First_Part > Frame_Length)
+	{
+		First_Part = Frame_Length;
+	}
+	memcpy(Frame, &UA_Rx_Ring[UA_Rx_Read_Index], First_Part);
+	memcpy(&Frame[First_Part], UA_Rx_Ring, Frame_Length - First_Part);
+	UA_Rx_Drop(Frame_Length);
+	return Frame_Length;
+}
+
+/* Frame check and command dispatch, the commands and their replies match the bootloader */
+static void UA_Dispatch(uint8_t *Frame, uint32_t Frame_Length)
+{
+	uint32_t Command_Len = Frame_Length - 1;
+	uint32_t Host_CRC = 0;
+	uint32_t Frame_CRC = UPDATE_AGENT_CRC_INITIAL;
+	
+	//every byte of the frame is one word for the CRC, like HAL_CRC_Accumulate in the bootloader
+	memcpy(&Host_CRC, &Frame[Frame_Length - CRC_TYPE_SIZE_BYTE], CRC_TYPE_SIZE_BYTE);
+	for(uint32_t Counter = 0; Counter < (Frame_Length - CRC_TYPE_SIZE_BYTE); Counter++)
+	{
+		Frame_CRC = UA_CRC_Word(Frame_CRC, Frame[Counter]);
+	}
+	if(Frame_CRC != Host_CRC)
+	{
+		UA_Send_NACK();
+		return;
+	}
+	
+	if((CBL_SLOT_STATUS_CMD == Frame[1]) && (BL_COMMAND_LENGTH(0) == Command_Len))
+	{
+		UA_Slot_Status();
+	}
+	else if((CBL_FLASH_ERASE_CMD == Frame[1]) && (BL_COMMAND_LENGTH(2) == Command_Len))
+	{
+		UA_Erase_Start(Frame);
+	}
+	else if((CBL_MEM_WRITE_CMD == Frame[1]) && (Command_Len >= BL_COMMAND_LENGTH(6)))
+	{
+		UA_Memory_Write(Frame, Frame_Length);
+	}
+	else if((CBL_MEM_CRC_CMD == Frame[1]) && (BL_COMMAND_LENGTH(8) == Command_Len))
+	{
+		UA_CRC_Start(Frame);
+	}
+	else if((CBL_SLOT_SWITCH_CMD == Frame[1]) && (BL_COMMAND_LENGTH(5) == Command_Len))
+	{
+		UA_Handoff(Frame);
+	}
+	else
+	{
+		UA_Send_NACK();
+	}
+}
+
+static uint32_t UA_Rx_Available(void)
+{
+	uint32_t Write_Index = 0;
+	
+	//NDTR counts down the bytes left until the DMA wraps to the start of the ring
+	Write_Index = (UPDATE_AGENT_RX_RING_LENGTH - __HAL_DMA_GET_COUNTER(UA_Host_UART->hdmarx)) % UPDATE_AGENT_RX_RING_LENGTH;
+	return (Write_Index + UPDATE_AGENT_RX_RING_LENGTH - UA_Rx_Read_Index) % UPDATE_AGENT_RX_RING_LENGTH;
+}
+
+static void UA_Rx_Drop(uint32_t Data_Len)
+{
+	UA_Rx_Read_Index = (UA_Rx_Read_Index + Data_Len) % UPDATE_AGENT_RX_RING_LENGTH;
+	UA_Rx_Last_Available = 0;
+}
+
+/*
+ * Reply of CBL_SLOT_STATUS_CMD. Active is the slot running now. The slot that is not running
+ * is only reported valid when its descriptor is in place, its CRC is not computed here.
+ */
+static void UA_Slot_Status(void)
+{
+	BL_Slot_Record Record;
+	uint8_t Status_Reply[SLOT_STATUS_REPLY_LENGTH] = {0};
+	uint8_t Running_Slot = UA_Running_Slot();
+	
+	if(0 == UA_Journal_Find(&Record))
+	{
+		memset(&Record, 0, sizeof(Record));
+		Record.Previous_Slot = BL_SLOT_NONE;
+		Record.State = BL_SLOT_STATE_NONE;
+	}
+	Status_Reply[0] = Running_Slot;
+	Status_Reply[1] = Record.Previous_Slot;
+	Status_Reply[2] = Record.State;
+	Status_Reply[3] = Record.Boot_Attempts;
+	memcpy(&Status_Reply[4], &Record.Sequence, 4);
+	memcpy(&Status_Reply[8], Record.Version, 8);
+	for(uint8_t Slot = 0; Slot < BL_SLOT_COUNT; Slot++)
+	{
+		//the bootloader checked the running image before starting it
+		Status_Reply[16 + Slot] = (Slot == Running_Slot) ? IMAGE_IS_VALID : UA_Image_Descriptor_Check(Slot);
+	}
+	UA_Send_ACK(SLOT_STATUS_REPLY_LENGTH);
+	UA_Send_Data(Status_Reply, SLOT_STATUS_REPLY_LENGTH);
+}
+
+/* Frame: Len | CMD | Sector | Count | CRC(4), answered once the last sector is erased */
+static void UA_Erase_Start(uint8_t *Frame)
+{
+	uint8_t Target_Slot = UA_Target_Slot();
+	uint8_t First_Sector = (BL_SLOT_A == Target_Slot) ? BL_SLOT_A_FIRST_SECTOR : BL_SLOT_B_FIRST_SECTOR;
+	uint8_t Sector_Status = INVALID_SECTOR_NUMBER;
+	
+	UA_Send_ACK(1);
+	if((BL_SLOT_NONE == Target_Slot) || (0 == Frame[3]) || (Frame[2] < First_Sector) ||
+	   ((Frame[2] + Frame[3]) > (First_Sector + BL_SLOT_SECTORS)))
+	{
+		UA_Send_Data(&Sector_Status, 1);
+	}
+	else
+	{
+		UA_Erase_Sector = Frame[2];
+		UA_Erase_Remaining = Frame[3];
+		UA_Erase_Status = SUCCESSFUL_ERASE;
+		UA_State = UPDATE_AGENT_ERASING;
+	}
+}
+
+/* One sector per call, the core waits for the flash meanwhile */
+static void UA_Erase_Step(void)
+{
+	FLASH_EraseInitTypeDef Erase;
+	uint32_t SectorError = 0;
+	
+	Erase.TypeErase = FLASH_TYPEERASE_SECTORS;
+	Erase.Banks = FLASH_BANK_1;
+	Erase.Sector = UA_Erase_Sector;
+	Erase.NbSectors = 1;
+	Erase.VoltageRange = BL_FLASH_VOLTAGE_RANGE;
+	
+	HAL_FLASH_Unlock();
+	if((HAL_OK != HAL_FLASHEx_Erase(&Erase, &SectorError)) || (HAL_SUCCESSFUL_ERASE != SectorError))
+	{
+		UA_Erase_Status = UNSUCCESSFUL_ERASE;
+		UA_Erase_Remaining = 0;
+	}
+	else
+	{
+		UA_Erase_Sector++;
+		UA_Erase_Remaining--;
+	}
+	HAL_FLASH_Lock();
+	
+	if(0 == UA_Erase_Remaining)
+	{
+		UA_Send_Data(&UA_Erase_Status, 1);
+		UA_State = UPDATE_AGENT_IDLE;
+	}
+}
+
+/* Frame: Len | CMD | Address(4) | Payload_Len | Payload | CRC(4), as Bootloader_Memory_Write takes it */
+static void UA_Memory_Write(uint8_t *Frame, uint32_t Frame_Length)
+{
+	uint32_t Address = 0;
+	uint8_t Payload_Len = Frame[6];
+	uint8_t Write_Status = FLASH_PAYLOAD_WRITE_FAILED;
+	
+	memcpy(&Address, &Frame[2], 4);
+	if((0 == Payload_Len) || (Frame_Length != (1U + BL_COMMAND_LENGTH(5) + Payload_Len)))
+	{
+		UA_Send_NACK();
+		return;
+	}
+	
+	UA_Send_ACK(1);
+	if(ADDRESS_IS_VALID == UA_Slot_Range_Verification(Address, Payload_Len))
+	{
+		Write_Status = UA_Flash_Write(&Frame[7], Address, Payload_Len);
+	}
+	UA_Send_Data(&Write_Status, 1);
+}
+
+/* Frame: Len | CMD | Address(4) | Length(4) | CRC(4), answered with CRC(4) | Cycles(4) | Core_Clock(4) */
+static void UA_CRC_Start(uint8_t *Frame)
+{
+	uint32_t Range_Address = 0;
+	uint32_t Range_Length = 0;
+	
+	memcpy(&Range_Address, &Frame[2], 4);
+	memcpy(&Range_Length, &Frame[6], 4);
+	if((Range_Address < FLASH_BASE) || (Range_Address >= STM32F407XX_FLASH_END) ||
+	   (Range_Length > (STM32F407XX_FLASH_END - Range_Address)) ||
+	   (0 != (Range_Address & 0x3)) || (0 != (Range_Length & 0x3)))
+	{
+		UA_Send_NACK();
+		return;
+	}
+	UA_CRC_Address = Range_Address;
+	UA_CRC_Remaining = Range_Length;
+	UA_CRC_Value = UPDATE_AGENT_CRC_INITIAL;
+	UA_CRC_Cycles = 0;
+	UA_State = UPDATE_AGENT_CHECKING;
+}
+
+static void UA_CRC_Step(void)
+{
+	uint32_t Start_Cycles = DWT->CYCCNT;
+	uint32_t Word_Count = UA_CRC_Remaining / 4;
+	uint32_t CRC_Reply[MEM_CRC_REPLY_LENGTH / 4] = {0};
+	
+	if(Word_Count > UPDATE_AGENT_CRC_STEP_WORDS)
+	{
+		Word_Count = UPDATE_AGENT_CRC_STEP_WORDS;
+	}
+	UA_CRC_Value = UA_CRC_Words(UA_CRC_Value, (const uint32_t *)(uintptr_t)UA_CRC_Address, Word_Count);
+	UA_CRC_Address += Word_Count * 4;
+	UA_CRC_Remaining -= Word_Count * 4;
+	UA_CRC_Cycles += DWT->CYCCNT - Start_Cycles;
+	
+	if(0 == UA_CRC_Remaining)
+	{
+		CRC_Reply[0] = UA_CRC_Value;
+		CRC_Reply[1] = UA_CRC_Cycles;
+		CRC_Reply[2] = SystemCoreClock;
+		UA_Send_ACK(MEM_CRC_REPLY_LENGTH);
+		UA_Send_Data((uint8_t *)CRC_Reply, MEM_CRC_REPLY_LENGTH);
+		UA_State = UPDATE_AGENT_IDLE;
+	}
+}
+
+/*
+ * Frame: Len | CMD | Slot | Version(4) | CRC(4)
+ * Only the slot that is not running, with its descriptor in place. The bootloader checks the
+ * whole image after the restart before it records the switch.
+ */
+static void UA_Handoff(uint8_t *Frame)
+{
+	uint8_t Slot = Frame[2];
+	uint32_t Version = 0;
+	uint8_t Switch_Status = SLOT_SWITCH_REFUSED;
+	
+	memcpy(&Version, &Frame[3], 4);
+	UA_Send_ACK(1);
+	if((BL_SLOT_NONE != UA_Target_Slot()) && (Slot == UA_Target_Slot()) && (IMAGE_IS_VALID == UA_Image_Descriptor_Check(Slot)))
+	{
+		BL_UPDATE_HANDOFF_VERSION_REGISTER = Version;
+		BL_UPDATE_HANDOFF_REGISTER = BL_UPDATE_HANDOFF_MAGIC | Slot;
+		Switch_Status = SLOT_SWITCH_DONE;
+		UA_State = UPDATE_AGENT_HANDOFF;
+	}
+	UA_Send_Data(&Switch_Status, 1);
+	
+#if (UPDATE_AGENT_AUTO_REBOOT == 1)
+	if(UPDATE_AGENT_HANDOFF == UA_State)
+	{
+		Update_Agent_Reboot();
+	}
+#endif
+}
+
+/* Slot the vector table was placed in by the bootloader, BL_SLOT_NONE outside the slots */
+static uint8_t UA_Running_Slot(void)
+{
+	uint32_t Vector_Table = SCB->VTOR;
+	uint8_t Running_Slot = BL_SLOT_NONE;
+	
+	if((Vector_Table >= BL_SLOT_A_BASE_ADDRESS) && (Vector_Table < (BL_SLOT_A_BASE_ADDRESS + BL_SLOT_SIZE)))
+	{
+		Running_Slot = BL_SLOT_A;
+	}
+	else if((Vector_Table >= BL_SLOT_B_BASE_ADDRESS) && (Vector_Table < (BL_SLOT_B_BASE_ADDRESS + BL_SLOT_SIZE)))
+	{
+		Running_Slot = BL_SLOT_B;
+	}
+	return Running_Slot;
+}
+
+/* The slot that is not running, the only one the agent writes */
+static uint8_t UA_Target_Slot(void)
+{
+	uint8_t Running_Slot = UA_Running_Slot();
+	
+	if(BL_SLOT_NONE == Running_Slot)
+	{
+		return BL_SLOT_NONE;
+	}
+	return (BL_SLOT_A == Running_Slot) ? BL_SLOT_B : BL_SLOT_A;
+}
+
+static uint32_t UA_Slot_Address(uint8_t Slot)
+{
+	return (BL_SLOT_A == Slot) ? BL_SLOT_A_BASE_ADDRESS : BL_SLOT_B_BASE_ADDRESS;
+}
+
+static uint8_t UA_Slot_Range_Verification(uint32_t Address, uint32_t Length)
+{
+	uint8_t Target_Slot = UA_Target_Slot();
+	uint32_t Slot_Address = UA_Slot_Address(Target_Slot);
+	
+	if((BL_SLOT_NONE == Target_Slot) || (Address < Slot_Address) || (Length > BL_SLOT_SIZE) ||
+	   ((Address - Slot_Address) > (BL_SLOT_SIZE - Length)))
+	{
+		return ADDRESS_IS_INVALID;
+	}
+	return ADDRESS_IS_VALID;
+}
+
+/* Magic and length of the image descriptor, see Bootloader_Image_Verification for the full check */
+static uint8_t UA_Image_Descriptor_Check(uint8_t Slot)
+{
+	const BL_Image_Descriptor *Descriptor = (const BL_Image_Descriptor *)(uintptr_t)(UA_Slot_Address(Slot) + BL_IMAGE_DESCRIPTOR_OFFSET);
+	
+	if((BL_IMAGE_MAGIC != Descriptor->Magic) || (Descriptor->Length < BL_IMAGE_MIN_LENGTH) || (Descriptor->Length > BL_SLOT_SIZE))
+	{
+		return IMAGE_IS_INVALID;
+	}
+	return IMAGE_IS_VALID;
+}
+
+/* Newest valid journal record, read like BL_Slot_Journal_Find does. Returns 0 without one. */
+static uint32_t UA_Journal_Find(BL_Slot_Record *Record)
+{
+	const BL_Slot_Record *Entry = NULL;
+	uint32_t Record_Address = 0;
+	uint32_t Record_CRC = 0;
+	
+	for(uint32_t Sector = 0; Sector < 2; Sector++)
+	{
+		Entry = (const BL_Slot_Record *)(uintptr_t)(BL_SLOT_JOURNAL_ADDRESS + (Sector * BL_SLOT_JOURNAL_SECTOR_SIZE));
+		for(uint32_t Index = 0; (Index < BL_SLOT_JOURNAL_RECORDS) && (0xFFFFFFFFU != Entry->Magic); Index++, Entry++)
+		{
+			Record_CRC = UA_CRC_Words(UPDATE_AGENT_CRC_INITIAL, (const uint32_t *)Entry, (sizeof(BL_Slot_Record) - 4) / 4);
+			if((BL_SLOT_RECORD_MAGIC == Entry->Magic) && (Entry->Record_CRC == Record_CRC) &&
+			   ((0 == Record_Address) || ((int32_t)(Entry->Sequence - Record->Sequence) > 0)))
+			{
+				memcpy(Record, Entry, sizeof(BL_Slot_Record));
+				Record_Address = (uint32_t)(uintptr_t)Entry;
+			}
+		}
+	}
+	return Record_Address;
+}
+
+static uint8_t UA_Flash_Write(uint8_t *Payload, uint32_t Address, uint16_t Payload_Len)
+{
+	HAL_StatusTypeDef HAL_Status = HAL_FLASH_Unlock();
+	uint32_t Width = 0;
+	uint64_t Data = 0;
+	
+	for(uint16_t Counter = 0; (HAL_OK == HAL_Status) && (Counter < Payload_Len); Counter += Width)
+	{
+		//widest write the parallelism allows that is aligned on the address and fits the remaining bytes
+		Width = BL_FLASH_PROGRAM_MAX_WIDTH;
+		while((Width > 1) && ((0 != ((Address + Counter) & (Width - 1))) || (Width > (uint32_t)(Payload_Len - Counter))))
+		{
+			Width /= 2;
+		}
+		Data = 0;
+		memcpy(&Data, &Payload[Counter], Width);
+		switch(Width)
+		{
+			case 8:
+				HAL_Status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_DOUBLEWORD, Address + Counter, Data);
+				break;
+			case 4:
+				HAL_Status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, Address + Counter, Data);
+				break;
+			case 2:
+				HAL_Status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, Address + Counter, Data);
+				break;
+			default:
+				HAL_Status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_BYTE, Address + Counter, Data);
+				break;
+		}
+	}
+	HAL_FLASH_Lock();
+	
+	if((HAL_OK != HAL_Status) || (0 != memcmp((void *)(uintptr_t)Address, Payload, Payload_Len)))
+	{
+		return FLASH_PAYLOAD_WRITE_FAILED;
+	}
+	return FLASH_PAYLOAD_WRITE_PASSED;
+}
+
+static uint32_t UA_CRC_Words(uint32_t CRC_Value, const uint32_t *Words, uint32_t Word_Count)
+{
+	for(uint32_t Index = 0; Index < Word_Count; Index++)
+	{
+		CRC_Value = UA_CRC_Word(CRC_Value, Words[Index]);
+	}
+	return CRC_Value;
+}
+
+/* Same result as writing Data to the DR register of the CRC unit */
+static uint32_t UA_CRC_Word(uint32_t CRC_Value, uint32_t Data)
+{
+	CRC_Value ^= Data;
+	for(uint8_t Nibble = 0; Nibble < 8; Nibble++)
+	{
+		CRC_Value = (CRC_Value << 4) ^ UA_CRC_Nibble_Table[CRC_Value >> 28];
+	}
+	return CRC_Value;
+}
+
+static void UA_Send_ACK(uint8_t Reply_Len)
+{
+	uint8_t Ack_Value[2] = { CBL_SEND_ACK, Reply_Len };
+	
+	HAL_UART_Transmit(UA_Host_UART, Ack_Value, 2, HAL_MAX_DELAY);
+}
+
+static void UA_Send_NACK(void)
+{
+	uint8_t Ack_Value = CBL_SEND_NACK;
+	
+	HAL_UART_Transmit(UA_Host_UART, &Ack_Value, 1, HAL_MAX_DELAY);
+}
+
+static void UA_Send_Data(uint8_t *pData, uint32_t Data_Len)
+{
+	HAL_UART_Transmit(UA_Host_UART, pData, Data_Len, HAL_MAX_DELAY);
+}
@@ -0,0 +1,75 @@
+#ifndef UPDATE_AGENT_H
+#define UPDATE_AGENT_H
+
+//Includes
+#include <string.h>
+#include "Bootloader.h"
+
+//---------------------------------------
+//-*-*-*-*-*-*-*-*-*-*-*-
+//User Type Definitions
+//-*-*-*-*-*-*-*-*-*-*-*
+
+typedef enum{
+	UPDATE_AGENT_IDLE = 0,
+	UPDATE_AGENT_ERASING,
+	UPDATE_AGENT_CHECKING,
+	UPDATE_AGENT_HANDOFF
+}Update_Agent_State;
+
+//---------------------------------------
+//-*-*-*-*-*-*-*-*-*-*-*-
+//Macros for Configurations
+//-*-*-*-*-*-*-*-*-*-*-*
+
+/*
+ * Update agent, linked into the application to receive an image while it keeps running.
+ * It takes the legacy host frames of the bootloader (Len | CMD | fields | CRC(4)) on the UART
+ * given to Update_Agent_Init and answers them the same way:
+ * CBL_SLOT_STATUS_CMD : Active is the slot running now, the rest comes from the journal.
+ *                       Image_Valid of the other slot only checks its descriptor.
+ * CBL_FLASH_ERASE_CMD : sectors of the slot that is not running only
+ * CBL_MEM_WRITE_CMD   : the Bootloader_Memory_Write frame, into the slot that is not running only
+ * CBL_MEM_CRC_CMD     : CRC of a flash range, same result as the CRC unit of the bootloader.
+ *                       Cycles counts the time taken from the application.
+ * CBL_SLOT_SWITCH_CMD : handoff of the slot that is not running. BL_UPDATE_HANDOFF_REGISTER is
+ *                       set and the MCU restarts, the bootloader checks the image, switches to it
+ *                       and starts it right away. A bad image leaves the running slot active.
+ * Anything else is answered with a NACK, large frames included.
+ * The new image starts on trial and calls Update_Agent_Confirm once it works, otherwise the
+ * bootloader rolls back to the slot it came from after BL_SLOT_MAX_BOOT_ATTEMPTS starts.
+ *
+ * The work is done in small steps from Update_Agent_Process, called from the main loop or the
+ * idle task: one frame, one sector erase or UPDATE_AGENT_CRC_STEP_WORDS words of a CRC per call.
+ * The F407 has a single flash bank, the core stalls on flash fetches while a sector erases
+ * (up to 2 s for 128KB) or a word programs. Code and interrupts that must keep running during
+ * an erase have to run from RAM. The CRC unit is left to the application, the agent computes
+ * its CRCs in software.
+ * Needs the RX DMA stream of the UART, the bytes are received into a circular ring.
+ */
+#define UPDATE_AGENT_RX_RING_LENGTH  512
+/* Len byte and the largest legacy frame behind it */
+#define UPDATE_AGENT_FRAME_LENGTH    256
+/* A frame still incomplete this many ms after its last byte is dropped */
+#define UPDATE_AGENT_FRAME_TIMEOUT   100
+#define UPDATE_AGENT_CRC_STEP_WORDS  1024
+/*
+ * 1 : restart into the bootloader as soon as the handoff is answered
+ * 0 : the application calls Update_Agent_Reboot once UPDATE_AGENT_HANDOFF is reported
+ */
+#define UPDATE_AGENT_AUTO_REBOOT     1
+
+/* CRC unit polynomial, words are shifted in from the most significant bit */
+#define UPDATE_AGENT_CRC_INITIAL     0xFFFFFFFFU
+
+//---------------------------------------
+//-*-*-*-*-*-*-*-*-*-*-*-
+//APIS
+//-*-*-*-*-*-*-*-*-*-*-*
+HAL_StatusTypeDef Update_Agent_Init(UART_HandleTypeDef *huart);
+Update_Agent_State Update_Agent_Process(void);
+void Update_Agent_Reboot(void);
+void Update_Agent_Confirm(void);
+//---------------------------------------
+
+#endif /*UPDATE_AGENT_H*/